@@ -0,0 +1,571 @@
+/* Microbenchmarks for censorscope. Each benchmark prints one line of JSON to
+ * stdout, so results from different versions can be compared mechanically:
+ *
+ *   {"benchmark": "sandbox_init", "version": "...", "iterations": 200,
+ *    "seconds": 0.0123, "ns_per_op": 61500.0, "ops_per_second": 16260.2}
+ *
+ * Run it from the top of the source tree, which has censorscope.conf and
+ * luasrc, with an optional substring to select benchmarks by name. */
+
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <event2/event.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "../src/arena.h"
+#include "../src/experiment.h"
+#include "../src/logging.h"
+#include "../src/options.h"
+#include "../src/results.h"
+#include "../src/sandbox.h"
+#include "../src/scheduling.h"
+#include "../src/serialize.h"
+#include "../src/subprocesses.h"
+#include "../src/util.h"
+#include "../src/workers.h"
+#include "servers.h"
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+/* The scheduler benchmarks spread their runs over this many experiments, and
+ * the worker benchmark uses this many workers. */
+#define BENCH_EXPERIMENTS 8
+#define BENCH_WORKERS 4
+
+/* How many targets each batch primitive benchmark passes per call. */
+#define BENCH_BATCH_SIZE 100
+
+typedef struct {
+    censorscope_options_t options;
+    bench_servers_t servers;
+    /* A scratch directory holding the benchmark's sandbox and results. */
+    char *directory;
+} bench_context_t;
+
+typedef struct {
+    const char *name;
+    /* The number of operations to time. */
+    long iterations;
+    /* Perform the operations, returning 0 on success or -1 on failure. */
+    int (*run)(bench_context_t *context, long iterations);
+} benchmark_t;
+
+static void report(const char *name, long iterations, int64_t microseconds) {
+    double seconds = microseconds / 1e6;
+    printf("{\"benchmark\": \"%s\", \"version\": \"%s\", \"iterations\": %ld, "
+           "\"seconds\": %.6f, \"ns_per_op\": %.1f, \"ops_per_second\": %.1f}\n",
+           name,
+           BENCH_VERSION,
+           iterations,
+           seconds,
+           iterations > 0 ? microseconds * 1000.0 / iterations : 0,
+           seconds > 0 ? iterations / seconds : 0);
+    fflush(stdout);
+}
+
+/* Write a script into the benchmark's sandbox directory. */
+static int write_script(bench_context_t *context,
+                        const char *name,
+                        const char *format,
+                        ...) __attribute__((format(printf, 3, 4)));
+
+static int write_script(bench_context_t *context,
+                        const char *name,
+                        const char *format,
+                        ...) {
+    char *path = module_filename(context->options.sandbox_dir, name);
+    if (!path) {
+        return -1;
+    }
+    FILE *file = fopen(path, "w");
+    free(path);
+    if (!file) {
+        log_error("error creating script '%s': %m", name);
+        return -1;
+    }
+    va_list args;
+    va_start(args, format);
+    vfprintf(file, format, args);
+    va_end(args);
+    return fclose(file) ? -1 : 0;
+}
+
+/* Run a script from the sandbox directory once in a fresh experiment
+ * sandbox. */
+static int run_script(bench_context_t *context, const char *name) {
+    sandbox_t sandbox;
+    if (experiment_sandbox_init(&sandbox, name, &context->options)) {
+        return -1;
+    }
+    experiment_t experiment;
+    if (experiment_init(&experiment, name, &context->options)) {
+        sandbox_destroy(&sandbox);
+        return -1;
+    }
+    int rc = experiment_run_in_sandbox(&experiment, &sandbox);
+    experiment_destroy(&experiment);
+    sandbox_destroy(&sandbox);
+    return rc;
+}
+
+/* Push the kind of record experiments typically write. */
+static void push_record(lua_State *L) {
+    lua_createtable(L, 0, 5);
+    lua_pushstring(L, "www.example.com");
+    lua_setfield(L, -2, "domain");
+    lua_pushstring(L, "93.184.216.34");
+    lua_setfield(L, -2, "address");
+    lua_pushnumber(L, 12345);
+    lua_setfield(L, -2, "rtt_microseconds");
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "connected");
+    lua_createtable(L, 3, 0);
+    for (int i = 1; i <= 3; ++i) {
+        lua_pushstring(L, "198.51.100.1");
+        lua_rawseti(L, -2, i);
+    }
+    lua_setfield(L, -2, "addresses");
+}
+
+static int bench_sandbox_init(bench_context_t *context, long iterations) {
+    for (long i = 0; i < iterations; ++i) {
+        sandbox_t sandbox;
+        if (sandbox_init(&sandbox, "bench", &context->options)) {
+            return -1;
+        }
+        sandbox_destroy(&sandbox);
+    }
+    return 0;
+}
+
+/* Creating a sandbox, registering the primitives and compiling api.lua. */
+static int bench_experiment_sandbox_init(bench_context_t *context,
+                                         long iterations) {
+    for (long i = 0; i < iterations; ++i) {
+        sandbox_t sandbox;
+        if (experiment_sandbox_init(&sandbox, "bench", &context->options)) {
+            return -1;
+        }
+        sandbox_destroy(&sandbox);
+    }
+    return 0;
+}
+
+/* Evaluating the api.lua environment and an empty experiment, as a worker
+ * does for every run. */
+static int bench_experiment_run(bench_context_t *context, long iterations) {
+    sandbox_t sandbox;
+    if (experiment_sandbox_init(&sandbox, "bench", &context->options)) {
+        return -1;
+    }
+    experiment_t experiment;
+    if (experiment_init(&experiment, "noop", &context->options)) {
+        sandbox_destroy(&sandbox);
+        return -1;
+    }
+    int rc = 0;
+    for (long i = 0; i < iterations && !rc; ++i) {
+        rc = experiment_run_in_sandbox(&experiment, &sandbox);
+    }
+    experiment_destroy(&experiment);
+    sandbox_destroy(&sandbox);
+    return rc;
+}
+
+/* Mixed allocations, reallocations and frees through the sandbox's
+ * allocator. Each iteration is one call. */
+static int bench_arena_alloc(bench_context_t *context, long iterations) {
+    static const size_t sizes[] = { 24, 40, 16, 64, 120, 33, 200, 512, 1000 };
+    const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    void *blocks[64] = { NULL };
+    size_t block_sizes[64] = { 0 };
+
+    arena_t arena;
+    arena_init(&arena, 0);
+    for (long i = 0; i < iterations; ++i) {
+        int slot = i % 64;
+        size_t size = (i / 64) % 3 == 2 ? 0 : sizes[i % nsizes];
+        void *block = arena_alloc(&arena, blocks[slot], block_sizes[slot], size);
+        if (size > 0 && !block) {
+            arena_destroy(&arena);
+            return -1;
+        }
+        blocks[slot] = block;
+        block_sizes[slot] = size;
+    }
+    arena_destroy(&arena);
+    return 0;
+}
+
+static int bench_serialize(long iterations,
+                           int (*serialize)(lua_State *,
+                                            int,
+                                            serialize_buffer_t *,
+                                            const char **)) {
+    lua_State *L = luaL_newstate();
+    if (!L) {
+        return -1;
+    }
+    push_record(L);
+    serialize_buffer_t buffer;
+    serialize_buffer_init(&buffer);
+    int rc = 0;
+    for (long i = 0; i < iterations && !rc; ++i) {
+        const char *error;
+        buffer.len = 0;
+        if (serialize(L, -1, &buffer, &error)) {
+            log_error("error serializing: %s", error);
+            rc = -1;
+        }
+    }
+    serialize_buffer_free(&buffer);
+    lua_close(L);
+    return rc;
+}
+
+static int bench_serialize_json(bench_context_t *context, long iterations) {
+    return bench_serialize(iterations, serialize_json);
+}
+
+static int bench_serialize_msgpack(bench_context_t *context, long iterations) {
+    return bench_serialize(iterations, serialize_msgpack);
+}
+
+static int bench_results_write(bench_context_t *context, long iterations) {
+    lua_State *L = luaL_newstate();
+    if (!L) {
+        return -1;
+    }
+    push_record(L);
+    results_writer_t *writer = results_writer_new(RESULTS_FORMAT_NDJSON,
+                                                  0,
+                                                  0);
+    char *path = sprintf_malloc("%s/bench.ndjson",
+                                context->options.results_dir);
+    int rc = writer && path ? 0 : -1;
+    for (long i = 0; i < iterations && !rc; ++i) {
+        const char *error;
+        if (results_writer_write(writer, path, L, -1, &error)) {
+            log_error("error writing result: %s", error);
+            rc = -1;
+        }
+    }
+    if (writer && results_writer_close(writer)) {
+        rc = -1;
+    }
+    results_writer_free(writer);
+    free(path);
+    lua_close(L);
+    return rc;
+}
+
+/* Run no-op experiments through the scheduler, forking for every run or
+ * using a worker pool. Each iteration is one run. */
+static int bench_scheduler(bench_context_t *context,
+                           long iterations,
+                           int workers) {
+    censorscope_options_t *options = &context->options;
+    options->workers = workers;
+    long runs_per_experiment = iterations / BENCH_EXPERIMENTS;
+
+    /* Build the table main.lua would return. */
+    lua_State *L = luaL_newstate();
+    if (!L) {
+        return -1;
+    }
+    lua_newtable(L);
+    lua_newtable(L);
+    for (int i = 0; i < BENCH_EXPERIMENTS; ++i) {
+        lua_createtable(L, 0, 2);
+        lua_pushnumber(L, 0);
+        lua_setfield(L, -2, "interval_seconds");
+        lua_pushnumber(L, runs_per_experiment);
+        lua_setfield(L, -2, "num_runs");
+        char name[32];
+        snprintf(name, sizeof(name), "noop_%d", i);
+        lua_setfield(L, -2, name);
+    }
+    lua_setfield(L, -2, "experiments");
+
+    int rc = -1;
+    struct event_base *base = event_base_new();
+    subprocesses_t subprocesses;
+    worker_pool_t pool;
+    experiment_schedules_t schedules;
+    if (!base || subprocesses_init(&subprocesses, base)) {
+        goto done;
+    }
+    if (workers > 0
+        && worker_pool_init(&pool, &subprocesses, options, base)) {
+        subprocesses_destroy(&subprocesses);
+        goto done;
+    }
+    if (experiment_schedules_init(&schedules,
+                                  &subprocesses,
+                                  workers > 0 ? &pool : NULL,
+                                  options,
+                                  base,
+                                  L,
+                                  1) == 0) {
+        rc = event_base_dispatch(base) == -1 ? -1 : 0;
+        experiment_schedules_destroy(&schedules);
+    }
+    if (workers > 0) {
+        worker_pool_destroy(&pool);
+    }
+    subprocesses_destroy(&subprocesses);
+
+done:
+    if (base) {
+        event_base_free(base);
+    }
+    lua_close(L);
+    options->workers = 0;
+    return rc;
+}
+
+static int bench_scheduler_fork(bench_context_t *context, long iterations) {
+    return bench_scheduler(context, iterations, 0);
+}
+
+static int bench_scheduler_workers(bench_context_t *context, long iterations) {
+    return bench_scheduler(context, iterations, BENCH_WORKERS);
+}
+
+static int bench_dns_lookup(bench_context_t *context, long iterations) {
+    if (write_script(context,
+                     "bench_dns_lookup",
+                     "for i = 1, %ld do\n"
+                     "  local address, err = dns_lookup(\"bench%%d.example\"\n"
+                     "                                  :format(i),\n"
+                     "                                  \"127.0.0.1:%d\")\n"
+                     "  assert(address, err)\n"
+                     "end\n",
+                     iterations,
+                     context->servers.dns_port)) {
+        return -1;
+    }
+    return run_script(context, "bench_dns_lookup");
+}
+
+static int bench_dns_lookup_batch(bench_context_t *context, long iterations) {
+    if (write_script(context,
+                     "bench_dns_lookup_batch",
+                     "local domains = {}\n"
+                     "for i = 1, %d do\n"
+                     "  domains[i] = \"bench\" .. i .. \".example\"\n"
+                     "end\n"
+                     "for i = 1, %ld do\n"
+                     "  local results, err = dns_lookup_batch(domains,\n"
+                     "                                        \"127.0.0.1:%d\")\n"
+                     "  assert(results, err)\n"
+                     "end\n",
+                     BENCH_BATCH_SIZE,
+                     iterations / BENCH_BATCH_SIZE,
+                     context->servers.dns_port)) {
+        return -1;
+    }
+    return run_script(context, "bench_dns_lookup_batch");
+}
+
+static int bench_http_get(bench_context_t *context, long iterations) {
+    if (write_script(context,
+                     "bench_http_get",
+                     "for i = 1, %ld do\n"
+                     "  local body, err = http_get(\"http://127.0.0.1:%d/\")\n"
+                     "  assert(body, err)\n"
+                     "end\n",
+                     iterations,
+                     context->servers.http_port)) {
+        return -1;
+    }
+    return run_script(context, "bench_http_get");
+}
+
+static int bench_http_get_batch(bench_context_t *context, long iterations) {
+    if (write_script(context,
+                     "bench_http_get_batch",
+                     "local urls = {}\n"
+                     "for i = 1, %d do\n"
+                     "  urls[i] = \"http://127.0.0.1:%d/\" .. i\n"
+                     "end\n"
+                     "for i = 1, %ld do\n"
+                     "  local results, err = http_get_batch(urls)\n"
+                     "  assert(results, err)\n"
+                     "end\n",
+                     BENCH_BATCH_SIZE,
+                     context->servers.http_port,
+                     iterations / BENCH_BATCH_SIZE)) {
+        return -1;
+    }
+    return run_script(context, "bench_http_get_batch");
+}
+
+static int bench_tcp_connect(bench_context_t *context, long iterations) {
+    if (write_script(context,
+                     "bench_tcp_connect",
+                     "for i = 1, %ld do\n"
+                     "  local connected, err = tcp_connect(\"127.0.0.1\", %d)\n"
+                     "  assert(connected, err)\n"
+                     "end\n",
+                     iterations,
+                     context->servers.http_port)) {
+        return -1;
+    }
+    return run_script(context, "bench_tcp_connect");
+}
+
+static int bench_tcp_connect_batch(bench_context_t *context, long iterations) {
+    if (write_script(context,
+                     "bench_tcp_connect_batch",
+                     "local targets = {}\n"
+                     "for i = 1, %d do\n"
+                     "  targets[i] = { ip = \"127.0.0.1\", port = %d }\n"
+                     "end\n"
+                     "for i = 1, %ld do\n"
+                     "  local results, err = tcp_connect_batch(targets)\n"
+                     "  assert(results, err)\n"
+                     "end\n",
+                     BENCH_BATCH_SIZE,
+                     context->servers.http_port,
+                     iterations / BENCH_BATCH_SIZE)) {
+        return -1;
+    }
+    return run_script(context, "bench_tcp_connect_batch");
+}
+
+static const benchmark_t benchmarks[] = {
+    { "sandbox_init", 200, bench_sandbox_init },
+    { "experiment_sandbox_init", 100, bench_experiment_sandbox_init },
+    { "experiment_run", 500, bench_experiment_run },
+    { "arena_alloc", 10000000, bench_arena_alloc },
+    { "serialize_json", 200000, bench_serialize_json },
+    { "serialize_msgpack", 200000, bench_serialize_msgpack },
+    { "results_write", 200000, bench_results_write },
+    { "scheduler_fork", 200, bench_scheduler_fork },
+    { "scheduler_workers", 800, bench_scheduler_workers },
+    { "dns_lookup", 2000, bench_dns_lookup },
+    { "dns_lookup_batch", 20000, bench_dns_lookup_batch },
+    { "http_get", 2000, bench_http_get },
+    { "http_get_batch", 5000, bench_http_get_batch },
+    { "tcp_connect", 2000, bench_tcp_connect },
+    { "tcp_connect_batch", 20000, bench_tcp_connect_batch },
+};
+
+/* Remove a directory and everything in it. */
+static void remove_tree(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            if (strcmp(entry->d_name, ".") == 0
+                || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char *child = sprintf_malloc("%s/%s", path, entry->d_name);
+            if (child) {
+                remove_tree(child);
+                free(child);
+            }
+        }
+        closedir(dir);
+    }
+    remove(path);
+}
+
+/* Point the options at a scratch sandbox with the experiments the scheduler
+ * benchmarks run. */
+static int make_directories(bench_context_t *context) {
+    char template[] = "/tmp/censorscope-bench-XXXXXX";
+    if (!mkdtemp(template)) {
+        log_error("mkdtemp: %m");
+        return -1;
+    }
+    context->directory = strdup(template);
+    censorscope_options_t *options = &context->options;
+    free(options->sandbox_dir);
+    free(options->results_dir);
+    free(options->metrics_file);
+    options->sandbox_dir = sprintf_malloc("%s/sandbox", template);
+    options->results_dir = sprintf_malloc("%s/results", template);
+    options->metrics_file = strdup("");
+    if (!context->directory
+        || !options->sandbox_dir
+        || !options->results_dir
+        || !options->metrics_file
+        || mkdir(options->sandbox_dir, 0700)
+        || mkdir(options->results_dir, 0700)) {
+        log_error("error creating benchmark directories");
+        return -1;
+    }
+
+    if (write_script(context, "noop", "-- Nothing to see here.\n")) {
+        return -1;
+    }
+    for (int i = 0; i < BENCH_EXPERIMENTS; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "noop_%d", i);
+        if (write_script(context, name, "local x = 1\n")) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *filter = argc > 1 ? argv[1] : "";
+
+    logging_init();
+    logging_set_level(LOGGING_ERROR);
+
+    bench_context_t context;
+    memset(&context, 0, sizeof(context));
+    char *options_argv[] = { argv[0], NULL };
+    if (censorscope_options_init(&context.options, 1, options_argv)) {
+        fprintf(stderr, "error loading options; run from the source tree\n");
+        return 1;
+    }
+    logging_set_level(LOGGING_ERROR);
+    int rc = make_directories(&context);
+    if (!rc) {
+        rc = bench_servers_start(&context.servers);
+    }
+
+    for (size_t i = 0;
+         !rc && i < sizeof(benchmarks) / sizeof(benchmarks[0]);
+         ++i) {
+        const benchmark_t *benchmark = &benchmarks[i];
+        if (!strstr(benchmark->name, filter)) {
+            continue;
+        }
+        int64_t start = monotonic_microseconds();
+        if (benchmark->run(&context, benchmark->iterations)) {
+            fprintf(stderr, "benchmark %s failed\n", benchmark->name);
+            rc = -1;
+            break;
+        }
+        report(benchmark->name,
+               benchmark->iterations,
+               monotonic_microseconds() - start);
+    }
+
+    bench_servers_stop(&context.servers);
+    if (context.directory) {
+        remove_tree(context.directory);
+        free(context.directory);
+    }
+    censorscope_options_destroy(&context.options);
+    logging_destroy();
+    return rc ? 1 : 0;
+}
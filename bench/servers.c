@@ -0,0 +1,174 @@
+#include "servers.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/util.h>
+
+#include "../src/logging.h"
+
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_PACKET 512
+
+static const char http_body[] = "censorscope benchmark response\n";
+
+/* Bind a socket to an ephemeral port on 127.0.0.1 and return it, storing the
+ * port, or return -1 on failure. */
+static evutil_socket_t bind_loopback(int type, int *port) {
+    evutil_socket_t fd = socket(AF_INET, type, 0);
+    if (fd < 0) {
+        log_error("socket: %m");
+        return -1;
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_len = sizeof(address);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address))
+        || getsockname(fd, (struct sockaddr *)&address, &address_len)
+        || (type == SOCK_STREAM && listen(fd, 1024))
+        || evutil_make_socket_nonblocking(fd)) {
+        log_error("error binding loopback socket: %m");
+        evutil_closesocket(fd);
+        return -1;
+    }
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+/* Turn a query into a response in place, answering its first question with
+ * 127.0.0.1, and return the response's length, or 0 to ignore the query. */
+static size_t answer_query(uint8_t *packet, size_t len) {
+    if (len < DNS_HEADER_SIZE || packet[4] != 0 || packet[5] == 0) {
+        return 0;
+    }
+    /* Skip the question's name and its type and class. */
+    size_t offset = DNS_HEADER_SIZE;
+    while (offset < len && packet[offset] != 0) {
+        offset += packet[offset] + 1;
+    }
+    offset += 1 + 4;
+    static const uint8_t answer[] = {
+        0xc0, DNS_HEADER_SIZE,  /* A pointer to the question's name. */
+        0, 1, 0, 1,             /* Type A, class IN. */
+        0, 0, 0, 60,            /* TTL. */
+        0, 4, 127, 0, 0, 1,
+    };
+    if (offset > len || offset + sizeof(answer) > DNS_MAX_PACKET) {
+        return 0;
+    }
+    packet[2] |= 0x80;  /* QR */
+    packet[3] = 0x80;   /* RA, NOERROR */
+    packet[5] = 1;      /* QDCOUNT */
+    memset(packet + 6, 0, 6);
+    packet[7] = 1;      /* ANCOUNT */
+    memcpy(packet + offset, answer, sizeof(answer));
+    return offset + sizeof(answer);
+}
+
+static void dns_callback(evutil_socket_t fd, short what, void *arg) {
+    uint8_t packet[DNS_MAX_PACKET];
+    struct sockaddr_storage from;
+    for (;;) {
+        socklen_t from_len = sizeof(from);
+        ssize_t len = recvfrom(fd,
+                               packet,
+                               sizeof(packet),
+                               0,
+                               (struct sockaddr *)&from,
+                               &from_len);
+        if (len < 0) {
+            return;
+        }
+        size_t response_len = answer_query(packet, len);
+        if (response_len > 0) {
+            sendto(fd,
+                   packet,
+                   response_len,
+                   0,
+                   (struct sockaddr *)&from,
+                   from_len);
+        }
+    }
+}
+
+static void http_callback(struct evhttp_request *request, void *arg) {
+    struct evbuffer *body = evbuffer_new();
+    if (!body) {
+        evhttp_send_error(request, HTTP_INTERNAL, NULL);
+        return;
+    }
+    evbuffer_add(body, http_body, sizeof(http_body) - 1);
+    evhttp_send_reply(request, HTTP_OK, "OK", body);
+    evbuffer_free(body);
+}
+
+static void serve(evutil_socket_t dns_fd, evutil_socket_t http_fd) {
+    struct event_base *base = event_base_new();
+    if (!base) {
+        exit(EXIT_FAILURE);
+    }
+    struct event *dns_event = event_new(base,
+                                        dns_fd,
+                                        EV_READ | EV_PERSIST,
+                                        dns_callback,
+                                        NULL);
+    struct evhttp *http = evhttp_new(base);
+    if (!dns_event
+        || event_add(dns_event, NULL)
+        || !http
+        || !evhttp_accept_socket_with_handle(http, http_fd)) {
+        exit(EXIT_FAILURE);
+    }
+    evhttp_set_gencb(http, http_callback, NULL);
+    event_base_dispatch(base);
+    exit(EXIT_SUCCESS);
+}
+
+int bench_servers_start(bench_servers_t *servers) {
+    evutil_socket_t dns_fd = bind_loopback(SOCK_DGRAM, &servers->dns_port);
+    if (dns_fd < 0) {
+        return -1;
+    }
+    evutil_socket_t http_fd = bind_loopback(SOCK_STREAM, &servers->http_port);
+    if (http_fd < 0) {
+        evutil_closesocket(dns_fd);
+        return -1;
+    }
+
+    logging_flush();
+    servers->pid = fork();
+    if (servers->pid < 0) {
+        log_error("fork: %m");
+        evutil_closesocket(dns_fd);
+        evutil_closesocket(http_fd);
+        return -1;
+    } else if (servers->pid == 0) {
+        serve(dns_fd, http_fd);
+    }
+    evutil_closesocket(dns_fd);
+    evutil_closesocket(http_fd);
+    return 0;
+}
+
+void bench_servers_stop(bench_servers_t *servers) {
+    if (servers->pid <= 0) {
+        return;
+    }
+    kill(servers->pid, SIGTERM);
+    while (waitpid(servers->pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+    servers->pid = 0;
+}
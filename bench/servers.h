@@ -0,0 +1,29 @@
+#ifndef CENSORSCOPE_BENCH_SERVERS_H
+#define CENSORSCOPE_BENCH_SERVERS_H
+
+#include <sys/types.h>
+
+/* Loopback servers for benchmarking the network primitives without depending
+ * on the real network. They run in a child process, so the blocking
+ * primitives can talk to them from the benchmark process. */
+typedef struct {
+    pid_t pid;
+    /* A DNS server on 127.0.0.1 that answers every question with one A record
+     * for 127.0.0.1. */
+    int dns_port;
+    /* An HTTP server on 127.0.0.1 that answers every request with a short
+     * body. It also accepts the connections of the TCP benchmarks. */
+    int http_port;
+} bench_servers_t;
+
+/* Bind the servers' sockets and start the child process that serves them.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int bench_servers_start(bench_servers_t *servers);
+
+/* Stop the servers and wait for their process to exit. */
+void bench_servers_stop(bench_servers_t *servers);
+
+#endif
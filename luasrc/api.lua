@@ -1,5 +1,3 @@
-local run_id = os.date("%Y%m%d-%H%M%S")
-
 local api = {}
 
 utils = require("utils")
@@ -13,6 +11,10 @@ utils = require("utils")
 -- Arguments:
 -- - message is the message to log.
 -- Returns: none
+--
+-- Each line of a script may log at most 10 messages per second; the rest are
+-- dropped and counted in the log. Debug messages aren't even formatted unless
+-- the log-level option is "debug".
 function api.log(formatstring, ...)
   log_info(string.format(formatstring, unpack(arg)))
 end
@@ -20,7 +22,9 @@ function api.log_error(formatstring, ...)
   log_error(string.format(formatstring, unpack(arg)))
 end
 function api.log_debug(formatstring, ...)
-  log_debug(string.format(formatstring, unpack(arg)))
+  if LOG_DEBUG_ENABLED then
+    log_debug(string.format(formatstring, unpack(arg)))
+  end
 end
 
 -- Load a module from the sandboxed module directory.
@@ -29,6 +33,10 @@ end
 -- not the requiring module. This is different from how requiring modules
 -- normally works in in Lua.
 --
+-- Modules that evaluate to plain data (tables of strings, numbers and
+-- booleans, like lists of domains) are only run once per sandbox, until the
+-- file changes. Every caller gets its own copy of the data.
+--
 -- Arguments:
 -- - name is the name of the module to load, without a path or .lua extension.
 -- Returns:
@@ -38,70 +46,680 @@ function api.require(name)
   return run_in_sandbox(name)
 end
 
+-- Tasks run experiment code concurrently as coroutines. When a task calls
+-- dns_lookup, http_get or tcp_connect, the primitive starts on the sandbox's
+-- event loop and the task yields until it finishes, so other tasks can run in
+-- the meantime. Outside a task, those primitives block as usual.
+
+-- The task running each coroutine, and the task waiting for each operation.
+local tasks_by_coroutine = {}
+local tasks_by_operation = {}
+
+local function current_task()
+  local co = coroutine.running()
+  return co and tasks_by_coroutine[co]
+end
+
+-- Wait for an operation started by a *_async primitive to finish, and return
+-- its value, error and timing.
+local function await(id, err)
+  if id == nil then
+    return nil, err
+  end
+  tasks_by_operation[id] = current_task()
+  return coroutine.yield()
+end
+
+-- Resume a task with the given values, and record its results if it
+-- finishes.
+local function resume_task(task, ...)
+  local results = { coroutine.resume(task.co, ...) }
+  if coroutine.status(task.co) ~= "dead" then
+    return
+  end
+  tasks_by_coroutine[task.co] = nil
+  task.done = true
+  task.group.running = task.group.running - 1
+  if results[1] then
+    task.value, task.error = results[2], results[3]
+  else
+    task.error = results[2]
+  end
+end
+
+local function start_task(task, group)
+  task.co = coroutine.create(task.fn)
+  task.group = group
+  tasks_by_coroutine[task.co] = task
+  group.running = group.running + 1
+  resume_task(task, unpack(task.args, 1, task.nargs))
+end
+
+-- Create a task that will call fn with the remaining arguments. The task
+-- doesn't start until it is passed to wait_all.
+--
+-- Arguments:
+-- - fn is the function to run.
+-- - any further arguments are passed to fn.
+-- Returns: the task.
+function api.spawn(fn, ...)
+  return { fn = fn, args = { ... }, nargs = select("#", ...), done = false }
+end
+
+-- Run tasks concurrently until all of them have finished.
+--
+-- At most concurrency tasks run at once; the rest start as others finish. A
+-- task that raises an error finishes with that error. Tasks may call wait_all
+-- themselves. Tasks can't call the asynchronous primitives from inside
+-- functions called by C, like a table.sort comparator.
+--
+-- Experiments scheduled with in_process suspend while wait_all waits, so the
+-- scheduler can run other work. There, only the experiment's own code may
+-- call wait_all: not a task, and not a function called through pcall.
+--
+-- Arguments:
+-- - tasks is an array of tasks from spawn.
+-- - concurrency is the maximum number of tasks running at once (default 64).
+-- Returns:
+-- - an array with the first value returned by each task, in the same order.
+-- - an array with the error of each task that failed or returned an error as
+-- its second value.
+-- - an error message if the tasks couldn't be run, or nil otherwise.
+function api.wait_all(tasks, concurrency)
+  concurrency = concurrency or 64
+  local group = { running = 0 }
+  local next_task = 1
+  local err = nil
+  while true do
+    while group.running < concurrency and next_task <= #tasks do
+      start_task(tasks[next_task], group)
+      next_task = next_task + 1
+    end
+    if group.running == 0 then
+      break
+    end
+    local finished
+    finished, err = async_wait()
+    if finished == nil then
+      break
+    end
+    for _, operation in ipairs(finished) do
+      local task = tasks_by_operation[operation.id]
+      if task then
+        tasks_by_operation[operation.id] = nil
+        resume_task(task, operation.value, operation.error, operation.timing)
+      end
+    end
+  end
+
+  local values, errors = {}, {}
+  for i, task in ipairs(tasks) do
+    values[i] = task.value
+    if task.done then
+      errors[i] = task.error
+    else
+      errors[i] = err or "task did not run"
+    end
+  end
+  return values, errors, err
+end
+
+-- Open a list of targets, like domains or URLs, without loading it into the
+-- sandbox's memory.
+--
+-- Lists are plain text files in the sandbox directory with a .txt extension
+-- and one entry per line. Blank lines and lines starting with # are skipped.
+-- The file is mapped read-only and shared by every experiment, so even very
+-- large lists don't count against max-memory; only the entries a script reads
+-- become Lua strings.
+--
+-- Arguments:
+-- - name is the list's file name, with or without .txt.
+-- Returns:
+-- - the list, or nil on error. #list and list:count() give the number of
+-- entries. list:entries([first, [step]]) returns an iterator over index,
+-- entry pairs for use in a for loop, starting at entry first (default 1) and
+-- taking every step'th entry (default 1). list:read(first, count) returns an
+-- array of up to count entries starting at entry first, for batch primitives.
+-- - an error message, or nil if no errors occurred.
+function api.targets(name)
+  return targets(name)
+end
+
+-- Take this shard's part of an array of targets.
+--
+-- An experiment scheduled with shards = N runs in N processes at once, each
+-- with its own SHARD_INDEX from 0 to N - 1. Shards take every Nth target, so
+-- together they cover the array exactly once. Unsharded runs take every
+-- target.
+--
+-- Arguments:
+-- - targets is an array, like a list of domains from require.
+-- Returns: a new array with this shard's targets, in order.
+function api.shard(targets)
+  local part = {}
+  for i = SHARD_INDEX + 1, #targets, SHARD_COUNT do
+    part[#part + 1] = targets[i]
+  end
+  return part
+end
+
+-- Iterate over this shard's part of a list from targets, like shard does for
+-- arrays.
+--
+-- Arguments:
+-- - list is a list returned by targets.
+-- Returns: an iterator over index, entry pairs, as for list:entries.
+function api.shard_entries(list)
+  return list:entries(SHARD_INDEX + 1, SHARD_COUNT)
+end
+
+-- Read entries first to first + count - 1 of a list or an array.
+local function read_chunk(source, first, count)
+  if type(source) ~= "table" then
+    return source:read(first, count)
+  end
+  local chunk = {}
+  for i = first, math.min(first + count - 1, #source) do
+    chunk[#chunk + 1] = source[i]
+  end
+  return chunk
+end
+
+-- The sink pipeline uses by default, which writes every value a stage
+-- returned.
+local function write_value(value)
+  if value ~= nil then
+    return api.write_result(value)
+  end
+end
+
+-- Process a list of targets of any size in chunks, so the experiment's
+-- memory depends on the chunk size rather than the list's.
+--
+-- Each chunk of targets is read from the source, the stage runs on each
+-- target as a task, as with wait_all, and the sink is called with each
+-- result in order. Then the results written so far are flushed to the
+-- results file and the garbage collector runs, before the next chunk is read.
+-- Stages should return what they measured rather than keeping it, so it can
+-- be collected once the sink has seen it.
+--
+-- pipeline calls wait_all, so the same restrictions apply to where it may be
+-- called from.
+--
+-- Arguments:
+-- - source is a list from targets, the name of one, or an array.
+-- - stage is a function called with a target and its index in the source.
+-- Its first value is the target's result and its second an error, if any.
+-- - sink is an optional function called with a stage's value, error, target
+-- and index, after the whole chunk has finished. By default it writes
+-- every value that isn't nil with write_result. If it returns an error, the
+-- pipeline stops.
+-- - opts is an optional table with these fields:
+--   - chunk is the number of targets read at a time (default 1000).
+--   - concurrency is the maximum number of stages running at once (default
+--   64).
+-- Returns:
+-- - a table with fields targets (the number processed), failed (the number
+-- whose stage returned or raised an error) and chunks.
+-- - an error message if the pipeline stopped early, or nil otherwise. It stops
+-- at the deadline too, with the error "deadline exceeded".
+function api.pipeline(source, stage, sink, opts)
+  opts = opts or {}
+  sink = sink or write_value
+  local chunk_size = opts.chunk or 1000
+  local concurrency = opts.concurrency or 64
+  if chunk_size < 1 then
+    return nil, "chunk must be positive"
+  end
+  if type(source) == "string" then
+    local err
+    source, err = targets(source)
+    if not source then
+      return nil, err
+    end
+  end
+
+  local summary = { targets = 0, failed = 0, chunks = 0 }
+  local count = #source
+  for first = 1, count, chunk_size do
+    local remaining = time_remaining()
+    if remaining and remaining <= 0 then
+      return summary, "deadline exceeded"
+    end
+
+    local chunk = read_chunk(source, first, chunk_size)
+    local tasks = {}
+    for i, target in ipairs(chunk) do
+      tasks[i] = api.spawn(stage, target, first + i - 1)
+    end
+    local values, errors, err = api.wait_all(tasks, concurrency)
+    if err then
+      return summary, err
+    end
+    for i, target in ipairs(chunk) do
+      if errors[i] then
+        summary.failed = summary.failed + 1
+      end
+      err = sink(values[i], errors[i], target, first + i - 1)
+      if err then
+        return summary, err
+      end
+    end
+    summary.targets = summary.targets + #chunk
+    summary.chunks = summary.chunks + 1
+
+    -- Drop our references to the chunk before collecting it.
+    chunk, tasks, values, errors = nil, nil, nil, nil
+    local _
+    _, err = flush_results()
+    if err then
+      return summary, err
+    end
+    collect_garbage()
+  end
+  return summary, nil
+end
+
+-- The scheduler can keep a cache of recent DNS answers and HTTP digests,
+-- shared by every experiment, for up to the cache-window option. Primitives
+-- only use it when asked with cache = "allow", since most measurements must
+-- see the network, not an earlier answer. A cached result's timing table has
+-- cached = true, started_at and total_microseconds = 0.
+
+local function cached_timing()
+  return { cached = true, started_at = monotonic_microseconds(), total_microseconds = 0 }
+end
+
 -- Perform a DNS lookup.
 --
--- Currently this just queries 8.8.8.8 and returns the first address.
+-- Resolvers are cached for the lifetime of the sandbox, so repeated lookups
+-- don't reload the system configuration. Inside a task, the lookup yields to
+-- other tasks until it finishes, and gives up after 5 seconds and 2 retries.
 --
 -- Arguments:
 -- - domain is the domain name to look up.
+-- - resolver is the nameserver to use, like "8.8.8.8" or "[::1]:5353". If
+-- omitted or an empty string, then query the system default nameserver.
+-- - opts is an optional table with these fields:
+--   - cache, if "allow", returns a fresh cached address for the same domain and
+--   resolver instead of looking it up, and caches the answer for its TTL.
+-- Returns:
+-- - return first IPv4 address in the result, or nil on error.
+-- - an error message, or nil if no errors occurred.
+-- - a table timing the lookup, also on error, with fields started_at (see
+-- monotonic_microseconds) and total_microseconds. Inside a task it also has
+-- attempts, first_sent_microseconds, sent_microseconds (of the last attempt),
+-- received_microseconds and rtt_microseconds, all in microseconds since
+-- started_at. If the answer had A records it also has ttl, the smallest of
+-- their TTLs in seconds.
+function api.dns_lookup(domain, resolver, opts)
+  if resolver == nil then
+    resolver = ""
+  end
+  local key
+  if opts and opts.cache == "allow" then
+    key = "dns\0" .. resolver .. "\0" .. domain
+    local address = cache_get(key)
+    if address then
+      return address, nil, cached_timing()
+    end
+  end
+  local address, err, timing
+  if current_task() then
+    address, err, timing = await(dns_lookup_async(domain, resolver))
+  else
+    address, err, timing = dns_lookup(domain, resolver)
+  end
+  if key and address and timing and timing.ttl then
+    cache_put(key, address, timing.ttl)
+  end
+  return address, err, timing
+end
+
+-- Perform DNS lookups for many domains concurrently.
+--
+-- Queries are sent over non-blocking UDP sockets, with at most opts.window of
+-- them outstanding at once, so a slow or blackholed name only delays its own
+-- result.
+--
+-- Arguments:
+-- - domains is an array of domain names to look up.
 -- - resolver is the nameserver to use. If omitted or an empty string, then
 -- query the system default nameserver.
+-- - opts is an optional table with these fields:
+--   - window is the maximum number of queries in flight (default 32).
+--   - timeout is the number of seconds to wait for each attempt (default 5).
+--   - retries is the number of times to resend a query (default 2).
 -- Returns:
--- - return first IPv4 address in the result, or nil on error.
+-- - a table mapping each domain to a table with fields address (the first
+-- IPv4 address), addresses (all IPv4 addresses), rcode, error and timing (as
+-- for dns_lookup inside a task).
 -- - an error message, or nil if no errors occurred.
-function api.dns_lookup(domain, resolver)
+function api.dns_lookup_batch(domains, resolver, opts)
   if resolver == nil then
     resolver = ""
   end
-  return dns_lookup(domain, resolver)
+  return dns_lookup_batch(domains, resolver, opts)
+end
+
+-- Look up many domains against several resolvers at once and compare their
+-- answers.
+--
+-- Every domain is sent to every resolver concurrently, with at most
+-- opts.window queries outstanding at once. Each query keeps listening for
+-- opts.listen seconds after its first response, since an on-path injector's
+-- forged response usually arrives before the real one, with the same query
+-- ID. Addresses are sorted, so resolvers that order the same records
+-- differently agree.
+--
+-- Arguments:
+-- - domains is an array of domain names to look up.
+-- - resolvers is an array of nameservers, as in dns_lookup.
+-- - opts is an optional table with these fields:
+--   - window is the maximum number of queries in flight (default 64).
+--   - timeout is the number of seconds to wait for each attempt (default 5).
+--   - retries is the number of times to resend a query (default 2).
+--   - listen is the number of seconds to wait for more responses after the
+--   first (default 1, or 0 to stop at the first).
+--   - control is one of the resolvers, such as one we trust, to compare the
+--   others with.
+-- The attempts and listening are shortened to fit before the deadline.
+-- Returns:
+-- - a table mapping each domain to a table with fields:
+--   - answers, mapping each resolver to a table with fields rcode and
+--   addresses, or error, of its first response, responses (the number that
+--   arrived), timing (as for dns_lookup inside a task) and, if more than one
+--   arrived, late (an array of the others, with rcode, addresses and
+--   rtt_microseconds) and injected (true if any differed from the first).
+--   - groups, an array of the distinct answers or errors, each with fields
+--   rcode and addresses, or error, and resolvers (those that gave it).
+--   - injected, an array of the resolvers whose answers were injected.
+--   - differs, if the control answered, an array of the resolvers whose
+--   answers differ from the control's.
+--   - consistent, true if there is one group and nothing was injected.
+-- - an error message, or nil if no errors occurred.
+function api.dns_compare(domains, resolvers, opts)
+  return dns_compare(domains, resolvers, opts)
+end
+
+-- Perform a DNS query for several record types at once, returning the full
+-- responses.
+--
+-- One query is sent per record type, all of them concurrently.
+--
+-- Arguments:
+-- - domain is the domain name to look up.
+-- - opts is an optional table with these fields:
+--   - types is an array of record types like { "A", "AAAA", "CNAME" }
+--   (default { "A" }).
+--   - resolver is the nameserver to use, as in dns_lookup.
+--   - timeout is the number of seconds to wait for each attempt (default 5).
+--   - retries is the number of times to resend a query (default 2).
+-- Returns:
+-- - a table mapping each record type to a table with fields rcode, aa, tc,
+-- ra, size (in bytes), rtt_microseconds, attempts, timing (as for dns_lookup
+-- inside a task) and the answer, authority and additional sections. Each
+-- section is an array of records with fields name, type, ttl and data. If the
+-- query failed, the table has just attempts, timing and error.
+-- - an error message, or nil if no errors occurred.
+function api.dns_query(domain, opts)
+  return dns_query(domain, opts)
 end
 
 -- Perform a HTTP GET request.
 --
+-- Inside a task, the request yields to other tasks until it finishes, and
+-- gives up after 30 seconds.
 --
 -- Arguments:
 -- - a url to connect to
+-- - opts is an optional table with these fields:
+--   - max_body_bytes stops the transfer after this many bytes of body
+--   (default 0, meaning no limit).
+--   - digest, if true, hashes the body as it arrives instead of keeping all
+--   of it (default false).
+--   - head_bytes is how much of the body to keep in digest mode (default
+--   1024).
+--   - cache, if "allow" in digest mode, returns a fresh cached digest of the
+--   same URL instead of fetching it, and caches the digest it fetches.
 -- Returns:
--- - return first IPv4 address in the result, or nil on error.
+-- - the response body, or nil on error. In digest mode this is instead a table
+-- with fields sha256 (in hex), length, head (the start of the body) and
+-- truncated.
 -- - an error message, or nil if no errors occurred.
-function api.http_get(url)
-  return http_get(url)
+-- - a table timing the request, also once a transfer has failed, with fields
+-- started_at (see monotonic_microseconds) and, in microseconds since then,
+-- queued_microseconds, dns_microseconds, connect_microseconds,
+-- tls_microseconds, first_byte_microseconds and total_microseconds. Phases
+-- that didn't happen, like TLS for plain HTTP, are left out.
+function api.http_get(url, opts)
+  local key
+  if opts and opts.digest and opts.cache == "allow" then
+    key = string.format("http\0%s\0%d\0%d", url, opts.max_body_bytes or 0, opts.head_bytes or 1024)
+    local cached = cache_get(key)
+    local sha256, length, truncated, head
+    if cached then
+      sha256, length, truncated, head = string.match(cached, "^(%x+) (%d+) (%d)\n(.*)$")
+    end
+    if sha256 then
+      local digest = { sha256 = sha256, length = tonumber(length), truncated = truncated == "1", head = head }
+      return digest, nil, cached_timing()
+    end
+  end
+  local body, err, timing
+  if current_task() then
+    body, err, timing = await(http_get_async(url, opts))
+  else
+    body, err, timing = http_get(url, opts)
+  end
+  if key and type(body) == "table" then
+    local truncated = body.truncated and 1 or 0
+    cache_put(key, string.format("%s %d %d\n", body.sha256, body.length, truncated) .. body.head)
+  end
+  return body, err, timing
+end
+
+-- Perform many HTTP GET requests concurrently.
+--
+-- Arguments:
+-- - urls is an array of URLs to fetch.
+-- - opts is an optional table with these fields:
+--   - concurrency is the maximum number of requests at once (default 16).
+--   - per_host is the maximum number of connections per host (default 4).
+--   - timeout is the time limit for each request in seconds (default 30).
+--   - max_body_bytes, digest and head_bytes are as for http_get.
+-- Returns:
+-- - a table mapping each URL to a table with fields body, status (the HTTP
+-- response code), truncated, error and timing (as for http_get). In digest
+-- mode, body is replaced by sha256, length and head.
+-- - an error message, or nil if no errors occurred.
+function api.http_get_batch(urls, opts)
+  return http_get_batch(urls, opts)
 end
 
 -- Perform a TCP connect test.
 --
+-- Inside a task, the connect yields to other tasks until it finishes, and
+-- gives up after 5 seconds.
 --
 -- Arguments:
 -- - an IP address and port to connect to
 -- Returns:
--- - true if sucessful else raise an error
+-- - true if sucessful, or nil on error.
+-- - an error message, or nil if no errors occurred.
+-- - a table timing the connect, with fields started_at (see
+-- monotonic_microseconds), queued_microseconds, connect_microseconds and
+-- total_microseconds.
 function api.tcp_connect(ip, port)
+  if current_task() then
+    return await(tcp_connect_async(ip, port))
+  end
   return tcp_connect(ip, port)
 end
 
+-- Perform many TCP connect tests concurrently, without blocking on filtered
+-- hosts for longer than the timeout.
+--
+-- Arguments:
+-- - targets is an array of tables with fields ip (an IPv4 or IPv6 address)
+-- and port.
+-- - opts is an optional table with these fields:
+--   - window is the maximum number of connects at once (default 64).
+--   - timeout is the time limit for each connect in seconds (default 5).
+-- Returns:
+-- - an array with a table for each target, in the same order, with fields
+-- ip, port, connected, rtt_microseconds, timing (as for tcp_connect) and
+-- error. error is one of
+-- "connection refused" (the host sent a RST), "timeout", "host unreachable"
+-- or "network unreachable" (we got an ICMP unreachable message), or another
+-- message for local failures.
+-- - an error message, or nil if no errors occurred.
+function api.tcp_connect_batch(targets, opts)
+  return tcp_connect_batch(targets, opts)
+end
+
+-- Find the hop where a probe is censored, like a parallel traceroute.
+--
+-- The same DNS query or HTTP request is sent with every TTL from first_ttl to
+-- max_ttl at once, and routers' ICMP time-exceeded replies and any responses
+-- are collected together, so a sweep takes one timeout at most. HTTP probes
+-- connect normally and only limit the TTL of the request, so the first TTL
+-- that gets a reset or a block page is where the censor sits. This blocks,
+-- even inside a task.
+--
+-- Arguments:
+-- - target is the IP address to probe.
+-- - protocol is "dns" or "http".
+-- - opts is an optional table with these fields:
+--   - port is the port to probe (default 53 for DNS and 80 for HTTP).
+--   - domain is the name to query, or the HTTP Host (default "example.com").
+--   - path is the HTTP path to request (default "/").
+--   - first_ttl and max_ttl give the TTLs to try (default 1 and 30).
+--   - timeout is how many seconds to wait for replies (default 3).
+-- Returns:
+-- - an array with a table for each TTL, in order, with fields ttl,
+-- sent_microseconds and error if the probe couldn't be sent. If a router
+-- replied it has hop_microseconds, and for DNS also hop (its address),
+-- icmp_type and icmp_code; HTTP probes can't tell which router it was.
+-- responses counts the replies, and if there were any it
+-- has response_microseconds and response_size, plus rcode and addresses for
+-- DNS or head (the start of the reply) for HTTP. HTTP probes also have reset.
+-- Times are in microseconds since the sweep started.
+-- - an error message, or nil if no errors occurred.
+-- - a table timing the sweep, with fields started_at (see
+-- monotonic_microseconds) and total_microseconds.
+function api.ttl_probe(target, protocol, opts)
+  return ttl_probe(target, protocol, opts)
+end
+
+-- Encode a value as JSON.
+--
+-- This is much cheaper than encoding in Lua, and the work doesn't count against
+-- the sandbox's instruction limit. Tables whose keys are exactly 1 to n become
+-- arrays and other tables become objects, whose keys must be strings or
+-- numbers. Empty tables become objects.
+--
+-- Arguments:
+-- - value is a string, number, boolean, nil or a table of those types. Tables
+-- may be nested up to 32 levels, but may not contain themselves.
+-- Returns:
+-- - the JSON string, or nil on error.
+-- - an error message, or nil if no error occurred.
+function api.encode_json(value)
+  return encode_json(value)
+end
+
+-- Encode a value as MessagePack (https://msgpack.org).
+--
+-- This accepts the same values as encode_json, except that table keys may be
+-- of any type encode_json accepts. The output is usually smaller than JSON.
+--
+-- Arguments:
+-- - value is the value to encode.
+-- Returns:
+-- - the encoded string, or nil on error.
+-- - an error message, or nil if no error occurred.
+function api.encode_msgpack(value)
+  return encode_msgpack(value)
+end
+
+-- Report how much memory the sandbox's Lua state is using.
+--
+-- Memory is reserved from the system in chunks, and small objects are rounded
+-- up to a size class, so reserved is usually somewhat more than used. The
+-- max-memory option limits reserved memory.
+--
+-- Returns: a table with fields used and reserved (in bytes), peak_used and
+-- peak_reserved (the highest values during this run), and limit (0 if there
+-- is none).
+function api.memory_usage()
+  return memory_usage()
+end
+
+-- Report how long the experiment has left to use the network.
+--
+-- Each run has a deadline a little before the experiment timeout. Primitives
+-- shorten their timeouts to finish by the deadline, and once it has passed
+-- they fail immediately with the error "deadline exceeded", so the experiment
+-- still has time to write the results it has.
+--
+-- Returns: the number of seconds until the deadline (0 once it has passed),
+-- or nil if there is no deadline.
+function api.time_remaining()
+  return time_remaining()
+end
+
+-- Read a monotonic clock, which measurements use for their timing.
+--
+-- It is unaffected by changes to the system time, so it is only meaningful
+-- for comparing with other readings on the same device.
+--
+-- Returns: the clock's reading in microseconds.
+function api.monotonic_microseconds()
+  return monotonic_microseconds()
+end
+
+-- File extensions for each value of the results-format option.
+local result_extensions = {
+  text = "txt",
+  ndjson = "ndjson",
+  ["length-prefixed"] = "lp",
+}
+
 -- Write a result to the current results file.
 --
 -- Each run on an experiment has one result file. This function appends to it.
+-- Results are buffered and written in batches, at the latest when the run
+-- finishes. Large or long-lived result files are split into several segments,
+-- which are compressed and uploaded while censorscope keeps running.
+--
+-- How a result is stored depends on the results-format option. In "text"
+-- format, strings and numbers are written as they are, one per line, and
+-- tables as JSON. In "ndjson" format, every result is one line of JSON. In
+-- "length-prefixed" format, every result is JSON preceded by its length in
+-- bytes, as a 4-byte big-endian integer.
 --
 -- Arguments:
 -- - result is a Lua object to write. You may pass strings, numbers, booleans,
--- and tables containing those types. Tables may be nested.
+-- and tables containing those types. Tables may be nested, but may not contain
+-- themselves.
 -- Returns:
 -- - an error message, or nil if no error occurred.
 function api.write_result(output)
   -- TODO: Check if results/ is present, if not
   --       create it
-  local filename = string.format("%s/%s-%s.txt", CENSORSCOPE_OPTIONS.results_dir, SANDBOX_NAME, run_id)
-  api.log("writing results to %s", filename)
-
-  local handle, err = io.open(filename, "a")
-  if err then
-    return err
+  local extension = result_extensions[CENSORSCOPE_OPTIONS.results_format] or "txt"
+  local filename
+  if SHARD_RESULTS_DIR then
+    -- The scheduler merges the shards' files once every shard has finished.
+    filename = string.format("%s/%d.%s", SHARD_RESULTS_DIR, SHARD_INDEX, extension)
+  else
+    -- RUN_ID is unique to this run, even in a worker that runs many.
+    filename = string.format("%s/%s-%s.%s", CENSORSCOPE_OPTIONS.results_dir, SANDBOX_NAME, RUN_ID, extension)
   end
-  handle:write(output)
-  handle:write("\n")
-  handle:close()
-  return nil
+  local _, err = write_result(filename, output)
+  return err
 end
 
 -- Useful functions from the Lua standard library. These are safe accoring to
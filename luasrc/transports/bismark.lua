@@ -1,9 +1,11 @@
 local bismark = {}
 
-function bismark.upload_results(results_path)
-  local mv_command = "mv " .. results_path .. "/* /tmp/bismark-uploads/censorscope"
-  assert(os.execute(mv_command) == 0,
-         "error uploading results using bismark-data-transmit")
+function bismark.upload_results(results_path, files)
+  for _, file in ipairs(files) do
+    local mv_command = "mv '" .. file.path .. "' /tmp/bismark-uploads/censorscope"
+    assert(os.execute(mv_command) == 0,
+           "error uploading results using bismark-data-transmit")
+  end
 end
 
 function bismark.sync_sandbox(sandbox_path)
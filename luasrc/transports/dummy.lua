@@ -4,7 +4,7 @@ function dummy.sync_sandbox(sandbox_path)
   return 0
 end
 
-function dummy.upload_results(results_path)
+function dummy.upload_results(results_path, files)
   return 0
 end
 
@@ -14,9 +14,18 @@ function rsync.sync_sandbox(sandbox_path)
   return exit_code
 end
 
-function rsync.upload_results(results_path)
+-- files lists what to upload, so rsync doesn't have to compare the whole
+-- directory with the server's copy.
+function rsync.upload_results(results_path, files)
   local remote_path = remote_hostname .. ":censorscope-server/results"
-  local rsync_command = "rsync -e 'ssh -p " .. tostring(remote_port) .."' -avz " .. results_path .. "/ " .. remote_user .. "@" .. remote_path
+  local sources = {}
+  for _, file in ipairs(files or {}) do
+    table.insert(sources, "'" .. file.path .. "'")
+  end
+  if #sources == 0 then
+    table.insert(sources, results_path .. "/")
+  end
+  local rsync_command = "rsync -e 'ssh -p " .. tostring(remote_port) .."' -avz " .. table.concat(sources, " ") .. " " .. remote_user .. "@" .. remote_path
 
   local exit_code = assert(os.execute(rsync_command) == 0,
                            "error uploading results using rsync")
@@ -1,12 +1,17 @@
 local urls = require("http_urls")
 
-for _, url in pairs(urls) do
-  log("Connecting to " .. url)
-  result, err = http_get(url)
-  if err then
-    log("Error connecting to " .. url .. ": " .. err)
-    write_result(url .. ",, " .. err)
+log("Fetching %d urls", #urls)
+local results, err = http_get_batch(urls)
+if err then
+  log("Error fetching urls: " .. err)
+  return
+end
+for _, url in ipairs(urls) do
+  local result = results[url]
+  if result.error then
+    log("Error connecting to " .. url .. ": " .. result.error)
+    write_result(url .. ",, " .. result.error)
   else
-    write_result(url .. ", " .. result .. ",")
+    write_result(url .. ", " .. result.body .. ",")
   end
 end
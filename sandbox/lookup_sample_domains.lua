@@ -1,13 +1,20 @@
 local domains = require("sample_domains")
 
 write_result("domain, ip, error")
-for _, domain in pairs(domains) do
-  log("Looking up " .. domain)
-  address, err = dns_lookup(domain)
-  if err then
-    log("Error looking up " .. domain .. ": " .. err)
-    write_result(domain .. ",, " .. err)
+log("Looking up %d domains", #domains)
+local results, err = dns_lookup_batch(domains)
+if err then
+  log("Error looking up domains: " .. err)
+  return
+end
+for _, domain in ipairs(domains) do
+  local result = results[domain]
+  if result.error then
+    log("Error looking up " .. domain .. ": " .. result.error)
+    write_result(domain .. ",, " .. result.error)
+  elseif result.address then
+    write_result(domain .. ", " .. result.address .. ",")
   else
-    write_result(domain .. ", " .. address .. ",")
+    write_result(domain .. ",, " .. result.rcode)
   end
 end
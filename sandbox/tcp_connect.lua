@@ -1,14 +1,24 @@
 local ips = require("tcp_connect_ips")
 
+local targets = {}
 for ip, port in pairs(ips) do
   log(string.format("%s %s:%d", "Connecting to", ip, port))
-  result, err = tcp_connect(ip, port)
-  if err then
-    log("Error connecting to " .. ip .. ": " .. err)
-    write_result(string.format("%s:%d %s", ip, port, err))
+  table.insert(targets, {ip = ip, port = port})
+end
+
+local results, err = tcp_connect_batch(targets)
+if err then
+  log("Error connecting: " .. err)
+  return
+end
+
+for _, result in ipairs(results) do
+  if result.error then
+    log("Error connecting to " .. result.ip .. ": " .. result.error)
+    write_result(string.format("%s:%d %s", result.ip, result.port, result.error))
   else
-    -- the result is a boolean, we need to convert it to a string
-    result = tostring(result)
-    write_result(string.format("%s:%d %s", ip, port, result))
+    write_result(string.format("%s:%d %s %d", result.ip, result.port,
+                               tostring(result.connected),
+                               result.rtt_microseconds))
   end
 end
@@ -0,0 +1,226 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+
+/* The size of each class, in bytes. Every size is a multiple of 16, so
+ * blocks stay aligned for any type. */
+static const size_t class_sizes[ARENA_CLASS_COUNT] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 192, 256, 384, 512
+};
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+} arena_chunk_t;
+
+/* Chunk data starts after the header, rounded up to keep it aligned. */
+#define CHUNK_HEADER_SIZE ((sizeof(arena_chunk_t) + 15) & ~(size_t)15)
+
+/* Return the size class of a small block. */
+static int size_class(size_t size) {
+    if (size <= 128) {
+        return size == 0 ? 0 : (int)((size - 1) / 16);
+    }
+    int index = 8;
+    while (class_sizes[index] < size) {
+        ++index;
+    }
+    return index;
+}
+
+static void add_reserved(arena_t *arena, size_t bytes) {
+    arena->reserved += bytes;
+    if (arena->reserved > arena->peak_reserved) {
+        arena->peak_reserved = arena->reserved;
+    }
+}
+
+static void set_used(arena_t *arena, size_t used) {
+    arena->used = used;
+    if (used > arena->peak_used) {
+        arena->peak_used = used;
+    }
+}
+
+/* Return 1 if we may reserve this many more bytes. */
+static int within_limit(const arena_t *arena, size_t bytes) {
+    return arena->limit == 0
+        || (arena->reserved <= arena->limit
+            && bytes <= arena->limit - arena->reserved);
+}
+
+/* Start a new chunk with room for at least one block of min_size bytes. Near
+ * the limit, the chunk is only as large as the limit allows, or just
+ * min_size if force is set. */
+static int new_chunk(arena_t *arena, size_t min_size, int force) {
+    size_t size = ARENA_CHUNK_SIZE;
+    size_t overhead = CHUNK_HEADER_SIZE + ARENA_MALLOC_OVERHEAD;
+    if (arena->limit > 0) {
+        size_t available = arena->limit > arena->reserved + overhead
+            ? arena->limit - arena->reserved - overhead
+            : 0;
+        if (available < size) {
+            size = available & ~(size_t)15;
+        }
+    }
+    if (size < min_size && !force) {
+        return -1;
+    } else if (size < min_size) {
+        size = min_size;
+    }
+    arena_chunk_t *chunk = malloc(CHUNK_HEADER_SIZE + size);
+    if (!chunk) {
+        log_error("malloc error: %m");
+        return -1;
+    }
+    chunk->size = size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    /* Whatever was left of the previous chunk is too small for the block we
+     * need, so rather than track it, we give it up. */
+    arena->bump = (char *)chunk + CHUNK_HEADER_SIZE;
+    arena->bump_left = size;
+    add_reserved(arena, size + overhead);
+    return 0;
+}
+
+/* Allocate a block, within the limit unless force is set. */
+static void *allocate(arena_t *arena, size_t size, int force) {
+    if (size > ARENA_MAX_SMALL) {
+        if (!force && !within_limit(arena, size + ARENA_MALLOC_OVERHEAD)) {
+            return NULL;
+        }
+        void *block = malloc(size);
+        if (block) {
+            add_reserved(arena, size + ARENA_MALLOC_OVERHEAD);
+        }
+        return block;
+    }
+
+    int index = size_class(size);
+    void *block = arena->free_lists[index];
+    if (block) {
+        memcpy(&arena->free_lists[index], block, sizeof(void *));
+        return block;
+    }
+    size_t class_size = class_sizes[index];
+    if (arena->bump_left < class_size
+        && new_chunk(arena, class_size, force)) {
+        return NULL;
+    }
+    block = arena->bump;
+    arena->bump += class_size;
+    arena->bump_left -= class_size;
+    return block;
+}
+
+static void release(arena_t *arena, void *block, size_t size) {
+    if (size > ARENA_MAX_SMALL) {
+        free(block);
+        arena->reserved -= size + ARENA_MALLOC_OVERHEAD;
+        return;
+    }
+    /* Small blocks go back on their free list; their chunk lives until the
+     * arena is destroyed. */
+    int index = size_class(size);
+    memcpy(block, &arena->free_lists[index], sizeof(void *));
+    arena->free_lists[index] = block;
+}
+
+void arena_init(arena_t *arena, size_t limit) {
+    memset(arena, 0, sizeof(arena_t));
+    arena->limit = limit;
+}
+
+static void *out_of_memory(const arena_t *arena) {
+    log_error("Out of memory! %zu of %zu bytes reserved",
+              arena->reserved,
+              arena->limit);
+    return NULL;
+}
+
+void *arena_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    arena_t *arena = ud;
+    if (!ptr) {
+        osize = 0;
+    }
+
+    if (nsize == 0) {
+        if (ptr) {
+            release(arena, ptr, osize);
+            set_used(arena, arena->used - osize);
+        }
+        return NULL;
+    }
+
+    /* Blocks that stay in the same size class don't move. */
+    if (ptr && osize <= ARENA_MAX_SMALL && nsize <= ARENA_MAX_SMALL
+        && size_class(osize) == size_class(nsize)) {
+        set_used(arena, arena->used - osize + nsize);
+        return ptr;
+    }
+
+    /* Large blocks can be resized by realloc. */
+    if (ptr && osize > ARENA_MAX_SMALL && nsize > ARENA_MAX_SMALL) {
+        if (nsize > osize && !within_limit(arena, nsize - osize)) {
+            return out_of_memory(arena);
+        }
+        void *block = realloc(ptr, nsize);
+        if (!block) {
+            /* realloc may fail even when shrinking, but Lua requires that
+             * shrinking succeeds, and the old block is still big enough.
+             * Lua will free it as nsize bytes, so count it as that. */
+            if (nsize < osize) {
+                arena->reserved -= osize - nsize;
+                set_used(arena, arena->used - osize + nsize);
+                return ptr;
+            }
+            log_error("realloc error: %m");
+            return NULL;
+        }
+        arena->reserved -= osize;
+        add_reserved(arena, nsize);
+        set_used(arena, arena->used - osize + nsize);
+        return block;
+    }
+
+    /* Shrinking a large block to a small one frees more than the small block
+     * takes, even if it needs a chunk of its own, so it may pass the limit. */
+    void *block = allocate(arena, nsize, ptr && osize > ARENA_MAX_SMALL);
+    if (!block) {
+        if (ptr && nsize < osize && osize <= ARENA_MAX_SMALL) {
+            /* Keep the block, which is big enough, and later goes on the
+             * smaller class's free list. We only get here when we're out of
+             * memory anyway. */
+            set_used(arena, arena->used - osize + nsize);
+            return ptr;
+        }
+        return out_of_memory(arena);
+    }
+    if (ptr) {
+        memcpy(block, ptr, osize < nsize ? osize : nsize);
+        release(arena, ptr, osize);
+    }
+    set_used(arena, arena->used - osize + nsize);
+    return block;
+}
+
+void arena_reset_peak(arena_t *arena) {
+    arena->peak_used = arena->used;
+    arena->peak_reserved = arena->reserved;
+}
+
+void arena_destroy(arena_t *arena) {
+    while (arena->chunks) {
+        arena_chunk_t *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    memset(arena->free_lists, 0, sizeof(arena->free_lists));
+    arena->bump = NULL;
+    arena->bump_left = 0;
+    arena->used = arena->reserved = 0;
+}
@@ -0,0 +1,59 @@
+#ifndef CENSORSCOPE_ARENA_H
+#define CENSORSCOPE_ARENA_H
+
+#include <stddef.h>
+
+/* Blocks up to this size come from per-size-class free lists. */
+#define ARENA_MAX_SMALL 512
+#define ARENA_CLASS_COUNT 12
+/* Small blocks are carved from chunks of this many bytes. */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+/* The bytes we assume malloc adds to every allocation, so the limit covers
+ * what the process really uses. */
+#define ARENA_MALLOC_OVERHEAD 16
+
+struct arena_chunk;
+
+/* An arena is the allocator for a sandbox's Lua state. Lua allocates many
+ * small objects, like strings, tables and closures, so blocks of up to
+ * ARENA_MAX_SMALL bytes are rounded up to a size class and recycled through a
+ * free list per class, instead of going through malloc one at a time. Larger
+ * blocks go straight to malloc. Destroying the arena releases every chunk at
+ * once. */
+typedef struct {
+    /* The most memory the arena may reserve, or 0 for no limit. */
+    size_t limit;
+    /* The bytes Lua has asked for and not freed. */
+    size_t used;
+    /* The bytes we've taken from malloc, including whole chunks, space lost
+     * to rounding up to size classes, and malloc's own overhead. This is what
+     * the limit applies to. */
+    size_t reserved;
+    /* The highest values of used and reserved since the last reset. */
+    size_t peak_used, peak_reserved;
+
+    void *free_lists[ARENA_CLASS_COUNT];
+    struct arena_chunk *chunks;
+    /* Unused space at the end of the newest chunk. */
+    char *bump;
+    size_t bump_left;
+} arena_t;
+
+/* Initialize an arena that reserves at most limit bytes, or any amount if
+ * limit is 0. */
+void arena_init(arena_t *arena, size_t limit);
+
+/* A lua_Alloc function. Pass the arena as ud. Like any lua_Alloc, it frees ptr
+ * if nsize is 0 and otherwise returns a block of nsize bytes holding the first
+ * bytes of ptr, or NULL if that would exceed the limit. Shrinking a block
+ * never fails. */
+void *arena_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+/* Start tracking peak usage afresh from the current usage. */
+void arena_reset_peak(arena_t *arena);
+
+/* Free every chunk. Only call this once nothing uses the arena's memory, for
+ * example after lua_close. */
+void arena_destroy(arena_t *arena);
+
+#endif
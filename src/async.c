@@ -0,0 +1,211 @@
+#include "async.h"
+
+#include <stdlib.h>
+
+#include <event2/event.h>
+
+#define LUALIB
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "dns.h"
+#include "http.h"
+#include "logging.h"
+#include "sandbox.h"
+#include "tcp.h"
+
+async_state_t *async_sandbox_state(sandbox_t *sandbox) {
+    if (sandbox->async) {
+        return sandbox->async;
+    }
+    async_state_t *state = calloc(1, sizeof(async_state_t));
+    if (!state) {
+        log_error("calloc error: %m");
+        return NULL;
+    }
+    state->next_id = 1;
+    state->sandbox = sandbox;
+    sandbox->async = state;
+    return state;
+}
+
+static void running_list_remove(async_op_t *op) {
+    if (op->prev) {
+        op->prev->next = op->next;
+    } else {
+        op->state->running = op->next;
+    }
+    if (op->next) {
+        op->next->prev = op->prev;
+    }
+    op->prev = op->next = NULL;
+}
+
+async_op_t *async_op_new(async_state_t *state,
+                         async_push_result push,
+                         async_free_data free_data) {
+    async_op_t *op = calloc(1, sizeof(async_op_t));
+    if (!op) {
+        log_error("calloc error: %m");
+        return NULL;
+    }
+    op->id = state->next_id++;
+    op->push = push;
+    op->free = free_data;
+    op->state = state;
+    op->next = state->running;
+    if (op->next) {
+        op->next->prev = op;
+    }
+    state->running = op;
+    return op;
+}
+
+void async_op_cancel(async_op_t *op) {
+    running_list_remove(op);
+    free(op);
+}
+
+void async_op_finish(async_op_t *op, void *data) {
+    async_state_t *state = op->state;
+    running_list_remove(op);
+    op->data = data;
+    op->finished = 1;
+    if (state->done_tail) {
+        state->done_tail->next = op;
+    } else {
+        state->done_head = op;
+    }
+    state->done_tail = op;
+    if (state->sandbox->async_wake) {
+        state->sandbox->async_wake(state->sandbox->async_wake_arg);
+    }
+}
+
+void async_state_free(sandbox_t *sandbox) {
+    async_state_t *state = sandbox->async;
+    if (!state) {
+        return;
+    }
+    /* The engines free the queries, requests and connections that haven't
+     * finished, without running their callbacks. */
+    if (state->dns) {
+        dns_engine_destroy(state->dns);
+        free(state->dns);
+    }
+    if (state->http) {
+        http_engine_destroy(state->http);
+        free(state->http);
+    }
+    if (state->tcp) {
+        tcp_engine_destroy(state->tcp);
+        free(state->tcp);
+    }
+    while (state->running) {
+        async_op_cancel(state->running);
+    }
+    while (state->done_head) {
+        async_op_t *op = state->done_head;
+        state->done_head = op->next;
+        op->free(op->data);
+        free(op);
+    }
+    free(state);
+    sandbox->async = NULL;
+}
+
+static void deadline_callback(evutil_socket_t fd, short what, void *arg) {
+    /* Waking up the event loop is enough. */
+}
+
+int l_async_wait(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    async_state_t *state = sandbox->async;
+    if (!state || (!state->running && !state->done_head)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "no operations to wait for");
+        return 2;
+    }
+
+    if (sandbox->run_thread) {
+        if (L != sandbox->run_thread) {
+            lua_pushnil(L);
+            lua_pushstring(L, "can't wait inside a task of an in-process run");
+            return 2;
+        }
+        if (!state->done_head) {
+            /* The scheduler runs the operations and resumes us, with the
+             * values async_push_finished or sandbox_push_deadline_error
+             * pushes. */
+            sandbox->suspended = 1;
+            return lua_yield(L, 0);
+        }
+        return async_push_finished(L, state);
+    }
+
+    /* Wake up at the sandbox's deadline even if nothing finishes by then. */
+    struct event *deadline = NULL;
+    int64_t remaining = sandbox_time_remaining(sandbox);
+    if (!state->done_head && remaining != INT64_MAX) {
+        struct timeval timeout = { remaining / 1000000, remaining % 1000000 };
+        deadline = evtimer_new(sandbox->base, deadline_callback, NULL);
+        if (!deadline || evtimer_add(deadline, &timeout)) {
+            if (deadline) {
+                event_free(deadline);
+            }
+            lua_pushnil(L);
+            lua_pushstring(L, "error creating deadline timer");
+            return 2;
+        }
+    }
+
+    const char *error = NULL;
+    while (!state->done_head && !error) {
+        if (sandbox_time_remaining(sandbox) == 0) {
+            error = SANDBOX_DEADLINE_ERROR;
+            break;
+        }
+        int rc = event_base_loop(sandbox->base, EVLOOP_ONCE);
+        if (rc == -1) {
+            error = "error running event loop";
+        } else if (rc == 1) {
+            /* Nothing is waiting on the event base, so nothing can finish. */
+            error = "operations are stalled";
+        }
+    }
+    if (deadline) {
+        event_free(deadline);
+    }
+    if (error) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+    return async_push_finished(L, state);
+}
+
+int async_push_finished(lua_State *L, async_state_t *state) {
+    lua_newtable(L);
+    int count = 0;
+    while (state->done_head) {
+        async_op_t *op = state->done_head;
+        state->done_head = op->next;
+        if (!state->done_head) {
+            state->done_tail = NULL;
+        }
+
+        lua_createtable(L, 0, 3);
+        lua_pushnumber(L, op->id);
+        lua_setfield(L, -2, "id");
+        op->push(L, op->data);
+        lua_setfield(L, -4, "timing");
+        lua_setfield(L, -3, "error");
+        lua_setfield(L, -2, "value");
+        lua_rawseti(L, -2, ++count);
+
+        op->free(op->data);
+        free(op);
+    }
+    lua_pushnil(L);
+    return 2;
+}
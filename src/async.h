@@ -0,0 +1,102 @@
+#ifndef CENSORSCOPE_ASYNC_H_
+#define CENSORSCOPE_ASYNC_H_
+
+#include "lua.h"
+
+#include "sandbox.h"
+
+struct dns_engine;
+struct http_engine;
+struct tcp_engine;
+
+typedef struct async_op async_op_t;
+
+/* Push the three Lua results of a finished operation, a value, an error
+ * message or nil, and a timing table or nil, exactly as the blocking primitive
+ * would return them. */
+typedef void (*async_push_result)(lua_State *L, void *data);
+/* Free the data of a finished operation. */
+typedef void (*async_free_data)(void *data);
+
+/* This tracks one asynchronous primitive call, from when Lua submits it until
+ * Lua collects its result with async_wait. */
+struct async_op {
+    lua_Integer id;
+    /* The engine's query, request or connection, set by async_op_finish. */
+    void *data;
+    async_push_result push;
+    async_free_data free;
+    int finished;
+    struct async_state *state;
+    async_op_t *prev, *next;
+};
+
+/* Each sandbox has asynchronous engines for DNS lookups, HTTP requests and TCP
+ * connects, created on first use on the sandbox's async_base, so operations
+ * submitted by many coroutines share one event loop. */
+typedef struct async_state {
+    sandbox_t *sandbox;
+    struct dns_engine *dns;
+    struct http_engine *http;
+    struct tcp_engine *tcp;
+
+    /* Operations that are still running. */
+    async_op_t *running;
+    /* Finished operations whose results Lua hasn't collected, in the order
+     * they finished. */
+    async_op_t *done_head, *done_tail;
+    lua_Integer next_id;
+} async_state_t;
+
+/* Return the sandbox's asynchronous state, creating it on first use.
+ *
+ * Returns: the state, which the sandbox owns, or NULL on failure.
+ *
+ */
+async_state_t *async_sandbox_state(sandbox_t *sandbox);
+
+/* Start tracking an operation. Submit it to an engine afterwards, with the op
+ * as the callback argument, and call async_op_finish from the callback.
+ *
+ * Returns: the new op, or NULL on failure.
+ *
+ */
+async_op_t *async_op_new(async_state_t *state,
+                         async_push_result push,
+                         async_free_data free);
+
+/* Abandon an op whose submission failed, before its callback could run. */
+void async_op_cancel(async_op_t *op);
+
+/* Mark an op as finished with the engine's data, and queue its result. */
+void async_op_finish(async_op_t *op, void *data);
+
+/* Abandon every unfinished operation and free the state. experiment.c calls
+ * this after every run, so results don't outlive the coroutines waiting for
+ * them, and sandbox_destroy calls it too. */
+void async_state_free(sandbox_t *sandbox);
+
+/* Wait for at least one asynchronous operation to finish. Expects the sandbox
+ * as its first upvalue. In runs inside the scheduler's process, this suspends
+ * the run's coroutine instead, and the scheduler resumes it with the same
+ * values, so only the run's own coroutine may wait there, not a task.
+ *
+ * Lua returns:
+ * - an array of tables with fields id, value, error and timing, one for each
+ *   operation that finished, or nil if there were no operations to wait for.
+ * - an error message, or nil if no errors occurred. Once the sandbox's deadline
+ *   passes, this is "deadline exceeded".
+ *
+ */
+int l_async_wait(lua_State *L);
+
+/* Push what async_wait returns once operations have finished: the array of
+ * their results, which it frees, and nil. The scheduler resumes suspended
+ * runs with these.
+ *
+ * Returns: 2, the number of values pushed.
+ *
+ */
+int async_push_finished(lua_State *L, async_state_t *state);
+
+#endif
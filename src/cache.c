@@ -0,0 +1,549 @@
+/* For struct ucred. */
+#define _GNU_SOURCE
+
+#include "cache.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "logging.h"
+#include "options.h"
+#include "util.h"
+
+/* Requests start with one of these bytes. A get is followed by the key, and
+ * answered with CACHE_HIT and the value or with CACHE_MISS. A put is followed
+ * by the TTL in seconds as a 4-byte big-endian integer, the key's length as a
+ * 2-byte one, the key and the value, and isn't answered. */
+#define CACHE_GET 'g'
+#define CACHE_PUT 'p'
+#define CACHE_HIT 'h'
+#define CACHE_MISS 'm'
+#define CACHE_PUT_HEADER_SIZE 7
+
+/* Set in the scheduler by cache_service_init, so children inherit them. */
+static cache_service_t *local_service;
+static pid_t service_pid;
+static long service_window;
+
+/* This process's connection to the service, and the pid that opened it, so
+ * a process doesn't use a connection inherited from its parent. */
+static int client_fd = -1;
+static pid_t client_pid;
+
+static uint32_t key_hash(const char *key, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void free_entry(cache_entry_t *entry) {
+    free(entry->key);
+    free(entry->value);
+    free(entry);
+}
+
+/* Return the link that points to the entry for key, or to the end of its
+ * bucket if there is none, dropping expired entries on the way. */
+static cache_entry_t **find_link(cache_service_t *service,
+                                 const char *key,
+                                 size_t key_len,
+                                 int64_t now) {
+    cache_entry_t **link = &service->buckets[key_hash(key, key_len)
+                                             % CACHE_BUCKETS];
+    while (*link) {
+        cache_entry_t *entry = *link;
+        if (entry->expires_at <= now) {
+            *link = entry->next;
+            free_entry(entry);
+            --service->count;
+        } else if (entry->key_len == key_len
+                   && memcmp(entry->key, key, key_len) == 0) {
+            return link;
+        } else {
+            link = &entry->next;
+        }
+    }
+    return link;
+}
+
+static void purge_expired(cache_service_t *service, int64_t now) {
+    for (int i = 0; i < CACHE_BUCKETS; ++i) {
+        cache_entry_t **link = &service->buckets[i];
+        while (*link) {
+            cache_entry_t *entry = *link;
+            if (entry->expires_at <= now) {
+                *link = entry->next;
+                free_entry(entry);
+                --service->count;
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+static const cache_entry_t *store_get(cache_service_t *service,
+                                      const char *key,
+                                      size_t key_len) {
+    return *find_link(service, key, key_len, monotonic_microseconds());
+}
+
+/* Store a copy of value under key, replacing any older entry. When the cache
+ * is full of fresh entries, new ones are dropped until some expire. */
+static void store_put(cache_service_t *service,
+                      const char *key,
+                      size_t key_len,
+                      const char *value,
+                      size_t value_len,
+                      long ttl_seconds) {
+    if (ttl_seconds > service->window_seconds) {
+        ttl_seconds = service->window_seconds;
+    }
+    if (ttl_seconds <= 0) {
+        return;
+    }
+    int64_t now = monotonic_microseconds();
+    cache_entry_t **link = find_link(service, key, key_len, now);
+    if (!*link && service->count >= CACHE_MAX_ENTRIES) {
+        purge_expired(service, now);
+        if (service->count >= CACHE_MAX_ENTRIES) {
+            log_debug("cache is full; dropping a new entry");
+            return;
+        }
+        link = find_link(service, key, key_len, now);
+    }
+
+    char *copy = malloc(value_len ? value_len : 1);
+    if (!copy) {
+        log_error("malloc error: %m");
+        return;
+    }
+    memcpy(copy, value, value_len);
+    cache_entry_t *entry = *link;
+    if (entry) {
+        free(entry->value);
+    } else {
+        entry = calloc(1, sizeof(cache_entry_t));
+        char *key_copy = malloc(key_len ? key_len : 1);
+        if (!entry || !key_copy) {
+            log_error("malloc error: %m");
+            free(entry);
+            free(key_copy);
+            free(copy);
+            return;
+        }
+        memcpy(key_copy, key, key_len);
+        entry->key = key_copy;
+        entry->key_len = key_len;
+        *link = entry;
+        ++service->count;
+    }
+    entry->value = copy;
+    entry->value_len = value_len;
+    entry->expires_at = now + (int64_t)ttl_seconds * 1000000;
+}
+
+/* Fill in the service's address for the scheduler with the given pid. */
+static socklen_t service_address(pid_t pid, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    /* The leading NUL puts the name in the abstract namespace, so there's no
+     * file to clean up. */
+    int len = snprintf(address->sun_path + 1,
+                       sizeof(address->sun_path) - 1,
+                       "censorscope-cache-%ld",
+                       (long)pid);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/* Abstract sockets have no permissions, so any local user could connect to
+ * the service, or bind its name first. Test whether the other end of a
+ * connection runs as our user, as the scheduler and its children do.
+ *
+ * Returns: 1 if it does, 0 if it doesn't or we couldn't tell.
+ *
+ */
+static int peer_is_ours(int fd) {
+    struct ucred credentials;
+    socklen_t len = sizeof(credentials);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &len)) {
+        return 0;
+    }
+    return credentials.uid == getuid();
+}
+
+static void close_connection(cache_connection_t *connection) {
+    cache_service_t *service = connection->service;
+    if (connection->prev) {
+        connection->prev->next = connection->next;
+    } else {
+        service->connections = connection->next;
+    }
+    if (connection->next) {
+        connection->next->prev = connection->prev;
+    }
+    event_free(connection->ev);
+    evutil_closesocket(connection->fd);
+    free(connection);
+}
+
+static void handle_request(cache_connection_t *connection,
+                           const char *packet,
+                           size_t len) {
+    cache_service_t *service = connection->service;
+    if (len >= 1 && packet[0] == CACHE_GET) {
+        const cache_entry_t *entry = store_get(service, packet + 1, len - 1);
+        char reply[CACHE_MAX_PACKET];
+        size_t reply_len = 1;
+        if (entry && entry->value_len < sizeof(reply)) {
+            reply[0] = CACHE_HIT;
+            memcpy(reply + 1, entry->value, entry->value_len);
+            reply_len += entry->value_len;
+        } else {
+            reply[0] = CACHE_MISS;
+        }
+        /* If the child isn't reading, it will give up and count a miss. */
+        send(connection->fd, reply, reply_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } else if (len >= CACHE_PUT_HEADER_SIZE && packet[0] == CACHE_PUT) {
+        uint32_t ttl;
+        uint16_t key_len;
+        memcpy(&ttl, packet + 1, sizeof(ttl));
+        memcpy(&key_len, packet + 5, sizeof(key_len));
+        key_len = ntohs(key_len);
+        if (key_len > len - CACHE_PUT_HEADER_SIZE) {
+            return;
+        }
+        const char *key = packet + CACHE_PUT_HEADER_SIZE;
+        store_put(service,
+                  key,
+                  key_len,
+                  key + key_len,
+                  len - CACHE_PUT_HEADER_SIZE - key_len,
+                  ntohl(ttl));
+    }
+}
+
+static void connection_callback(evutil_socket_t fd, short what, void *arg) {
+    cache_connection_t *connection = arg;
+    char packet[CACHE_MAX_PACKET];
+    for (;;) {
+        ssize_t len = recv(fd, packet, sizeof(packet), MSG_DONTWAIT);
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len <= 0) {
+            /* The child exited. */
+            close_connection(connection);
+            return;
+        }
+        handle_request(connection, packet, len);
+    }
+}
+
+static void listener_callback(evutil_socket_t fd, short what, void *arg) {
+    cache_service_t *service = arg;
+    for (;;) {
+        evutil_socket_t client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error("error accepting cache connection: %m");
+            }
+            return;
+        }
+        if (!peer_is_ours(client)) {
+            log_error("rejecting cache connection from another user");
+            evutil_closesocket(client);
+            continue;
+        }
+        if (evutil_make_socket_nonblocking(client)
+            || evutil_make_socket_closeonexec(client)) {
+            log_error("error configuring cache connection");
+            evutil_closesocket(client);
+            continue;
+        }
+        cache_connection_t *connection = calloc(1, sizeof(cache_connection_t));
+        if (!connection) {
+            log_error("calloc error: %m");
+            evutil_closesocket(client);
+            continue;
+        }
+        connection->fd = client;
+        connection->service = service;
+        connection->ev = event_new(service->base,
+                                   client,
+                                   EV_READ | EV_PERSIST,
+                                   connection_callback,
+                                   connection);
+        if (!connection->ev || event_add(connection->ev, NULL)) {
+            log_error("error adding cache connection event");
+            if (connection->ev) {
+                event_free(connection->ev);
+            }
+            evutil_closesocket(client);
+            free(connection);
+            continue;
+        }
+        connection->next = service->connections;
+        if (service->connections) {
+            service->connections->prev = connection;
+        }
+        service->connections = connection;
+    }
+}
+
+int cache_service_init(cache_service_t *service,
+                       const censorscope_options_t *options,
+                       struct event_base *base) {
+    memset(service, 0, sizeof(*service));
+    service->fd = -1;
+    service->base = base;
+    service->window_seconds = options->cache_window_seconds;
+    if (service->window_seconds <= 0) {
+        return 0;
+    }
+
+    service->fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (service->fd < 0) {
+        log_error("socket: %m");
+        return -1;
+    }
+    struct sockaddr_un address;
+    socklen_t address_len = service_address(getpid(), &address);
+    if (bind(service->fd, (struct sockaddr *)&address, address_len)
+        || listen(service->fd, 64)
+        || evutil_make_socket_nonblocking(service->fd)
+        || evutil_make_socket_closeonexec(service->fd)) {
+        log_error("error binding cache socket: %m");
+        evutil_closesocket(service->fd);
+        service->fd = -1;
+        return -1;
+    }
+    service->listener = event_new(base,
+                                  service->fd,
+                                  EV_READ | EV_PERSIST,
+                                  listener_callback,
+                                  service);
+    if (!service->listener || event_add(service->listener, NULL)) {
+        log_error("error adding cache listener event");
+        cache_service_destroy(service);
+        return -1;
+    }
+
+    local_service = service;
+    service_pid = getpid();
+    service_window = service->window_seconds;
+    log_info("caching DNS answers and HTTP digests for up to %ld seconds",
+             service->window_seconds);
+    return 0;
+}
+
+void cache_service_stop(cache_service_t *service) {
+    while (service->connections) {
+        close_connection(service->connections);
+    }
+    if (service->listener) {
+        event_del(service->listener);
+    }
+}
+
+int cache_service_destroy(cache_service_t *service) {
+    while (service->connections) {
+        close_connection(service->connections);
+    }
+    if (service->listener) {
+        event_free(service->listener);
+        service->listener = NULL;
+    }
+    if (service->fd >= 0) {
+        evutil_closesocket(service->fd);
+        service->fd = -1;
+    }
+    for (int i = 0; i < CACHE_BUCKETS; ++i) {
+        while (service->buckets[i]) {
+            cache_entry_t *entry = service->buckets[i];
+            service->buckets[i] = entry->next;
+            free_entry(entry);
+        }
+    }
+    service->count = 0;
+    if (local_service == service) {
+        local_service = NULL;
+        service_window = 0;
+    }
+    return 0;
+}
+
+static void client_disconnect() {
+    if (client_fd >= 0) {
+        close(client_fd);
+        client_fd = -1;
+    }
+}
+
+/* Return this process's connection to the service, connecting on first use,
+ * or -1 on failure. */
+static int client_connect() {
+    if (client_fd >= 0 && client_pid == getpid()) {
+        return client_fd;
+    }
+    /* A connection inherited from our parent is the parent's to use. */
+    client_disconnect();
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct timeval timeout = {
+        CACHE_TIMEOUT_MICROSECONDS / 1000000,
+        CACHE_TIMEOUT_MICROSECONDS % 1000000,
+    };
+    struct sockaddr_un address;
+    socklen_t address_len = service_address(service_pid, &address);
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))
+        || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))
+        || evutil_make_socket_closeonexec(fd)
+        || connect(fd, (struct sockaddr *)&address, address_len)) {
+        log_debug("error connecting to cache: %m");
+        close(fd);
+        return -1;
+    }
+    if (!peer_is_ours(fd)) {
+        log_error("cache socket belongs to another user");
+        close(fd);
+        return -1;
+    }
+    client_fd = fd;
+    client_pid = getpid();
+    return fd;
+}
+
+/* Send one request to the service. On failure we drop the connection, so a
+ * late reply can't be mistaken for the answer to a later request. */
+static int client_send(const char *packet, size_t len) {
+    int fd = client_connect();
+    if (fd < 0) {
+        return -1;
+    }
+    if (send(fd, packet, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        client_disconnect();
+        return -1;
+    }
+    return 0;
+}
+
+int l_cache_get(lua_State *L) {
+    size_t key_len;
+    const char *key = luaL_checklstring(L, 1, &key_len);
+    if (service_window <= 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "cache is disabled");
+        return 2;
+    }
+    if (key_len + 1 > CACHE_MAX_PACKET) {
+        lua_pushnil(L);
+        lua_pushstring(L, "key is too long");
+        return 2;
+    }
+    /* Code running in the scheduler itself, like main.lua or synchronous
+     * runs, can't wait for its own event loop, so it reads the store. */
+    if (local_service && getpid() == service_pid) {
+        const cache_entry_t *entry = store_get(local_service, key, key_len);
+        if (entry) {
+            lua_pushlstring(L, entry->value, entry->value_len);
+        } else {
+            lua_pushnil(L);
+        }
+        lua_pushnil(L);
+        return 2;
+    }
+
+    char packet[CACHE_MAX_PACKET];
+    packet[0] = CACHE_GET;
+    memcpy(packet + 1, key, key_len);
+    if (client_send(packet, key_len + 1)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error contacting cache");
+        return 2;
+    }
+    ssize_t len;
+    do {
+        len = recv(client_fd, packet, sizeof(packet), 0);
+    } while (len < 0 && errno == EINTR);
+    if (len < 1) {
+        client_disconnect();
+        lua_pushnil(L);
+        lua_pushstring(L, "no reply from cache");
+        return 2;
+    }
+    if (packet[0] == CACHE_HIT) {
+        lua_pushlstring(L, packet + 1, len - 1);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_pushnil(L);
+    return 2;
+}
+
+int l_cache_put(lua_State *L) {
+    size_t key_len, value_len;
+    const char *key = luaL_checklstring(L, 1, &key_len);
+    const char *value = luaL_checklstring(L, 2, &value_len);
+    lua_Integer ttl = luaL_optinteger(L, 3, service_window);
+    if (service_window <= 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "cache is disabled");
+        return 2;
+    }
+    if (key_len > UINT16_MAX
+        || CACHE_PUT_HEADER_SIZE + key_len + value_len > CACHE_MAX_PACKET) {
+        lua_pushnil(L);
+        lua_pushstring(L, "entry is too large to cache");
+        return 2;
+    }
+    if (ttl < 0) {
+        ttl = 0;
+    } else if (ttl > service_window) {
+        ttl = service_window;
+    }
+    if (local_service && getpid() == service_pid) {
+        store_put(local_service, key, key_len, value, value_len, ttl);
+        lua_pushboolean(L, 1);
+        lua_pushnil(L);
+        return 2;
+    }
+
+    char packet[CACHE_MAX_PACKET];
+    uint32_t ttl_field = htonl(ttl);
+    uint16_t key_len_field = htons(key_len);
+    packet[0] = CACHE_PUT;
+    memcpy(packet + 1, &ttl_field, sizeof(ttl_field));
+    memcpy(packet + 5, &key_len_field, sizeof(key_len_field));
+    memcpy(packet + CACHE_PUT_HEADER_SIZE, key, key_len);
+    memcpy(packet + CACHE_PUT_HEADER_SIZE + key_len, value, value_len);
+    if (client_send(packet, CACHE_PUT_HEADER_SIZE + key_len + value_len)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error contacting cache");
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    return 2;
+}
@@ -0,0 +1,110 @@
+#ifndef CENSORSCOPE_CACHE_H
+#define CENSORSCOPE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event2/util.h>
+
+#include "lua.h"
+
+#include "options.h"
+
+/* The cache service lets experiments reuse each other's recent DNS answers
+ * and HTTP digests, so several experiments measuring the same hosts in one
+ * window don't all repeat the same requests. The scheduler owns the cache: it
+ * listens on a UNIX socket in the abstract namespace, named after its pid, and
+ * every child forked afterwards, workers included, connects on first use.
+ * Anyone could connect to that name, so both ends check with SO_PEERCRED that
+ * the other runs as the same user, and the service refuses everyone else.
+ *
+ * Entries live for the TTL their writer gives, but never longer than the
+ * cache-window option, and the cache is off if that is 0. Lookups that can't
+ * reach the service within CACHE_TIMEOUT_MICROSECONDS are misses, so a busy
+ * scheduler only costs a measurement its cache hit. */
+
+#define CACHE_BUCKETS 1024
+#define CACHE_MAX_ENTRIES 4096
+/* The largest request or reply, and so the largest key plus value. */
+#define CACHE_MAX_PACKET 16384
+#define CACHE_TIMEOUT_MICROSECONDS 100000
+
+typedef struct cache_entry {
+    char *key;
+    size_t key_len;
+    char *value;
+    size_t value_len;
+    /* In monotonic microseconds. */
+    int64_t expires_at;
+    struct cache_entry *next;
+} cache_entry_t;
+
+/* A child's connection to the service. */
+typedef struct cache_connection {
+    evutil_socket_t fd;
+    struct event *ev;
+    struct cache_service *service;
+    struct cache_connection *prev, *next;
+} cache_connection_t;
+
+typedef struct cache_service {
+    long window_seconds;
+    /* The listening socket, or -1 if the cache is off. */
+    evutil_socket_t fd;
+    struct event *listener;
+    struct event_base *base;
+    cache_connection_t *connections;
+    /* Entries hashed by key, with chaining. */
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    int count;
+} cache_service_t;
+
+/* Start the cache service, unless options->cache_window_seconds is 0. Call it
+ * before forking any children, so they know where to find it.
+ *
+ * Arguments:
+ * - base is the scheduler's event base, on which we serve requests.
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int cache_service_init(cache_service_t *service,
+                       const censorscope_options_t *options,
+                       struct event_base *base);
+
+/* Stop serving requests, closing every connection, so the event loop can
+ * exit once nothing else is left to run. Lookups are misses from then on. */
+void cache_service_stop(cache_service_t *service);
+
+/* Stop the service, closing every connection and dropping every entry.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int cache_service_destroy(cache_service_t *service);
+
+/* Look up a fresh value in the cache.
+ *
+ * Lua arguments:
+ * - key is a string.
+ * Lua returns:
+ * - the cached string, or nil if there is no fresh entry.
+ * - an error message if the cache could not be asked, or nil otherwise.
+ *
+ */
+int l_cache_get(lua_State *L);
+
+/* Store a value in the cache.
+ *
+ * Lua arguments:
+ * - key is a string.
+ * - value is a string.
+ * - ttl_seconds is how long the value stays fresh, capped at the
+ *   cache window (default: the cache window).
+ * Lua returns:
+ * - true on success, or nil on error.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_cache_put(lua_State *L);
+
+#endif
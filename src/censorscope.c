@@ -8,14 +8,41 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
+#include "cache.h"
+#include "chunks.h"
 #include "logging.h"
 #include "options.h"
+#include "ratelimit.h"
+#include "resync.h"
 #include "sandbox.h"
 #include "scheduling.h"
+#include "segments.h"
 #include "subprocesses.h"
+#include "targets.h"
 #include "termination.h"
-#include "transport.h"
-#include "util.h"
+#include "trace.h"
+#include "workers.h"
+
+/* Periodic work that should stop once there's nothing left to run, so the
+ * event loop can exit. */
+typedef struct {
+    segments_t *segments;
+    resync_t *resync;
+    struct event *log_flush;
+    cache_service_t *cache;
+} periodic_t;
+
+static void on_schedules_idle(void *arg) {
+    periodic_t *periodic = arg;
+    segments_stop(periodic->segments);
+    resync_stop(periodic->resync);
+    event_del(periodic->log_flush);
+    cache_service_stop(periodic->cache);
+}
+
+static void flush_logs(evutil_socket_t fd, short what, void *arg) {
+    logging_flush();
+}
 
 int main(int argc, char **argv) {
     logging_init();
@@ -25,37 +52,29 @@ int main(int argc, char **argv) {
         log_error("error parsing flags");
         return 1;
     }
-
-    transport_t transport;
-    if (transport_init(&transport, &options, options.download_transport)) {
-        log_error("error initializing transport");
-        return 1;
-    }
-    if (transport_download(&transport)) {
-        log_error("error synchronizing sandbox");
-    }
-    if (transport_destroy(&transport)) {
-        log_error("error destroying transport");
-        return 1;
+    logging_set_level(options.log_level);
+    if (trace_open(options.trace_file)) {
+        log_error("error opening trace file; continuing without tracing");
     }
 
-    /* Load the experiments configuration from sandbox/main.lua. */
+    /* Load the experiments configuration from the sandbox we already have.
+     * The download runs in the background once the event loop starts, and
+     * replaces the schedules if it changes main.lua. */
     sandbox_t sandbox;
     if (sandbox_init(&sandbox, "main", &options)) {
         log_error("error initializing sandbox");
         return 1;
     }
-    char *main_filename = sprintf_malloc("%s/main.lua", options.sandbox_dir);
-    if (!main_filename) {
-        log_error("error allocating main_filename");
-        return 1;
+    if (resync_load_main(&sandbox, &options)) {
+        log_error("starting with no experiments");
     }
-    if (sandbox_run(&sandbox, main_filename, NULL)) {
-        log_error("error running code in sandbox");
-        free(main_filename);
-        return 1;
-    }
-    free(main_filename);
+
+    /* Compile the environment and every experiment and module now, and map
+     * every target list, so children inherit them instead of parsing them on
+     * every run. */
+    chunks_preload_directory(sandbox.L, options.luasrc_dir);
+    chunks_preload_directory(sandbox.L, options.sandbox_dir);
+    targets_preload_directory(options.sandbox_dir);
 
     struct event_base *base = event_base_new();
     if (!base) {
@@ -67,8 +86,29 @@ int main(int argc, char **argv) {
         log_error("error initializing subprocess handling");
         return 1;
     }
+    /* Start the cache before anything forks, so every child can find it. */
+    cache_service_t cache;
+    if (cache_service_init(&cache, &options, base)) {
+        log_error("error starting cache; continuing without it");
+    }
+    /* Likewise for the rate limiter, so every child shares one budget. */
+    if (ratelimit_init(&options)) {
+        log_error("error starting rate limiter; continuing without limits");
+    }
+    worker_pool_t workers;
+    if (options.workers > 0
+        && worker_pool_init(&workers, &subprocesses, &options, base)) {
+        log_error("error initializing worker pool");
+        return 1;
+    }
     experiment_schedules_t schedules;
-    if (experiment_schedules_init(&schedules, &subprocesses, &options, base, sandbox.L, 1)) {
+    if (experiment_schedules_init(&schedules,
+                                  &subprocesses,
+                                  options.workers > 0 ? &workers : NULL,
+                                  &options,
+                                  base,
+                                  sandbox.L,
+                                  1)) {
         log_error("error initializing experiments schedule");
         return 1;
     }
@@ -76,6 +116,30 @@ int main(int argc, char **argv) {
         log_error("error destroying sandbox");
         return 1;
     }
+    /* Start the download first, so uploads see that there will be
+     * experiments to run even if we have none yet. */
+    resync_t resync;
+    if (resync_init(&resync, &options, &subprocesses, &schedules, base)) {
+        log_error("error initializing sandbox sync");
+        return 1;
+    }
+    segments_t segments;
+    if (segments_init(&segments, &options, &subprocesses, &schedules, base)) {
+        log_error("error initializing results uploads");
+        return 1;
+    }
+    /* Write buffered log messages out even when nothing new is logged. */
+    struct timeval flush_interval = { LOGGING_FLUSH_INTERVAL_SECONDS, 0 };
+    struct event *log_flush = event_new(base, -1, EV_PERSIST, flush_logs, NULL);
+    if (!log_flush || event_add(log_flush, &flush_interval)) {
+        log_error("error scheduling log flushes");
+        return 1;
+    }
+    periodic_t periodic = { &segments, &resync, log_flush, &cache };
+    schedules.idle_callback = on_schedules_idle;
+    schedules.idle_callback_arg = &periodic;
+    /* Stop everything now if there's nothing to run and nothing to download. */
+    experiment_schedules_check_idle(&schedules);
 
     add_termination_handlers(base, &schedules);
 
@@ -86,28 +150,42 @@ int main(int argc, char **argv) {
         log_info("no more events to dispatch");
     }
 
+    if (resync_destroy(&resync)) {
+        log_error("error destroying sandbox sync");
+        return 1;
+    }
+    if (segments_destroy(&segments)) {
+        log_error("error destroying results uploads");
+        return 1;
+    }
     if (experiment_schedules_destroy(&schedules)) {
         log_error("error destroying schedules");
         return 1;
     }
+    if (options.workers > 0 && worker_pool_destroy(&workers)) {
+        log_error("error destroying worker pool");
+        return 1;
+    }
+    if (cache_service_destroy(&cache)) {
+        log_error("error destroying cache");
+        return 1;
+    }
     if (subprocesses_destroy(&subprocesses)) {
         log_error("error destroying subprocesses");
         return 1;
     }
+    event_free(log_flush);
     event_base_free(base);
+    chunks_free();
+    targets_free();
+    ratelimit_destroy();
 
-    if (transport_init(&transport, &options, options.upload_transport)) {
-        log_error("error initializing transport");
-        return 1;
-    }
-    if (transport_upload(&transport)) {
+    /* Nothing is running any more, so ship every segment. */
+    if (segments_upload(&options, 1)) {
         log_error("error uploading results");
     }
-    if (transport_destroy(&transport)) {
-        log_error("error destroying transport");
-        return 1;
-    }
 
+    trace_close();
     if (censorscope_options_destroy(&options)) {
         log_error("error destroying options");
         return 1;
@@ -0,0 +1,235 @@
+#include "chunks.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "logging.h"
+#include "util.h"
+
+#define BYTECODE_MAGIC_NUMBER 27
+
+typedef struct chunk {
+    char *path;
+    struct timespec mtime;
+    off_t size;
+    /* The output of lua_dump. */
+    char *code;
+    size_t code_len, code_capacity;
+    struct chunk *next;
+} chunk_t;
+
+static chunk_t *cache = NULL;
+
+static chunk_t *find_chunk(const char *path) {
+    for (chunk_t *chunk = cache; chunk; chunk = chunk->next) {
+        if (strcmp(chunk->path, path) == 0) {
+            return chunk;
+        }
+    }
+    return NULL;
+}
+
+static void remove_chunk(chunk_t *chunk) {
+    chunk_t **link = &cache;
+    while (*link != chunk) {
+        link = &(*link)->next;
+    }
+    *link = chunk->next;
+    free(chunk->path);
+    free(chunk->code);
+    free(chunk);
+}
+
+static int write_code(lua_State *L, const void *p, size_t size, void *ud) {
+    chunk_t *chunk = ud;
+    if (chunk->code_len + size > chunk->code_capacity) {
+        size_t capacity = chunk->code_capacity ? chunk->code_capacity : 4096;
+        while (capacity < chunk->code_len + size) {
+            capacity *= 2;
+        }
+        char *code = realloc(chunk->code, capacity);
+        if (!code) {
+            return 1;
+        }
+        chunk->code = code;
+        chunk->code_capacity = capacity;
+    }
+    memcpy(chunk->code + chunk->code_len, p, size);
+    chunk->code_len += size;
+    return 0;
+}
+
+/* Read an entire file into memory. */
+static char *read_file(const char *filename, size_t *len) {
+    FILE *handle = fopen(filename, "r");
+    if (!handle) {
+        return NULL;
+    }
+    size_t capacity = 4096;
+    char *contents = malloc(capacity);
+    *len = 0;
+    while (contents) {
+        *len += fread(contents + *len, 1, capacity - *len, handle);
+        if (*len < capacity) {
+            break;
+        }
+        capacity *= 2;
+        char *new_contents = realloc(contents, capacity);
+        if (!new_contents) {
+            free(contents);
+        }
+        contents = new_contents;
+    }
+    if (ferror(handle)) {
+        free(contents);
+        contents = NULL;
+    }
+    fclose(handle);
+    return contents;
+}
+
+/* Compile a source file, refusing bytecode, and leave the function on top of
+ * the stack. */
+static int compile_file(lua_State *L, const char *filename) {
+    size_t len;
+    char *source = read_file(filename, &len);
+    if (!source) {
+        lua_pushfstring(L, "cannot read %s", filename);
+        return -1;
+    }
+
+    /* Like luaL_loadfile, skip a leading '#' line, but keep its newline so
+     * line numbers stay right. */
+    size_t start = 0;
+    if (len > 0 && source[0] == '#') {
+        while (start < len && source[start] != '\n') {
+            ++start;
+        }
+    }
+    /* For security, we do not evaluate Lua bytecode. */
+    if (start < len
+        && (source[start] == BYTECODE_MAGIC_NUMBER || source[start] == 0)) {
+        free(source);
+        lua_pushfstring(L, "%s: for security, we do not evaluate Lua bytecode",
+                        filename);
+        return -1;
+    }
+
+    char *chunkname = sprintf_malloc("@%s", filename);
+    if (!chunkname) {
+        free(source);
+        lua_pushstring(L, "error allocating chunk name");
+        return -1;
+    }
+    int rc = luaL_loadbuffer(L, source + start, len - start, chunkname);
+    free(chunkname);
+    free(source);
+    return rc ? -1 : 0;
+}
+
+typedef struct {
+    const chunk_t *chunk;
+    int done;
+} code_reader_t;
+
+static const char *read_code(lua_State *L, void *ud, size_t *size) {
+    code_reader_t *reader = ud;
+    if (reader->done) {
+        *size = 0;
+        return NULL;
+    }
+    reader->done = 1;
+    *size = reader->chunk->code_len;
+    return reader->chunk->code;
+}
+
+int chunks_load(lua_State *L, const char *filename) {
+    struct stat info;
+    if (stat(filename, &info)) {
+        lua_pushfstring(L, "cannot stat %s", filename);
+        return -1;
+    }
+
+    chunk_t *chunk = find_chunk(filename);
+    if (chunk
+        && chunk->size == info.st_size
+        && chunk->mtime.tv_sec == info.st_mtim.tv_sec
+        && chunk->mtime.tv_nsec == info.st_mtim.tv_nsec) {
+        code_reader_t reader = { chunk, 0 };
+        char *chunkname = sprintf_malloc("@%s", filename);
+        if (!chunkname) {
+            lua_pushstring(L, "error allocating chunk name");
+            return -1;
+        }
+        int rc = lua_load(L, read_code, &reader, chunkname);
+        free(chunkname);
+        return rc ? -1 : 0;
+    }
+    if (chunk) {
+        remove_chunk(chunk);
+    }
+
+    if (compile_file(L, filename)) {
+        return -1;
+    }
+
+    /* Failing to cache the chunk isn't an error; we'll just compile it again
+     * next time. */
+    chunk = calloc(1, sizeof(chunk_t));
+    if (!chunk) {
+        return 0;
+    }
+    chunk->path = strdup(filename);
+    if (!chunk->path || lua_dump(L, write_code, chunk)) {
+        free(chunk->path);
+        free(chunk->code);
+        free(chunk);
+        return 0;
+    }
+    chunk->mtime = info.st_mtim;
+    chunk->size = info.st_size;
+    chunk->next = cache;
+    cache = chunk;
+    return 0;
+}
+
+int chunks_preload_directory(lua_State *L, const char *directory) {
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        log_error("opendir(%s) error: %m", directory);
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        size_t len = strlen(entry->d_name);
+        if (len < 4 || strcmp(entry->d_name + len - 4, ".lua") != 0) {
+            continue;
+        }
+        char *filename = sprintf_malloc("%s/%s", directory, entry->d_name);
+        if (!filename) {
+            continue;
+        }
+        if (chunks_load(L, filename)) {
+            log_error("error precompiling %s: %s",
+                      filename,
+                      lua_tostring(L, -1));
+        }
+        lua_pop(L, 1);
+        free(filename);
+    }
+    closedir(dir);
+    return 0;
+}
+
+void chunks_free() {
+    while (cache) {
+        remove_chunk(cache);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef CENSORSCOPE_CHUNKS_H
+#define CENSORSCOPE_CHUNKS_H
+
+#include "lua.h"
+
+/* The chunk cache keeps the compiled form of every Lua file we load, keyed
+ * by path, modification time and size, so a file is only parsed again when it
+ * changes. The cache is global to the process. The parent fills it before
+ * forking, so children inherit it copy-on-write and start without reading or
+ * compiling anything.
+ *
+ * We never load bytecode from disk, since it can escape the sandbox. The
+ * cache only holds bytecode that we compiled ourselves from source. */
+
+/* Load a Lua source file as a function on top of the stack, like
+ * luaL_loadfile, but use the cached compiled code if the file hasn't changed.
+ *
+ * Returns: 0 on success. Otherwise, returns -1 and pushes an error message.
+ *
+ */
+int chunks_load(lua_State *L, const char *filename);
+
+/* Compile every .lua file in a directory into the cache, using L as scratch
+ * space. Files that don't compile are logged and skipped.
+ *
+ * Returns: 0 on success, -1 if the directory could not be read.
+ *
+ */
+int chunks_preload_directory(lua_State *L, const char *directory);
+
+/* Free every cached chunk. */
+void chunks_free();
+
+#endif
@@ -1,14 +1,679 @@
 #include "dns.h"
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
 #include <ldns/ldns.h>
 
 #define LUALIB
 #include "lua.h"
 #include "lauxlib.h"
 
+#include "async.h"
+#include "logging.h"
+#include "luautil.h"
+#include "ratelimit.h"
+#include "sandbox.h"
+#include "util.h"
+
+#define DNS_PORT 53
+#define DEFAULT_BATCH_WINDOW 32
+#define DEFAULT_BATCH_TIMEOUT_SECONDS 5
+#define DEFAULT_BATCH_RETRIES 2
+#define DEFAULT_COMPARE_WINDOW 64
+#define DEFAULT_COMPARE_LISTEN_SECONDS 1
+/* About how big a query is, for pacing lookups we don't encode ourselves. */
+#define DNS_QUERY_BYTES 64
+
+/* Responses are read into this buffer before parsing. The engine is single
+ * threaded, so one buffer is enough. */
+static uint8_t receive_buffer[LDNS_MAX_PACKETLEN];
+
+static void on_query_event(evutil_socket_t fd, short what, void *arg);
+
+static void active_list_remove(dns_query_t *query) {
+    dns_engine_t *engine = query->engine;
+    if (query->prev) {
+        query->prev->next = query->next;
+    } else {
+        engine->active = query->next;
+    }
+    if (query->next) {
+        query->next->prev = query->prev;
+    }
+    query->prev = query->next = NULL;
+}
+
+static void release_socket(dns_query_t *query) {
+    if (query->ev) {
+        event_free(query->ev);
+        query->ev = NULL;
+    }
+    if (query->fd >= 0) {
+        evutil_closesocket(query->fd);
+        query->fd = -1;
+    }
+}
+
+static void start_pending(dns_engine_t *engine);
+
+/* Tell the rate limiter whether the nameserver answered. */
+static void report_query(const dns_query_t *query,
+                         int lost,
+                         size_t received_bytes) {
+    char key[RATELIMIT_KEY_SIZE];
+    ratelimit_address_key((const struct sockaddr *)&query->server,
+                          key,
+                          sizeof(key));
+    ratelimit_report(key, lost, received_bytes);
+}
+
+/* Finish a query that's on the wire: release its socket, hand it to the
+ * callback and let the next pending query take its slot. */
+static void finish_query(dns_query_t *query,
+                         ldns_pkt *response,
+                         const char *error) {
+    dns_engine_t *engine = query->engine;
+
+    release_socket(query);
+    active_list_remove(query);
+    --engine->in_flight;
+    --engine->outstanding;
+    query->finished_at = monotonic_microseconds();
+
+    query->response = response;
+    query->error = error;
+    free(query->wire);
+    query->wire = NULL;
+
+    query->callback(query, query->callback_arg);
+    start_pending(engine);
+}
+
+/* Finish a query that failed, unless it already has a response, which wins
+ * over anything that goes wrong while we listen for late ones. */
+static void fail_query(dns_query_t *query, const char *error) {
+    if (query->response) {
+        finish_query(query, query->response, NULL);
+    } else {
+        finish_query(query, NULL, error);
+    }
+}
+
+/* Keep a response that arrived after the query's first, up to
+ * DNS_MAX_LATE_RESPONSES of them. */
+static void add_late_response(dns_query_t *query,
+                              ldns_pkt *response,
+                              int64_t rtt_microseconds,
+                              size_t size) {
+    dns_late_response_t *late = NULL;
+    if (query->late_count < DNS_MAX_LATE_RESPONSES) {
+        late = calloc(1, sizeof(dns_late_response_t));
+    }
+    if (!late) {
+        ldns_pkt_free(response);
+        return;
+    }
+    late->response = response;
+    late->rtt_microseconds = rtt_microseconds;
+    late->size = size;
+    dns_late_response_t **link = &query->late_responses;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = late;
+    ++query->late_count;
+}
+
+/* (Re)arm the read event so it fires at the query's deadline at the latest. */
+static int wait_for_response(dns_query_t *query) {
+    int64_t remaining = query->deadline - monotonic_microseconds();
+    if (remaining < 0) {
+        remaining = 0;
+    }
+    struct timeval timeout = { remaining / 1000000, remaining % 1000000 };
+    return event_add(query->ev, &timeout);
+}
+
+static int send_attempt(dns_query_t *query) {
+    dns_engine_t *engine = query->engine;
+
+    ++query->attempts;
+    query->sent_at = monotonic_microseconds();
+    if (query->attempts == 1) {
+        query->first_sent_at = query->sent_at;
+    }
+    query->deadline = query->sent_at
+                    + engine->timeout.tv_sec * 1000000LL
+                    + engine->timeout.tv_usec;
+
+    /* If the send fails (e.g., ENOBUFS) we still wait for the timeout and
+     * treat it like a lost packet, so transient errors get retried. */
+    send(query->fd, query->wire, query->wire_len, 0);
+    return wait_for_response(query);
+}
+
+/* Move a query from the pending queue onto the wire. */
+static void start_query(dns_query_t *query) {
+    dns_engine_t *engine = query->engine;
+
+    query->prev = NULL;
+    query->next = engine->active;
+    if (engine->active) {
+        engine->active->prev = query;
+    }
+    engine->active = query;
+    ++engine->in_flight;
+
+    /* Every query gets its own socket, and therefore its own random source
+     * port. Connecting the socket means the kernel drops datagrams from any
+     * other address and reports ICMP port unreachable errors to us. */
+    query->fd = socket(query->server.ss_family, SOCK_DGRAM, 0);
+    if (query->fd < 0) {
+        finish_query(query, NULL, "error creating socket");
+        return;
+    }
+    if (evutil_make_socket_nonblocking(query->fd)
+        || evutil_make_socket_closeonexec(query->fd)) {
+        finish_query(query, NULL, "error configuring socket");
+        return;
+    }
+    if (connect(query->fd,
+                (struct sockaddr *)&query->server,
+                query->server_len)) {
+        finish_query(query, NULL, "error connecting to nameserver");
+        return;
+    }
+    query->ev = event_new(engine->base,
+                          query->fd,
+                          EV_READ,
+                          on_query_event,
+                          query);
+    if (!query->ev) {
+        finish_query(query, NULL, "error creating event");
+        return;
+    }
+    if (send_attempt(query)) {
+        finish_query(query, NULL, "error adding event");
+        return;
+    }
+}
+
+static void start_pending(dns_engine_t *engine) {
+    if (engine->starting) {
+        return;
+    }
+    engine->starting = 1;
+    while (engine->pending_head && engine->in_flight < engine->window) {
+        dns_query_t *query = engine->pending_head;
+        char key[RATELIMIT_KEY_SIZE];
+        ratelimit_address_key((const struct sockaddr *)&query->server,
+                              key,
+                              sizeof(key));
+        int64_t wait = ratelimit_acquire(key, query->wire_len);
+        if (wait > 0) {
+            struct timeval delay = { wait / 1000000, wait % 1000000 };
+            if (event_add(engine->pace, &delay)) {
+                log_error("error scheduling DNS query");
+            }
+            break;
+        }
+        engine->pending_head = query->next;
+        if (!engine->pending_head) {
+            engine->pending_tail = NULL;
+        }
+        query->next = NULL;
+        start_query(query);
+    }
+    engine->starting = 0;
+}
+
+static void on_pace_event(evutil_socket_t fd, short what, void *arg) {
+    start_pending(arg);
+}
+
+static void on_query_event(evutil_socket_t fd, short what, void *arg) {
+    dns_query_t *query = arg;
+
+    if (what & EV_TIMEOUT && query->response) {
+        /* We're done listening for late responses. */
+        finish_query(query, query->response, NULL);
+        return;
+    }
+    if (what & EV_TIMEOUT) {
+        /* Retries aren't paced, since there are only a few and the loss
+         * has already slowed down new queries to this nameserver. */
+        report_query(query, 1, 0);
+        if (query->attempts <= query->engine->retries) {
+            if (send_attempt(query)) {
+                finish_query(query, NULL, "error adding event");
+            }
+        } else {
+            finish_query(query, NULL, "timeout");
+        }
+        return;
+    }
+
+    ssize_t length = recv(fd, receive_buffer, sizeof(receive_buffer), 0);
+    int64_t received_at = monotonic_microseconds();
+    if (length < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            if (wait_for_response(query)) {
+                fail_query(query, "error adding event");
+            }
+        } else if (errno == ECONNREFUSED) {
+            report_query(query, 0, 0);
+            fail_query(query, "connection refused");
+        } else {
+            fail_query(query, "error receiving response");
+        }
+        return;
+    }
+
+    /* Ignore anything that doesn't parse or doesn't answer our query, and keep
+     * waiting until the deadline for the real response. */
+    ldns_pkt *response = NULL;
+    if (ldns_wire2pkt(&response, receive_buffer, length) != LDNS_STATUS_OK) {
+        response = NULL;
+    } else if (!ldns_pkt_qr(response)
+               || ldns_pkt_id(response) != query->id) {
+        ldns_pkt_free(response);
+        response = NULL;
+    }
+    if (!response) {
+        if (wait_for_response(query)) {
+            fail_query(query, "error adding event");
+        }
+        return;
+    }
+    report_query(query, 0, length);
+    if (query->response) {
+        add_late_response(query,
+                          response,
+                          received_at - query->sent_at,
+                          length);
+    } else {
+        query->rtt_microseconds = received_at - query->sent_at;
+        query->response_size = length;
+        if (query->engine->listen_microseconds <= 0) {
+            finish_query(query, response, NULL);
+            return;
+        }
+        query->response = response;
+        query->deadline = received_at + query->engine->listen_microseconds;
+    }
+    if (wait_for_response(query)) {
+        fail_query(query, "error adding event");
+    }
+}
+
+int dns_engine_init(dns_engine_t *engine,
+                    struct event_base *base,
+                    int window,
+                    struct timeval timeout,
+                    int retries) {
+    if (window < 1 || retries < 0) {
+        log_error("invalid DNS engine parameters");
+        return -1;
+    }
+    engine->base = base;
+    engine->window = window;
+    engine->timeout = timeout;
+    engine->retries = retries;
+    engine->listen_microseconds = 0;
+    engine->pending_head = engine->pending_tail = NULL;
+    engine->active = NULL;
+    engine->in_flight = 0;
+    engine->outstanding = 0;
+    engine->starting = 0;
+    engine->pace = evtimer_new(base, on_pace_event, engine);
+    if (!engine->pace) {
+        log_error("error creating DNS pacing event");
+        return -1;
+    }
+    return 0;
+}
+
+dns_query_t *dns_engine_submit(dns_engine_t *engine,
+                               const char *domain,
+                               ldns_rr_type type,
+                               const struct sockaddr_storage *server,
+                               int server_len,
+                               dns_query_callback callback,
+                               void *callback_arg,
+                               const char **error) {
+    dns_query_t *query = calloc(1, sizeof(dns_query_t));
+    if (!query) {
+        *error = "error allocating query";
+        return NULL;
+    }
+    query->fd = -1;
+    query->submitted_at = monotonic_microseconds();
+    query->type = type;
+    query->engine = engine;
+    query->callback = callback;
+    query->callback_arg = callback_arg;
+    memcpy(&query->server, server, sizeof(query->server));
+    query->server_len = server_len;
+
+    query->domain = strdup(domain);
+    if (!query->domain) {
+        *error = "error allocating query";
+        dns_query_free(query);
+        return NULL;
+    }
+
+    ldns_rdf *name = ldns_dname_new_frm_str(domain);
+    if (!name) {
+        *error = "error parsing domain name";
+        dns_query_free(query);
+        return NULL;
+    }
+    /* The packet takes ownership of the name. */
+    ldns_pkt *pkt = ldns_pkt_query_new(name, type, LDNS_RR_CLASS_IN, LDNS_RD);
+    if (!pkt) {
+        *error = "error creating query";
+        dns_query_free(query);
+        return NULL;
+    }
+    ldns_pkt_set_random_id(pkt);
+    query->id = ldns_pkt_id(pkt);
+    ldns_status status = ldns_pkt2wire(&query->wire, pkt, &query->wire_len);
+    ldns_pkt_free(pkt);
+    if (status != LDNS_STATUS_OK) {
+        *error = "error encoding query";
+        dns_query_free(query);
+        return NULL;
+    }
+
+    if (engine->pending_tail) {
+        engine->pending_tail->next = query;
+    } else {
+        engine->pending_head = query;
+    }
+    engine->pending_tail = query;
+    ++engine->outstanding;
+
+    start_pending(engine);
+    return query;
+}
+
+int dns_engine_run(dns_engine_t *engine) {
+    while (engine->outstanding > 0) {
+        if (event_base_loop(engine->base, EVLOOP_ONCE) == -1) {
+            log_error("error running DNS event loop");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int dns_engine_destroy(dns_engine_t *engine) {
+    while (engine->active) {
+        dns_query_t *query = engine->active;
+        release_socket(query);
+        active_list_remove(query);
+        dns_query_free(query);
+    }
+    while (engine->pending_head) {
+        dns_query_t *query = engine->pending_head;
+        engine->pending_head = query->next;
+        dns_query_free(query);
+    }
+    engine->pending_tail = NULL;
+    engine->in_flight = 0;
+    engine->outstanding = 0;
+    if (engine->pace) {
+        event_free(engine->pace);
+        engine->pace = NULL;
+    }
+    return 0;
+}
+
+void dns_query_free(dns_query_t *query) {
+    if (query->response) {
+        ldns_pkt_free(query->response);
+    }
+    while (query->late_responses) {
+        dns_late_response_t *late = query->late_responses;
+        query->late_responses = late->next;
+        ldns_pkt_free(late->response);
+        free(late);
+    }
+    free(query->wire);
+    free(query->domain);
+    free(query);
+}
+
+void dns_push_timing(lua_State *L, const dns_query_t *query) {
+    lua_createtable(L, 0, 7);
+    lua_pushnumber(L, query->submitted_at);
+    lua_setfield(L, -2, "started_at");
+    lua_pushinteger(L, query->attempts);
+    lua_setfield(L, -2, "attempts");
+    lua_pushnumber(L, query->finished_at - query->submitted_at);
+    lua_setfield(L, -2, "total_microseconds");
+    if (query->attempts > 0) {
+        lua_pushnumber(L, query->first_sent_at - query->submitted_at);
+        lua_setfield(L, -2, "first_sent_microseconds");
+        lua_pushnumber(L, query->sent_at - query->submitted_at);
+        lua_setfield(L, -2, "sent_microseconds");
+    }
+    if (query->response) {
+        lua_pushnumber(L, query->sent_at
+                          + query->rtt_microseconds
+                          - query->submitted_at);
+        lua_setfield(L, -2, "received_microseconds");
+        lua_pushnumber(L, query->rtt_microseconds);
+        lua_setfield(L, -2, "rtt_microseconds");
+    }
+}
+
+/* Parse an explicit nameserver address, defaulting to port 53. */
+static int parse_nameserver_address(const char *resolver,
+                                    struct sockaddr_storage *server,
+                                    int *server_len) {
+    *server_len = sizeof(*server);
+    if (evutil_parse_sockaddr_port(resolver,
+                                   (struct sockaddr *)server,
+                                   server_len)) {
+        return -1;
+    }
+    if (server->ss_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)server;
+        if (sin->sin_port == 0) {
+            sin->sin_port = htons(DNS_PORT);
+        }
+    } else if (server->ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)server;
+        if (sin6->sin6_port == 0) {
+            sin6->sin6_port = htons(DNS_PORT);
+        }
+    }
+    return 0;
+}
+
+static ldns_resolver *new_resolver(const char *resolver_string,
+                                   const char **error) {
+    ldns_resolver *resolver;
+    if (strlen(resolver_string) == 0) {
+        if (ldns_resolver_new_frm_file(&resolver, NULL) != LDNS_STATUS_OK) {
+            *error = "error creating new resolver";
+            return NULL;
+        }
+        return resolver;
+    }
+
+    struct sockaddr_storage server;
+    int server_len;
+    if (parse_nameserver_address(resolver_string, &server, &server_len)) {
+        *error = "error parsing nameserver address";
+        return NULL;
+    }
+    uint16_t port;
+    ldns_rdf *nameserver = ldns_sockaddr_storage2rdf(&server, &port);
+    if (!nameserver) {
+        *error = "error parsing nameserver address";
+        return NULL;
+    }
+    resolver = ldns_resolver_new();
+    if (!resolver) {
+        ldns_rdf_deep_free(nameserver);
+        *error = "error creating new resolver";
+        return NULL;
+    }
+    ldns_resolver_set_port(resolver, port);
+    /* The resolver keeps its own copy of the nameserver. */
+    ldns_status status = ldns_resolver_push_nameserver(resolver, nameserver);
+    ldns_rdf_deep_free(nameserver);
+    if (status != LDNS_STATUS_OK) {
+        ldns_resolver_deep_free(resolver);
+        *error = "error pushing nameserver address";
+        return NULL;
+    }
+    return resolver;
+}
+
+/* Return the per-attempt timeout that lets every attempt of a query finish
+ * before the sandbox's deadline, or timeout if that comes first. */
+static struct timeval attempt_timeout(const sandbox_t *sandbox,
+                                      double timeout,
+                                      int attempts) {
+    if (attempts < 1) {
+        attempts = 1;
+    }
+    double total = sandbox_limit_seconds(sandbox, timeout * attempts);
+    return timeval_from_seconds(total / attempts);
+}
+
+/* Give a cached resolver its own timeout, limited by the deadline. ldns tries
+ * each nameserver 'retry' times, each attempt taking up to the timeout. */
+static ldns_resolver *limit_resolver(sandbox_t *sandbox,
+                                     dns_resolver_cache_t *entry) {
+    int attempts = ldns_resolver_retry(entry->resolver)
+                   * ldns_resolver_nameserver_count(entry->resolver);
+    double timeout = entry->timeout.tv_sec + entry->timeout.tv_usec / 1e6;
+    ldns_resolver_set_timeout(entry->resolver,
+                              attempt_timeout(sandbox, timeout, attempts));
+    return entry->resolver;
+}
+
+ldns_resolver *dns_cached_resolver(sandbox_t *sandbox,
+                                   const char *resolver_string,
+                                   const char **error) {
+    dns_resolver_cache_t *entry;
+    for (entry = sandbox->dns_resolvers; entry; entry = entry->next) {
+        if (strcmp(entry->key, resolver_string) == 0) {
+            return limit_resolver(sandbox, entry);
+        }
+    }
+
+    entry = malloc(sizeof(dns_resolver_cache_t));
+    if (!entry) {
+        *error = "error allocating resolver";
+        return NULL;
+    }
+    entry->key = strdup(resolver_string);
+    if (!entry->key) {
+        free(entry);
+        *error = "error allocating resolver";
+        return NULL;
+    }
+    entry->resolver = new_resolver(resolver_string, error);
+    if (!entry->resolver) {
+        free(entry->key);
+        free(entry);
+        return NULL;
+    }
+    entry->timeout = ldns_resolver_timeout(entry->resolver);
+    entry->next = sandbox->dns_resolvers;
+    sandbox->dns_resolvers = entry;
+    return limit_resolver(sandbox, entry);
+}
+
+void dns_resolver_cache_free(dns_resolver_cache_t *cache) {
+    while (cache) {
+        dns_resolver_cache_t *next = cache->next;
+        ldns_resolver_deep_free(cache->resolver);
+        free(cache->key);
+        free(cache);
+        cache = next;
+    }
+}
+
+int dns_parse_nameserver(sandbox_t *sandbox,
+                         const char *resolver_string,
+                         struct sockaddr_storage *server,
+                         int *server_len) {
+    if (strlen(resolver_string) > 0) {
+        return parse_nameserver_address(resolver_string, server, server_len);
+    }
+
+    /* Use the system default nameserver, without reparsing resolv.conf. */
+    const char *error;
+    ldns_resolver *resolver = dns_cached_resolver(sandbox, "", &error);
+    if (!resolver || ldns_resolver_nameserver_count(resolver) == 0) {
+        return -1;
+    }
+    size_t size;
+    struct sockaddr_storage *address = ldns_rdf2native_sockaddr_storage(
+            ldns_resolver_nameservers(resolver)[0],
+            ldns_resolver_port(resolver),
+            &size);
+    if (!address) {
+        return -1;
+    }
+    memcpy(server, address, size);
+    *server_len = size;
+    free(address);
+    return 0;
+}
+
+/* Push the timing of a blocking lookup, for which ldns doesn't tell us about
+ * individual attempts. */
+static void push_lookup_timing(lua_State *L,
+                               int64_t started_at,
+                               int64_t finished_at) {
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, started_at);
+    lua_setfield(L, -2, "started_at");
+    lua_pushnumber(L, finished_at - started_at);
+    lua_setfield(L, -2, "total_microseconds");
+}
+
+/* Set field ttl of the table at the top of the stack to the smallest TTL of
+ * a list of A records, if there are any, so callers know how long they may
+ * reuse the address. */
+static void set_answer_ttl(lua_State *L, const ldns_rr_list *results) {
+    size_t count = ldns_rr_list_rr_count(results);
+    if (count == 0) {
+        return;
+    }
+    uint32_t ttl = ldns_rr_ttl(ldns_rr_list_rr(results, 0));
+    for (size_t i = 1; i < count; ++i) {
+        uint32_t rr_ttl = ldns_rr_ttl(ldns_rr_list_rr(results, i));
+        if (rr_ttl < ttl) {
+            ttl = rr_ttl;
+        }
+    }
+    lua_pushnumber(L, ttl);
+    lua_setfield(L, -2, "ttl");
+}
+
 int l_dns_lookup(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
     const char *domain_string = luaL_checkstring(L, 1);
     const char *resolver_string = luaL_checkstring(L, 2);
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
 
     ldns_rdf *domain = ldns_dname_new_frm_str(domain_string);
     if (!domain) {
@@ -17,52 +682,39 @@ int l_dns_lookup(lua_State *L) {
         return 2;
     }
 
-    ldns_resolver *resolver;
-    if (strlen(resolver_string) == 0) {
-        ldns_status status = ldns_resolver_new_frm_file(&resolver, NULL);
-        if (status != LDNS_STATUS_OK) {
-            ldns_rdf_deep_free(domain);
-            lua_pushnil(L);
-            lua_pushstring(L, "error creating new resolver");
-            return 2;
-        }
-    } else {
-        resolver = ldns_resolver_new();
-        if (!resolver) {
-            ldns_rdf_deep_free(domain);
-            lua_pushnil(L);
-            lua_pushstring(L, "error creating new resolver");
-            return 2;
-        }
-        ldns_rdf *nameserver = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_A, resolver_string);
-        if (!nameserver) {
-            ldns_rdf_deep_free(domain);
-            ldns_resolver_deep_free(resolver);
-            lua_pushnil(L);
-            lua_pushstring(L, "error parsing nameserver address");
-            return 2;
-        }
-        ldns_status status = ldns_resolver_push_nameserver(resolver, nameserver);
-        if (status != LDNS_STATUS_OK) {
-            ldns_rdf_deep_free(domain);
-            ldns_resolver_deep_free(resolver);
-            lua_pushnil(L);
-            lua_pushstring(L, "error pushing nameserver address");
-            return 2;
-        }
+    const char *error;
+    ldns_resolver *resolver = dns_cached_resolver(sandbox,
+                                                  resolver_string,
+                                                  &error);
+    if (!resolver) {
+        ldns_rdf_deep_free(domain);
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
     }
 
+    /* The resolver may try several nameservers, so we pace the lookup as a
+     * whole, under the name the script gave for the resolver. */
+    if (ratelimit_wait(resolver_string,
+                       DNS_QUERY_BYTES,
+                       sandbox_time_remaining(sandbox))) {
+        ldns_rdf_deep_free(domain);
+        return sandbox_push_deadline_error(L);
+    }
+    int64_t started_at = monotonic_microseconds();
     ldns_pkt *pkt = ldns_resolver_query(resolver,
                                         domain,
                                         LDNS_RR_TYPE_A,
                                         LDNS_RR_CLASS_IN,
                                         LDNS_RD);
+    int64_t finished_at = monotonic_microseconds();
     ldns_rdf_deep_free(domain);
+    ratelimit_report(resolver_string, !pkt, pkt ? ldns_pkt_size(pkt) : 0);
     if (!pkt) {
-        ldns_resolver_deep_free(resolver);
         lua_pushnil(L);
         lua_pushstring(L, "error issuing query");
-        return 2;
+        push_lookup_timing(L, started_at, finished_at);
+        return 3;
     }
 
     ldns_rr_list *results = ldns_pkt_rr_list_by_type(pkt,
@@ -70,10 +722,10 @@ int l_dns_lookup(lua_State *L) {
                                                      LDNS_SECTION_ANSWER);
     if (!results) {
         ldns_pkt_free(pkt);
-        ldns_resolver_deep_free(resolver);
         lua_pushnil(L);
         lua_pushstring(L, "error extracting result");
-        return 2;
+        push_lookup_timing(L, started_at, finished_at);
+        return 3;
     }
 
     if (ldns_rr_list_rr_count(results) == 0) {
@@ -85,9 +737,855 @@ int l_dns_lookup(lua_State *L) {
         lua_pushstring(L, ip_address);
         free(ip_address);
     }
+    lua_pushnil(L);
+    push_lookup_timing(L, started_at, finished_at);
+    set_answer_ttl(L, results);
     ldns_rr_list_deep_free(results);
     ldns_pkt_free(pkt);
-    ldns_resolver_deep_free(resolver);
+    return 3;
+}
+
+/* Push the result of an A lookup as a table with fields address, addresses,
+ * rcode, error and timing. */
+static void push_lookup_result(lua_State *L, const dns_query_t *query) {
+    lua_newtable(L);
+    dns_push_timing(L, query);
+    lua_setfield(L, -2, "timing");
+    if (query->error) {
+        lua_pushstring(L, query->error);
+        lua_setfield(L, -2, "error");
+        return;
+    }
+
+    ldns_lookup_table *rcode = ldns_lookup_by_id(
+            ldns_rcodes, ldns_pkt_get_rcode(query->response));
+    lua_pushstring(L, rcode ? rcode->name : "UNKNOWN");
+    lua_setfield(L, -2, "rcode");
+
+    lua_newtable(L);
+    ldns_rr_list *results = ldns_pkt_rr_list_by_type(query->response,
+                                                     LDNS_RR_TYPE_A,
+                                                     LDNS_SECTION_ANSWER);
+    if (results) {
+        for (size_t i = 0; i < ldns_rr_list_rr_count(results); ++i) {
+            ldns_rdf *a_record = ldns_rr_a_address(ldns_rr_list_rr(results, i));
+            char *ip_address = ldns_rdf2str(a_record);
+            if (!ip_address) {
+                continue;
+            }
+            lua_pushstring(L, ip_address);
+            free(ip_address);
+            lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+        }
+        ldns_rr_list_deep_free(results);
+    }
+    lua_rawgeti(L, -1, 1);
+    lua_setfield(L, -3, "address");
+    lua_setfield(L, -2, "addresses");
+}
+
+static void batch_query_done(dns_query_t *query, void *arg) {
+    /* Nothing to do; we collect results once the whole batch has finished. */
+}
+
+int l_dns_lookup_batch(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    luaL_checktype(L, 1, LUA_TTABLE);
+    const char *resolver_string = luaL_optstring(L, 2, "");
+    int window = optfield_integer(L, 3, "window", DEFAULT_BATCH_WINDOW);
+    double timeout = optfield_number(L,
+                                     3,
+                                     "timeout",
+                                     DEFAULT_BATCH_TIMEOUT_SECONDS);
+    int retries = optfield_integer(L, 3, "retries", DEFAULT_BATCH_RETRIES);
+    luaL_argcheck(L, window > 0, 3, "window must be positive");
+    luaL_argcheck(L, retries >= 0, 3, "retries must not be negative");
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
+
+    size_t count = lua_objlen(L, 1);
+    for (size_t i = 1; i <= count; ++i) {
+        lua_rawgeti(L, 1, i);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_argerror(L, 1, "domains must be strings");
+        }
+        lua_pop(L, 1);
+    }
+
+    struct sockaddr_storage server;
+    int server_len;
+    if (dns_parse_nameserver(sandbox,
+                             resolver_string,
+                             &server,
+                             &server_len)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error parsing nameserver address");
+        return 2;
+    }
+
+    dns_engine_t engine;
+    if (dns_engine_init(&engine,
+                        sandbox->base,
+                        window,
+                        attempt_timeout(sandbox, timeout, retries + 1),
+                        retries)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating DNS engine");
+        return 2;
+    }
+    dns_query_t **queries = calloc(count ? count : 1, sizeof(dns_query_t *));
+    if (!queries) {
+        dns_engine_destroy(&engine);
+        lua_pushnil(L);
+        lua_pushstring(L, "error allocating queries");
+        return 2;
+    }
+
+    lua_settop(L, 3);
+    lua_newtable(L);  /* The results table, at index 4. */
+    for (size_t i = 0; i < count; ++i) {
+        lua_rawgeti(L, 1, i + 1);
+        const char *domain = lua_tostring(L, -1);
+        const char *error = NULL;
+        queries[i] = dns_engine_submit(&engine,
+                                       domain,
+                                       LDNS_RR_TYPE_A,
+                                       &server,
+                                       server_len,
+                                       batch_query_done,
+                                       NULL,
+                                       &error);
+        if (!queries[i]) {
+            lua_newtable(L);
+            lua_pushstring(L, error);
+            lua_setfield(L, -2, "error");
+            lua_setfield(L, 4, domain);
+        }
+        lua_pop(L, 1);
+    }
+
+    if (dns_engine_run(&engine)) {
+        /* Finished queries belong to us; the engine frees the rest. */
+        for (size_t i = 0; i < count; ++i) {
+            if (queries[i] && (queries[i]->response || queries[i]->error)) {
+                dns_query_free(queries[i]);
+            }
+        }
+        dns_engine_destroy(&engine);
+        free(queries);
+        lua_pushnil(L);
+        lua_pushstring(L, "error running DNS queries");
+        return 2;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (!queries[i]) {
+            continue;
+        }
+        push_lookup_result(L, queries[i]);
+        lua_setfield(L, 4, queries[i]->domain);
+        dns_query_free(queries[i]);
+    }
+    free(queries);
+    dns_engine_destroy(&engine);
+
+    lua_pushnil(L);
+    return 2;
+}
+
+/* The rcode and sorted addresses of a response's A records, or the error
+ * that kept a query from getting one. */
+typedef struct {
+    const char *error;
+    const char *rcode;
+    char **addresses;
+    size_t count;
+} dns_answer_t;
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void answer_init(dns_answer_t *answer,
+                        const ldns_pkt *response,
+                        const char *error) {
+    memset(answer, 0, sizeof(*answer));
+    if (!response) {
+        answer->error = error ? error : "no response";
+        return;
+    }
+    ldns_lookup_table *rcode = ldns_lookup_by_id(
+            ldns_rcodes, ldns_pkt_get_rcode(response));
+    answer->rcode = rcode ? rcode->name : "UNKNOWN";
+
+    ldns_rr_list *results = ldns_pkt_rr_list_by_type(response,
+                                                     LDNS_RR_TYPE_A,
+                                                     LDNS_SECTION_ANSWER);
+    if (!results) {
+        return;
+    }
+    size_t total = ldns_rr_list_rr_count(results);
+    answer->addresses = calloc(total ? total : 1, sizeof(char *));
+    if (!answer->addresses) {
+        answer->error = "error allocating answer";
+        ldns_rr_list_deep_free(results);
+        return;
+    }
+    for (size_t i = 0; i < total; ++i) {
+        ldns_rdf *a_record = ldns_rr_a_address(ldns_rr_list_rr(results, i));
+        char *ip_address = ldns_rdf2str(a_record);
+        if (ip_address) {
+            answer->addresses[answer->count++] = ip_address;
+        }
+    }
+    ldns_rr_list_deep_free(results);
+    /* Resolvers may order the same records differently. */
+    qsort(answer->addresses, answer->count, sizeof(char *), compare_strings);
+}
+
+static void answer_free(dns_answer_t *answer) {
+    for (size_t i = 0; i < answer->count; ++i) {
+        free(answer->addresses[i]);
+    }
+    free(answer->addresses);
+    answer->addresses = NULL;
+    answer->count = 0;
+}
+
+static int same_answer(const dns_answer_t *a, const dns_answer_t *b) {
+    if (a->error || b->error) {
+        return a->error && b->error && strcmp(a->error, b->error) == 0;
+    }
+    if (strcmp(a->rcode, b->rcode) != 0 || a->count != b->count) {
+        return 0;
+    }
+    for (size_t i = 0; i < a->count; ++i) {
+        if (strcmp(a->addresses[i], b->addresses[i]) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Set the fields rcode and addresses, or error, of the table on top of the
+ * stack. */
+static void set_answer_fields(lua_State *L, const dns_answer_t *answer) {
+    if (answer->error) {
+        lua_pushstring(L, answer->error);
+        lua_setfield(L, -2, "error");
+        return;
+    }
+    lua_pushstring(L, answer->rcode);
+    lua_setfield(L, -2, "rcode");
+    lua_createtable(L, answer->count, 0);
+    for (size_t i = 0; i < answer->count; ++i) {
+        lua_pushstring(L, answer->addresses[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "addresses");
+}
+
+/* Append the name of the resolver at index to the array on top of the
+ * stack. resolvers is the stack index of the array of names. */
+static void append_resolver(lua_State *L, int resolvers, size_t index) {
+    lua_rawgeti(L, resolvers, index + 1);
+    lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+}
+
+/* Push what one resolver said about a domain, as a table with its first
+ * answer, responses, late, injected and timing. Returns whether a later
+ * response differed from the first. */
+static int push_compared_answer(lua_State *L,
+                                const dns_answer_t *answer,
+                                const dns_query_t *query) {
+    lua_newtable(L);
+    set_answer_fields(L, answer);
+    if (!query) {
+        lua_pushinteger(L, 0);
+        lua_setfield(L, -2, "responses");
+        return 0;
+    }
+    dns_push_timing(L, query);
+    lua_setfield(L, -2, "timing");
+    lua_pushinteger(L, query->response ? 1 + query->late_count : 0);
+    lua_setfield(L, -2, "responses");
+    if (!query->late_responses) {
+        return 0;
+    }
+
+    int injected = 0;
+    lua_newtable(L);
+    for (const dns_late_response_t *late = query->late_responses;
+         late;
+         late = late->next) {
+        dns_answer_t late_answer;
+        answer_init(&late_answer, late->response, NULL);
+        if (!same_answer(&late_answer, answer)) {
+            injected = 1;
+        }
+        lua_newtable(L);
+        set_answer_fields(L, &late_answer);
+        lua_pushnumber(L, late->rtt_microseconds);
+        lua_setfield(L, -2, "rtt_microseconds");
+        lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+        answer_free(&late_answer);
+    }
+    lua_setfield(L, -2, "late");
+    lua_pushboolean(L, injected);
+    lua_setfield(L, -2, "injected");
+    return injected;
+}
+
+/* Push the comparison of one domain's answers from every resolver. resolvers
+ * is the stack index of the array of resolver names, and control the index of
+ * the control resolver, or -1. */
+static void push_comparison(lua_State *L,
+                            int resolvers,
+                            const dns_answer_t *answers,
+                            dns_query_t **queries,
+                            size_t resolver_count,
+                            int control) {
+    lua_newtable(L);
+    int result = lua_gettop(L);
+
+    lua_newtable(L);
+    lua_newtable(L);  /* The injected resolvers. */
+    for (size_t i = 0; i < resolver_count; ++i) {
+        int injected = push_compared_answer(L, &answers[i], queries[i]);
+        lua_rawgeti(L, resolvers, i + 1);
+        lua_insert(L, -2);
+        lua_settable(L, -4);
+        if (injected) {
+            append_resolver(L, resolvers, i);
+        }
+    }
+    int consistent = lua_objlen(L, -1) == 0;
+    lua_setfield(L, result, "injected");
+    lua_setfield(L, result, "answers");
+
+    lua_newtable(L);
+    for (size_t i = 0; i < resolver_count; ++i) {
+        size_t first = 0;
+        while (!same_answer(&answers[first], &answers[i])) {
+            ++first;
+        }
+        if (first < i) {
+            /* This answer is already in an earlier resolver's group. */
+            continue;
+        }
+        lua_newtable(L);
+        set_answer_fields(L, &answers[i]);
+        lua_newtable(L);
+        for (size_t j = i; j < resolver_count; ++j) {
+            if (same_answer(&answers[i], &answers[j])) {
+                append_resolver(L, resolvers, j);
+            }
+        }
+        lua_setfield(L, -2, "resolvers");
+        lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+    }
+    if (lua_objlen(L, -1) > 1) {
+        consistent = 0;
+    }
+    lua_setfield(L, result, "groups");
+
+    if (control >= 0 && !answers[control].error) {
+        lua_newtable(L);
+        for (size_t i = 0; i < resolver_count; ++i) {
+            if (!same_answer(&answers[control], &answers[i])) {
+                append_resolver(L, resolvers, i);
+            }
+        }
+        lua_setfield(L, result, "differs");
+    }
+    lua_pushboolean(L, consistent);
+    lua_setfield(L, result, "consistent");
+}
+
+int l_dns_compare(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int window = optfield_integer(L, 3, "window", DEFAULT_COMPARE_WINDOW);
+    double timeout = optfield_number(L,
+                                     3,
+                                     "timeout",
+                                     DEFAULT_BATCH_TIMEOUT_SECONDS);
+    int retries = optfield_integer(L, 3, "retries", DEFAULT_BATCH_RETRIES);
+    double listen = optfield_number(L,
+                                    3,
+                                    "listen",
+                                    DEFAULT_COMPARE_LISTEN_SECONDS);
+    const char *control_string = optfield_string(L, 3, "control", NULL);
+    luaL_argcheck(L, window > 0, 3, "window must be positive");
+    luaL_argcheck(L, retries >= 0, 3, "retries must not be negative");
+    luaL_argcheck(L, timeout >= 0, 3, "timeout must not be negative");
+    luaL_argcheck(L, listen >= 0, 3, "listen must not be negative");
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
+
+    size_t domain_count = lua_objlen(L, 1);
+    for (size_t i = 1; i <= domain_count; ++i) {
+        lua_rawgeti(L, 1, i);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_argerror(L, 1, "domains must be strings");
+        }
+        lua_pop(L, 1);
+    }
+    size_t resolver_count = lua_objlen(L, 2);
+    int control = -1;
+    for (size_t i = 1; i <= resolver_count; ++i) {
+        lua_rawgeti(L, 2, i);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_argerror(L, 2, "resolvers must be strings");
+        }
+        if (control_string
+            && strcmp(lua_tostring(L, -1), control_string) == 0) {
+            control = i - 1;
+        }
+        lua_pop(L, 1);
+    }
+    luaL_argcheck(L,
+                  !control_string || control >= 0,
+                  3,
+                  "control must be one of the resolvers");
+
+    size_t count = domain_count * resolver_count;
+    size_t slots = resolver_count ? resolver_count : 1;
+    struct sockaddr_storage *servers = calloc(slots,
+                                              sizeof(struct sockaddr_storage));
+    int *server_lens = calloc(slots, sizeof(int));
+    dns_query_t **queries = calloc(count ? count : 1, sizeof(dns_query_t *));
+    dns_answer_t *answers = calloc(count ? count : 1, sizeof(dns_answer_t));
+    if (!servers || !server_lens || !queries || !answers) {
+        free(servers);
+        free(server_lens);
+        free(queries);
+        free(answers);
+        lua_pushnil(L);
+        lua_pushstring(L, "error allocating queries");
+        return 2;
+    }
+    for (size_t i = 0; i < resolver_count; ++i) {
+        lua_rawgeti(L, 2, i + 1);
+        int failed = dns_parse_nameserver(sandbox,
+                                          lua_tostring(L, -1),
+                                          &servers[i],
+                                          &server_lens[i]);
+        lua_pop(L, 1);
+        if (failed) {
+            free(servers);
+            free(server_lens);
+            free(queries);
+            free(answers);
+            lua_pushnil(L);
+            lua_pushstring(L, "error parsing nameserver address");
+            return 2;
+        }
+    }
+
+    /* Share the time left between the attempts and listening after them, so
+     * a query answered at its last moment can still listen. */
+    double wanted = timeout * (retries + 1) + listen;
+    if (wanted > 0) {
+        double scale = sandbox_limit_seconds(sandbox, wanted) / wanted;
+        timeout *= scale;
+        listen *= scale;
+    }
+    dns_engine_t engine;
+    if (dns_engine_init(&engine,
+                        sandbox->base,
+                        window,
+                        attempt_timeout(sandbox, timeout, retries + 1),
+                        retries)) {
+        free(servers);
+        free(server_lens);
+        free(queries);
+        free(answers);
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating DNS engine");
+        return 2;
+    }
+    engine.listen_microseconds = listen * 1e6;
+
+    /* Submit every domain to every resolver before running any, so they're
+     * all in flight at once, up to the window. */
+    for (size_t d = 0; d < domain_count; ++d) {
+        lua_rawgeti(L, 1, d + 1);
+        const char *domain = lua_tostring(L, -1);
+        for (size_t r = 0; r < resolver_count; ++r) {
+            size_t i = d * resolver_count + r;
+            const char *error = NULL;
+            queries[i] = dns_engine_submit(&engine,
+                                           domain,
+                                           LDNS_RR_TYPE_A,
+                                           &servers[r],
+                                           server_lens[r],
+                                           batch_query_done,
+                                           NULL,
+                                           &error);
+            if (!queries[i]) {
+                answers[i].error = error;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    free(servers);
+    free(server_lens);
+
+    if (dns_engine_run(&engine)) {
+        /* Finished queries belong to us; the engine frees the rest. Queries
+         * still listening already have a response, so check finished_at. */
+        for (size_t i = 0; i < count; ++i) {
+            if (queries[i] && queries[i]->finished_at) {
+                dns_query_free(queries[i]);
+            }
+        }
+        dns_engine_destroy(&engine);
+        free(queries);
+        free(answers);
+        lua_pushnil(L);
+        lua_pushstring(L, "error running DNS queries");
+        return 2;
+    }
+    dns_engine_destroy(&engine);
+
+    lua_settop(L, 2);
+    lua_newtable(L);  /* The results table, at index 3. */
+    for (size_t d = 0; d < domain_count; ++d) {
+        size_t row = d * resolver_count;
+        for (size_t r = 0; r < resolver_count; ++r) {
+            if (queries[row + r]) {
+                answer_init(&answers[row + r],
+                            queries[row + r]->response,
+                            queries[row + r]->error);
+            }
+        }
+        lua_rawgeti(L, 1, d + 1);
+        push_comparison(L,
+                        2,
+                        &answers[row],
+                        &queries[row],
+                        resolver_count,
+                        control);
+        lua_settable(L, 3);
+        for (size_t r = 0; r < resolver_count; ++r) {
+            answer_free(&answers[row + r]);
+            if (queries[row + r]) {
+                dns_query_free(queries[row + r]);
+            }
+        }
+    }
+    free(queries);
+    free(answers);
+
+    lua_pushnil(L);
+    return 2;
+}
+
+/* Push a list of resource records as an array of tables with fields name,
+ * type, ttl and data. data is the record's rdata in presentation format. */
+static void push_rr_list(lua_State *L, const ldns_rr_list *rrs) {
+    lua_newtable(L);
+    if (!rrs) {
+        return;
+    }
+    for (size_t i = 0; i < ldns_rr_list_rr_count(rrs); ++i) {
+        ldns_rr *rr = ldns_rr_list_rr(rrs, i);
+        lua_newtable(L);
+
+        char *owner = ldns_rdf2str(ldns_rr_owner(rr));
+        if (owner) {
+            lua_pushstring(L, owner);
+            lua_setfield(L, -2, "name");
+            free(owner);
+        }
+        char *type = ldns_rr_type2str(ldns_rr_get_type(rr));
+        if (type) {
+            lua_pushstring(L, type);
+            lua_setfield(L, -2, "type");
+            free(type);
+        }
+        lua_pushnumber(L, ldns_rr_ttl(rr));
+        lua_setfield(L, -2, "ttl");
+
+        /* Join multi-field rdata like MX and SOA with spaces. */
+        luaL_Buffer data;
+        luaL_buffinit(L, &data);
+        for (size_t j = 0; j < ldns_rr_rd_count(rr); ++j) {
+            char *field = ldns_rdf2str(ldns_rr_rdf(rr, j));
+            if (!field) {
+                continue;
+            }
+            if (j > 0) {
+                luaL_addchar(&data, ' ');
+            }
+            luaL_addstring(&data, field);
+            free(field);
+        }
+        luaL_pushresult(&data);
+        lua_setfield(L, -2, "data");
+
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+/* Push the full result of one query as a table with fields rcode, aa, tc, ra,
+ * size, rtt_microseconds, attempts, timing, answer, authority and additional,
+ * or a table with just attempts, timing and error fields. */
+static void push_query_result(lua_State *L, const dns_query_t *query) {
+    lua_newtable(L);
+    lua_pushinteger(L, query->attempts);
+    lua_setfield(L, -2, "attempts");
+    dns_push_timing(L, query);
+    lua_setfield(L, -2, "timing");
+    if (query->error) {
+        lua_pushstring(L, query->error);
+        lua_setfield(L, -2, "error");
+        return;
+    }
+
+    const ldns_pkt *response = query->response;
+    ldns_lookup_table *rcode = ldns_lookup_by_id(ldns_rcodes,
+                                                 ldns_pkt_get_rcode(response));
+    lua_pushstring(L, rcode ? rcode->name : "UNKNOWN");
+    lua_setfield(L, -2, "rcode");
+    lua_pushboolean(L, ldns_pkt_aa(response));
+    lua_setfield(L, -2, "aa");
+    lua_pushboolean(L, ldns_pkt_tc(response));
+    lua_setfield(L, -2, "tc");
+    lua_pushboolean(L, ldns_pkt_ra(response));
+    lua_setfield(L, -2, "ra");
+    lua_pushnumber(L, query->response_size);
+    lua_setfield(L, -2, "size");
+    lua_pushnumber(L, query->rtt_microseconds);
+    lua_setfield(L, -2, "rtt_microseconds");
+
+    push_rr_list(L, ldns_pkt_answer(response));
+    lua_setfield(L, -2, "answer");
+    push_rr_list(L, ldns_pkt_authority(response));
+    lua_setfield(L, -2, "authority");
+    push_rr_list(L, ldns_pkt_additional(response));
+    lua_setfield(L, -2, "additional");
+}
+
+#define MAX_QUERY_TYPES 16
+
+int l_dns_query(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    const char *domain = luaL_checkstring(L, 1);
+    const char *resolver_string = optfield_string(L, 2, "resolver", "");
+    double timeout = optfield_number(L,
+                                     2,
+                                     "timeout",
+                                     DEFAULT_BATCH_TIMEOUT_SECONDS);
+    int retries = optfield_integer(L, 2, "retries", DEFAULT_BATCH_RETRIES);
+    luaL_argcheck(L, retries >= 0, 2, "retries must not be negative");
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
+
+    /* Parse the list of record types, which defaults to { "A" }. */
+    ldns_rr_type types[MAX_QUERY_TYPES];
+    const char *type_names[MAX_QUERY_TYPES];
+    int type_count = 0;
+    if (!lua_isnoneornil(L, 2)) {
+        lua_getfield(L, 2, "types");
+    } else {
+        lua_pushnil(L);
+    }
+    if (lua_isnil(L, -1)) {
+        types[0] = LDNS_RR_TYPE_A;
+        type_names[0] = "A";
+        type_count = 1;
+    } else {
+        luaL_argcheck(L, lua_istable(L, -1), 2, "types must be a table");
+        int count = lua_objlen(L, -1);
+        luaL_argcheck(L, count <= MAX_QUERY_TYPES, 2, "too many types");
+        for (int i = 1; i <= count; ++i) {
+            lua_rawgeti(L, -1, i);
+            if (lua_type(L, -1) != LUA_TSTRING) {
+                return luaL_argerror(L, 2, "types must be strings");
+            }
+            const char *name = lua_tostring(L, -1);
+            ldns_rr_type type = ldns_get_rr_type_by_name(name);
+            if (type == 0) {
+                return luaL_error(L, "unknown record type '%s'", name);
+            }
+            /* The name stays alive in the types table. */
+            types[type_count] = type;
+            type_names[type_count] = name;
+            ++type_count;
+            lua_pop(L, 1);
+        }
+    }
+
+    struct sockaddr_storage server;
+    int server_len;
+    if (dns_parse_nameserver(sandbox,
+                             resolver_string,
+                             &server,
+                             &server_len)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error parsing nameserver address");
+        return 2;
+    }
+
+    /* Send one query per type at once. */
+    dns_engine_t engine;
+    if (dns_engine_init(&engine,
+                        sandbox->base,
+                        MAX_QUERY_TYPES,
+                        attempt_timeout(sandbox, timeout, retries + 1),
+                        retries)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating DNS engine");
+        return 2;
+    }
+    dns_query_t *queries[MAX_QUERY_TYPES];
+    for (int i = 0; i < type_count; ++i) {
+        const char *error = NULL;
+        queries[i] = dns_engine_submit(&engine,
+                                       domain,
+                                       types[i],
+                                       &server,
+                                       server_len,
+                                       batch_query_done,
+                                       NULL,
+                                       &error);
+        if (!queries[i]) {
+            for (int j = 0; j < i; ++j) {
+                if (queries[j]->response || queries[j]->error) {
+                    dns_query_free(queries[j]);
+                }
+            }
+            dns_engine_destroy(&engine);
+            lua_pushnil(L);
+            lua_pushstring(L, error);
+            return 2;
+        }
+    }
+    if (dns_engine_run(&engine)) {
+        for (int i = 0; i < type_count; ++i) {
+            if (queries[i]->response || queries[i]->error) {
+                dns_query_free(queries[i]);
+            }
+        }
+        dns_engine_destroy(&engine);
+        lua_pushnil(L);
+        lua_pushstring(L, "error running DNS queries");
+        return 2;
+    }
+
+    lua_newtable(L);
+    for (int i = 0; i < type_count; ++i) {
+        push_query_result(L, queries[i]);
+        lua_setfield(L, -2, type_names[i]);
+        dns_query_free(queries[i]);
+    }
+    dns_engine_destroy(&engine);
+    lua_pushnil(L);
+    return 2;
+}
+
+/* Push what dns_lookup would return for a finished query. */
+static void push_async_lookup(lua_State *L, void *data) {
+    const dns_query_t *query = data;
+    if (query->error) {
+        lua_pushnil(L);
+        lua_pushstring(L, query->error);
+    } else {
+        push_lookup_result(L, query);
+        lua_getfield(L, -1, "address");
+        lua_remove(L, -2);
+        lua_pushnil(L);
+    }
+    dns_push_timing(L, query);
+    if (query->response) {
+        ldns_rr_list *results = ldns_pkt_rr_list_by_type(query->response,
+                                                         LDNS_RR_TYPE_A,
+                                                         LDNS_SECTION_ANSWER);
+        if (results) {
+            set_answer_ttl(L, results);
+            ldns_rr_list_deep_free(results);
+        }
+    }
+}
+
+static void free_async_query(void *data) {
+    dns_query_free(data);
+}
+
+static void async_query_done(dns_query_t *query, void *arg) {
+    async_op_finish(arg, query);
+}
+
+int l_dns_lookup_async(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    const char *domain = luaL_checkstring(L, 1);
+    const char *resolver_string = luaL_optstring(L, 2, "");
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
+
+    struct sockaddr_storage server;
+    int server_len;
+    if (dns_parse_nameserver(sandbox,
+                             resolver_string,
+                             &server,
+                             &server_len)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error parsing nameserver address");
+        return 2;
+    }
+
+    async_state_t *state = async_sandbox_state(sandbox);
+    if (!state) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating async state");
+        return 2;
+    }
+    if (!state->dns) {
+        state->dns = malloc(sizeof(dns_engine_t));
+        if (!state->dns
+            || dns_engine_init(state->dns,
+                               sandbox->async_base,
+                               DEFAULT_BATCH_WINDOW,
+                               attempt_timeout(sandbox,
+                                               DEFAULT_BATCH_TIMEOUT_SECONDS,
+                                               DEFAULT_BATCH_RETRIES + 1),
+                               DEFAULT_BATCH_RETRIES)) {
+            free(state->dns);
+            state->dns = NULL;
+            lua_pushnil(L);
+            lua_pushstring(L, "error creating DNS engine");
+            return 2;
+        }
+    }
+
+    async_op_t *op = async_op_new(state, push_async_lookup, free_async_query);
+    if (!op) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error allocating operation");
+        return 2;
+    }
+    const char *error = NULL;
+    if (!dns_engine_submit(state->dns,
+                           domain,
+                           LDNS_RR_TYPE_A,
+                           &server,
+                           server_len,
+                           async_query_done,
+                           op,
+                           &error)) {
+        async_op_cancel(op);
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+    lua_pushnumber(L, op->id);
     lua_pushnil(L);
     return 2;
 }
@@ -1,8 +1,302 @@
 #ifndef CENSORSCOPE_DNS_H_
 #define CENSORSCOPE_DNS_H_
 
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <event2/util.h>
+#include <ldns/ldns.h>
+
 #include "lua.h"
 
+#include "sandbox.h"
+
+struct event;
+struct event_base;
+
+typedef struct dns_engine dns_engine_t;
+typedef struct dns_query dns_query_t;
+
+/* Called exactly once for every submitted query, after it has either received
+ * a response or failed. The callback owns the query and must eventually free
+ * it with dns_query_free. */
+typedef void (*dns_query_callback)(dns_query_t *query, void *arg);
+
+/* Engines that listen after the first response keep at most this many more
+ * for each query. */
+#define DNS_MAX_LATE_RESPONSES 8
+
+/* A response that arrived after a query's first one. */
+typedef struct dns_late_response {
+    ldns_pkt *response;
+    /* The time between sending the last attempt and receiving it. */
+    int64_t rtt_microseconds;
+    size_t size;
+    struct dns_late_response *next;
+} dns_late_response_t;
+
+/* This tracks a single outstanding DNS query. */
+struct dns_query {
+    /* The name and record type we're looking up. */
+    char *domain;
+    ldns_rr_type type;
+    /* The nameserver we send the query to. */
+    struct sockaddr_storage server;
+    int server_len;
+
+    /* These are valid once the callback has run. Exactly one of response and
+     * error is non-NULL. error points to a static string. */
+    ldns_pkt *response;
+    const char *error;
+    /* The number of times we sent the query, including retries. */
+    int attempts;
+    /* The time between sending the last attempt and receiving the response. */
+    int64_t rtt_microseconds;
+    /* When the query was submitted, first sent and finished, in monotonic
+     * microseconds. first_sent_at is 0 if it was never sent. */
+    int64_t submitted_at;
+    int64_t first_sent_at;
+    int64_t finished_at;
+    /* The size of the response on the wire, in bytes. */
+    size_t response_size;
+    /* Further responses with the query's id, in the order they arrived, if
+     * the engine listens after the first. An on-path injector's forged
+     * response usually arrives first and the real one after it. */
+    dns_late_response_t *late_responses;
+    int late_count;
+
+    /* Internal state. */
+    dns_engine_t *engine;
+    dns_query_callback callback;
+    void *callback_arg;
+    uint16_t id;
+    uint8_t *wire;
+    size_t wire_len;
+    evutil_socket_t fd;
+    struct event *ev;
+    int64_t sent_at;
+    int64_t deadline;
+    dns_query_t *prev, *next;
+};
+
+/* The DNS engine sends queries over non-blocking UDP sockets and multiplexes
+ * the responses on a libevent event base. At most 'window' queries are on the
+ * wire at once; the rest wait in a FIFO queue. Queries also wait there until
+ * the rate limiter lets them go, and every response and timeout is reported to
+ * it. */
+struct dns_engine {
+    struct event_base *base;
+    int window;
+    struct timeval timeout;
+    int retries;
+    /* How long to keep listening after a query's first response, or 0 to
+     * finish the query right away. dns_engine_init sets it to 0. */
+    int64_t listen_microseconds;
+
+    /* Queries waiting for a free slot in the window. */
+    dns_query_t *pending_head, *pending_tail;
+    /* Queries on the wire, or listening for late responses. */
+    dns_query_t *active;
+    int in_flight;
+    /* The number of submitted queries whose callbacks have not run yet. */
+    int outstanding;
+    /* Set while we're moving queries onto the wire, so queries that fail
+     * immediately don't recurse back into start_pending. */
+    int starting;
+    /* Fires when the rate limiter will let the next pending query go. */
+    struct event *pace;
+};
+
+/* Initialize a DNS engine.
+ *
+ * Arguments:
+ * - base is the event base on which we will wait for responses.
+ * - window is the maximum number of queries in flight at once.
+ * - timeout is how long to wait for a response to each attempt.
+ * - retries is how many times to resend a query after a timeout.
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int dns_engine_init(dns_engine_t *engine,
+                    struct event_base *base,
+                    int window,
+                    struct timeval timeout,
+                    int retries);
+
+/* Queue a query for sending.
+ *
+ * Arguments:
+ * - domain is the name to look up.
+ * - type is the record type to ask for.
+ * - server and server_len are the address of the nameserver.
+ * - callback is called with callback_arg when the query finishes.
+ * - error is set to a static error message if submission fails.
+ * Returns: the new query, or NULL if it could not be submitted. The callback
+ * won't run for queries that could not be submitted.
+ *
+ */
+dns_query_t *dns_engine_submit(dns_engine_t *engine,
+                               const char *domain,
+                               ldns_rr_type type,
+                               const struct sockaddr_storage *server,
+                               int server_len,
+                               dns_query_callback callback,
+                               void *callback_arg,
+                               const char **error);
+
+/* Run the event loop until every submitted query has finished.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int dns_engine_run(dns_engine_t *engine);
+
+/* Abandon every unfinished query without running its callback. */
+int dns_engine_destroy(dns_engine_t *engine);
+
+void dns_query_free(dns_query_t *query);
+
+/* A sandbox keeps the resolvers it has used in a list keyed by resolver
+ * string, so repeated lookups don't reparse resolv.conf or reallocate the
+ * resolver. */
+typedef struct dns_resolver_cache {
+    /* The resolver string; the empty string is the system default. */
+    char *key;
+    ldns_resolver *resolver;
+    /* The resolver's own per-attempt timeout, before the deadline limits it. */
+    struct timeval timeout;
+    struct dns_resolver_cache *next;
+} dns_resolver_cache_t;
+
+/* Return the sandbox's resolver for resolver_string, creating it on first use.
+ * Its timeout is shortened so that all of its attempts finish before the
+ * sandbox's deadline.
+ *
+ * Arguments:
+ * - resolver_string is a nameserver address like "8.8.8.8",
+ *   "2001:4860:4860::8888" or "[::1]:5353", or "" for the nameservers in the
+ *   system's resolv.conf.
+ * - error is set to a static error message on failure.
+ * Returns: the resolver, which the sandbox owns, or NULL on failure.
+ *
+ */
+ldns_resolver *dns_cached_resolver(sandbox_t *sandbox,
+                                   const char *resolver_string,
+                                   const char **error);
+
+/* Free an entire resolver cache. sandbox_destroy calls this. */
+void dns_resolver_cache_free(dns_resolver_cache_t *cache);
+
+/* Parse a nameserver address in the same format as dns_cached_resolver. The
+ * empty string means the first nameserver in the system's resolv.conf.
+ *
+ * Returns: 0 on success, -1 if the address could not be parsed.
+ *
+ */
+int dns_parse_nameserver(sandbox_t *sandbox,
+                         const char *resolver_string,
+                         struct sockaddr_storage *server,
+                         int *server_len);
+
+/* Push a query's timing as a table with fields started_at (when it was
+ * submitted, in monotonic microseconds), attempts, total_microseconds, and
+ * where they apply first_sent_microseconds, sent_microseconds (of the last
+ * attempt), received_microseconds, all since started_at, and
+ * rtt_microseconds. */
+void dns_push_timing(lua_State *L, const dns_query_t *query);
+
+/* Look up the first A record of a domain. Expects the sandbox as its first
+ * upvalue.
+ *
+ * Lua arguments:
+ * - domain is the name to look up.
+ * - resolver is the nameserver to query, or "" for the system default.
+ * Lua returns:
+ * - the first IPv4 address, or nil on error.
+ * - an error message, or nil if no errors occurred.
+ * - a table with fields started_at and total_microseconds, the time the
+ *   whole lookup took including retries, also on error. If the answer had A
+ *   records it also has ttl, the smallest of their TTLs in seconds.
+ *
+ */
 int l_dns_lookup(lua_State *L);
 
+/* Look up the A records of many domains at once. Expects the sandbox as its
+ * first upvalue.
+ *
+ * Lua arguments:
+ * - domains is an array of names to look up.
+ * - resolver is the nameserver to query, or "" for the system default.
+ * - opts is an optional table with fields window, timeout (in seconds) and
+ *   retries.
+ * Lua returns:
+ * - a table mapping each domain name to a table with fields address (the
+ *   first IPv4 address), addresses (all of them), rcode, error and timing.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_dns_lookup_batch(lua_State *L);
+
+/* Query several record types for one domain concurrently, returning the full
+ * responses. Expects the sandbox as its first upvalue.
+ *
+ * Lua arguments:
+ * - domain is the name to look up.
+ * - opts is an optional table with fields types (an array of record type
+ *   names, default { "A" }), resolver, timeout (in seconds) and retries.
+ * Lua returns:
+ * - a table mapping each type name to the parsed response, each with a timing
+ *   field as for dns_push_timing.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_dns_query(lua_State *L);
+
+/* Start an A lookup like dns_lookup without waiting for it. Expects the
+ * sandbox as its first upvalue.
+ *
+ * Lua arguments:
+ * - domain is the name to look up.
+ * - resolver is the nameserver to query, or "" for the system default.
+ * Lua returns:
+ * - an operation id to wait for with async_wait, whose value is the first
+ *   IPv4 address and whose timing is as for dns_push_timing, plus ttl as for
+ *   dns_lookup; nil on error.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_dns_lookup_async(lua_State *L);
+
+/* Look up the A records of many domains against several resolvers at once,
+ * and compare the answers. Every query keeps listening for a while after its
+ * first response, so responses forged by an injector and the real ones both
+ * arrive. Expects the sandbox as its first upvalue.
+ *
+ * Lua arguments:
+ * - domains is an array of names to look up.
+ * - resolvers is an array of nameservers, as for dns_lookup.
+ * - opts is an optional table with fields window, timeout (in seconds),
+ *   retries, listen (in seconds) and control (one of the resolvers, whose
+ *   answers the others are compared with).
+ * Lua returns:
+ * - a table mapping each domain name to a table with fields:
+ *   - answers, mapping each resolver to its first response's rcode and
+ *     sorted addresses, or error, along with responses (how many arrived),
+ *     late (the responses after the first, if any), injected (if a later
+ *     response differed from the first) and timing.
+ *   - groups, an array of the distinct first answers or errors, each with
+ *     rcode and addresses, or error, and the resolvers that gave it, in the
+ *     order of resolvers.
+ *   - injected, an array of the resolvers whose queries were answered
+ *     differently more than once.
+ *   - differs, if control answered, an array of the resolvers whose answers
+ *     differ from the control's.
+ *   - consistent, true if every resolver gave the same answer and none were
+ *     injected.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_dns_compare(lua_State *L);
+
 #endif
@@ -1,7 +1,9 @@
 #include "experiment.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/resource.h>
 #include <sys/time.h>
@@ -10,16 +12,25 @@
 
 #include <event2/event.h>
 
+#include "lua.h"
+
+#include "async.h"
 #include "logging.h"
 #include "options.h"
 #include "register.h"
+#include "results.h"
 #include "sandbox.h"
+#include "trace.h"
 #include "util.h"
 
 int experiment_init(experiment_t *experiment,
                     const char *name,
                     censorscope_options_t *options) {
     experiment->options = options;
+    experiment->shard_index = 0;
+    experiment->shard_count = 1;
+    experiment->shard_dir = NULL;
+    experiment->run_id[0] = '\0';
 
     if (!is_valid_module_name(name)) {
         log_error("invalid experiment name");
@@ -40,46 +51,164 @@ int experiment_init(experiment_t *experiment,
     return 0;
 }
 
-static int set_limits(const censorscope_options_t *options) {
+void experiment_new_run_id(char *run_id, size_t size) {
+    static unsigned long count = 0;
+    char timestamp[32];
+    time_t now = time(NULL);
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d-%H%M%S", localtime(&now));
+    snprintf(run_id,
+             size,
+             "%s-%ld-%lu",
+             timestamp,
+             (long)getpid(),
+             count++);
+}
+
+int experiment_set_limits(const censorscope_options_t *options) {
     rlim_t as_limit = 200*1024*1024;
     struct rlimit limits = { as_limit, as_limit };
     setrlimit(RLIMIT_AS, &limits);
     return 0;
 }
 
-int experiment_run(experiment_t *experiment) {
-    /* Set OS limits on the child. */
-    set_limits(experiment->options);
-
-    censorscope_options_t *options = experiment->options;
-
-    sandbox_t sandbox;
-    if (sandbox_init(&sandbox, experiment->name, options)) {
-        log_error("error initializing sandbox for '%s'", experiment->path);
+int experiment_sandbox_init(sandbox_t *sandbox,
+                            const char *name,
+                            censorscope_options_t *options) {
+    if (sandbox_init(sandbox, name, options)) {
+        log_error("error initializing sandbox '%s'", name);
         return -1;
     }
-    if (register_functions(options, &sandbox)) {
+    if (register_functions(options, sandbox)) {
         log_error("error registering sandbox functions");
-        sandbox_destroy(&sandbox);
+        sandbox_destroy(sandbox);
         return -1;
     }
     char *filename = sprintf_malloc("%s/api.lua", options->luasrc_dir);
     if (!filename) {
         log_error("error allocating filename for '%s'", options->luasrc_dir);
-        sandbox_destroy(&sandbox);
+        sandbox_destroy(sandbox);
         return -1;
     }
-    if (sandbox_run(&sandbox, experiment->path, filename)) {
-        log_error("error running '%s'", experiment->path);
+    if (sandbox_preload_environment(sandbox, filename)) {
+        log_error("error loading '%s'", filename);
         free(filename);
-        sandbox_destroy(&sandbox);
+        sandbox_destroy(sandbox);
         return -1;
     }
     free(filename);
-    sandbox_destroy(&sandbox);
     return 0;
 }
 
+void experiment_start_run(experiment_t *experiment,
+                          sandbox_t *sandbox,
+                          char *run_id) {
+    /* api.lua names result files after the sandbox. */
+    lua_pushstring(sandbox->L, experiment->name);
+    lua_setglobal(sandbox->L, "SANDBOX_NAME");
+    lua_pushinteger(sandbox->L, experiment->shard_index);
+    lua_setglobal(sandbox->L, "SHARD_INDEX");
+    lua_pushinteger(sandbox->L, experiment->shard_count);
+    lua_setglobal(sandbox->L, "SHARD_COUNT");
+    if (experiment->shard_dir) {
+        lua_pushstring(sandbox->L, experiment->shard_dir);
+    } else {
+        lua_pushnil(sandbox->L);
+    }
+    lua_setglobal(sandbox->L, "SHARD_RESULTS_DIR");
+
+    /* Workers run many experiments with one experiment_t each, so they get
+     * their ids here. */
+    if (experiment->run_id[0]) {
+        strcpy(run_id, experiment->run_id);
+    } else {
+        experiment_new_run_id(run_id, EXPERIMENT_RUN_ID_SIZE);
+    }
+    lua_pushstring(sandbox->L, run_id);
+    lua_setglobal(sandbox->L, "RUN_ID");
+    sandbox->run_id = run_id;
+    sandbox->run_experiment = experiment->name;
+    sandbox_reset_limits(sandbox, experiment->options);
+}
+
+int experiment_finish_run(experiment_t *experiment, sandbox_t *sandbox) {
+    int64_t cleanup_start = monotonic_microseconds();
+    int rc = 0;
+    log_info("'%s' used at most %zu bytes of Lua memory (%zu reserved)",
+             experiment->name,
+             sandbox->arena.peak_used,
+             sandbox->arena.peak_reserved);
+
+    /* Nothing is left to collect the results of operations still running. */
+    async_state_free(sandbox);
+
+    /* The next run writes to a different file, so don't hold this one. */
+    if (sandbox->results) {
+        if (results_writer_close(sandbox->results)) {
+            rc = -1;
+        }
+        sandbox->results->run_id = sandbox->results->experiment = NULL;
+    }
+    sandbox->run_id = sandbox->run_experiment = NULL;
+
+    lua_settop(sandbox->L, 0);
+    lua_gc(sandbox->L, LUA_GCCOLLECT, 0);
+    trace_span("cleanup",
+               experiment->name,
+               cleanup_start,
+               monotonic_microseconds());
+    return rc;
+}
+
+int experiment_run_in_sandbox(experiment_t *experiment, sandbox_t *sandbox) {
+    censorscope_options_t *options = experiment->options;
+    char run_id[EXPERIMENT_RUN_ID_SIZE];
+    experiment_start_run(experiment, sandbox, run_id);
+
+    char *filename = sprintf_malloc("%s/api.lua", options->luasrc_dir);
+    if (!filename) {
+        log_error("error allocating filename for '%s'", options->luasrc_dir);
+        experiment_finish_run(experiment, sandbox);
+        return -1;
+    }
+    int64_t script_start = monotonic_microseconds();
+    int rc = sandbox_run(sandbox, experiment->path, filename);
+    trace_span("script",
+               experiment->name,
+               script_start,
+               monotonic_microseconds());
+    if (rc) {
+        log_error("error running '%s'", experiment->path);
+    }
+    free(filename);
+    if (experiment_finish_run(experiment, sandbox)) {
+        rc = -1;
+    }
+    return rc;
+}
+
+int experiment_run(experiment_t *experiment) {
+    /* Set OS limits on the child. */
+    experiment_set_limits(experiment->options);
+
+    sandbox_t sandbox;
+    int64_t init_start = monotonic_microseconds();
+    if (experiment_sandbox_init(&sandbox,
+                                experiment->name,
+                                experiment->options)) {
+        log_error("error initializing sandbox for '%s'", experiment->path);
+        return -1;
+    }
+    trace_span("sandbox_init",
+               experiment->name,
+               init_start,
+               monotonic_microseconds());
+    int rc = experiment_run_in_sandbox(experiment, &sandbox);
+    int64_t exit_start = monotonic_microseconds();
+    sandbox_destroy(&sandbox);
+    trace_span("exit", experiment->name, exit_start, monotonic_microseconds());
+    return rc;
+}
+
 int experiment_destroy(experiment_t *experiment) {
     free(experiment->name);
     free(experiment->path);
@@ -1,22 +1,89 @@
 #ifndef CENSORSCOPE_EXPERIMENT_H
 #define CENSORSCOPE_EXPERIMENT_H
 
+#include <stddef.h>
+
 #include "options.h"
+#include "sandbox.h"
 
 struct event_base;
 
+/* Room for a run id, including the terminating NUL. */
+#define EXPERIMENT_RUN_ID_SIZE 64
+
 typedef struct {
     char *name;
     char *path;
     censorscope_options_t *options;
+    /* Which shard of a sharded run this is, from 0 to shard_count - 1, and
+     * the directory its results go in. Unsharded runs have one shard and no
+     * shard_dir. */
+    int shard_index;
+    int shard_count;
+    const char *shard_dir;
+    /* The id of the next run, which names its results file and the entries
+     * for it in the results index. Shards of a run share their run's id. If
+     * this is empty, experiment_run_in_sandbox makes a new one. */
+    char run_id[EXPERIMENT_RUN_ID_SIZE];
 } experiment_t;
 
 int experiment_init(experiment_t *experiment,
                     const char *name,
                     censorscope_options_t *options);
 
+/* Make a run id that no other run on this device has, even among runs that
+ * start in the same second: the time the run starts, then the pid of the
+ * process that made the id and a count of the ids it has made. */
+void experiment_new_run_id(char *run_id, size_t size);
+
+/* Run an experiment in a new sandbox. Call this in a child process, since it
+ * also sets operating system resource limits. */
 int experiment_run(experiment_t *experiment);
 
+/* Set the operating system resource limits for processes that run
+ * experiments. */
+int experiment_set_limits(const censorscope_options_t *options);
+
+/* Prepare a sandbox that can run many experiments in turn, with the primitives
+ * registered and api.lua compiled ahead of time.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int experiment_sandbox_init(sandbox_t *sandbox,
+                            const char *name,
+                            censorscope_options_t *options);
+
+/* Prepare a sandbox created by experiment_sandbox_init for a run of an
+ * experiment: set the globals api.lua reads, pick the run's id and restart
+ * the sandbox's limits.
+ *
+ * Arguments:
+ * - run_id has room for EXPERIMENT_RUN_ID_SIZE bytes, and receives the run's
+ *   id. It must outlive the run, since the results writer refers to it.
+ *
+ */
+void experiment_start_run(experiment_t *experiment,
+                          sandbox_t *sandbox,
+                          char *run_id);
+
+/* Clean up after a run started with experiment_start_run: abandon its
+ * asynchronous operations, close its results file and collect its garbage,
+ * so the sandbox can run the next one.
+ *
+ * Returns: 0 on success, -1 if its results couldn't be written.
+ *
+ */
+int experiment_finish_run(experiment_t *experiment, sandbox_t *sandbox);
+
+/* Run an experiment in a sandbox created by experiment_sandbox_init, and
+ * collect its garbage afterwards so the sandbox can run the next one.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int experiment_run_in_sandbox(experiment_t *experiment, sandbox_t *sandbox);
+
 int experiment_destroy(experiment_t *experiment);
 
 #endif
@@ -5,85 +5,941 @@
 #include <string.h>
 
 #include <curl/curl.h>
+#include <event2/event.h>
+#include <openssl/evp.h>
 
 #define LUALIB
 #include "lua.h"
 #include "lauxlib.h"
 
-struct buffer {
-    char *string;
-    size_t len;
-};
+#include "async.h"
+#include "logging.h"
+#include "luautil.h"
+#include "ratelimit.h"
+#include "sandbox.h"
+#include "util.h"
 
-void init_buffer(struct buffer *data) {
-    data->len = 0;
+#define DEFAULT_BATCH_CONCURRENCY 16
+#define DEFAULT_BATCH_PER_HOST 4
+#define DEFAULT_BATCH_TIMEOUT_SECONDS 30
+
+#define DEFAULT_HEAD_BYTES 1024
+#define MIN_BUFFER_CAPACITY 4096
+/* About how much a request sends besides its URL, for the rate limiter:
+ * the TCP handshake, the request's headers and a TLS handshake. */
+#define REQUEST_OVERHEAD_BYTES 1024
+
+static int init_buffer(http_buffer_t *data,
+                       const http_body_options_t *options) {
+    memset(data, 0, sizeof(*data));
+    if (options) {
+        data->options = *options;
+    }
+    if (data->options.digest) {
+        data->digest = EVP_MD_CTX_new();
+        if (!data->digest
+            || !EVP_DigestInit_ex(data->digest, EVP_sha256(), NULL)) {
+            log_error("error initializing SHA-256 digest");
+            EVP_MD_CTX_free(data->digest);
+            data->digest = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_buffer(http_buffer_t *data) {
+    free(data->string);
     data->string = NULL;
+    if (data->digest) {
+        EVP_MD_CTX_free(data->digest);
+        data->digest = NULL;
+    }
+}
+
+/* Append to the stored body, growing the buffer geometrically so a large body
+ * costs a linear amount of copying. */
+static int append_buffer(http_buffer_t *data, const char *string, size_t len) {
+    if (data->len + len > data->capacity) {
+        size_t capacity = data->capacity ? data->capacity : MIN_BUFFER_CAPACITY;
+        while (capacity < data->len + len) {
+            capacity *= 2;
+        }
+        char *new_string = realloc(data->string, capacity);
+        if (!new_string) {
+            log_error("realloc failed");
+            return -1;
+        }
+        data->string = new_string;
+        data->capacity = capacity;
+    }
+    memcpy(data->string + data->len, string, len);
+    data->len += len;
+    return 0;
 }
 
 static size_t write_data(void *string, size_t size, size_t nmemb, void *arg)
 {
-    struct buffer *data = (struct buffer *) arg;
+    http_buffer_t *data = (http_buffer_t *) arg;
 
     const size_t data_len = size*nmemb;
-    const size_t new_len = data->len + data_len;
+    size_t accepted = data_len;
+    if (data->options.max_body_bytes > 0
+        && data->total_len + data_len > data->options.max_body_bytes) {
+        accepted = data->options.max_body_bytes - data->total_len;
+        data->truncated = 1;
+    }
 
-    data->string = realloc(data->string, new_len);
-    if (data->string == NULL) {
-        fprintf(stderr, "realloc failed\n");
+    size_t kept = accepted;
+    if (data->digest) {
+        if (!EVP_DigestUpdate(data->digest, string, accepted)) {
+            log_error("error updating SHA-256 digest");
+            return 0;
+        }
+        size_t head_bytes = data->options.head_bytes;
+        kept = data->len < head_bytes ? head_bytes - data->len : 0;
+        if (kept > accepted) {
+            kept = accepted;
+        }
+    }
+    if (kept > 0 && append_buffer(data, string, kept)) {
         return 0;
     }
+    data->total_len += accepted;
 
-    memcpy(data->string + data->len, string, data_len);
-    data->len = new_len;
+    /* Returning less than we were given makes curl abort the transfer with
+     * CURLE_WRITE_ERROR, which callers treat as success when truncated. */
+    return data->truncated ? 0 : data_len;
+}
 
-    return data_len;
+void http_body_options_lua(lua_State *L,
+                           int table_index,
+                           http_body_options_t *options) {
+    lua_Number max_body_bytes = optfield_number(L,
+                                                table_index,
+                                                "max_body_bytes",
+                                                0);
+    luaL_argcheck(L,
+                  max_body_bytes >= 0,
+                  table_index,
+                  "max_body_bytes must not be negative");
+    lua_Number head_bytes = optfield_number(L,
+                                            table_index,
+                                            "head_bytes",
+                                            DEFAULT_HEAD_BYTES);
+    luaL_argcheck(L,
+                  head_bytes >= 0,
+                  table_index,
+                  "head_bytes must not be negative");
+    options->max_body_bytes = max_body_bytes;
+    options->head_bytes = head_bytes;
+    options->digest = optfield_boolean(L, table_index, "digest", 0);
 }
 
-int l_http_get(lua_State *L) {
-    CURL *curl_handle;
-    CURLcode res;
+/* Set the body fields of the table at the top of the stack: body, or sha256,
+ * length and head in digest mode, plus truncated. */
+static void set_body_fields(lua_State *L, http_buffer_t *data) {
+    if (data->digest) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len = 0;
+        if (EVP_DigestFinal_ex(data->digest, digest, &digest_len)) {
+            char hex[2 * EVP_MAX_MD_SIZE + 1];
+            for (unsigned int i = 0; i < digest_len; ++i) {
+                snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+            }
+            lua_pushlstring(L, hex, 2 * digest_len);
+            lua_setfield(L, -2, "sha256");
+        }
+        lua_pushnumber(L, data->total_len);
+        lua_setfield(L, -2, "length");
+        lua_pushlstring(L, data->string ? data->string : "", data->len);
+        lua_setfield(L, -2, "head");
+    } else {
+        lua_pushlstring(L, data->string ? data->string : "", data->len);
+        lua_setfield(L, -2, "body");
+    }
+    lua_pushboolean(L, data->truncated);
+    lua_setfield(L, -2, "truncated");
+}
+
+/* Add curl's phase times, which it measures from when the transfer started, to
+ * a timing whose started_at and queued_microseconds are already set. */
+static void read_timing(CURL *easy, http_timing_t *timing) {
+    static const CURLINFO phases[] = {
+        CURLINFO_NAMELOOKUP_TIME_T,
+        CURLINFO_CONNECT_TIME_T,
+        CURLINFO_APPCONNECT_TIME_T,
+        CURLINFO_STARTTRANSFER_TIME_T,
+        CURLINFO_TOTAL_TIME_T,
+    };
+    int64_t *fields[] = {
+        &timing->dns_microseconds,
+        &timing->connect_microseconds,
+        &timing->tls_microseconds,
+        &timing->first_byte_microseconds,
+        &timing->total_microseconds,
+    };
+    for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); ++i) {
+        curl_off_t elapsed = 0;
+        if (curl_easy_getinfo(easy, phases[i], &elapsed) != CURLE_OK
+            || elapsed <= 0) {
+            *fields[i] = -1;
+        } else {
+            *fields[i] = timing->queued_microseconds + elapsed;
+        }
+    }
+    if (timing->total_microseconds < 0) {
+        timing->total_microseconds = monotonic_microseconds()
+                                   - timing->started_at;
+    }
+}
+
+/* Push a timing as a table, leaving out phases that never finished. */
+static void push_timing(lua_State *L, const http_timing_t *timing) {
+    lua_createtable(L, 0, 7);
+    lua_pushnumber(L, timing->started_at);
+    lua_setfield(L, -2, "started_at");
+    const struct {
+        const char *name;
+        int64_t value;
+    } fields[] = {
+        { "queued_microseconds", timing->queued_microseconds },
+        { "dns_microseconds", timing->dns_microseconds },
+        { "connect_microseconds", timing->connect_microseconds },
+        { "tls_microseconds", timing->tls_microseconds },
+        { "first_byte_microseconds", timing->first_byte_microseconds },
+        { "total_microseconds", timing->total_microseconds },
+    };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        if (fields[i].value >= 0) {
+            lua_pushnumber(L, fields[i].value);
+            lua_setfield(L, -2, fields[i].name);
+        }
+    }
+}
+
+/* This is the context curl associates with each socket it asks us to watch. */
+typedef struct http_socket {
+    struct event *ev;
+    struct http_socket *prev, *next;
+} http_socket_t;
+
+static void free_socket(http_engine_t *engine, http_socket_t *sock) {
+    if (sock->prev) {
+        sock->prev->next = sock->next;
+    } else {
+        engine->sockets = sock->next;
+    }
+    if (sock->next) {
+        sock->next->prev = sock->prev;
+    }
+    if (sock->ev) {
+        event_free(sock->ev);
+    }
+    free(sock);
+}
+
+static void active_list_remove(http_request_t *request) {
+    http_engine_t *engine = request->engine;
+    if (request->prev) {
+        request->prev->next = request->next;
+    } else {
+        engine->active = request->next;
+    }
+    if (request->next) {
+        request->next->prev = request->prev;
+    }
+    request->prev = request->next = NULL;
+    --engine->active_count;
+}
+
+static void finish_request(http_request_t *request, const char *error) {
+    http_engine_t *engine = request->engine;
+    --engine->outstanding;
+    request->error = error;
+    request->finished = 1;
+    request->callback(request, request->callback_arg);
+}
+
+static void start_pending(http_engine_t *engine);
+
+/* Ask the rate limiter to let a request to a URL go now.
+ *
+ * Returns: 0 if it may go, or else the microseconds to wait.
+ *
+ */
+static int64_t acquire_request(const char *url) {
+    char key[RATELIMIT_KEY_SIZE];
+    ratelimit_url_key(url, key, sizeof(key));
+    return ratelimit_acquire(key, strlen(url) + REQUEST_OVERHEAD_BYTES);
+}
+
+/* Tell the rate limiter whether the server for a URL answered. */
+static void report_request(const char *url,
+                           CURLcode result,
+                           const http_buffer_t *body) {
+    char key[RATELIMIT_KEY_SIZE];
+    ratelimit_url_key(url, key, sizeof(key));
+    ratelimit_report(key, result == CURLE_OPERATION_TIMEDOUT, body->total_len);
+}
+
+/* Hand every finished transfer back to its callback. */
+static void check_multi_info(http_engine_t *engine) {
+    CURLMsg *message;
+    int messages_left;
+    while ((message = curl_multi_info_read(engine->multi, &messages_left))) {
+        if (message->msg != CURLMSG_DONE) {
+            continue;
+        }
+        http_request_t *request;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &request);
+        CURLcode result = message->data.result;
+
+        curl_multi_remove_handle(engine->multi, request->easy);
+        active_list_remove(request);
+
+        curl_easy_getinfo(request->easy, CURLINFO_RESPONSE_CODE, &request->status);
+        read_timing(request->easy, &request->timing);
+        report_request(request->url, result, &request->body);
+        const char *error = NULL;
+        if (result == CURLE_WRITE_ERROR && request->body.truncated) {
+            /* We stopped the transfer ourselves at max_body_bytes. */
+        } else if (result != CURLE_OK) {
+            error = request->error_buffer[0]
+                  ? request->error_buffer
+                  : curl_easy_strerror(result);
+        }
+        finish_request(request, error);
+    }
+    start_pending(engine);
+}
+
+static void on_socket_event(evutil_socket_t fd, short what, void *arg) {
+    http_engine_t *engine = arg;
+    int flags = 0;
+    if (what & EV_READ) {
+        flags |= CURL_CSELECT_IN;
+    }
+    if (what & EV_WRITE) {
+        flags |= CURL_CSELECT_OUT;
+    }
+    int running;
+    curl_multi_socket_action(engine->multi, fd, flags, &running);
+    check_multi_info(engine);
+}
+
+static void on_timer_event(evutil_socket_t fd, short what, void *arg) {
+    http_engine_t *engine = arg;
+    int running;
+    curl_multi_socket_action(engine->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    check_multi_info(engine);
+}
+
+/* curl calls this to tell us which sockets to watch. See
+ * http://curl.haxx.se/libcurl/c/CURLMOPT_SOCKETFUNCTION.html */
+static int socket_callback(CURL *easy,
+                           curl_socket_t fd,
+                           int what,
+                           void *userp,
+                           void *socketp) {
+    http_engine_t *engine = userp;
+    http_socket_t *sock = socketp;
+
+    if (what == CURL_POLL_REMOVE) {
+        if (sock) {
+            free_socket(engine, sock);
+        }
+        return 0;
+    }
+
+    if (!sock) {
+        sock = calloc(1, sizeof(http_socket_t));
+        if (!sock) {
+            log_error("calloc error: %m");
+            return -1;
+        }
+        sock->next = engine->sockets;
+        if (engine->sockets) {
+            engine->sockets->prev = sock;
+        }
+        engine->sockets = sock;
+        curl_multi_assign(engine->multi, fd, sock);
+    } else {
+        event_free(sock->ev);
+        sock->ev = NULL;
+    }
+
+    short kind = EV_PERSIST;
+    if (what & CURL_POLL_IN) {
+        kind |= EV_READ;
+    }
+    if (what & CURL_POLL_OUT) {
+        kind |= EV_WRITE;
+    }
+    sock->ev = event_new(engine->base, fd, kind, on_socket_event, engine);
+    if (!sock->ev || event_add(sock->ev, NULL)) {
+        log_error("error watching curl socket");
+        return -1;
+    }
+    return 0;
+}
+
+/* curl calls this to ask for a single timeout. See
+ * http://curl.haxx.se/libcurl/c/CURLMOPT_TIMERFUNCTION.html */
+static int timer_callback(CURLM *multi, long timeout_ms, void *userp) {
+    http_engine_t *engine = userp;
+    if (timeout_ms < 0) {
+        return event_del(engine->timer);
+    }
+    struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    return event_add(engine->timer, &timeout);
+}
+
+static void on_pace_event(evutil_socket_t fd, short what, void *arg) {
+    start_pending(arg);
+}
+
+static void start_pending(http_engine_t *engine) {
+    while (engine->pending_head && engine->active_count < engine->concurrency) {
+        http_request_t *request = engine->pending_head;
+        int64_t wait = acquire_request(request->url);
+        if (wait > 0) {
+            struct timeval delay = { wait / 1000000, wait % 1000000 };
+            if (event_add(engine->pace, &delay)) {
+                log_error("error scheduling HTTP request");
+            }
+            break;
+        }
+        engine->pending_head = request->next;
+        if (!engine->pending_head) {
+            engine->pending_tail = NULL;
+        }
+        request->next = NULL;
+
+        request->timing.queued_microseconds = monotonic_microseconds()
+                                            - request->timing.started_at;
+        CURLMcode code = curl_multi_add_handle(engine->multi, request->easy);
+        if (code != CURLM_OK) {
+            request->timing.total_microseconds =
+                    request->timing.queued_microseconds;
+            finish_request(request, curl_multi_strerror(code));
+            continue;
+        }
+        request->next = engine->active;
+        if (engine->active) {
+            engine->active->prev = request;
+        }
+        engine->active = request;
+        ++engine->active_count;
+    }
+}
+
+int http_engine_init(http_engine_t *engine,
+                     struct event_base *base,
+                     http_state_t *state,
+                     int concurrency,
+                     int per_host,
+                     long timeout_ms) {
+    if (concurrency < 1 || per_host < 1) {
+        log_error("invalid HTTP engine parameters");
+        return -1;
+    }
+    engine->base = base;
+    engine->state = state;
+    engine->concurrency = concurrency;
+    engine->timeout_ms = timeout_ms;
+    engine->pending_head = engine->pending_tail = NULL;
+    engine->active = NULL;
+    engine->active_count = 0;
+    engine->sockets = NULL;
+    engine->outstanding = 0;
+
+    engine->timer = evtimer_new(base, on_timer_event, engine);
+    if (!engine->timer) {
+        log_error("error creating curl timer event");
+        return -1;
+    }
+    engine->pace = evtimer_new(base, on_pace_event, engine);
+    if (!engine->pace) {
+        log_error("error creating HTTP pacing event");
+        event_free(engine->timer);
+        return -1;
+    }
+    engine->multi = curl_multi_init();
+    if (!engine->multi) {
+        log_error("error creating curl multi handle");
+        event_free(engine->pace);
+        event_free(engine->timer);
+        return -1;
+    }
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETDATA, engine);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERDATA, engine);
+    curl_multi_setopt(engine->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)per_host);
+    return 0;
+}
+
+http_request_t *http_engine_submit(http_engine_t *engine,
+                                   const char *url,
+                                   const http_body_options_t *body_options,
+                                   http_request_callback callback,
+                                   void *callback_arg) {
+    http_request_t *request = calloc(1, sizeof(http_request_t));
+    if (!request) {
+        return NULL;
+    }
+    if (init_buffer(&request->body, body_options)) {
+        free(request);
+        return NULL;
+    }
+    request->engine = engine;
+    request->callback = callback;
+    request->callback_arg = callback_arg;
+    request->state = engine->state;
+    request->url = strdup(url);
+    if (request->state) {
+        request->easy = http_acquire_handle(request->state);
+    } else {
+        request->easy = curl_easy_init();
+        if (request->easy) {
+            curl_easy_setopt(request->easy, CURLOPT_NOPROGRESS, 1L);
+            curl_easy_setopt(request->easy, CURLOPT_NOSIGNAL, 1L);
+        }
+    }
+    if (!request->url || !request->easy) {
+        http_request_free(request);
+        return NULL;
+    }
+
+    curl_easy_setopt(request->easy, CURLOPT_URL, request->url);
+    curl_easy_setopt(request->easy, CURLOPT_WRITEFUNCTION, write_data);
+    curl_easy_setopt(request->easy, CURLOPT_WRITEDATA, &request->body);
+    curl_easy_setopt(request->easy, CURLOPT_ERRORBUFFER, request->error_buffer);
+    curl_easy_setopt(request->easy, CURLOPT_PRIVATE, request);
+    if (engine->timeout_ms > 0) {
+        curl_easy_setopt(request->easy, CURLOPT_TIMEOUT_MS, engine->timeout_ms);
+    }
+
+    request->timing.started_at = monotonic_microseconds();
+    request->timing.dns_microseconds = -1;
+    request->timing.connect_microseconds = -1;
+    request->timing.tls_microseconds = -1;
+    request->timing.first_byte_microseconds = -1;
+    if (engine->pending_tail) {
+        engine->pending_tail->next = request;
+    } else {
+        engine->pending_head = request;
+    }
+    engine->pending_tail = request;
+    ++engine->outstanding;
+
+    start_pending(engine);
+    return request;
+}
+
+int http_engine_run(http_engine_t *engine) {
+    while (engine->outstanding > 0) {
+        if (event_base_loop(engine->base, EVLOOP_ONCE) == -1) {
+            log_error("error running HTTP event loop");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int http_engine_destroy(http_engine_t *engine) {
+    while (engine->active) {
+        http_request_t *request = engine->active;
+        curl_multi_remove_handle(engine->multi, request->easy);
+        active_list_remove(request);
+        http_request_free(request);
+    }
+    while (engine->pending_head) {
+        http_request_t *request = engine->pending_head;
+        engine->pending_head = request->next;
+        http_request_free(request);
+    }
+    engine->pending_tail = NULL;
+    engine->outstanding = 0;
 
+    curl_multi_cleanup(engine->multi);
+    /* curl normally tells us to stop watching each socket as it closes them,
+     * but don't leave events behind on the event base if it didn't. */
+    while (engine->sockets) {
+        free_socket(engine, engine->sockets);
+    }
+    event_free(engine->pace);
+    event_free(engine->timer);
+    return 0;
+}
+
+void http_request_free(http_request_t *request) {
+    if (request->easy && request->state) {
+        http_release_handle(request->state, request->easy);
+    } else if (request->easy) {
+        curl_easy_cleanup(request->easy);
+    }
+    free_buffer(&request->body);
+    free(request->url);
+    free(request);
+}
+
+http_state_t *http_sandbox_state(sandbox_t *sandbox) {
+    if (sandbox->http) {
+        return sandbox->http;
+    }
+    http_state_t *state = calloc(1, sizeof(http_state_t));
+    if (!state) {
+        log_error("calloc error: %m");
+        return NULL;
+    }
+    state->share = curl_share_init();
+    if (!state->share) {
+        log_error("error creating curl share handle");
+        free(state);
+        return NULL;
+    }
+    /* Sandboxes are single threaded, so the share needs no lock functions. */
+    curl_share_setopt(state->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(state->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(state->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    sandbox->http = state;
+    return state;
+}
+
+CURL *http_acquire_handle(http_state_t *state) {
+    CURL *handle;
+    if (state->pool_count > 0) {
+        handle = state->pool[--state->pool_count];
+    } else {
+        handle = curl_easy_init();
+        if (!handle) {
+            return NULL;
+        }
+    }
+    /* curl_easy_reset clears every option, so set these on every use. */
+    curl_easy_setopt(handle, CURLOPT_SHARE, state->share);
+    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    return handle;
+}
+
+void http_release_handle(http_state_t *state, CURL *handle) {
+    if (state->pool_count == HTTP_HANDLE_POOL_SIZE) {
+        curl_easy_cleanup(handle);
+        return;
+    }
+    /* Resetting keeps the handle's own caches, but forgets its options,
+     * including pointers to buffers that are about to be freed. */
+    curl_easy_reset(handle);
+    state->pool[state->pool_count++] = handle;
+}
+
+void http_state_free(http_state_t *state) {
+    if (!state) {
+        return;
+    }
+    /* Every handle must be detached from the share before it can go. */
+    for (int i = 0; i < state->pool_count; ++i) {
+        curl_easy_cleanup(state->pool[i]);
+    }
+    curl_share_cleanup(state->share);
+    free(state);
+}
+
+/* Convert a timeout to milliseconds for curl, limited by the sandbox's
+ * deadline. Never returns 0, which curl takes to mean no timeout. */
+static long limit_timeout_ms(const sandbox_t *sandbox, double seconds) {
+    long timeout_ms = (long)(sandbox_limit_seconds(sandbox, seconds) * 1000);
+    return timeout_ms > 0 ? timeout_ms : 1;
+}
+
+int l_http_get(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
     const char *url = luaL_checkstring(L, 1);
+    http_body_options_t body_options;
+    http_body_options_lua(L, 2, &body_options);
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
+    char key[RATELIMIT_KEY_SIZE];
+    ratelimit_url_key(url, key, sizeof(key));
+    if (ratelimit_wait(key,
+                       strlen(url) + REQUEST_OVERHEAD_BYTES,
+                       sandbox_time_remaining(sandbox))) {
+        return sandbox_push_deadline_error(L);
+    }
+    int64_t remaining = sandbox_time_remaining(sandbox);
+    if (remaining == 0) {
+        return sandbox_push_deadline_error(L);
+    }
 
-    /* init the curl session */
-    curl_handle = curl_easy_init();
-    if(!curl_handle) {
-        curl_global_cleanup();
+    http_state_t *state = http_sandbox_state(sandbox);
+    if (!state) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating curl state");
+        return 2;
+    }
+    CURL *curl_handle = http_acquire_handle(state);
+    if (!curl_handle) {
         lua_pushnil(L);
         lua_pushstring(L, "error creating handle");
         return 2;
     }
 
     /* create a buffer to keep our response */
-    struct buffer data;
-    init_buffer(&data);
+    http_buffer_t data;
+    if (init_buffer(&data, &body_options)) {
+        http_release_handle(state, curl_handle);
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating buffer");
+        return 2;
+    }
 
     /* set URL to get */
     curl_easy_setopt(curl_handle, CURLOPT_URL, url);
 
-    /* no progress meter please */
-    curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 1L);
-
     /* send all data to this function  */
     curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_data);
 
     /* pass the response string to the write function */
     curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &data);
 
-    /* perform the request */
-    res = curl_easy_perform(curl_handle);
-    if (res != CURLE_OK) {
-        curl_global_cleanup();
+    /* give up on the transfer at the sandbox's deadline */
+    if (remaining != INT64_MAX) {
+        curl_easy_setopt(curl_handle,
+                         CURLOPT_TIMEOUT_MS,
+                         limit_timeout_ms(sandbox, remaining / 1e6));
+    }
+
+    /* perform the request, then return the handle to the pool */
+    http_timing_t timing = { .started_at = monotonic_microseconds() };
+    CURLcode res = curl_easy_perform(curl_handle);
+    read_timing(curl_handle, &timing);
+    http_release_handle(state, curl_handle);
+    report_request(url, res, &data);
+    if (res != CURLE_OK && !(res == CURLE_WRITE_ERROR && data.truncated)) {
+        free_buffer(&data);
         lua_pushnil(L);
-        lua_pushstring(L, "error performing the request");
-        return 2;
+        lua_pushstring(L, curl_easy_strerror(res));
+        push_timing(L, &timing);
+        return 3;
     }
 
-    lua_pushlstring(L, data.string, data.len);
+    if (data.digest) {
+        lua_newtable(L);
+        set_body_fields(L, &data);
+    } else {
+        lua_pushlstring(L, data.string ? data.string : "", data.len);
+    }
 
     /* cleanup */
-    free(data.string);
-    curl_easy_cleanup(curl_handle);
+    free_buffer(&data);
+    lua_pushnil(L);
+    push_timing(L, &timing);
+    return 3;
+}
+
+static void batch_request_done(http_request_t *request, void *arg) {
+    /* Nothing to do; we collect results once the whole batch has finished. */
+}
+
+int l_http_get_batch(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int concurrency = optfield_integer(L,
+                                       2,
+                                       "concurrency",
+                                       DEFAULT_BATCH_CONCURRENCY);
+    int per_host = optfield_integer(L, 2, "per_host", DEFAULT_BATCH_PER_HOST);
+    double timeout = optfield_number(L,
+                                     2,
+                                     "timeout",
+                                     DEFAULT_BATCH_TIMEOUT_SECONDS);
+    luaL_argcheck(L, concurrency > 0, 2, "concurrency must be positive");
+    luaL_argcheck(L, per_host > 0, 2, "per_host must be positive");
+    http_body_options_t body_options;
+    http_body_options_lua(L, 2, &body_options);
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
+
+    size_t count = lua_objlen(L, 1);
+    for (size_t i = 1; i <= count; ++i) {
+        lua_rawgeti(L, 1, i);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_argerror(L, 1, "urls must be strings");
+        }
+        lua_pop(L, 1);
+    }
+
+    http_state_t *state = http_sandbox_state(sandbox);
+    if (!state) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating curl state");
+        return 2;
+    }
+    http_engine_t engine;
+    if (http_engine_init(&engine,
+                         sandbox->base,
+                         state,
+                         concurrency,
+                         per_host,
+                         limit_timeout_ms(sandbox, timeout))) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating HTTP engine");
+        return 2;
+    }
+    http_request_t **requests = calloc(count ? count : 1,
+                                       sizeof(http_request_t *));
+    if (!requests) {
+        http_engine_destroy(&engine);
+        lua_pushnil(L);
+        lua_pushstring(L, "error allocating requests");
+        return 2;
+    }
+
+    lua_settop(L, 2);
+    lua_newtable(L);  /* The results table, at index 3. */
+    for (size_t i = 0; i < count; ++i) {
+        lua_rawgeti(L, 1, i + 1);
+        const char *url = lua_tostring(L, -1);
+        requests[i] = http_engine_submit(&engine,
+                                         url,
+                                         &body_options,
+                                         batch_request_done,
+                                         NULL);
+        if (!requests[i]) {
+            lua_newtable(L);
+            lua_pushstring(L, "error creating handle");
+            lua_setfield(L, -2, "error");
+            lua_setfield(L, 3, url);
+        }
+        lua_pop(L, 1);
+    }
+
+    if (http_engine_run(&engine)) {
+        /* Finished requests belong to us; the engine frees the rest. */
+        for (size_t i = 0; i < count; ++i) {
+            if (requests[i] && requests[i]->finished) {
+                http_request_free(requests[i]);
+            }
+        }
+        http_engine_destroy(&engine);
+        free(requests);
+        lua_pushnil(L);
+        lua_pushstring(L, "error running HTTP requests");
+        return 2;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        http_request_t *request = requests[i];
+        if (!request) {
+            continue;
+        }
+        lua_newtable(L);
+        if (request->error) {
+            lua_pushstring(L, request->error);
+            lua_setfield(L, -2, "error");
+        } else {
+            set_body_fields(L, &request->body);
+        }
+        lua_pushnumber(L, request->status);
+        lua_setfield(L, -2, "status");
+        push_timing(L, &request->timing);
+        lua_setfield(L, -2, "timing");
+        lua_setfield(L, 3, request->url);
+        http_request_free(request);
+    }
+    free(requests);
+    http_engine_destroy(&engine);
+
+    lua_pushnil(L);
+    return 2;
+}
+
+/* Push what http_get would return for a finished request. */
+static void push_async_request(lua_State *L, void *data) {
+    http_request_t *request = data;
+    if (request->error) {
+        lua_pushnil(L);
+        lua_pushstring(L, request->error);
+    } else if (request->body.digest) {
+        lua_newtable(L);
+        set_body_fields(L, &request->body);
+        lua_pushnil(L);
+    } else {
+        lua_pushlstring(L,
+                        request->body.string ? request->body.string : "",
+                        request->body.len);
+        lua_pushnil(L);
+    }
+    push_timing(L, &request->timing);
+}
+
+static void free_async_request(void *data) {
+    http_request_free(data);
+}
+
+static void async_request_done(http_request_t *request, void *arg) {
+    async_op_finish(arg, request);
+}
+
+int l_http_get_async(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    const char *url = luaL_checkstring(L, 1);
+    http_body_options_t body_options;
+    http_body_options_lua(L, 2, &body_options);
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
+
+    async_state_t *state = async_sandbox_state(sandbox);
+    http_state_t *http = http_sandbox_state(sandbox);
+    if (!state || !http) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating async state");
+        return 2;
+    }
+    if (!state->http) {
+        state->http = malloc(sizeof(http_engine_t));
+        if (!state->http
+            || http_engine_init(state->http,
+                                sandbox->async_base,
+                                http,
+                                DEFAULT_BATCH_CONCURRENCY,
+                                DEFAULT_BATCH_PER_HOST,
+                                limit_timeout_ms(
+                                        sandbox,
+                                        DEFAULT_BATCH_TIMEOUT_SECONDS))) {
+            free(state->http);
+            state->http = NULL;
+            lua_pushnil(L);
+            lua_pushstring(L, "error creating HTTP engine");
+            return 2;
+        }
+    }
+
+    async_op_t *op = async_op_new(state,
+                                  push_async_request,
+                                  free_async_request);
+    if (!op) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error allocating operation");
+        return 2;
+    }
+    if (!http_engine_submit(state->http,
+                            url,
+                            &body_options,
+                            async_request_done,
+                            op)) {
+        async_op_cancel(op);
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating handle");
+        return 2;
+    }
+    lua_pushnumber(L, op->id);
     lua_pushnil(L);
     return 2;
 }
@@ -1,8 +1,241 @@
 #ifndef CENSORSCOPE_HTTP_H_
 #define CENSORSCOPE_HTTP_H_
 
+#include <stdint.h>
+
+#include <curl/curl.h>
+
 #include "lua.h"
 
+#include "sandbox.h"
+
+struct event;
+struct event_base;
+
+typedef struct http_engine http_engine_t;
+typedef struct http_request http_request_t;
+
+#define HTTP_HANDLE_POOL_SIZE 16
+
+/* Each sandbox keeps curl state for its whole lifetime, so consecutive
+ * requests reuse DNS lookups, TLS sessions and keep-alive connections. */
+typedef struct http_state {
+    /* Shares the DNS cache, TLS session cache and connection cache between
+     * all of the sandbox's easy handles. */
+    CURLSH *share;
+    /* Idle easy handles, ready for reuse. */
+    CURL *pool[HTTP_HANDLE_POOL_SIZE];
+    int pool_count;
+} http_state_t;
+
+/* Called exactly once for every submitted request, after it has finished. The
+ * callback owns the request and must eventually free it with
+ * http_request_free. */
+typedef void (*http_request_callback)(http_request_t *request, void *arg);
+
+/* Controls how much of a response body we keep. */
+typedef struct {
+    /* Abort the transfer after this many bytes, or 0 for no limit. */
+    size_t max_body_bytes;
+    /* If set, compute a SHA-256 digest of the body as it arrives and only keep
+     * its first head_bytes bytes. */
+    int digest;
+    size_t head_bytes;
+} http_body_options_t;
+
+/* A buffer for a response body, which grows geometrically. */
+typedef struct {
+    char *string;
+    size_t len;
+    size_t capacity;
+    /* The number of bytes received, which may exceed len in digest mode. */
+    size_t total_len;
+    /* Set if we stopped the transfer at max_body_bytes. */
+    int truncated;
+    http_body_options_t options;
+    /* The running digest of the body, or NULL if not in digest mode. */
+    struct evp_md_ctx_st *digest;
+} http_buffer_t;
+
+/* Read body options (max_body_bytes, digest and head_bytes) from the options
+ * table at table_index. */
+void http_body_options_lua(lua_State *L,
+                           int table_index,
+                           http_body_options_t *options);
+
+/* When each phase of a request finished. started_at is when the request was
+ * submitted, in monotonic microseconds; the other fields are microseconds since
+ * then, or -1 for phases the request never finished, such as TLS for plain
+ * HTTP. queued_microseconds is the time spent waiting for a free slot. */
+typedef struct {
+    int64_t started_at;
+    int64_t queued_microseconds;
+    int64_t dns_microseconds;
+    int64_t connect_microseconds;
+    int64_t tls_microseconds;
+    int64_t first_byte_microseconds;
+    int64_t total_microseconds;
+} http_timing_t;
+
+/* This tracks a single HTTP request. */
+struct http_request {
+    char *url;
+
+    /* These are valid once the callback has run. error is NULL on success;
+     * otherwise it points into error_buffer or to a static string. */
+    http_buffer_t body;
+    long status;
+    const char *error;
+    char error_buffer[CURL_ERROR_SIZE];
+    http_timing_t timing;
+
+    /* Set once the request has finished and been handed to the callback. */
+    int finished;
+
+    /* Internal state. */
+    http_engine_t *engine;
+    http_state_t *state;
+    CURL *easy;
+    http_request_callback callback;
+    void *callback_arg;
+    http_request_t *prev, *next;
+};
+
+/* The HTTP engine runs requests concurrently on a curl multi handle, whose
+ * sockets and timers are driven by a libevent event base. At most 'concurrency'
+ * requests run at once; the rest wait in a FIFO queue. Requests also wait
+ * there until the rate limiter lets them go. */
+struct http_engine {
+    struct event_base *base;
+    http_state_t *state;
+    CURLM *multi;
+    struct event *timer;
+    /* Fires when the rate limiter will let the next pending request go. */
+    struct event *pace;
+    int concurrency;
+    long timeout_ms;
+
+    /* Requests waiting for a free slot. */
+    http_request_t *pending_head, *pending_tail;
+    /* Requests attached to the multi handle. */
+    http_request_t *active;
+    int active_count;
+    /* Sockets curl has asked us to watch. */
+    struct http_socket *sockets;
+    /* The number of submitted requests whose callbacks have not run yet. */
+    int outstanding;
+};
+
+/* Initialize an HTTP engine.
+ *
+ * Arguments:
+ * - base is the event base on which we will run transfers.
+ * - state is the curl state from which to take easy handles, or NULL to
+ *   create a fresh handle for every request.
+ * - concurrency is the maximum number of requests running at once.
+ * - per_host is the maximum number of connections to a single host.
+ * - timeout_ms is the time limit for each request, including connecting.
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int http_engine_init(http_engine_t *engine,
+                     struct event_base *base,
+                     http_state_t *state,
+                     int concurrency,
+                     int per_host,
+                     long timeout_ms);
+
+/* Queue a GET request.
+ *
+ * Arguments:
+ * - url is the URL to fetch.
+ * - body_options says how to store the body, or NULL to keep all of it.
+ * - callback is called with callback_arg when the request finishes.
+ * Returns: the new request, or NULL if it could not be created. The callback
+ * won't run for requests that could not be created.
+ *
+ */
+http_request_t *http_engine_submit(http_engine_t *engine,
+                                   const char *url,
+                                   const http_body_options_t *body_options,
+                                   http_request_callback callback,
+                                   void *callback_arg);
+
+/* Run the event loop until every submitted request has finished.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int http_engine_run(http_engine_t *engine);
+
+/* Abandon every unfinished request without running its callback, and free the
+ * engine. */
+int http_engine_destroy(http_engine_t *engine);
+
+void http_request_free(http_request_t *request);
+
+/* Return the sandbox's curl state, creating it on first use.
+ *
+ * Returns: the state, which the sandbox owns, or NULL on failure.
+ *
+ */
+http_state_t *http_sandbox_state(sandbox_t *sandbox);
+
+/* Take an easy handle from the pool, or create one if the pool is empty. The
+ * handle is attached to the state's share object.
+ *
+ * Returns: the handle, or NULL on failure.
+ *
+ */
+CURL *http_acquire_handle(http_state_t *state);
+
+/* Reset an easy handle and return it to the pool. */
+void http_release_handle(http_state_t *state, CURL *handle);
+
+/* Free the pool and share object. sandbox_destroy calls this. */
+void http_state_free(http_state_t *state);
+
+/* Perform a GET request. Expects the sandbox as its first upvalue.
+ *
+ * Lua arguments:
+ * - url is the URL to fetch.
+ * - opts is an optional table with fields max_body_bytes, digest and
+ *   head_bytes.
+ * Lua returns:
+ * - the body, or in digest mode a table with fields sha256, length, head and
+ *   truncated; nil on error.
+ * - an error message, or nil if no errors occurred.
+ * - a table with the fields of http_timing_t that apply, also once a transfer
+ *   has failed.
+ *
+ */
 int l_http_get(lua_State *L);
 
+/* Fetch many URLs concurrently. Expects the sandbox as its first upvalue.
+ *
+ * Lua arguments:
+ * - urls is an array of URLs to fetch.
+ * - opts is an optional table with fields concurrency, per_host, timeout (in
+ *   seconds), max_body_bytes, digest and head_bytes.
+ * Lua returns:
+ * - a table mapping each URL to a table with fields status, truncated, error
+ *   and timing, plus either body or sha256, length and head in digest mode.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_http_get_batch(lua_State *L);
+
+/* Start a GET request like http_get without waiting for it. Expects the
+ * sandbox as its first upvalue.
+ *
+ * Lua arguments:
+ * - url and opts are as for http_get.
+ * Lua returns:
+ * - an operation id to wait for with async_wait, whose value and timing are
+ *   what http_get would return; nil on error.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_http_get_async(lua_State *L);
+
 #endif
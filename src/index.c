@@ -0,0 +1,278 @@
+#include "index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "util.h"
+
+#define INDEX_MAX_FIELDS 7
+
+/* Fields are separated by tabs and entries by newlines, so neither may
+ * appear in a field. */
+static int is_valid_field(const char *field) {
+    return field && field[0] && !strpbrk(field, "\t\n");
+}
+
+static char *index_path(const char *directory) {
+    char *path = sprintf_malloc("%s/%s", directory, INDEX_FILENAME);
+    if (!path) {
+        log_error("error allocating index name");
+    }
+    return path;
+}
+
+/* Return the index line for a segment, allocated with malloc, or NULL on
+ * failure. */
+static char *segment_line(const index_entry_t *entry) {
+    const char *run_id = entry->run_id ? entry->run_id : "-";
+    const char *experiment = entry->experiment ? entry->experiment : "-";
+    if (!is_valid_field(entry->segment)
+        || !is_valid_field(run_id)
+        || !is_valid_field(experiment)) {
+        log_error("can't index segment with an invalid name");
+        return NULL;
+    }
+    char *line = sprintf_malloc(
+            "segment\t%s\t%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%08" PRIx32 "\n",
+            entry->segment,
+            run_id,
+            experiment,
+            entry->offset,
+            entry->bytes,
+            entry->crc32);
+    if (!line) {
+        log_error("error allocating index entry");
+    }
+    return line;
+}
+
+/* Append a line to a directory's index with a single write, so lines from
+ * different processes never interleave. */
+static int append_line(const char *directory, const char *line) {
+    char *path = index_path(directory);
+    if (!path) {
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_error("error opening %s: %m", path);
+        free(path);
+        return -1;
+    }
+    size_t len = strlen(line);
+    ssize_t written;
+    do {
+        written = write(fd, line, len);
+    } while (written < 0 && errno == EINTR);
+    int rc = 0;
+    if (written != (ssize_t)len) {
+        log_error("error writing %s: %m", path);
+        rc = -1;
+    }
+    if (close(fd)) {
+        log_error("error closing %s: %m", path);
+        rc = -1;
+    }
+    free(path);
+    return rc;
+}
+
+int index_add_segment(const char *directory, const index_entry_t *entry) {
+    char *line = segment_line(entry);
+    if (!line) {
+        return -1;
+    }
+    int rc = append_line(directory, line);
+    free(line);
+    return rc;
+}
+
+int index_mark_uploaded(const char *directory, const char *segment) {
+    if (!is_valid_field(segment)) {
+        log_error("can't index segment with an invalid name");
+        return -1;
+    }
+    char *line = sprintf_malloc("uploaded\t%s\n", segment);
+    if (!line) {
+        log_error("error allocating index entry");
+        return -1;
+    }
+    int rc = append_line(directory, line);
+    free(line);
+    return rc;
+}
+
+const index_entry_t *index_find(const results_index_t *index,
+                                const char *segment) {
+    /* Search from the end, since a name reused after compaction belongs to
+     * the latest entry. */
+    for (size_t i = index->count; i > 0; --i) {
+        if (strcmp(index->entries[i - 1].segment, segment) == 0) {
+            return &index->entries[i - 1];
+        }
+    }
+    return NULL;
+}
+
+static void free_entry(index_entry_t *entry) {
+    free(entry->segment);
+    free(entry->run_id);
+    free(entry->experiment);
+}
+
+/* Add a segment line, already split into fields, to the index. */
+static int add_entry(results_index_t *index, char **fields) {
+    if (index->count == index->capacity) {
+        size_t capacity = index->capacity ? 2 * index->capacity : 16;
+        index_entry_t *entries = realloc(index->entries,
+                                         capacity * sizeof(index_entry_t));
+        if (!entries) {
+            log_error("realloc error: %m");
+            return -1;
+        }
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    index_entry_t *entry = &index->entries[index->count];
+    entry->segment = strdup(fields[1]);
+    entry->run_id = strdup(fields[2]);
+    entry->experiment = strdup(fields[3]);
+    entry->offset = strtoull(fields[4], NULL, 10);
+    entry->bytes = strtoull(fields[5], NULL, 10);
+    entry->crc32 = strtoul(fields[6], NULL, 16);
+    entry->uploaded = 0;
+    if (!entry->segment || !entry->run_id || !entry->experiment) {
+        log_error("strdup error: %m");
+        free_entry(entry);
+        return -1;
+    }
+    ++index->count;
+    return 0;
+}
+
+int index_load(results_index_t *index, const char *directory) {
+    index->entries = NULL;
+    index->count = index->capacity = 0;
+
+    char *path = index_path(directory);
+    if (!path) {
+        return -1;
+    }
+    FILE *file = fopen(path, "re");
+    if (!file) {
+        int rc = errno == ENOENT ? 0 : -1;
+        if (rc) {
+            log_error("error opening %s: %m", path);
+        }
+        free(path);
+        return rc;
+    }
+
+    int rc = 0;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, file)) >= 0) {
+        if (len == 0 || line[len - 1] != '\n') {
+            /* A writer was interrupted partway through this line. */
+            continue;
+        }
+        line[len - 1] = '\0';
+        char *fields[INDEX_MAX_FIELDS];
+        int count = 0;
+        for (char *field = line; field && count < INDEX_MAX_FIELDS; ++count) {
+            fields[count] = field;
+            field = strchr(field, '\t');
+            if (field) {
+                *field++ = '\0';
+            }
+        }
+        if (count == INDEX_MAX_FIELDS && strcmp(fields[0], "segment") == 0) {
+            if (add_entry(index, fields)) {
+                rc = -1;
+                break;
+            }
+        } else if (count == 2 && strcmp(fields[0], "uploaded") == 0) {
+            index_entry_t *entry =
+                (index_entry_t *)index_find(index, fields[1]);
+            if (entry) {
+                entry->uploaded = 1;
+            }
+        }
+    }
+    if (ferror(file)) {
+        log_error("error reading %s: %m", path);
+        rc = -1;
+    }
+    free(line);
+    fclose(file);
+    free(path);
+    if (rc) {
+        index_free(index);
+    }
+    return rc;
+}
+
+int index_compact(const char *directory) {
+    results_index_t index;
+    if (index_load(&index, directory)) {
+        return -1;
+    }
+    char *path = index_path(directory);
+    char *temporary = sprintf_malloc("%s/%s.new", directory, INDEX_FILENAME);
+    if (!path || !temporary) {
+        log_error("error allocating index name");
+        free(path);
+        free(temporary);
+        index_free(&index);
+        return -1;
+    }
+
+    int rc = 0;
+    FILE *file = fopen(temporary, "we");
+    if (!file) {
+        log_error("error opening %s: %m", temporary);
+        rc = -1;
+    } else {
+        for (size_t i = 0; i < index.count && rc == 0; ++i) {
+            if (index.entries[i].uploaded) {
+                continue;
+            }
+            char *line = segment_line(&index.entries[i]);
+            if (!line || fputs(line, file) == EOF) {
+                rc = -1;
+            }
+            free(line);
+        }
+        if (fclose(file) || rc) {
+            log_error("error writing %s: %m", temporary);
+            rc = -1;
+        }
+        if (rc) {
+            unlink(temporary);
+        } else if (rename(temporary, path)) {
+            log_error("error renaming %s: %m", temporary);
+            unlink(temporary);
+            rc = -1;
+        }
+    }
+    free(path);
+    free(temporary);
+    index_free(&index);
+    return rc;
+}
+
+void index_free(results_index_t *index) {
+    for (size_t i = 0; i < index->count; ++i) {
+        free_entry(&index->entries[i]);
+    }
+    free(index->entries);
+    index->entries = NULL;
+    index->count = index->capacity = 0;
+}
@@ -0,0 +1,80 @@
+#ifndef CENSORSCOPE_INDEX_H
+#define CENSORSCOPE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Every directory that results writers close segments in keeps an index of
+ * them in this file. */
+#define INDEX_FILENAME ".index"
+
+/* The results index records every closed segment along with the run that
+ * wrote it and whether it has been uploaded, so uploads can send exactly the
+ * segments the server hasn't seen and tell it which part of which run each
+ * one holds. The index is an append-only log of tab-separated lines, one per
+ * event, so writers in different processes can add to it with a single
+ * write each and never rewrite what others wrote:
+ *
+ *   segment <name> <run id> <experiment> <offset> <bytes> <crc32>
+ *   uploaded <name>
+ *
+ * offset is where the segment starts within all of its run's results and
+ * crc32 is the checksum of its contents, in hex. index_compact drops the
+ * segments that have been uploaded once nothing else is writing. */
+typedef struct {
+    /* The segment's file name, without its directory. */
+    char *segment;
+    char *run_id;
+    char *experiment;
+    uint64_t offset;
+    uint64_t bytes;
+    uint32_t crc32;
+    int uploaded;
+} index_entry_t;
+
+typedef struct {
+    index_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} results_index_t;
+
+/* Record a closed segment in a directory's index.
+ *
+ * Arguments:
+ * - directory is the directory that holds the segment.
+ * - entry describes the segment. Its uploaded field is ignored.
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int index_add_segment(const char *directory, const index_entry_t *entry);
+
+/* Record that a segment in a directory's index was uploaded.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int index_mark_uploaded(const char *directory, const char *segment);
+
+/* Read a directory's index. A directory without one has an empty index.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int index_load(results_index_t *index, const char *directory);
+
+/* Return the entry for a segment, or NULL if the index doesn't have it. */
+const index_entry_t *index_find(const results_index_t *index,
+                                const char *segment);
+
+/* Rewrite a directory's index without the segments that were uploaded. Call
+ * it only while nothing else writes to the index, since an entry added during
+ * the rewrite would be lost.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int index_compact(const char *directory);
+
+void index_free(results_index_t *index);
+
+#endif
@@ -0,0 +1,282 @@
+#include "inprocess.h"
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <event2/event.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "async.h"
+#include "experiment.h"
+#include "logging.h"
+#include "sandbox.h"
+#include "trace.h"
+#include "util.h"
+
+typedef struct inprocess_run {
+    experiment_t experiment;
+    sandbox_t sandbox;
+    char run_id[EXPERIMENT_RUN_ID_SIZE];
+    /* The coroutine the script runs in, and the reference that keeps it from
+     * being collected. */
+    lua_State *thread;
+    int thread_ref;
+    /* Resumes the suspended script once an operation finishes or the
+     * sandbox's deadline passes. */
+    struct event *wake;
+    /* Abandons the run at the experiment timeout. */
+    struct event *kill;
+    int64_t started_at;
+    run_result_t result;
+    inprocess_done_callback done;
+    void *done_arg, *run_arg;
+    struct inprocess_run *prev, *next;
+} inprocess_run_t;
+
+/* Every run in progress, so they can be abandoned at exit. */
+static inprocess_run_t *runs = NULL;
+
+static int64_t timeval_microseconds(const struct timeval *tv) {
+    return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static void free_run(inprocess_run_t *run) {
+    if (run->prev) {
+        run->prev->next = run->next;
+    } else if (runs == run) {
+        runs = run->next;
+    }
+    if (run->next) {
+        run->next->prev = run->prev;
+    }
+    if (run->wake) {
+        event_free(run->wake);
+    }
+    if (run->kill) {
+        event_free(run->kill);
+    }
+    /* Closing the state frees the coroutine too. */
+    sandbox_destroy(&run->sandbox);
+    experiment_destroy(&run->experiment);
+    free(run);
+}
+
+/* Clean up after a run and tell the scheduler how it went. */
+static void finish_run(inprocess_run_t *run, int succeeded) {
+    int64_t now = monotonic_microseconds();
+    trace_span("script", run->experiment.name, run->started_at, now);
+    run->result.succeeded = succeeded && !run->result.timed_out;
+    run->result.wall_microseconds = now - run->started_at;
+    /* The closest thing to a child's peak RSS is what its Lua state
+     * reserved. */
+    run->result.max_rss_kilobytes = run->sandbox.arena.peak_reserved / 1024;
+    if (experiment_finish_run(&run->experiment, &run->sandbox)) {
+        run->result.succeeded = 0;
+    }
+
+    run_result_t result = run->result;
+    inprocess_done_callback done = run->done;
+    void *done_arg = run->done_arg, *run_arg = run->run_arg;
+    free_run(run);
+    done(done_arg, run_arg, &result);
+}
+
+/* Wait for the wake event, which async_op_finish triggers early. */
+static int arm_wake(inprocess_run_t *run) {
+    int64_t remaining = sandbox_time_remaining(&run->sandbox);
+    if (remaining == INT64_MAX) {
+        return 0;
+    }
+    struct timeval timeout = { remaining / 1000000, remaining % 1000000 };
+    if (evtimer_add(run->wake, &timeout)) {
+        log_error("error scheduling wake up for '%s'", run->experiment.name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Run the script until it finishes or is suspended again, passing it the top
+ * nargs values of its stack, and count the CPU time it used. */
+static void resume_run(inprocess_run_t *run, int nargs) {
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    int status = lua_resume(run->thread, nargs);
+    getrusage(RUSAGE_SELF, &after);
+    run->result.user_microseconds += timeval_microseconds(&after.ru_utime)
+                                   - timeval_microseconds(&before.ru_utime);
+    run->result.system_microseconds += timeval_microseconds(&after.ru_stime)
+                                     - timeval_microseconds(&before.ru_stime);
+
+    if (status == LUA_YIELD && run->sandbox.suspended) {
+        if (arm_wake(run)) {
+            finish_run(run, 0);
+        }
+        return;
+    }
+    if (status == LUA_YIELD) {
+        log_error("error running %s: yielded outside async_wait",
+                  run->experiment.path);
+    } else if (status != 0) {
+        log_error("error running %s: %s",
+                  run->experiment.path,
+                  lua_tostring(run->thread, -1));
+    }
+    finish_run(run, status == 0);
+}
+
+/* These push what async_wait returns onto the suspended coroutine. They run
+ * in protected mode on the main state, since an allocation that failed on
+ * the coroutine, outside of any pcall, would abort the whole process.
+ * async_wait leaves the coroutine room for the two values. */
+
+static int push_finished(lua_State *L) {
+    inprocess_run_t *run = lua_touserdata(L, 1);
+    async_push_finished(L, run->sandbox.async);
+    lua_xmove(L, run->thread, 2);
+    return 0;
+}
+
+static int push_deadline_error(lua_State *L) {
+    inprocess_run_t *run = lua_touserdata(L, 1);
+    sandbox_push_deadline_error(L);
+    lua_xmove(L, run->thread, 2);
+    return 0;
+}
+
+static void on_wake(evutil_socket_t fd, short what, void *arg) {
+    inprocess_run_t *run = arg;
+    sandbox_t *sandbox = &run->sandbox;
+    if (!sandbox->suspended) {
+        /* An operation finished while the script was still running; it
+         * collects the result itself. */
+        return;
+    }
+    lua_CFunction push;
+    if (sandbox->async && sandbox->async->done_head) {
+        push = push_finished;
+    } else if (sandbox_time_remaining(sandbox) == 0) {
+        push = push_deadline_error;
+    } else {
+        /* Woken by an operation the script had already collected. */
+        if (arm_wake(run)) {
+            finish_run(run, 0);
+        }
+        return;
+    }
+    sandbox->suspended = 0;
+    if (lua_cpcall(sandbox->L, push, run)) {
+        log_error("error resuming '%s': %s",
+                  run->experiment.name,
+                  lua_tostring(sandbox->L, -1));
+        finish_run(run, 0);
+        return;
+    }
+    resume_run(run, 2);
+}
+
+static void on_kill(evutil_socket_t fd, short what, void *arg) {
+    inprocess_run_t *run = arg;
+    log_error("in-process run of '%s' timed out", run->experiment.name);
+    run->result.timed_out = 1;
+    finish_run(run, 0);
+}
+
+static void wake_run(void *arg) {
+    inprocess_run_t *run = arg;
+    /* Resume from the event loop rather than inside the engine's callback,
+     * which the script could otherwise free from under it. */
+    event_active(run->wake, EV_TIMEOUT, 1);
+}
+
+int inprocess_start(const experiment_t *experiment,
+                    struct event_base *base,
+                    inprocess_done_callback done,
+                    void *arg,
+                    void *run_arg) {
+    inprocess_run_t *run = calloc(1, sizeof(inprocess_run_t));
+    if (!run) {
+        log_error("calloc error: %m");
+        return -1;
+    }
+    run->thread_ref = LUA_NOREF;
+    run->done = done;
+    run->done_arg = arg;
+    run->run_arg = run_arg;
+    if (experiment_init(&run->experiment,
+                        experiment->name,
+                        experiment->options)) {
+        experiment_destroy(&run->experiment);
+        free(run);
+        return -1;
+    }
+    const censorscope_options_t *options = run->experiment.options;
+
+    int64_t init_start = monotonic_microseconds();
+    sandbox_t *sandbox = &run->sandbox;
+    if (experiment_sandbox_init(sandbox,
+                                run->experiment.name,
+                                run->experiment.options)) {
+        log_error("error initializing sandbox for '%s'",
+                  run->experiment.path);
+        experiment_destroy(&run->experiment);
+        free(run);
+        return -1;
+    }
+    trace_span("sandbox_init",
+               run->experiment.name,
+               init_start,
+               monotonic_microseconds());
+    sandbox->async_base = base;
+    sandbox->async_wake = wake_run;
+    sandbox->async_wake_arg = run;
+    run->wake = evtimer_new(base, on_wake, run);
+    run->kill = evtimer_new(base, on_kill, run);
+    struct timeval timeout = { options->experiment_timeout_seconds, 0 };
+    if (!run->wake
+        || !run->kill
+        || (timeout.tv_sec > 0 && evtimer_add(run->kill, &timeout))) {
+        log_error("error scheduling timeout for '%s'", run->experiment.name);
+        free_run(run);
+        return -1;
+    }
+
+    run->next = runs;
+    if (runs) {
+        runs->prev = run;
+    }
+    runs = run;
+
+    /* From here on, failures count as failed runs, like a child that
+     * exits with an error. */
+    run->started_at = monotonic_microseconds();
+    experiment_start_run(&run->experiment, sandbox, run->run_id);
+    sandbox_set_time_limit(sandbox,
+                           options,
+                           options->experiment_timeout_seconds);
+    if (sandbox_load(sandbox,
+                     run->experiment.path,
+                     sandbox->environment_path)) {
+        log_error("error running '%s'", run->experiment.path);
+        finish_run(run, 0);
+        return 0;
+    }
+    /* The coroutine inherits the hook sandbox_set_time_limit installed. */
+    run->thread = lua_newthread(sandbox->L);
+    run->thread_ref = luaL_ref(sandbox->L, LUA_REGISTRYINDEX);
+    lua_xmove(sandbox->L, run->thread, 1);
+    sandbox->run_thread = run->thread;
+    resume_run(run, 0);
+    return 0;
+}
+
+void inprocess_abort_all(void) {
+    while (runs) {
+        inprocess_run_t *run = runs;
+        log_info("abandoning in-process run of '%s'", run->experiment.name);
+        experiment_finish_run(&run->experiment, &run->sandbox);
+        free_run(run);
+    }
+}
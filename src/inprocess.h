@@ -0,0 +1,57 @@
+#ifndef CENSORSCOPE_INPROCESS_H
+#define CENSORSCOPE_INPROCESS_H
+
+#include "experiment.h"
+#include "metrics.h"
+
+struct event_base;
+
+/* Trusted experiments can run inside the scheduler's process instead of a
+ * child, which saves the fork, the copied page tables and a new interpreter
+ * for frequent experiments that do little. Each run still gets a fresh
+ * sandbox, so runs share no Lua state. The script runs as a coroutine on the
+ * scheduler's event loop and is suspended whenever it waits for its
+ * asynchronous operations, as wait_all does, so the scheduler and other runs
+ * carry on in the meantime.
+ *
+ * We can't kill a run that shares our process, so its limits are enforced
+ * from inside:
+ * - memory by the sandbox's arena, within options->max_memory;
+ * - computation by an instruction hook that also watches the clock, and
+ *   aborts a script still computing at the experiment timeout;
+ * - waiting by the primitives' deadline, and a timer that abandons a run
+ *   still suspended at the experiment timeout.
+ * The blocking primitives, batches and ttl_probe still work, but stall the
+ * scheduler while they wait, and the interpreter is no security boundary, so
+ * only experiments we trust should run this way. */
+
+/* Called when a run finishes, with the arguments passed to inprocess_start
+ * and how the run went. */
+typedef void (*inprocess_done_callback)(void *arg,
+                                        void *run_arg,
+                                        const run_result_t *result);
+
+/* Start a run of an experiment inside this process.
+ *
+ * Arguments:
+ * - experiment is the experiment to run. The run keeps its own copy, so the
+ *   experiment may be freed while the run is in progress.
+ * - base is the scheduler's event base, on which the run's operations and
+ *   timers run.
+ * - done is called with arg, run_arg and the run's result once it finishes,
+ *   fails or times out. This may happen before inprocess_start returns.
+ * Returns: 0 if the run started, or -1 if it couldn't, in which case done is
+ * never called.
+ *
+ */
+int inprocess_start(const experiment_t *experiment,
+                    struct event_base *base,
+                    inprocess_done_callback done,
+                    void *arg,
+                    void *run_arg);
+
+/* Abandon every run in progress, keeping the results they wrote, without
+ * calling their callbacks. Call this before freeing the event base. */
+void inprocess_abort_all(void);
+
+#endif
@@ -1,64 +1,227 @@
 #include "logging.h"
 
+#include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <syslog.h>
 #include <time.h>
+#include <unistd.h>
 
 #ifndef LOGGING_IDENT
 #define LOGGING_IDENT "censorscope"
 #endif
 
+/* The buffer holds formatted stderr lines, which we write with one call per
+ * flush. Each message is truncated to LOGGING_MAX_MESSAGE bytes. */
+#define LOGGING_BUFFER_SIZE 16384
+#define LOGGING_MAX_RECORDS 256
+#define LOGGING_MAX_MESSAGE 1024
+
+/* The number of call sites log_site_allowed tracks at once. A site that
+ * collides with another takes over its slot. */
+#define LOGGING_SITES 64
+#define LOGGING_SITE_NAME_SIZE 64
+
+int logging_level = LOGGING_MAX_LEVEL;
+
+/* A buffered message. The syslog message is the stderr line without its
+ * prefix and newline. */
+typedef struct {
+    int level;
+    size_t offset;
+    size_t prefix_len;
+    size_t message_len;
+} log_record_t;
+
+static struct {
+    char text[LOGGING_BUFFER_SIZE];
+    size_t used;
+    log_record_t records[LOGGING_MAX_RECORDS];
+    int count;
+    /* When the oldest buffered message was logged. */
+    time_t oldest;
+} buffer;
+
+/* The timestamp for the current second, formatted once. */
+static time_t stamp_time = -1;
+static char stamp[20];
+
+typedef struct {
+    uint32_t hash;
+    char source[LOGGING_SITE_NAME_SIZE];
+    int line;
+    time_t second;
+    int count;
+    int dropped;
+} log_site_t;
+
+static log_site_t sites[LOGGING_SITES];
+
+static const char *level_names[] = { "ERROR", "INFO", "DEBUG" };
+static const int syslog_priorities[] = { LOG_ERR, LOG_INFO, LOG_DEBUG };
+
 void logging_init() {
     openlog(LOGGING_IDENT, LOG_CONS, LOG_USER);
+    /* Children exit without returning from main, so flush from atexit. */
+    atexit(logging_flush);
 }
 
 void logging_destroy() {
+    logging_flush();
     closelog();
 }
 
-static void common_log(int level, const char *format, va_list args) {
-    va_list args_copy;
-    va_copy(args_copy, args);
-
-    vsyslog(level, format, args);
-
-    char buf[20];
-    time_t now = time(0);
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    fprintf(stderr, "[%s] ", buf);
-    switch(level) {
-    case LOG_INFO:
-        fprintf(stderr, "(INFO) ");
-        break;
-    case LOG_DEBUG:
-        fprintf(stderr, "(DEBUG) ");
-        break;
-    case LOG_ERR:
-        fprintf(stderr, "(ERROR) ");
-        break;
+void logging_set_level(int level) {
+    logging_level = level;
+}
+
+int logging_parse_level(const char *name, int *level) {
+    for (int i = 0; i <= LOGGING_DEBUG; ++i) {
+        if (strcasecmp(name, level_names[i]) == 0) {
+            *level = i;
+            return 0;
+        }
     }
-    vfprintf(stderr, format, args_copy);
-    fprintf(stderr, "\n");
+    return -1;
 }
 
-void log_debug(const char *format, ...) {
-    va_list ap;
-    va_start(ap, format);
-    common_log(LOG_DEBUG, format, ap);
-    va_end(ap);
+void logging_flush() {
+    if (buffer.count == 0) {
+        return;
+    }
+    int saved_errno = errno;
+
+    size_t written = 0;
+    while (written < buffer.used) {
+        ssize_t rc = write(STDERR_FILENO,
+                           buffer.text + written,
+                           buffer.used - written);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        } else if (rc <= 0) {
+            break;
+        }
+        written += rc;
+    }
+
+    for (int i = 0; i < buffer.count; ++i) {
+        const log_record_t *record = &buffer.records[i];
+        syslog(syslog_priorities[record->level],
+               "%.*s",
+               (int)record->message_len,
+               buffer.text + record->offset + record->prefix_len);
+    }
+
+    buffer.used = 0;
+    buffer.count = 0;
+    errno = saved_errno;
 }
 
-void log_info(const char *format, ...) {
+void log_write(int level, const char *format, ...) {
+    /* Formats may use %m, so keep errno from the caller. */
+    int saved_errno = errno;
+
+    time_t now = time(NULL);
+    if (buffer.count > 0
+        && now - buffer.oldest >= LOGGING_FLUSH_INTERVAL_SECONDS) {
+        logging_flush();
+    }
+    if (buffer.count == LOGGING_MAX_RECORDS
+        || LOGGING_BUFFER_SIZE - buffer.used < LOGGING_MAX_MESSAGE) {
+        logging_flush();
+    }
+    if (now != stamp_time) {
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        stamp_time = now;
+    }
+
+    log_record_t *record = &buffer.records[buffer.count];
+    char *start = buffer.text + buffer.used;
+    /* Leave room for the newline. */
+    size_t room = LOGGING_MAX_MESSAGE - 1;
+    int prefix_len = snprintf(start,
+                              room,
+                              "[%s] (%s) ",
+                              stamp,
+                              level_names[level]);
+    room -= prefix_len;
+
+    errno = saved_errno;
     va_list ap;
     va_start(ap, format);
-    common_log(LOG_INFO, format, ap);
+    int message_len = vsnprintf(start + prefix_len, room, format, ap);
     va_end(ap);
+    if (message_len < 0) {
+        message_len = 0;
+    } else if ((size_t)message_len >= room) {
+        message_len = room - 1;
+    }
+    start[prefix_len + message_len] = '\n';
+
+    record->level = level;
+    record->offset = buffer.used;
+    record->prefix_len = prefix_len;
+    record->message_len = message_len;
+    if (buffer.count == 0) {
+        buffer.oldest = now;
+    }
+    ++buffer.count;
+    buffer.used += prefix_len + message_len + 1;
+
+    /* Don't sit on errors, in case we're about to crash. */
+    if (level == LOGGING_ERROR) {
+        logging_flush();
+    }
+    errno = saved_errno;
 }
 
-void log_error(const char *format, ...) {
-    va_list ap;
-    va_start(ap, format);
-    common_log(LOG_ERR, format, ap);
-    va_end(ap);
+static uint32_t site_hash(const char *source, int line) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = source; *c; ++c) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return (hash ^ (uint32_t)line) * 16777619u;
+}
+
+/* Report how many messages a site dropped during its last second. */
+static void report_dropped(log_site_t *site) {
+    if (site->dropped > 0) {
+        log_info("dropped %d messages from %s:%d",
+                 site->dropped,
+                 site->source,
+                 site->line);
+    }
+    site->dropped = 0;
+}
+
+int log_site_allowed(const char *source, int line) {
+    uint32_t hash = site_hash(source, line);
+    log_site_t *site = &sites[hash % LOGGING_SITES];
+    time_t now = time(NULL);
+
+    if (site->hash != hash
+        || site->line != line
+        || strncmp(site->source, source, LOGGING_SITE_NAME_SIZE - 1) != 0) {
+        report_dropped(site);
+        site->hash = hash;
+        site->line = line;
+        snprintf(site->source, sizeof(site->source), "%s", source);
+        site->second = now;
+        site->count = 0;
+    } else if (site->second != now) {
+        report_dropped(site);
+        site->second = now;
+        site->count = 0;
+    }
+
+    if (site->count < LOGGING_SITE_BURST) {
+        ++site->count;
+        return 1;
+    }
+    ++site->dropped;
+    return 0;
 }
@@ -1,15 +1,82 @@
 #ifndef CENSORSCOPE_LOGGING_H
 #define CENSORSCOPE_LOGGING_H
 
+/* Log levels, from most to least important. */
+#define LOGGING_ERROR 0
+#define LOGGING_INFO 1
+#define LOGGING_DEBUG 2
+
+/* Messages above this level are compiled out, so neither they nor their
+ * arguments cost anything. Build with -DLOGGING_MAX_LEVEL=LOGGING_INFO for
+ * devices that never need debug logs. */
+#ifndef LOGGING_MAX_LEVEL
+#define LOGGING_MAX_LEVEL LOGGING_DEBUG
+#endif
+
+/* Buffered messages are written out once the oldest is this many seconds old,
+ * so callers with an event loop should call logging_flush at least this
+ * often. */
+#define LOGGING_FLUSH_INTERVAL_SECONDS 1
+
+/* log_site_allowed lets this many messages from each call site through per
+ * second. */
+#define LOGGING_SITE_BURST 10
+
+/* Messages above this level are dropped at runtime. */
+extern int logging_level;
+
 /* Call this function before using log_debug, log_info, or log_error. */
 void logging_init();
 
+/* Flush buffered messages and close the connection to syslog. */
 void logging_destroy();
 
-void log_debug(const char *format, ...);
+/* Set the runtime log level to LOGGING_ERROR, LOGGING_INFO or LOGGING_DEBUG. */
+void logging_set_level(int level);
+
+/* Parse "error", "info" or "debug" into a log level.
+ *
+ * Returns: 0 on success, -1 if the name is not a log level.
+ *
+ */
+int logging_parse_level(const char *name, int *level);
+
+/* Write buffered messages to stderr and syslog.
+ *
+ * Messages are buffered and written in batches: when the buffer fills, when
+ * the oldest message is LOGGING_FLUSH_INTERVAL_SECONDS old, when an error is
+ * logged, before forking and at exit. */
+void logging_flush();
+
+/* Decide whether to log another message from a call site, such as a line of
+ * a Lua script, allowing LOGGING_SITE_BURST messages per site per second.
+ * When a site's second is over, we log how many of its messages were
+ * dropped.
+ *
+ * Returns: 1 if the message should be logged, 0 if it should be dropped.
+ *
+ */
+int log_site_allowed(const char *source, int line);
+
+/* Format and buffer a message at the given level. Use the log_* macros
+ * instead, which skip disabled levels without evaluating their arguments. */
+void log_write(int level, const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+#define logging_enabled(level) \
+    ((level) <= LOGGING_MAX_LEVEL && (level) <= logging_level)
+
+#define log_at(level, ...) \
+    do { \
+        if (logging_enabled(level)) { \
+            log_write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define log_debug(...) log_at(LOGGING_DEBUG, __VA_ARGS__)
 
-void log_info(const char *format, ...);
+#define log_info(...) log_at(LOGGING_INFO, __VA_ARGS__)
 
-void log_error(const char *format, ...);
+#define log_error(...) log_at(LOGGING_ERROR, __VA_ARGS__)
 
 #endif
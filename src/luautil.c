@@ -0,0 +1,133 @@
+#include "luautil.h"
+
+#include "lua.h"
+#include "lauxlib.h"
+
+/* Push the field onto the stack, or return 0 and push nothing if the options
+ * table or the field is missing. */
+static int push_field(lua_State *L, int table_index, const char *key) {
+    if (lua_isnoneornil(L, table_index)) {
+        return 0;
+    }
+    luaL_checktype(L, table_index, LUA_TTABLE);
+    lua_getfield(L, table_index, key);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    return 1;
+}
+
+lua_Number optfield_number(lua_State *L,
+                           int table_index,
+                           const char *key,
+                           lua_Number default_value) {
+    if (!push_field(L, table_index, key)) {
+        return default_value;
+    }
+    if (!lua_isnumber(L, -1)) {
+        return luaL_error(L, "option '%s' must be a number", key);
+    }
+    lua_Number value = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return value;
+}
+
+lua_Integer optfield_integer(lua_State *L,
+                             int table_index,
+                             const char *key,
+                             lua_Integer default_value) {
+    if (!push_field(L, table_index, key)) {
+        return default_value;
+    }
+    if (!lua_isnumber(L, -1)) {
+        return luaL_error(L, "option '%s' must be an integer", key);
+    }
+    lua_Integer value = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return value;
+}
+
+int optfield_boolean(lua_State *L,
+                     int table_index,
+                     const char *key,
+                     int default_value) {
+    if (!push_field(L, table_index, key)) {
+        return default_value;
+    }
+    int value = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return value;
+}
+
+const char *optfield_string(lua_State *L,
+                            int table_index,
+                            const char *key,
+                            const char *default_value) {
+    if (!push_field(L, table_index, key)) {
+        return default_value;
+    }
+    if (lua_type(L, -1) != LUA_TSTRING) {
+        luaL_error(L, "option '%s' must be a string", key);
+        return NULL;
+    }
+    /* The string stays alive because it is still referenced by the options
+     * table, so it's safe to pop it. */
+    const char *value = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    return value;
+}
+
+static int absolute_index(lua_State *L, int index) {
+    if (index > 0 || index <= LUA_REGISTRYINDEX) {
+        return index;
+    }
+    return lua_gettop(L) + index + 1;
+}
+
+static int is_plain_key(lua_State *L, int index) {
+    int type = lua_type(L, index);
+    return type == LUA_TSTRING || type == LUA_TNUMBER || type == LUA_TBOOLEAN;
+}
+
+int is_plain_data(lua_State *L, int index, int max_depth) {
+    index = absolute_index(L, index);
+    if (is_plain_key(L, index)) {
+        return 1;
+    }
+    if (lua_type(L, index) != LUA_TTABLE || max_depth <= 0) {
+        return 0;
+    }
+    if (lua_getmetatable(L, index)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    luaL_checkstack(L, 3, "data nested too deeply");
+    lua_pushnil(L);  /* first key */
+    while (lua_next(L, index) != 0) {
+        if (!is_plain_key(L, -2) || !is_plain_data(L, -1, max_depth - 1)) {
+            lua_pop(L, 2);  /* Pop value and key. */
+            return 0;
+        }
+        lua_pop(L, 1);  /* Pop value. Leave key for lua_next. */
+    }
+    return 1;
+}
+
+void copy_plain_data(lua_State *L, int index) {
+    index = absolute_index(L, index);
+    if (lua_type(L, index) != LUA_TTABLE) {
+        lua_pushvalue(L, index);
+        return;
+    }
+    luaL_checkstack(L, 4, "data nested too deeply");
+    lua_newtable(L);
+    int copy = lua_gettop(L);
+    lua_pushnil(L);  /* first key */
+    while (lua_next(L, index) != 0) {
+        lua_pushvalue(L, -2);
+        copy_plain_data(L, -2);
+        lua_rawset(L, copy);
+        lua_pop(L, 1);  /* Pop value. Leave key for lua_next. */
+    }
+}
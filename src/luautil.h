@@ -0,0 +1,52 @@
+#ifndef CENSORSCOPE_LUAUTIL_H
+#define CENSORSCOPE_LUAUTIL_H
+
+#include "lua.h"
+
+/* Helpers for reading optional fields out of an options table passed to a
+ * primitive, e.g. dns_lookup_batch(domains, resolver, { window = 64 }).
+ *
+ * Arguments:
+ * - L is a Lua state.
+ * - table_index is the stack position of the options table. If that position
+ *   is nil or none, every field takes its default value.
+ * - key is the name of the field to look up.
+ * - default_value is returned if the field is absent or nil.
+ * Returns: the value of the field. Raises a Lua error if the field has the
+ * wrong type.
+ *
+ */
+lua_Number optfield_number(lua_State *L,
+                           int table_index,
+                           const char *key,
+                           lua_Number default_value);
+
+lua_Integer optfield_integer(lua_State *L,
+                             int table_index,
+                             const char *key,
+                             lua_Integer default_value);
+
+int optfield_boolean(lua_State *L,
+                     int table_index,
+                     const char *key,
+                     int default_value);
+
+/* Like the above, but the returned string is only valid while the options
+ * table is on the stack. */
+const char *optfield_string(lua_State *L,
+                            int table_index,
+                            const char *key,
+                            const char *default_value);
+
+/* Test whether the value at index is plain data: a string, number or boolean,
+ * or a table without a metatable whose keys are strings, numbers or booleans
+ * and whose values are plain data, nested at most max_depth tables deep.
+ * Tables that contain themselves are never plain data.
+ *
+ */
+int is_plain_data(lua_State *L, int index, int max_depth);
+
+/* Push a deep copy of the plain data at index. */
+void copy_plain_data(lua_State *L, int index);
+
+#endif
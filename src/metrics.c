@@ -0,0 +1,187 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <event2/event.h>
+
+#include "logging.h"
+#include "options.h"
+#include "serialize.h"
+#include "util.h"
+
+static int64_t timeval_microseconds(const struct timeval *tv) {
+    return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static void metrics_callback(evutil_socket_t fd, short what, void *arg) {
+    metrics_t *metrics = arg;
+    metrics_write(metrics);
+    struct timeval interval = { metrics->options->metrics_interval_seconds, 0 };
+    if (event_add(metrics->timer, &interval)) {
+        log_error("error scheduling metrics");
+    }
+}
+
+int metrics_init(metrics_t *metrics,
+                 const censorscope_options_t *options,
+                 struct event_base *base) {
+    metrics->options = options;
+    metrics->stats = NULL;
+    metrics->timer = NULL;
+    if (options->metrics_file[0] == '\0'
+        || options->metrics_interval_seconds <= 0) {
+        return 0;
+    }
+    metrics->timer = evtimer_new(base, metrics_callback, metrics);
+    if (!metrics->timer) {
+        log_error("error creating metrics event");
+        return -1;
+    }
+    struct timeval interval = { options->metrics_interval_seconds, 0 };
+    if (event_add(metrics->timer, &interval)) {
+        log_error("error scheduling metrics");
+        return -1;
+    }
+    return 0;
+}
+
+run_stats_t *metrics_stats(metrics_t *metrics, const char *name) {
+    for (run_stats_t *stats = metrics->stats; stats; stats = stats->next) {
+        if (strcmp(stats->name, name) == 0) {
+            return stats;
+        }
+    }
+    run_stats_t *stats = calloc(1, sizeof(run_stats_t));
+    if (!stats) {
+        log_error("calloc error: %m");
+        return NULL;
+    }
+    stats->name = strdup(name);
+    if (!stats->name) {
+        log_error("strdup error: %m");
+        free(stats);
+        return NULL;
+    }
+    stats->next = metrics->stats;
+    metrics->stats = stats;
+    return stats;
+}
+
+void metrics_record(run_stats_t *stats, const run_result_t *result) {
+    if (result->succeeded) {
+        ++stats->succeeded;
+    } else {
+        ++stats->failed;
+    }
+    if (result->timed_out) {
+        ++stats->timed_out;
+    }
+    stats->wall_microseconds += result->wall_microseconds;
+    if (result->wall_microseconds > stats->max_wall_microseconds) {
+        stats->max_wall_microseconds = result->wall_microseconds;
+    }
+    stats->user_microseconds += result->user_microseconds;
+    stats->system_microseconds += result->system_microseconds;
+    if (result->max_rss_kilobytes > stats->max_rss_kilobytes) {
+        stats->max_rss_kilobytes = result->max_rss_kilobytes;
+    }
+}
+
+void metrics_result_from_status(run_result_t *result,
+                                int status,
+                                const struct rusage *usage) {
+    result->succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    result->user_microseconds = timeval_microseconds(&usage->ru_utime);
+    result->system_microseconds = timeval_microseconds(&usage->ru_stime);
+    result->max_rss_kilobytes = usage->ru_maxrss;
+}
+
+int metrics_write(metrics_t *metrics) {
+    const char *path = metrics->options->metrics_file;
+    if (path[0] == '\0') {
+        return 0;
+    }
+    /* Write a new file and rename it over the old one, so readers never see
+     * a partial file. */
+    char *temporary = sprintf_malloc("%s.tmp", path);
+    if (!temporary) {
+        log_error("error allocating metrics filename");
+        return -1;
+    }
+    FILE *file = fopen(temporary, "w");
+    if (!file) {
+        log_error("error opening %s: %m", temporary);
+        free(temporary);
+        return -1;
+    }
+    fprintf(file, "{\"time\":%lld,\"experiments\":{", (long long)time(NULL));
+    serialize_buffer_t name;
+    serialize_buffer_init(&name);
+    int rc = 0;
+    for (run_stats_t *stats = metrics->stats; stats; stats = stats->next) {
+        name.len = 0;
+        if (serialize_json_string(&name, stats->name, strlen(stats->name))) {
+            log_error("error encoding experiment name");
+            rc = -1;
+            break;
+        }
+        fprintf(file,
+                "%s%.*s:{\"started\":%ld,\"succeeded\":%ld,\"failed\":%ld,"
+                "\"timed_out\":%ld,\"wall_microseconds\":%lld,"
+                "\"max_wall_microseconds\":%lld,\"user_microseconds\":%lld,"
+                "\"system_microseconds\":%lld,\"max_rss_kilobytes\":%ld}",
+                stats == metrics->stats ? "" : ",",
+                (int)name.len,
+                name.data,
+                stats->started,
+                stats->succeeded,
+                stats->failed,
+                stats->timed_out,
+                (long long)stats->wall_microseconds,
+                (long long)stats->max_wall_microseconds,
+                (long long)stats->user_microseconds,
+                (long long)stats->system_microseconds,
+                stats->max_rss_kilobytes);
+    }
+    serialize_buffer_free(&name);
+    fprintf(file, "}}\n");
+    if (fclose(file)) {
+        log_error("error writing %s: %m", temporary);
+        rc = -1;
+    }
+    if (rc) {
+        unlink(temporary);
+    } else if (rename(temporary, path)) {
+        log_error("error renaming %s: %m", temporary);
+        rc = -1;
+    }
+    free(temporary);
+    return rc;
+}
+
+void metrics_stop(metrics_t *metrics) {
+    if (metrics->timer && event_del(metrics->timer)) {
+        log_error("error removing metrics event");
+    }
+}
+
+int metrics_destroy(metrics_t *metrics) {
+    int rc = metrics_write(metrics);
+    if (metrics->timer) {
+        event_free(metrics->timer);
+        metrics->timer = NULL;
+    }
+    while (metrics->stats) {
+        run_stats_t *next = metrics->stats->next;
+        free(metrics->stats->name);
+        free(metrics->stats);
+        metrics->stats = next;
+    }
+    return rc;
+}
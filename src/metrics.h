@@ -0,0 +1,82 @@
+#ifndef CENSORSCOPE_METRICS_H
+#define CENSORSCOPE_METRICS_H
+
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include "options.h"
+
+struct event;
+struct event_base;
+
+/* How a single run of an experiment went. */
+typedef struct {
+    int succeeded;
+    /* Set if the run was killed for exceeding experiment_timeout_seconds. */
+    int timed_out;
+    int64_t wall_microseconds;
+    int64_t user_microseconds, system_microseconds;
+    /* The peak resident set size of the process that ran the experiment. */
+    long max_rss_kilobytes;
+} run_result_t;
+
+/* Totals for every run of one experiment. */
+typedef struct run_stats {
+    char *name;
+    long started, succeeded, failed, timed_out;
+    int64_t wall_microseconds, max_wall_microseconds;
+    int64_t user_microseconds, system_microseconds;
+    long max_rss_kilobytes;
+    struct run_stats *next;
+} run_stats_t;
+
+/* The scheduler keeps run statistics for each experiment by name, so they
+ * survive the experiment being reloaded, and writes them to
+ * options->metrics_file every options->metrics_interval_seconds. */
+typedef struct {
+    const censorscope_options_t *options;
+    run_stats_t *stats;
+    struct event *timer;
+} metrics_t;
+
+/* Initialize metrics and, if a metrics file and interval are set, start
+ * writing it periodically.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int metrics_init(metrics_t *metrics,
+                 const censorscope_options_t *options,
+                 struct event_base *base);
+
+/* Return the statistics for an experiment, creating them on first use.
+ *
+ * Returns: the statistics, which metrics owns, or NULL on failure.
+ *
+ */
+run_stats_t *metrics_stats(metrics_t *metrics, const char *name);
+
+/* Add a finished run to an experiment's statistics. */
+void metrics_record(run_stats_t *stats, const run_result_t *result);
+
+/* Fill in a run result from a wait status and the child's resource usage. */
+void metrics_result_from_status(run_result_t *result,
+                                int status,
+                                const struct rusage *usage);
+
+/* Replace the metrics file with the current statistics. Does nothing if
+ * there's no metrics file.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int metrics_write(metrics_t *metrics);
+
+/* Stop writing the metrics file periodically. */
+void metrics_stop(metrics_t *metrics);
+
+/* Write the metrics file one last time and free the statistics. */
+int metrics_destroy(metrics_t *metrics);
+
+#endif
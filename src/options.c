@@ -11,6 +11,7 @@
 #include "lualib.h"
 
 #include "logging.h"
+#include "results.h"
 #include "../ext/ini.h"
 
 #ifndef DEFAULT_SANDBOX_DIR
@@ -25,6 +26,66 @@
 #define DEFAULT_RESULTS_DIR "results"
 #endif
 
+#ifndef DEFAULT_RESULTS_FORMAT
+#define DEFAULT_RESULTS_FORMAT "text"
+#endif
+
+#ifndef DEFAULT_SEGMENT_MAX_BYTES
+#define DEFAULT_SEGMENT_MAX_BYTES 1048576
+#endif
+
+#ifndef DEFAULT_SEGMENT_MAX_AGE
+#define DEFAULT_SEGMENT_MAX_AGE 300
+#endif
+
+#ifndef DEFAULT_UPLOAD_INTERVAL
+#define DEFAULT_UPLOAD_INTERVAL 3600
+#endif
+
+#ifndef DEFAULT_SYNC_INTERVAL
+#define DEFAULT_SYNC_INTERVAL 0
+#endif
+
+#ifndef DEFAULT_JITTER
+#define DEFAULT_JITTER 0
+#endif
+
+#ifndef DEFAULT_METRICS_FILE
+#define DEFAULT_METRICS_FILE "metrics.json"
+#endif
+
+#ifndef DEFAULT_METRICS_INTERVAL
+#define DEFAULT_METRICS_INTERVAL 60
+#endif
+
+#ifndef DEFAULT_TRACE_FILE
+#define DEFAULT_TRACE_FILE ""
+#endif
+
+#ifndef DEFAULT_MAIN_CACHE
+#define DEFAULT_MAIN_CACHE "main.lua.good"
+#endif
+
+#ifndef DEFAULT_CACHE_WINDOW
+#define DEFAULT_CACHE_WINDOW 0
+#endif
+
+#ifndef DEFAULT_MAX_PACKETS_PER_SECOND
+#define DEFAULT_MAX_PACKETS_PER_SECOND 0
+#endif
+
+#ifndef DEFAULT_MAX_BYTES_PER_SECOND
+#define DEFAULT_MAX_BYTES_PER_SECOND 0
+#endif
+
+#ifndef DEFAULT_DESTINATION_PACKETS_PER_SECOND
+#define DEFAULT_DESTINATION_PACKETS_PER_SECOND 0
+#endif
+
+#ifndef DEFAULT_LOG_LEVEL
+#define DEFAULT_LOG_LEVEL "info"
+#endif
+
 #ifndef DEFAULT_MAX_MEMORY
 #define DEFAULT_MAX_MEMORY 0
 #endif
@@ -45,6 +106,22 @@
 #define DEFAULT_EXPERIMENT_TIMEOUT 60
 #endif
 
+#ifndef DEFAULT_MAX_CHILDREN
+#define DEFAULT_MAX_CHILDREN 0
+#endif
+
+#ifndef DEFAULT_WORKERS
+#define DEFAULT_WORKERS 0
+#endif
+
+#ifndef DEFAULT_WORKER_MAX_RUNS
+#define DEFAULT_WORKER_MAX_RUNS 100
+#endif
+
+#ifndef DEFAULT_WORKER_MAX_MEMORY_GROWTH
+#define DEFAULT_WORKER_MAX_MEMORY_GROWTH 0
+#endif
+
 #ifndef CONFIGURATION_PATH
 #define CONFIGURATION_PATH "censorscope.conf"
 #endif
@@ -52,27 +129,65 @@
 static void print_usage(const char *program) {
     const char *usage_string =
         "Usage: %s [options]\n"
+        "  -P --max-packets-per-second <count> (default: %d, 0 for no limit)\n"
+        "  -B --max-bytes-per-second <count> (default: %d, 0 for no limit)\n"
+        "  -D --destination-packets-per-second <count> (default: %d, 0 for no limit)\n"
+        "  -a --segment-max-age <seconds> (default: %d seconds)\n"
+        "  -b --segment-max-bytes <bytes> (default: %d)\n"
+        "  -c --max-children <count> (default: %d, for no limit)\n"
         "  -d --download-transport <transport> (default: \"%s\")\n"
+        "  -e --metrics-file <path> (default: \"%s\", \"\" for none)\n"
+        "  -f --results-format <text|ndjson|length-prefixed> (default: \"%s\")\n"
+        "  -g --worker-max-memory-growth <bytes> (default: %d)\n"
         "  -h --help\n"
         "  -i --max-instructions <instructions> (default: %ld)\n"
+        "  -j --jitter-seconds <seconds> (default: %d seconds)\n"
+        "  -k --worker-max-runs <runs> (default: %d)\n"
         "  -l --luasrc-dir <path> (default: \"%s\")\n"
         "  -m --max-memory <bytes> (default: %ld)\n"
+        "  -n --sync-interval <seconds> (default: %d, for startup only)\n"
+        "  -o --metrics-interval <seconds> (default: %d seconds, 0 for exit only)\n"
+        "  -p --upload-interval <seconds> (default: %d seconds, 0 for exit only)\n"
+        "  -q --main-cache <path> (default: \"%s\", \"\" for none)\n"
         "  -r --results-dir <path> (default: \"%s\")\n"
         "  -s --sandbox-dir <path> (default: \"%s\")\n"
         "  -t --experiment-timeout <seconds> (default: %d seconds)\n"
         "  -u --upload-transport <transport> (default: \"%s\")\n"
-        "  -y --synchronous (for debugging only)\n";
+        "  -v --log-level <error|info|debug> (default: \"%s\")\n"
+        "  -w --workers <count> (default: %d, to fork for every run)\n"
+        "  -x --trace-file <path> (default: \"%s\", \"\" for none)\n"
+        "  -y --synchronous (for debugging only)\n"
+        "  -z --cache-window <seconds> (default: %d seconds, 0 for no cache)\n";
     fprintf(stderr,
             usage_string,
             program,
+            DEFAULT_MAX_PACKETS_PER_SECOND,
+            DEFAULT_MAX_BYTES_PER_SECOND,
+            DEFAULT_DESTINATION_PACKETS_PER_SECOND,
+            DEFAULT_SEGMENT_MAX_AGE,
+            DEFAULT_SEGMENT_MAX_BYTES,
+            DEFAULT_MAX_CHILDREN,
             DEFAULT_DOWNLOAD_TRANSPORT,
+            DEFAULT_METRICS_FILE,
+            DEFAULT_RESULTS_FORMAT,
+            DEFAULT_WORKER_MAX_MEMORY_GROWTH,
             DEFAULT_MAX_INSTRUCTIONS,
+            DEFAULT_JITTER,
+            DEFAULT_WORKER_MAX_RUNS,
             DEFAULT_LUASRC_DIR,
             DEFAULT_MAX_MEMORY,
+            DEFAULT_SYNC_INTERVAL,
+            DEFAULT_METRICS_INTERVAL,
+            DEFAULT_UPLOAD_INTERVAL,
+            DEFAULT_MAIN_CACHE,
             DEFAULT_RESULTS_DIR,
             DEFAULT_SANDBOX_DIR,
             DEFAULT_EXPERIMENT_TIMEOUT,
-            DEFAULT_UPLOAD_TRANSPORT);
+            DEFAULT_UPLOAD_TRANSPORT,
+            DEFAULT_LOG_LEVEL,
+            DEFAULT_WORKERS,
+            DEFAULT_TRACE_FILE,
+            DEFAULT_CACHE_WINDOW);
 }
 
 static int config_file_handler(void *user, const char *section,
@@ -91,6 +206,15 @@ static int config_file_handler(void *user, const char *section,
         options->luasrc_dir = strdup(value);
     } else if (strcmp(name, "results-dir") == 0) {
         options->results_dir = strdup(value);
+    } else if (strcmp(name, "results-format") == 0) {
+        results_format_t format;
+        if (results_format_parse(value, &format)) {
+            log_error("invalid results format '%s'", value);
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        free(options->results_format);
+        options->results_format = strdup(value);
     } else if (strcmp(name, "max-memory") == 0) {
         options->max_memory = strtol(value, &first_invalid, 10);
         if (errno) {
@@ -133,6 +257,189 @@ static int config_file_handler(void *user, const char *section,
             censorscope_options_destroy(options);
             return 0;
         }
+    } else if (strcmp(name, "max-children") == 0) {
+        options->max_children = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->max_children < 0) {
+            log_error("invalid maximum number of children");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "workers") == 0) {
+        options->workers = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->workers < 0) {
+            log_error("invalid worker count");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "worker-max-runs") == 0) {
+        options->worker_max_runs = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->worker_max_runs < 1) {
+            log_error("invalid worker run limit");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "worker-max-memory-growth") == 0) {
+        options->worker_max_memory_growth = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0') {
+            log_error("invalid worker memory growth: not a number");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "segment-max-bytes") == 0) {
+        options->segment_max_bytes = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0') {
+            log_error("invalid segment size: not a number");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "segment-max-age-seconds") == 0) {
+        options->segment_max_age_seconds = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->segment_max_age_seconds < 0) {
+            log_error("invalid segment age");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "upload-interval-seconds") == 0) {
+        options->upload_interval_seconds = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->upload_interval_seconds < 0) {
+            log_error("invalid upload interval");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "sync-interval-seconds") == 0) {
+        options->sync_interval_seconds = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->sync_interval_seconds < 0) {
+            log_error("invalid sync interval");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "cache-window-seconds") == 0) {
+        options->cache_window_seconds = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->cache_window_seconds < 0) {
+            log_error("invalid cache window");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "max-packets-per-second") == 0) {
+        options->max_packets_per_second = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->max_packets_per_second < 0) {
+            log_error("invalid packet rate");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "max-bytes-per-second") == 0) {
+        options->max_bytes_per_second = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->max_bytes_per_second < 0) {
+            log_error("invalid byte rate");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "destination-packets-per-second") == 0) {
+        options->destination_packets_per_second = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->destination_packets_per_second < 0) {
+            log_error("invalid destination packet rate");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "jitter-seconds") == 0) {
+        options->jitter_seconds = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->jitter_seconds < 0) {
+            log_error("invalid jitter");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "metrics-file") == 0) {
+        free(options->metrics_file);
+        options->metrics_file = strdup(value);
+    } else if (strcmp(name, "metrics-interval-seconds") == 0) {
+        options->metrics_interval_seconds = strtol(value, &first_invalid, 10);
+        if (errno) {
+            log_error("strtol error: %m");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+        if (first_invalid[0] != '\0' || options->metrics_interval_seconds < 0) {
+            log_error("invalid metrics interval");
+            censorscope_options_destroy(options);
+            return 0;
+        }
+    } else if (strcmp(name, "trace-file") == 0) {
+        free(options->trace_file);
+        options->trace_file = strdup(value);
+    } else if (strcmp(name, "main-cache") == 0) {
+        free(options->main_cache);
+        options->main_cache = strdup(value);
+    } else if (strcmp(name, "log-level") == 0) {
+        if (logging_parse_level(value, &options->log_level)) {
+            log_error("invalid log level '%s'", value);
+            censorscope_options_destroy(options);
+            return 0;
+        }
     } else {
         log_error("invalid configuration option: '%s'", name);
         return 0;
@@ -187,10 +494,19 @@ static int set_default_options(censorscope_options_t *options) {
         log_error("strdup error: %m");
         return -1;
     }
+    options->results_format = strdup(DEFAULT_RESULTS_FORMAT);
+    if (!options->results_format) {
+        free(options->results_dir);
+        free(options->luasrc_dir);
+        free(options->sandbox_dir);
+        log_error("strdup error: %m");
+        return -1;
+    }
     options->max_memory = DEFAULT_MAX_MEMORY;
     options->max_instructions = DEFAULT_MAX_INSTRUCTIONS;
     options->download_transport = strdup(DEFAULT_DOWNLOAD_TRANSPORT);
     if (!options->download_transport) {
+        free(options->results_format);
         free(options->results_dir);
         free(options->luasrc_dir);
         free(options->sandbox_dir);
@@ -200,6 +516,43 @@ static int set_default_options(censorscope_options_t *options) {
     options->upload_transport = strdup(DEFAULT_UPLOAD_TRANSPORT);
     if (!options->upload_transport) {
         free(options->download_transport);
+        free(options->results_format);
+        free(options->results_dir);
+        free(options->luasrc_dir);
+        free(options->sandbox_dir);
+        log_error("strdup error: %m");
+        return -1;
+    }
+    options->metrics_file = strdup(DEFAULT_METRICS_FILE);
+    if (!options->metrics_file) {
+        free(options->upload_transport);
+        free(options->download_transport);
+        free(options->results_format);
+        free(options->results_dir);
+        free(options->luasrc_dir);
+        free(options->sandbox_dir);
+        log_error("strdup error: %m");
+        return -1;
+    }
+    options->trace_file = strdup(DEFAULT_TRACE_FILE);
+    if (!options->trace_file) {
+        free(options->metrics_file);
+        free(options->upload_transport);
+        free(options->download_transport);
+        free(options->results_format);
+        free(options->results_dir);
+        free(options->luasrc_dir);
+        free(options->sandbox_dir);
+        log_error("strdup error: %m");
+        return -1;
+    }
+    options->main_cache = strdup(DEFAULT_MAIN_CACHE);
+    if (!options->main_cache) {
+        free(options->trace_file);
+        free(options->metrics_file);
+        free(options->upload_transport);
+        free(options->download_transport);
+        free(options->results_format);
         free(options->results_dir);
         free(options->luasrc_dir);
         free(options->sandbox_dir);
@@ -208,6 +561,25 @@ static int set_default_options(censorscope_options_t *options) {
     }
     options->synchronous = 0;
     options->experiment_timeout_seconds = DEFAULT_EXPERIMENT_TIMEOUT;
+    options->max_children = DEFAULT_MAX_CHILDREN;
+    options->workers = DEFAULT_WORKERS;
+    options->worker_max_runs = DEFAULT_WORKER_MAX_RUNS;
+    options->worker_max_memory_growth = DEFAULT_WORKER_MAX_MEMORY_GROWTH;
+    options->segment_max_bytes = DEFAULT_SEGMENT_MAX_BYTES;
+    options->segment_max_age_seconds = DEFAULT_SEGMENT_MAX_AGE;
+    options->upload_interval_seconds = DEFAULT_UPLOAD_INTERVAL;
+    options->sync_interval_seconds = DEFAULT_SYNC_INTERVAL;
+    options->jitter_seconds = DEFAULT_JITTER;
+    options->metrics_interval_seconds = DEFAULT_METRICS_INTERVAL;
+    options->cache_window_seconds = DEFAULT_CACHE_WINDOW;
+    options->max_packets_per_second = DEFAULT_MAX_PACKETS_PER_SECOND;
+    options->max_bytes_per_second = DEFAULT_MAX_BYTES_PER_SECOND;
+    options->destination_packets_per_second = DEFAULT_DESTINATION_PACKETS_PER_SECOND;
+    if (logging_parse_level(DEFAULT_LOG_LEVEL, &options->log_level)) {
+        log_error("invalid default log level '%s'", DEFAULT_LOG_LEVEL);
+        censorscope_options_destroy(options);
+        return -1;
+    }
 
     return 0;
 }
@@ -215,18 +587,37 @@ static int set_default_options(censorscope_options_t *options) {
 static int parse_cli_options(censorscope_options_t *options,
                              int argc,
                              char **argv) {
-    const char *short_options = "d:hi:l:m:r:s:t:u:y";
+    const char *short_options = "B:D:P:a:b:c:d:e:f:g:hi:j:k:l:m:n:o:p:q:r:s:t:u:v:w:x:yz:";
     const struct option long_options[] = {
+        {"max-packets-per-second", 1, NULL, 'P'},
+        {"max-bytes-per-second", 1, NULL, 'B'},
+        {"destination-packets-per-second", 1, NULL, 'D'},
+        {"segment-max-age", 1, NULL, 'a'},
+        {"segment-max-bytes", 1, NULL, 'b'},
+        {"max-children", 1, NULL, 'c'},
         {"download-transport", 1, NULL, 'd'},
+        {"metrics-file", 1, NULL, 'e'},
+        {"results-format", 1, NULL, 'f'},
+        {"worker-max-memory-growth", 1, NULL, 'g'},
         {"help", 0, NULL, 'h'},
         {"max-instructions", 1, NULL, 'i'},
+        {"jitter-seconds", 1, NULL, 'j'},
+        {"worker-max-runs", 1, NULL, 'k'},
         {"luasrc-dir", 1, NULL, 'l'},
         {"max-memory", 1, NULL, 'm'},
+        {"sync-interval", 1, NULL, 'n'},
+        {"metrics-interval", 1, NULL, 'o'},
+        {"upload-interval", 1, NULL, 'p'},
+        {"main-cache", 1, NULL, 'q'},
         {"results-dir", 1, NULL, 'r'},
         {"sandbox-dir", 1, NULL, 's'},
         {"experiment-timeout", 1, NULL, 't'},
         {"upload-transport", 1, NULL, 'u'},
+        {"log-level", 1, NULL, 'v'},
+        {"workers", 1, NULL, 'w'},
+        {"trace-file", 1, NULL, 'x'},
         {"synchronous", 0, NULL, 'y'},
+        {"cache-window", 1, NULL, 'z'},
         {0, 0, 0, 0}
     };
     for (;;) {
@@ -245,6 +636,51 @@ static int parse_cli_options(censorscope_options_t *options,
 
         char *first_invalid;
         switch (c) {
+        case 'a':
+            errno = 0;
+            options->segment_max_age_seconds = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0' || options->segment_max_age_seconds < 0) {
+                log_error("invalid segment age");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'b':
+            errno = 0;
+            options->segment_max_bytes = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0') {
+                log_error("invalid segment size: not a number");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'c':
+            errno = 0;
+            options->max_children = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0' || options->max_children < 0) {
+                log_error("invalid maximum number of children");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
         case 'd':
             free(options->download_transport);
             options->download_transport = strdup(optarg);
@@ -255,6 +691,50 @@ static int parse_cli_options(censorscope_options_t *options,
             }
             break;
 
+        case 'e':
+            free(options->metrics_file);
+            options->metrics_file = strdup(optarg);
+            if (!options->metrics_file) {
+                log_error("strdup error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'f': {
+            results_format_t format;
+            if (results_format_parse(optarg, &format)) {
+                log_error("invalid results format '%s'", optarg);
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            free(options->results_format);
+            options->results_format = strdup(optarg);
+            if (!options->results_format) {
+                log_error("strdup error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+        }
+
+        case 'g':
+            errno = 0;
+            options->worker_max_memory_growth = strtol(optarg,
+                                                       &first_invalid,
+                                                       10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0') {
+                log_error("invalid worker memory growth: not a number");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
         case 'h':
             print_usage(argv[0]);
             censorscope_options_destroy(options);
@@ -275,6 +755,36 @@ static int parse_cli_options(censorscope_options_t *options,
             }
             break;
 
+        case 'j':
+            errno = 0;
+            options->jitter_seconds = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0' || options->jitter_seconds < 0) {
+                log_error("invalid jitter");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'k':
+            errno = 0;
+            options->worker_max_runs = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0' || options->worker_max_runs < 1) {
+                log_error("invalid worker run limit");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
         case 'l':
             free(options->luasrc_dir);
             options->luasrc_dir = strdup(optarg);
@@ -300,6 +810,64 @@ static int parse_cli_options(censorscope_options_t *options,
             }
             break;
 
+        case 'n':
+            errno = 0;
+            options->sync_interval_seconds = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0' || options->sync_interval_seconds < 0) {
+                log_error("invalid sync interval");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'o':
+            errno = 0;
+            options->metrics_interval_seconds = strtol(optarg,
+                                                       &first_invalid,
+                                                       10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0'
+                || options->metrics_interval_seconds < 0) {
+                log_error("invalid metrics interval");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'p':
+            errno = 0;
+            options->upload_interval_seconds = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0' || options->upload_interval_seconds < 0) {
+                log_error("invalid upload interval");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'q':
+            free(options->main_cache);
+            options->main_cache = strdup(optarg);
+            if (!options->main_cache) {
+                log_error("strdup error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
         case 'r':
             free(options->results_dir);
             options->results_dir = strdup(optarg);
@@ -347,10 +915,103 @@ static int parse_cli_options(censorscope_options_t *options,
             }
             break;
 
+        case 'v':
+            if (logging_parse_level(optarg, &options->log_level)) {
+                log_error("invalid log level '%s'", optarg);
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'w':
+            errno = 0;
+            options->workers = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0' || options->workers < 0) {
+                log_error("invalid worker count");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'x':
+            free(options->trace_file);
+            options->trace_file = strdup(optarg);
+            if (!options->trace_file) {
+                log_error("strdup error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
         case 'y':
             options->synchronous = 1;
             break;
 
+        case 'P':
+            errno = 0;
+            options->max_packets_per_second = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0' || options->max_packets_per_second < 0) {
+                log_error("invalid packet rate");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'B':
+            errno = 0;
+            options->max_bytes_per_second = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0' || options->max_bytes_per_second < 0) {
+                log_error("invalid byte rate");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'D':
+            errno = 0;
+            options->destination_packets_per_second = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0' || options->destination_packets_per_second < 0) {
+                log_error("invalid destination packet rate");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
+        case 'z':
+            errno = 0;
+            options->cache_window_seconds = strtol(optarg, &first_invalid, 10);
+            if (errno) {
+                log_error("strtol error: %m");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            if (first_invalid[0] != '\0' || options->cache_window_seconds < 0) {
+                log_error("invalid cache window");
+                censorscope_options_destroy(options);
+                return -1;
+            }
+            break;
+
         default:
             log_error("invalid option");
             print_usage(argv[0]);
@@ -394,6 +1055,8 @@ int censorscope_options_lua(const censorscope_options_t *options,
     lua_setfield(L, -2, "luasrc_dir");
     lua_pushstring(L, options->results_dir);
     lua_setfield(L, -2, "results_dir");
+    lua_pushstring(L, options->results_format);
+    lua_setfield(L, -2, "results_format");
     lua_pushnumber(L, options->max_memory);
     lua_setfield(L, -2, "max_memory");
     lua_pushnumber(L, options->max_instructions);
@@ -409,7 +1072,11 @@ int censorscope_options_destroy(censorscope_options_t *options) {
     free(options->luasrc_dir);
     free(options->sandbox_dir);
     free(options->results_dir);
+    free(options->results_format);
     free(options->download_transport);
     free(options->upload_transport);
+    free(options->metrics_file);
+    free(options->trace_file);
+    free(options->main_cache);
     return 0;
 }
@@ -9,6 +9,46 @@ typedef struct {
     char *sandbox_dir;
     char *luasrc_dir;
     char *results_dir;
+    /* How write_result stores records: "text", "ndjson" or
+     * "length-prefixed". */
+    char *results_format;
+    /* Start a new results segment once the current one reaches this many
+     * bytes or is this many seconds old; 0 means no limit. */
+    size_t segment_max_bytes;
+    long segment_max_age_seconds;
+    /* Compress and upload closed results segments this often, or only at exit
+     * if 0. */
+    long upload_interval_seconds;
+    /* Download the sandbox again this often, or only at startup if 0. */
+    long sync_interval_seconds;
+    /* A copy of the last sandbox/main.lua that loaded, kept outside the
+     * sandbox so a download can't remove it. We start from it when main.lua
+     * is missing or broken, until a download brings a good one. An empty path
+     * disables it. */
+    char *main_cache;
+    /* The default for each experiment's jitter_seconds, which delays every
+     * run by a random amount so a fleet of probes doesn't run in lockstep. */
+    long jitter_seconds;
+    /* Write per-experiment run statistics to this file every
+     * metrics_interval_seconds, and at exit. An empty path disables them. */
+    char *metrics_file;
+    long metrics_interval_seconds;
+    /* Let experiments that ask for it reuse DNS answers and HTTP digests up
+     * to this many seconds old, or keep no cache if 0. */
+    long cache_window_seconds;
+    /* The device's budget for everything the network primitives send, in
+     * packets and bytes per second, and the most packets per second for any
+     * one destination, which adapts down after losses. 0 means no limit. See
+     * ratelimit.h. */
+    long max_packets_per_second;
+    long max_bytes_per_second;
+    long destination_packets_per_second;
+    /* Append a span for each phase of every run to this file. An empty path
+     * disables tracing. */
+    char *trace_file;
+    /* The most verbose level to log: LOGGING_ERROR, LOGGING_INFO or
+     * LOGGING_DEBUG. */
+    int log_level;
     /* The total amount of memory available to the interpreter for evaluating
      * the environment and running the sandboxed code. */
     size_t max_memory;
@@ -24,6 +64,17 @@ typedef struct {
     char *upload_transport;
     int synchronous;
     long experiment_timeout_seconds;
+    /* The maximum number of experiments running at once, or 0 for no limit.
+     * Runs beyond the limit wait in the scheduler's queue. */
+    int max_children;
+    /* The number of long-lived worker processes that run experiments, or 0 to
+     * fork a fresh process for every run. */
+    int workers;
+    /* Replace a worker after it has run this many experiments. */
+    long worker_max_runs;
+    /* Replace a worker once its peak resident memory has grown by this many
+     * bytes since it started, or 0 for no limit. */
+    size_t worker_max_memory_growth;
 } censorscope_options_t;
 
 int censorscope_options_init(censorscope_options_t *options,
@@ -0,0 +1,245 @@
+#include "ratelimit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+
+#include "logging.h"
+#include "options.h"
+#include "util.h"
+
+/* When the device's next packet is due, shared by every process. NULL if the
+ * device has no budget. */
+static int64_t *shared_next_at = NULL;
+static double microseconds_per_packet = 0;
+static double microseconds_per_byte = 0;
+/* The most packets per second each destination gets, or 0 for no limit. */
+static double destination_rate = 0;
+
+static ratelimit_destination_t *destinations[RATELIMIT_BUCKETS];
+static int destination_count = 0;
+
+static void free_destinations(void) {
+    for (int i = 0; i < RATELIMIT_BUCKETS; ++i) {
+        while (destinations[i]) {
+            ratelimit_destination_t *destination = destinations[i];
+            destinations[i] = destination->next;
+            free(destination->key);
+            free(destination);
+        }
+    }
+    destination_count = 0;
+}
+
+int ratelimit_init(const censorscope_options_t *options) {
+    ratelimit_destroy();
+    if (options->max_packets_per_second > 0) {
+        microseconds_per_packet = 1e6 / options->max_packets_per_second;
+    }
+    if (options->max_bytes_per_second > 0) {
+        microseconds_per_byte = 1e6 / options->max_bytes_per_second;
+    }
+    destination_rate = options->destination_packets_per_second;
+    if (microseconds_per_packet == 0 && microseconds_per_byte == 0) {
+        return 0;
+    }
+    void *shared = mmap(NULL,
+                        sizeof(int64_t),
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS,
+                        -1,
+                        0);
+    if (shared == MAP_FAILED) {
+        log_error("mmap error: %m");
+        microseconds_per_packet = microseconds_per_byte = 0;
+        return -1;
+    }
+    shared_next_at = shared;
+    *shared_next_at = 0;
+    return 0;
+}
+
+void ratelimit_destroy(void) {
+    if (shared_next_at) {
+        munmap(shared_next_at, sizeof(int64_t));
+        shared_next_at = NULL;
+    }
+    microseconds_per_packet = microseconds_per_byte = 0;
+    destination_rate = 0;
+    free_destinations();
+}
+
+static unsigned hash_key(const char *key) {
+    unsigned hash = 5381;
+    for (; *key; ++key) {
+        hash = hash * 33 + (unsigned char)*key;
+    }
+    return hash % RATELIMIT_BUCKETS;
+}
+
+/* Return the destination for a key, adding it at the full rate if it's new,
+ * or NULL if destinations aren't limited. */
+static ratelimit_destination_t *find_destination(const char *key) {
+    if (destination_rate <= 0 || !key) {
+        return NULL;
+    }
+    unsigned bucket = hash_key(key);
+    for (ratelimit_destination_t *destination = destinations[bucket];
+         destination;
+         destination = destination->next) {
+        if (strcmp(destination->key, key) == 0) {
+            return destination;
+        }
+    }
+    if (destination_count >= RATELIMIT_MAX_DESTINATIONS) {
+        free_destinations();
+    }
+    ratelimit_destination_t *destination = calloc(1, sizeof(*destination));
+    if (!destination || !(destination->key = strdup(key))) {
+        log_error("error allocating rate limit destination");
+        free(destination);
+        return NULL;
+    }
+    destination->rate = destination_rate;
+    destination->next = destinations[bucket];
+    destinations[bucket] = destination;
+    ++destination_count;
+    return destination;
+}
+
+/* Move the device's next packet later by cost, unless the budget is already
+ * more than a burst ahead of now and force isn't set.
+ *
+ * Returns: 0 if we took the budget, or else the microseconds until we may.
+ *
+ */
+static int64_t take_budget(int64_t now, int64_t cost, int force) {
+    int64_t next_at = __atomic_load_n(shared_next_at, __ATOMIC_RELAXED);
+    for (;;) {
+        int64_t start = next_at > now ? next_at : now;
+        if (!force && start - now > RATELIMIT_BURST_MICROSECONDS) {
+            return start - now - RATELIMIT_BURST_MICROSECONDS;
+        }
+        if (__atomic_compare_exchange_n(shared_next_at,
+                                        &next_at,
+                                        start + cost,
+                                        0,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            return 0;
+        }
+    }
+}
+
+int64_t ratelimit_acquire(const char *destination, size_t bytes) {
+    int64_t now = monotonic_microseconds();
+    ratelimit_destination_t *limited = find_destination(destination);
+    if (limited && limited->next_at - now > RATELIMIT_BURST_MICROSECONDS) {
+        return limited->next_at - now - RATELIMIT_BURST_MICROSECONDS;
+    }
+    if (shared_next_at) {
+        /* Charging the larger of the two costs keeps us within both
+         * limits. */
+        double cost = microseconds_per_packet;
+        if (bytes * microseconds_per_byte > cost) {
+            cost = bytes * microseconds_per_byte;
+        }
+        int64_t wait = take_budget(now, (int64_t)cost, 0);
+        if (wait > 0) {
+            return wait;
+        }
+    }
+    if (limited) {
+        int64_t start = limited->next_at > now ? limited->next_at : now;
+        limited->next_at = start + (int64_t)(1e6 / limited->rate);
+    }
+    return 0;
+}
+
+int ratelimit_wait(const char *destination,
+                   size_t bytes,
+                   int64_t max_wait_microseconds) {
+    for (;;) {
+        int64_t wait = ratelimit_acquire(destination, bytes);
+        if (wait == 0) {
+            return 0;
+        }
+        if (wait > max_wait_microseconds) {
+            return -1;
+        }
+        struct timespec delay = { wait / 1000000, (wait % 1000000) * 1000 };
+        nanosleep(&delay, NULL);
+        max_wait_microseconds -= wait;
+    }
+}
+
+void ratelimit_report(const char *destination,
+                      int lost,
+                      size_t received_bytes) {
+    if (shared_next_at && received_bytes > 0 && microseconds_per_byte > 0) {
+        /* The bytes have already arrived, so they only delay what we send
+         * next. */
+        take_budget(monotonic_microseconds(),
+                    (int64_t)(received_bytes * microseconds_per_byte),
+                    1);
+    }
+    ratelimit_destination_t *limited = find_destination(destination);
+    if (!limited) {
+        return;
+    }
+    if (lost) {
+        limited->rate /= 2;
+        if (limited->rate < RATELIMIT_MIN_RATE) {
+            limited->rate = RATELIMIT_MIN_RATE;
+        }
+    } else {
+        limited->rate += RATELIMIT_INCREASE;
+        if (limited->rate > destination_rate) {
+            limited->rate = destination_rate;
+        }
+    }
+}
+
+void ratelimit_address_key(const struct sockaddr *address,
+                           char *key,
+                           size_t size) {
+    const void *ip;
+    if (address->sa_family == AF_INET6) {
+        ip = &((const struct sockaddr_in6 *)address)->sin6_addr;
+    } else {
+        ip = &((const struct sockaddr_in *)address)->sin_addr;
+    }
+    if (!inet_ntop(address->sa_family, ip, key, size)) {
+        key[0] = '\0';
+    }
+}
+
+void ratelimit_url_key(const char *url, char *key, size_t size) {
+    const char *host = strstr(url, "://");
+    host = host ? host + 3 : url;
+    size_t len = strcspn(host, "/?#");
+    /* Skip any user name and password. */
+    const char *at = memchr(host, '@', len);
+    if (at) {
+        len -= at + 1 - host;
+        host = at + 1;
+    }
+    const char *end;
+    if (host[0] == '[' && (end = memchr(host, ']', len))) {
+        /* An IPv6 address, whose colons aren't a port. Leave out the
+         * brackets, to match the key of the same address. */
+        ++host;
+        len = end - host;
+    } else {
+        const char *colon = memchr(host, ':', len);
+        len = colon ? (size_t)(colon - host) : len;
+    }
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(key, host, len);
+    key[len] = '\0';
+}
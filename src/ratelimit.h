@@ -0,0 +1,108 @@
+#ifndef CENSORSCOPE_RATELIMIT_H
+#define CENSORSCOPE_RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "options.h"
+
+/* The rate limiter paces what every network primitive sends, so batches and
+ * concurrent operations don't flood a small uplink or the servers we measure,
+ * and losses we cause ourselves don't look like censorship.
+ *
+ * There are two limits, and a packet goes out only when both allow it:
+ *
+ * - A budget for the whole device, from the max-packets-per-second and
+ *   max-bytes-per-second options. It lives in memory shared by every process
+ *   the scheduler forks, so all running experiments draw on it together.
+ *   Bytes received count against it too, once they arrive.
+ * - A rate for each destination, which starts at the
+ *   destination-packets-per-second option and adapts to what we observe:
+ *   every timeout halves it and every answer adds RATELIMIT_INCREASE, up to
+ *   the option again. Each process keeps its own destinations.
+ *
+ * Both are token buckets kept as the time the next packet is due, so a
+ * burst of RATELIMIT_BURST_MICROSECONDS worth of packets goes out at once and
+ * the rest are spread out at the limit. A limit of 0 means no limit. */
+
+/* How far ahead of its limit a bucket may run. */
+#define RATELIMIT_BURST_MICROSECONDS 100000
+/* The packets per second a destination's rate is never halved below. */
+#define RATELIMIT_MIN_RATE 1.0
+/* The packets per second each answer adds to its destination's rate. */
+#define RATELIMIT_INCREASE 1.0
+/* We forget every destination's rate once we know this many. */
+#define RATELIMIT_MAX_DESTINATIONS 4096
+#define RATELIMIT_BUCKETS 1024
+/* Room for a destination key: an address or a host name. */
+#define RATELIMIT_KEY_SIZE 256
+
+typedef struct ratelimit_destination {
+    char *key;
+    /* The current rate, in packets per second. */
+    double rate;
+    /* When the next packet is due, in monotonic microseconds. */
+    int64_t next_at;
+    struct ratelimit_destination *next;
+} ratelimit_destination_t;
+
+/* Set the limits from the options. Call it in the scheduler before forking,
+ * so every child shares the device's budget. Until it is called nothing is
+ * limited.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int ratelimit_init(const censorscope_options_t *options);
+
+/* Forget every destination and remove the limits. */
+void ratelimit_destroy(void);
+
+/* Ask to send a packet now.
+ *
+ * Arguments:
+ * - destination is the key of where the packet goes, like an address or host
+ *   name, or NULL to only check the device's budget.
+ * - bytes is the size of the packet.
+ * Returns: 0 if the packet may go now, which uses up its share of both
+ * limits, or else the microseconds to wait before asking again.
+ *
+ */
+int64_t ratelimit_acquire(const char *destination, size_t bytes);
+
+/* Wait until a packet may go, for primitives that block anyway.
+ *
+ * Arguments:
+ * - max_wait_microseconds is the longest we may wait, such as the time left
+ *   before the sandbox's deadline.
+ * Returns: 0 once the packet may go, or -1 if that would take too long.
+ *
+ */
+int ratelimit_wait(const char *destination,
+                   size_t bytes,
+                   int64_t max_wait_microseconds);
+
+/* Tell the limiter what happened to something we sent, so the destination's
+ * rate can adapt.
+ *
+ * Arguments:
+ * - lost is 1 if it timed out, and 0 if the destination answered, even with
+ *   an error or a reset.
+ * - received_bytes is the size of the answer, which counts against the
+ *   device's byte budget.
+ *
+ */
+void ratelimit_report(const char *destination,
+                      int lost,
+                      size_t received_bytes);
+
+/* Write the key for an address, which is its IP without the port. */
+void ratelimit_address_key(const struct sockaddr *address,
+                           char *key,
+                           size_t size);
+
+/* Write the key for a URL, which is its host name. */
+void ratelimit_url_key(const char *url, char *key, size_t size);
+
+#endif
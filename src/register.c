@@ -1,19 +1,51 @@
 #include "register.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
 
+#include "async.h"
+#include "cache.h"
 #include "dns.h"
 #include "logging.h"
+#include "luautil.h"
 #include "tcp.h"
 #include "http.h"
 #include "options.h"
+#include "results.h"
 #include "sandbox.h"
+#include "serialize.h"
+#include "targets.h"
+#include "traceroute.h"
 #include "util.h"
 
+/* Modules that evaluate to plain data, like lists of domains, are kept in
+ * this registry table keyed by filename, so requiring them again doesn't run
+ * them in a new sandbox. Each entry records the file's modification time and
+ * size, so changes are noticed. */
+#define REQUIRE_MEMO_KEY "censorscope.require_memo"
+#define REQUIRE_MEMO_MAX_DEPTH 16
+
+/* The metatable of target list userdata. */
+#define TARGETS_METATABLE "censorscope.targets"
+
+/* Push the memo table, creating it if necessary. */
+static void push_require_memo(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, REQUIRE_MEMO_KEY);
+    if (lua_istable(L, -1)) {
+        return;
+    }
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, REQUIRE_MEMO_KEY);
+}
+
 int run_in_sandbox(lua_State *L) {
     censorscope_options_t *options = lua_touserdata(L, lua_upvalueindex(1));
     sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(2));
@@ -23,8 +55,34 @@ int run_in_sandbox(lua_State *L) {
         return luaL_error(L, "invalid module name");
     }
 
+    struct stat info;
+    char signature[64] = "";
+    if (stat(filename, &info) == 0) {
+        snprintf(signature,
+                 sizeof(signature),
+                 "%lld.%09ld:%lld",
+                 (long long)info.st_mtim.tv_sec,
+                 info.st_mtim.tv_nsec,
+                 (long long)info.st_size);
+        push_require_memo(L);
+        lua_getfield(L, -1, filename);
+        if (lua_istable(L, -1)) {
+            lua_getfield(L, -1, "signature");
+            if (strcmp(luaL_optstring(L, -1, ""), signature) == 0) {
+                /* Callers get their own copy, so they can't change what
+                 * later callers see. */
+                lua_getfield(L, -2, "value");
+                copy_plain_data(L, -1);
+                free(filename);
+                return 1;
+            }
+        }
+        lua_settop(L, 1);
+    }
+
     char *api_filename = sprintf_malloc("%s/api.lua", options->luasrc_dir);
     if (!api_filename) {
+        free(filename);
         return luaL_error(L, "error allocating api_filename");
     }
     if (sandbox_run(sandbox, filename, api_filename)) {
@@ -33,42 +91,324 @@ int run_in_sandbox(lua_State *L) {
         return luaL_error(L, "error running in sandbox");
     }
 
+    if (signature[0] != '\0'
+        && lua_istable(L, -1)
+        && is_plain_data(L, -1, REQUIRE_MEMO_MAX_DEPTH)) {
+        push_require_memo(L);
+        lua_createtable(L, 0, 2);
+        lua_pushstring(L, signature);
+        lua_setfield(L, -2, "signature");
+        copy_plain_data(L, -3);
+        lua_setfield(L, -2, "value");
+        lua_setfield(L, -2, filename);
+        lua_pop(L, 1);  /* Pop the memo table. */
+    }
+
     free(api_filename);
     free(filename);
     return 1;
 }
 
-int l_log_error(lua_State *L) {
+/* Log a message from Lua, unless its call site has logged too much lately.
+ * Scripts call these through api.lua, so the call site is the caller of the
+ * api function. */
+static int log_from_lua(lua_State *L, int level) {
     const char *message = luaL_checkstring(L, -1);
-    log_error("%s", message);
+    if (!logging_enabled(level)) {
+        return 0;
+    }
+    lua_Debug ar;
+    if (lua_getstack(L, 2, &ar) || lua_getstack(L, 1, &ar)) {
+        lua_getinfo(L, "Sl", &ar);
+        if (!log_site_allowed(ar.short_src, ar.currentline)) {
+            return 0;
+        }
+    }
+    log_write(level, "%s", message);
     return 0;
 }
 
+int l_log_error(lua_State *L) {
+    return log_from_lua(L, LOGGING_ERROR);
+}
+
 int l_log_info(lua_State *L) {
-    const char *message = luaL_checkstring(L, -1);
-    log_info("%s", message);
-    return 0;
+    return log_from_lua(L, LOGGING_INFO);
 }
 
 int l_log_debug(lua_State *L) {
-    const char *message = luaL_checkstring(L, -1);
-    log_debug("%s", message);
+    return log_from_lua(L, LOGGING_DEBUG);
+}
+
+int l_memory_usage(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    const arena_t *arena = &sandbox->arena;
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, arena->used);
+    lua_setfield(L, -2, "used");
+    lua_pushnumber(L, arena->peak_used);
+    lua_setfield(L, -2, "peak_used");
+    lua_pushnumber(L, arena->reserved);
+    lua_setfield(L, -2, "reserved");
+    lua_pushnumber(L, arena->peak_reserved);
+    lua_setfield(L, -2, "peak_reserved");
+    lua_pushnumber(L, arena->limit);
+    lua_setfield(L, -2, "limit");
+    return 1;
+}
+
+/* Run a full garbage collection cycle, so memory freed by one part of a large
+ * experiment is reused by the next instead of growing the arena. */
+int l_collect_garbage(lua_State *L) {
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    return 0;
+}
+
+int l_time_remaining(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    int64_t remaining = sandbox_time_remaining(sandbox);
+    if (remaining == INT64_MAX) {
+        lua_pushnil(L);
+    } else {
+        lua_pushnumber(L, remaining / 1e6);
+    }
+    return 1;
+}
+
+int l_monotonic_microseconds(lua_State *L) {
+    lua_pushnumber(L, monotonic_microseconds());
+    return 1;
+}
+
+/* Target lists are userdata holding a reference to the mapped list, so they
+ * stay mapped while Lua can reach them. */
+static targets_list_t *check_targets(lua_State *L, int index) {
+    targets_list_t **list = luaL_checkudata(L, index, TARGETS_METATABLE);
+    return *list;
+}
+
+int l_targets(lua_State *L) {
+    censorscope_options_t *options = lua_touserdata(L, lua_upvalueindex(1));
+    const char *name = luaL_checkstring(L, 1);
+    char *filename = targets_filename(options->sandbox_dir, name);
+    if (!filename) {
+        lua_pushnil(L);
+        lua_pushstring(L, "invalid target list name");
+        return 2;
+    }
+    targets_list_t **list = lua_newuserdata(L, sizeof(targets_list_t *));
+    *list = targets_open(filename);
+    free(filename);
+    if (!*list) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error opening target list");
+        return 2;
+    }
+    luaL_getmetatable(L, TARGETS_METATABLE);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int targets_gc(lua_State *L) {
+    targets_list_t **list = lua_touserdata(L, 1);
+    if (*list) {
+        targets_release(*list);
+        *list = NULL;
+    }
     return 0;
 }
 
+static int targets_count(lua_State *L) {
+    lua_pushnumber(L, check_targets(L, 1)->count);
+    return 1;
+}
+
+/* The iterator of targets_entries. Its upvalues are the list, the cursor's
+ * offset and index, and the step. */
+static int targets_entries_next(lua_State *L) {
+    targets_list_t *list = check_targets(L, lua_upvalueindex(1));
+    targets_cursor_t cursor;
+    cursor.offset = lua_tonumber(L, lua_upvalueindex(2));
+    cursor.index = lua_tonumber(L, lua_upvalueindex(3));
+    size_t step = lua_tonumber(L, lua_upvalueindex(4));
+
+    const char *entry;
+    size_t len;
+    if (!targets_next(list, &cursor, &entry, &len)) {
+        return 0;
+    }
+    lua_pushnumber(L, cursor.index);
+    lua_pushlstring(L, entry, len);
+
+    /* Skip to the next entry we'll return. */
+    const char *skipped;
+    size_t skipped_len;
+    for (size_t i = 1; i < step; ++i) {
+        if (!targets_next(list, &cursor, &skipped, &skipped_len)) {
+            break;
+        }
+    }
+    lua_pushnumber(L, cursor.offset);
+    lua_replace(L, lua_upvalueindex(2));
+    lua_pushnumber(L, cursor.index);
+    lua_replace(L, lua_upvalueindex(3));
+    return 2;
+}
+
+static int targets_entries(lua_State *L) {
+    targets_list_t *list = check_targets(L, 1);
+    lua_Integer first = luaL_optinteger(L, 2, 1);
+    lua_Integer step = luaL_optinteger(L, 3, 1);
+    luaL_argcheck(L, first >= 1, 2, "first must be positive");
+    luaL_argcheck(L, step >= 1, 3, "step must be positive");
+
+    targets_cursor_t cursor;
+    targets_seek(list, first - 1, &cursor);
+    lua_pushvalue(L, 1);
+    lua_pushnumber(L, cursor.offset);
+    lua_pushnumber(L, cursor.index);
+    lua_pushnumber(L, step);
+    lua_pushcclosure(L, targets_entries_next, 4);
+    return 1;
+}
+
+static int targets_read(lua_State *L) {
+    targets_list_t *list = check_targets(L, 1);
+    lua_Integer first = luaL_checkinteger(L, 2);
+    lua_Integer count = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, first >= 1, 2, "first must be positive");
+    luaL_argcheck(L, count >= 0, 3, "count must not be negative");
+
+    targets_cursor_t cursor;
+    targets_seek(list, first - 1, &cursor);
+    lua_Integer available = list->count - cursor.index;
+    lua_createtable(L, count < available ? count : available, 0);
+    const char *entry;
+    size_t len;
+    for (lua_Integer i = 1;
+         i <= count && targets_next(list, &cursor, &entry, &len);
+         ++i) {
+        lua_pushlstring(L, entry, len);
+        lua_rawseti(L, -2, i);
+    }
+    return 1;
+}
+
+static const luaL_Reg targets_methods[] = {
+    { "count", targets_count },
+    { "entries", targets_entries },
+    { "read", targets_read },
+    { NULL, NULL }
+};
+
+/* Create the metatable of target lists in the sandbox's registry. */
+static void register_targets_metatable(lua_State *L) {
+    luaL_newmetatable(L, TARGETS_METATABLE);
+    lua_newtable(L);
+    luaL_register(L, NULL, targets_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, targets_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, targets_count);
+    lua_setfield(L, -2, "__len");
+    /* Scripts can't replace the methods through getmetatable. */
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+}
+
 int register_functions(censorscope_options_t *options, sandbox_t *sandbox) {
-    lua_register(sandbox->L, "dns_lookup", l_dns_lookup);
-    lua_register(sandbox->L, "http_get", l_http_get);
-    lua_register(sandbox->L, "tcp_connect", l_tcp_connect);
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_dns_lookup, 1);
+    lua_setglobal(sandbox->L, "dns_lookup");
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_http_get, 1);
+    lua_setglobal(sandbox->L, "http_get");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_http_get_batch, 1);
+    lua_setglobal(sandbox->L, "http_get_batch");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_tcp_connect, 1);
+    lua_setglobal(sandbox->L, "tcp_connect");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_tcp_connect_batch, 1);
+    lua_setglobal(sandbox->L, "tcp_connect_batch");
 
     lua_register(sandbox->L, "log_error", l_log_error);
     lua_register(sandbox->L, "log_info", l_log_info);
     lua_register(sandbox->L, "log_debug", l_log_debug);
+    lua_pushboolean(sandbox->L, logging_enabled(LOGGING_DEBUG));
+    lua_setglobal(sandbox->L, "LOG_DEBUG_ENABLED");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_memory_usage, 1);
+    lua_setglobal(sandbox->L, "memory_usage");
+    lua_register(sandbox->L, "collect_garbage", l_collect_garbage);
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_time_remaining, 1);
+    lua_setglobal(sandbox->L, "time_remaining");
+    lua_register(sandbox->L, "monotonic_microseconds", l_monotonic_microseconds);
+
+    lua_register(sandbox->L, "cache_get", l_cache_get);
+    lua_register(sandbox->L, "cache_put", l_cache_put);
+
+    lua_register(sandbox->L, "encode_json", l_encode_json);
+    lua_register(sandbox->L, "encode_msgpack", l_encode_msgpack);
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_dns_lookup_batch, 1);
+    lua_setglobal(sandbox->L, "dns_lookup_batch");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_dns_compare, 1);
+    lua_setglobal(sandbox->L, "dns_compare");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_dns_query, 1);
+    lua_setglobal(sandbox->L, "dns_query");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_dns_lookup_async, 1);
+    lua_setglobal(sandbox->L, "dns_lookup_async");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_http_get_async, 1);
+    lua_setglobal(sandbox->L, "http_get_async");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_tcp_connect_async, 1);
+    lua_setglobal(sandbox->L, "tcp_connect_async");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_ttl_probe, 1);
+    lua_setglobal(sandbox->L, "ttl_probe");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_async_wait, 1);
+    lua_setglobal(sandbox->L, "async_wait");
 
     lua_pushlightuserdata(sandbox->L, options);
     lua_pushlightuserdata(sandbox->L, sandbox);
     lua_pushcclosure(sandbox->L, run_in_sandbox, 2);
     lua_setglobal(sandbox->L, "run_in_sandbox");
 
+    register_targets_metatable(sandbox->L);
+    lua_pushlightuserdata(sandbox->L, options);
+    lua_pushcclosure(sandbox->L, l_targets, 1);
+    lua_setglobal(sandbox->L, "targets");
+
+    lua_pushlightuserdata(sandbox->L, options);
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_write_result, 2);
+    lua_setglobal(sandbox->L, "write_result");
+
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_pushcclosure(sandbox->L, l_flush_results, 1);
+    lua_setglobal(sandbox->L, "flush_results");
+
     return 0;
 }
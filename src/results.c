@@ -0,0 +1,452 @@
+#include "results.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "index.h"
+#include "logging.h"
+#include "options.h"
+#include "sandbox.h"
+#include "serialize.h"
+#include "util.h"
+
+int results_format_parse(const char *name, results_format_t *format) {
+    if (strcmp(name, "text") == 0) {
+        *format = RESULTS_FORMAT_TEXT;
+    } else if (strcmp(name, "ndjson") == 0) {
+        *format = RESULTS_FORMAT_NDJSON;
+    } else if (strcmp(name, "length-prefixed") == 0) {
+        *format = RESULTS_FORMAT_LENGTH_PREFIXED;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char *results_format_extension(results_format_t format) {
+    switch (format) {
+    case RESULTS_FORMAT_NDJSON:
+        return "ndjson";
+    case RESULTS_FORMAT_LENGTH_PREFIXED:
+        return "lp";
+    default:
+        return "txt";
+    }
+}
+
+results_writer_t *results_writer_new(results_format_t format,
+                                     size_t max_bytes,
+                                     long max_age_seconds) {
+    results_writer_t *writer = calloc(1, sizeof(results_writer_t));
+    if (!writer) {
+        log_error("calloc error: %m");
+        return NULL;
+    }
+    writer->buffer = malloc(RESULTS_BUFFER_SIZE);
+    if (!writer->buffer) {
+        log_error("malloc error: %m");
+        free(writer);
+        return NULL;
+    }
+    writer->format = format;
+    writer->max_bytes = max_bytes;
+    writer->max_age_seconds = max_age_seconds;
+    writer->fd = -1;
+    serialize_buffer_init(&writer->scratch);
+    return writer;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+int results_writer_flush(results_writer_t *writer) {
+    writer->last_flush = monotonic_microseconds();
+    if (writer->len == 0) {
+        return 0;
+    }
+    int rc = write_all(writer->fd, writer->buffer, writer->len);
+    if (rc) {
+        log_error("error writing results to %s: %m", writer->partial_path);
+    } else {
+        writer->segment_crc32 = crc32(writer->segment_crc32,
+                                      (const Bytef *)writer->buffer,
+                                      writer->len);
+    }
+    /* Drop the records either way, so one bad write doesn't fail every
+     * later one. */
+    writer->len = 0;
+    return rc;
+}
+
+/* Add the closed segment to the index of its directory. */
+static int index_segment(results_writer_t *writer) {
+    char *directory = strdup(writer->segment_path);
+    if (!directory) {
+        log_error("strdup error: %m");
+        return -1;
+    }
+    char *slash = strrchr(directory, '/');
+    const char *segment = writer->segment_path;
+    if (slash) {
+        *slash = '\0';
+        segment += slash - directory + 1;
+    } else {
+        strcpy(directory, ".");
+    }
+    index_entry_t entry = {
+        .segment = (char *)segment,
+        .run_id = (char *)writer->run_id,
+        .experiment = (char *)writer->experiment,
+        .offset = writer->path_offset,
+        .bytes = writer->segment_bytes,
+        .crc32 = writer->segment_crc32,
+    };
+    int rc = index_add_segment(directory, &entry);
+    free(directory);
+    return rc;
+}
+
+int results_writer_close(results_writer_t *writer) {
+    if (writer->fd < 0) {
+        return 0;
+    }
+    int rc = results_writer_flush(writer);
+    if (close(writer->fd)) {
+        log_error("error closing %s: %m", writer->partial_path);
+        rc = -1;
+    }
+    if (rename(writer->partial_path, writer->segment_path)) {
+        log_error("error renaming %s: %m", writer->partial_path);
+        rc = -1;
+    } else if (index_segment(writer)) {
+        rc = -1;
+    }
+    writer->path_offset += writer->segment_bytes;
+    writer->fd = -1;
+    free(writer->segment_path);
+    free(writer->partial_path);
+    writer->segment_path = writer->partial_path = NULL;
+    return rc;
+}
+
+void results_writer_free(results_writer_t *writer) {
+    if (!writer) {
+        return;
+    }
+    results_writer_close(writer);
+    free(writer->path);
+    serialize_buffer_free(&writer->scratch);
+    free(writer->buffer);
+    free(writer);
+}
+
+char *results_segment_name(const char *path, int sequence) {
+    if (sequence == 0) {
+        return strdup(path);
+    }
+    const char *slash = strrchr(path, '/');
+    const char *dot = strrchr(path, '.');
+    if (!dot || (slash && dot < slash)) {
+        return sprintf_malloc("%s-%d", path, sequence);
+    }
+    return sprintf_malloc("%.*s-%d%s",
+                          (int)(dot - path),
+                          path,
+                          sequence,
+                          dot);
+}
+
+/* Open the first segment of writer->path that doesn't exist yet. Every run
+ * writes to a path of its own, but the sequence starts again at 0 whenever
+ * the writer switches paths, so a path it returns to may already have
+ * segments here. Only segments still in results_dir are skipped: once the
+ * uploader moves one to the outbox its name is free again, which is why
+ * compress_segment adds .N to a name the outbox already holds. */
+static int open_segment(results_writer_t *writer) {
+    for (;; ++writer->sequence) {
+        char *segment_path = results_segment_name(writer->path,
+                                                  writer->sequence);
+        if (!segment_path) {
+            log_error("error allocating segment name");
+            return -1;
+        }
+        char *partial_path = sprintf_malloc("%s%s",
+                                            segment_path,
+                                            RESULTS_PARTIAL_SUFFIX);
+        if (!partial_path) {
+            log_error("error allocating segment name");
+            free(segment_path);
+            return -1;
+        }
+        int exists = access(segment_path, F_OK) == 0;
+        int fd = -1;
+        if (!exists) {
+            fd = open(partial_path,
+                      O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                      0644);
+        }
+        if (fd >= 0) {
+            writer->segment_path = segment_path;
+            writer->partial_path = partial_path;
+            writer->fd = fd;
+            break;
+        }
+        if (!exists && errno != EEXIST) {
+            log_error("error opening %s: %m", partial_path);
+            free(segment_path);
+            free(partial_path);
+            return -1;
+        }
+        free(segment_path);
+        free(partial_path);
+    }
+    ++writer->sequence;
+    writer->segment_bytes = 0;
+    writer->segment_crc32 = crc32(0, Z_NULL, 0);
+    writer->opened_at = writer->last_flush = monotonic_microseconds();
+    log_info("writing results to %s", writer->segment_path);
+    return 0;
+}
+
+/* Return 1 if the current segment is full or too old. */
+static int segment_finished(results_writer_t *writer) {
+    if (writer->max_bytes > 0 && writer->segment_bytes >= writer->max_bytes) {
+        return 1;
+    }
+    int64_t age = monotonic_microseconds() - writer->opened_at;
+    return writer->max_age_seconds > 0
+        && age >= (int64_t)writer->max_age_seconds * 1000000;
+}
+
+/* Serialize a record, including its framing, into the writer's scratch
+ * buffer. */
+static int encode_record(results_writer_t *writer,
+                         lua_State *L,
+                         int index,
+                         const char **error) {
+    serialize_buffer_t *scratch = &writer->scratch;
+    scratch->len = 0;
+
+    size_t prefix_len = 0;
+    if (writer->format == RESULTS_FORMAT_LENGTH_PREFIXED) {
+        /* Leave room for the length, which we fill in below. */
+        prefix_len = 4;
+        if (serialize_buffer_append(scratch, "\0\0\0\0", prefix_len)) {
+            goto out_of_memory;
+        }
+    }
+
+    int type = lua_type(L, index);
+    if (writer->format == RESULTS_FORMAT_TEXT
+        && (type == LUA_TSTRING || type == LUA_TNUMBER)) {
+        size_t len;
+        const char *string = lua_tolstring(L, index, &len);
+        if (serialize_buffer_append(scratch, string, len)) {
+            goto out_of_memory;
+        }
+    } else if (serialize_json(L, index, scratch, error)) {
+        return -1;
+    }
+
+    if (writer->format == RESULTS_FORMAT_LENGTH_PREFIXED) {
+        size_t len = scratch->len - prefix_len;
+        if (len > UINT32_MAX) {
+            *error = "result is too large";
+            return -1;
+        }
+        unsigned char *prefix = (unsigned char *)scratch->data;
+        prefix[0] = len >> 24;
+        prefix[1] = len >> 16;
+        prefix[2] = len >> 8;
+        prefix[3] = len;
+    } else if (serialize_buffer_append(scratch, "\n", 1)) {
+        goto out_of_memory;
+    }
+    return 0;
+
+out_of_memory:
+    *error = "out of memory while serializing";
+    return -1;
+}
+
+/* Make sure the writer has a segment of path open to write to, starting a
+ * new one if the path changed or the current one is finished. */
+static int prepare_segment(results_writer_t *writer,
+                           const char *path,
+                           const char **error) {
+    if (!writer->path || strcmp(writer->path, path) != 0) {
+        results_writer_close(writer);
+        free(writer->path);
+        writer->path = strdup(path);
+        if (!writer->path) {
+            *error = "out of memory";
+            return -1;
+        }
+        writer->sequence = 0;
+        writer->path_offset = 0;
+    } else if (writer->fd >= 0 && segment_finished(writer)) {
+        results_writer_close(writer);
+    }
+    if (writer->fd < 0 && open_segment(writer)) {
+        *error = "error opening results file";
+        return -1;
+    }
+    return 0;
+}
+
+int results_writer_write(results_writer_t *writer,
+                         const char *path,
+                         lua_State *L,
+                         int index,
+                         const char **error) {
+    if (prepare_segment(writer, path, error)) {
+        return -1;
+    }
+
+    if (encode_record(writer, L, index, error)) {
+        return -1;
+    }
+    const char *record = writer->scratch.data;
+    size_t len = writer->scratch.len;
+    writer->segment_bytes += len;
+
+    if (writer->len + len > RESULTS_BUFFER_SIZE
+        && results_writer_flush(writer)) {
+        *error = "error writing results file";
+        return -1;
+    }
+    if (len > RESULTS_BUFFER_SIZE) {
+        /* This record would never fit, so write it directly. */
+        if (write_all(writer->fd, record, len)) {
+            log_error("error writing results to %s: %m",
+                      writer->partial_path);
+            *error = "error writing results file";
+            return -1;
+        }
+        writer->segment_crc32 = crc32(writer->segment_crc32,
+                                      (const Bytef *)record,
+                                      len);
+        return 0;
+    }
+    memcpy(writer->buffer + writer->len, record, len);
+    writer->len += len;
+
+    if (monotonic_microseconds() - writer->last_flush
+            >= RESULTS_FLUSH_INTERVAL_MICROSECONDS
+        && results_writer_flush(writer)) {
+        *error = "error writing results file";
+        return -1;
+    }
+    return 0;
+}
+
+int results_writer_append_file(results_writer_t *writer,
+                               const char *path,
+                               const char *source) {
+    int fd = open(source, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("error opening %s: %m", source);
+        return -1;
+    }
+    const char *error;
+    if (prepare_segment(writer, path, &error) || results_writer_flush(writer)) {
+        close(fd);
+        return -1;
+    }
+    int rc = 0;
+    for (;;) {
+        /* The buffer is empty now, so borrow it. */
+        ssize_t len = read(fd, writer->buffer, RESULTS_BUFFER_SIZE);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len < 0) {
+            log_error("error reading %s: %m", source);
+            rc = -1;
+            break;
+        } else if (len == 0) {
+            break;
+        }
+        if (write_all(writer->fd, writer->buffer, len)) {
+            log_error("error writing results to %s: %m",
+                      writer->partial_path);
+            rc = -1;
+            break;
+        }
+        writer->segment_bytes += len;
+        writer->segment_crc32 = crc32(writer->segment_crc32,
+                                      (const Bytef *)writer->buffer,
+                                      len);
+    }
+    close(fd);
+    return rc;
+}
+
+int l_write_result(lua_State *L) {
+    censorscope_options_t *options = lua_touserdata(L, lua_upvalueindex(1));
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(2));
+    const char *filename = luaL_checkstring(L, 1);
+    luaL_checkany(L, 2);
+
+    if (!sandbox->results) {
+        results_format_t format;
+        if (results_format_parse(options->results_format, &format)) {
+            lua_pushnil(L);
+            lua_pushstring(L, "invalid results format");
+            return 2;
+        }
+        sandbox->results = results_writer_new(format,
+                                              options->segment_max_bytes,
+                                              options->segment_max_age_seconds);
+        if (!sandbox->results) {
+            lua_pushnil(L);
+            lua_pushstring(L, "error creating results writer");
+            return 2;
+        }
+    }
+
+    /* The writer is reused across runs, so take the current one's. */
+    sandbox->results->run_id = sandbox->run_id;
+    sandbox->results->experiment = sandbox->run_experiment;
+
+    const char *error = NULL;
+    if (results_writer_write(sandbox->results, filename, L, 2, &error)) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    return 2;
+}
+
+int l_flush_results(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    if (sandbox->results && results_writer_flush(sandbox->results)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error writing results");
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    return 2;
+}
@@ -0,0 +1,170 @@
+#ifndef CENSORSCOPE_RESULTS_H
+#define CENSORSCOPE_RESULTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lua.h"
+
+#include "serialize.h"
+
+/* Records are buffered until this many bytes are waiting. */
+#define RESULTS_BUFFER_SIZE (64 * 1024)
+/* Buffered records are also written once they are this old. */
+#define RESULTS_FLUSH_INTERVAL_MICROSECONDS 1000000
+/* Segments are written under their name plus this suffix, and renamed when
+ * they are closed. */
+#define RESULTS_PARTIAL_SUFFIX ".part"
+
+typedef enum {
+    /* Strings are written as they are, one per line, and tables as JSON. */
+    RESULTS_FORMAT_TEXT,
+    /* Every record is written as a line of JSON. */
+    RESULTS_FORMAT_NDJSON,
+    /* Every record is JSON preceded by its length, as a 4-byte big-endian
+     * integer, so records may contain newlines. */
+    RESULTS_FORMAT_LENGTH_PREFIXED,
+} results_format_t;
+
+/* Parse the name of a results format, as used by the results-format option.
+ *
+ * Returns: 0 on success, -1 if the name is not a format.
+ *
+ */
+int results_format_parse(const char *name, results_format_t *format);
+
+/* Return the file extension for a results format, without the dot. */
+const char *results_format_extension(results_format_t format);
+
+/* A results writer keeps the current run's results file open and gathers
+ * records in a fixed-size buffer, so a run that writes many records makes a
+ * few large writes instead of opening and closing the file for each one.
+ *
+ * A results file is written as one or more segments. The first has the name
+ * the caller asked for and later ones add a sequence number before the
+ * extension, as in "dns-20150101-120000-1.txt". A segment is written as
+ * name.part and renamed once it is closed, at the end of the run or when it
+ * reaches max_bytes or max_age_seconds, so only closed segments are ever
+ * uploaded. Each closed segment is recorded in the results index of its
+ * directory (see index.h), along with the run and experiment the caller
+ * set. */
+typedef struct results_writer {
+    results_format_t format;
+    size_t max_bytes;
+    long max_age_seconds;
+    /* The file the caller is writing to, or NULL before the first record. */
+    char *path;
+    /* The current segment, or NULL and -1 if none is open. */
+    char *segment_path;
+    char *partial_path;
+    int fd;
+    /* The sequence number to try for the next segment of path. */
+    int sequence;
+    size_t segment_bytes;
+    /* The checksum of the current segment's contents. */
+    uint32_t segment_crc32;
+    /* The bytes in earlier segments of path, where the current one starts. */
+    uint64_t path_offset;
+    int64_t opened_at;
+    /* Records waiting to be written. */
+    char *buffer;
+    size_t len;
+    int64_t last_flush;
+    /* Holds each record while we serialize it. */
+    serialize_buffer_t scratch;
+    /* The run and experiment to index closed segments under, which the
+     * writer doesn't own, or NULL if unknown. */
+    const char *run_id;
+    const char *experiment;
+} results_writer_t;
+
+/* Allocate a writer.
+ *
+ * Arguments:
+ * - format is how to store records.
+ * - max_bytes and max_age_seconds say when to start a new segment, or 0 for no
+ *   limit.
+ * Returns: the writer, or NULL on failure.
+ *
+ */
+results_writer_t *results_writer_new(results_format_t format,
+                                     size_t max_bytes,
+                                     long max_age_seconds);
+
+/* Append the Lua value at index to the results file at path. If path differs
+ * from that of the last record, the old file is flushed and closed first.
+ *
+ * Arguments:
+ * - error is set to a static error message on failure.
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int results_writer_write(results_writer_t *writer,
+                         const char *path,
+                         lua_State *L,
+                         int index,
+                         const char **error);
+
+/* Append the records in a closed segment file to the results file at path,
+ * like results_writer_write does for a single record. The file's records are
+ * kept together, so a new segment only starts between files.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int results_writer_append_file(results_writer_t *writer,
+                               const char *path,
+                               const char *source);
+
+/* Return the name of a segment of path: path itself for sequence 0, and with
+ * the sequence number before the extension otherwise.
+ *
+ * Returns: the name allocated with malloc, which you must free, or NULL on
+ * failure.
+ *
+ */
+char *results_segment_name(const char *path, int sequence);
+
+/* Write every buffered record to the file.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int results_writer_flush(results_writer_t *writer);
+
+/* Flush and close the current segment, and add it to the results index. The
+ * next record starts a new one.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int results_writer_close(results_writer_t *writer);
+
+/* Close and free a writer. */
+void results_writer_free(results_writer_t *writer);
+
+/* Append a record to a results file. Expects the options as its first upvalue
+ * and the sandbox as its second, whose writer it creates on first use.
+ *
+ * Lua arguments:
+ * - filename is the results file.
+ * - result is a string, number, boolean or table to write.
+ * Lua returns:
+ * - true on success, or nil on error.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_write_result(lua_State *L);
+
+/* Write the sandbox's buffered results to their file now, instead of when the
+ * buffer fills up or the run finishes. Expects the sandbox as its first
+ * upvalue.
+ *
+ * Lua returns:
+ * - true on success, or nil on error.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_flush_results(lua_State *L);
+
+#endif
@@ -0,0 +1,442 @@
+#include "resync.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <event2/event.h>
+#include <openssl/evp.h>
+
+#include "lua.h"
+
+#include "chunks.h"
+#include "logging.h"
+#include "options.h"
+#include "sandbox.h"
+#include "scheduling.h"
+#include "subprocesses.h"
+#include "targets.h"
+#include "transport.h"
+#include "util.h"
+
+#define HASH_CHUNK_SIZE (64 * 1024)
+
+static int hash_file(const char *path, unsigned char *digest) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("error opening %s: %m", path);
+        return -1;
+    }
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    if (!context || !EVP_DigestInit_ex(context, EVP_sha256(), NULL)) {
+        log_error("error initializing digest");
+        EVP_MD_CTX_free(context);
+        close(fd);
+        return -1;
+    }
+    int rc = 0;
+    char chunk[HASH_CHUNK_SIZE];
+    for (;;) {
+        ssize_t len = read(fd, chunk, sizeof(chunk));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0) {
+            log_error("error reading %s: %m", path);
+            rc = -1;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+        if (!EVP_DigestUpdate(context, chunk, len)) {
+            rc = -1;
+            break;
+        }
+    }
+    if (rc == 0 && !EVP_DigestFinal_ex(context, digest, NULL)) {
+        rc = -1;
+    }
+    EVP_MD_CTX_free(context);
+    close(fd);
+    return rc;
+}
+
+static void free_manifest(resync_file_t *manifest) {
+    while (manifest) {
+        resync_file_t *next = manifest->next;
+        free(manifest->path);
+        free(manifest);
+        manifest = next;
+    }
+}
+
+static const resync_file_t *find_file(const resync_file_t *manifest,
+                                      const char *path) {
+    for (; manifest; manifest = manifest->next) {
+        if (strcmp(manifest->path, path) == 0) {
+            return manifest;
+        }
+    }
+    return NULL;
+}
+
+/* List every .lua file in a directory with its digest, copying digests from
+ * the previous manifest for files whose modification time and size haven't
+ * changed. */
+static int build_manifest(const char *directory,
+                          const resync_file_t *previous,
+                          resync_file_t **manifest) {
+    *manifest = NULL;
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        log_error("opendir(%s) error: %m", directory);
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        size_t len = strlen(entry->d_name);
+        if (len < 4 || strcmp(entry->d_name + len - 4, ".lua") != 0) {
+            continue;
+        }
+        resync_file_t *file = calloc(1, sizeof(resync_file_t));
+        if (!file) {
+            log_error("calloc error: %m");
+            break;
+        }
+        file->path = sprintf_malloc("%s/%s", directory, entry->d_name);
+        struct stat info;
+        if (!file->path || stat(file->path, &info)) {
+            free(file->path);
+            free(file);
+            continue;
+        }
+        file->mtime = info.st_mtim;
+        file->size = info.st_size;
+
+        const resync_file_t *old = find_file(previous, file->path);
+        if (old
+            && old->mtime.tv_sec == file->mtime.tv_sec
+            && old->mtime.tv_nsec == file->mtime.tv_nsec
+            && old->size == file->size) {
+            memcpy(file->digest, old->digest, sizeof(file->digest));
+        } else if (hash_file(file->path, file->digest)) {
+            free(file->path);
+            free(file);
+            continue;
+        }
+        file->next = *manifest;
+        *manifest = file;
+    }
+    closedir(dir);
+    return 0;
+}
+
+/* Return the number of files that were added, changed or removed, and set
+ * main_changed if sandbox/main.lua is one of them. */
+static int count_changes(const resync_file_t *old,
+                         const resync_file_t *new,
+                         const char *main_filename,
+                         int *main_changed) {
+    int changes = 0;
+    *main_changed = 0;
+    for (const resync_file_t *file = new; file; file = file->next) {
+        const resync_file_t *previous = find_file(old, file->path);
+        if (previous
+            && memcmp(previous->digest, file->digest, sizeof(file->digest)) == 0) {
+            continue;
+        }
+        log_info("%s has %s", file->path, previous ? "changed" : "been added");
+        ++changes;
+        if (strcmp(file->path, main_filename) == 0) {
+            *main_changed = 1;
+        }
+    }
+    for (const resync_file_t *file = old; file; file = file->next) {
+        if (!find_file(new, file->path)) {
+            log_info("%s has been removed", file->path);
+            ++changes;
+        }
+    }
+    return changes;
+}
+
+/* Copy sandbox/main.lua to options->main_cache. We write a temporary file
+ * first, so a crash never leaves a truncated copy. */
+static int save_main(const censorscope_options_t *options,
+                     const char *main_filename) {
+    if (options->main_cache[0] == '\0') {
+        return 0;
+    }
+    char *temporary = sprintf_malloc("%s.new", options->main_cache);
+    if (!temporary) {
+        log_error("error allocating main cache name");
+        return -1;
+    }
+    int input = open(main_filename, O_RDONLY | O_CLOEXEC);
+    if (input < 0) {
+        log_error("error opening %s: %m", main_filename);
+        free(temporary);
+        return -1;
+    }
+    int output = open(temporary,
+                      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+    if (output < 0) {
+        log_error("error opening %s: %m", temporary);
+        close(input);
+        free(temporary);
+        return -1;
+    }
+    int rc = 0;
+    char chunk[HASH_CHUNK_SIZE];
+    for (;;) {
+        ssize_t len = read(input, chunk, sizeof(chunk));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0) {
+            log_error("error reading %s: %m", main_filename);
+            rc = -1;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+        if (write(output, chunk, len) != len) {
+            log_error("error writing %s: %m", temporary);
+            rc = -1;
+            break;
+        }
+    }
+    close(input);
+    if (close(output)) {
+        log_error("error closing %s: %m", temporary);
+        rc = -1;
+    }
+    if (rc == 0 && rename(temporary, options->main_cache)) {
+        log_error("error renaming %s: %m", temporary);
+        rc = -1;
+    }
+    if (rc) {
+        unlink(temporary);
+    }
+    free(temporary);
+    return rc;
+}
+
+/* Evaluate a main.lua, and check that it returned settings with an
+ * experiments table. */
+static int run_main(sandbox_t *sandbox, const char *filename) {
+    lua_settop(sandbox->L, 0);
+    if (sandbox_run(sandbox, filename, NULL)) {
+        return -1;
+    }
+    if (!lua_istable(sandbox->L, -1)) {
+        log_error("%s didn't return a table", filename);
+        return -1;
+    }
+    lua_getfield(sandbox->L, -1, "experiments");
+    int has_experiments = lua_istable(sandbox->L, -1);
+    lua_pop(sandbox->L, 1);
+    if (!has_experiments) {
+        log_error("%s has no experiments table", filename);
+        return -1;
+    }
+    return 0;
+}
+
+int resync_load_main(sandbox_t *sandbox, const censorscope_options_t *options) {
+    char *main_filename = sprintf_malloc("%s/main.lua", options->sandbox_dir);
+    if (main_filename && run_main(sandbox, main_filename) == 0) {
+        save_main(options, main_filename);
+        free(main_filename);
+        return 0;
+    }
+    free(main_filename);
+
+    if (options->main_cache[0] != '\0'
+        && access(options->main_cache, F_OK) == 0) {
+        log_info("starting from %s", options->main_cache);
+        if (run_main(sandbox, options->main_cache) == 0) {
+            return 0;
+        }
+    }
+
+    log_error("no main.lua to start from; waiting for the sandbox download");
+    lua_settop(sandbox->L, 0);
+    lua_newtable(sandbox->L);
+    lua_newtable(sandbox->L);
+    lua_setfield(sandbox->L, -2, "experiments");
+    return -1;
+}
+
+/* Apply a downloaded sandbox. */
+static void reload(resync_t *resync) {
+    censorscope_options_t *options = resync->options;
+    resync_file_t *manifest;
+    if (build_manifest(options->sandbox_dir, resync->manifest, &manifest)) {
+        return;
+    }
+    char *main_filename = sprintf_malloc("%s/main.lua", options->sandbox_dir);
+    if (!main_filename) {
+        log_error("error allocating main_filename");
+        free_manifest(manifest);
+        return;
+    }
+    int main_changed;
+    int changes = count_changes(resync->manifest,
+                                manifest,
+                                main_filename,
+                                &main_changed);
+    free_manifest(resync->manifest);
+    resync->manifest = manifest;
+    if (changes == 0) {
+        log_info("sandbox is unchanged");
+        free(main_filename);
+        return;
+    }
+
+    sandbox_t sandbox;
+    if (sandbox_init(&sandbox, "main", options)) {
+        log_error("error initializing sandbox");
+        free(main_filename);
+        return;
+    }
+    if (main_changed) {
+        if (run_main(&sandbox, main_filename)) {
+            log_error("error running %s; keeping old schedules", main_filename);
+        } else if (experiment_schedules_update(resync->schedules,
+                                               sandbox.L,
+                                               1)) {
+            log_error("error updating schedules");
+        } else {
+            save_main(options, main_filename);
+        }
+    }
+    /* Children inherit the compiled code and mapped target lists. Unchanged
+     * files hit the caches. */
+    chunks_preload_directory(sandbox.L, options->sandbox_dir);
+    targets_preload_directory(options->sandbox_dir);
+    sandbox_destroy(&sandbox);
+    free(main_filename);
+}
+
+static void on_syncer_exit(const subprocess_exit_t *child,
+                           void *arg) {
+    resync_t *resync = arg;
+    resync->syncer = 0;
+    reload(resync);
+    if (resync->schedules->sync_pending) {
+        /* We might be idle now, if the first download brought nothing to
+         * run. */
+        resync->schedules->sync_pending = 0;
+        experiment_schedules_check_idle(resync->schedules);
+    }
+}
+
+/* Fork a child to download the sandbox, and reload when it exits.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+static int start_sync(resync_t *resync, time_t timeout_seconds) {
+    censorscope_options_t *options = resync->options;
+    pid_t pid = subprocesses_fork(resync->subprocesses, timeout_seconds);
+    if (pid == 0) {
+        transport_t transport;
+        if (transport_init(&transport, options, options->download_transport)) {
+            exit(EXIT_FAILURE);
+        }
+        int rc = transport_download(&transport);
+        transport_destroy(&transport);
+        exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+    } else if (pid < 0) {
+        return -1;
+    }
+    resync->syncer = pid;
+    return subprocesses_on_exit(resync->subprocesses,
+                                pid,
+                                on_syncer_exit,
+                                resync);
+}
+
+static void resync_callback(evutil_socket_t fd, short what, void *arg) {
+    resync_t *resync = arg;
+    censorscope_options_t *options = resync->options;
+
+    if (resync->syncer > 0) {
+        log_info("sync by pid %d is still running; skipping this one",
+                 resync->syncer);
+    } else {
+        start_sync(resync, options->sync_interval_seconds);
+    }
+
+    struct timeval interval = { options->sync_interval_seconds, 0 };
+    if (event_add(resync->timer, &interval)) {
+        log_error("error scheduling sync");
+    }
+}
+
+int resync_init(resync_t *resync,
+                censorscope_options_t *options,
+                subprocesses_t *subprocesses,
+                experiment_schedules_t *schedules,
+                struct event_base *base) {
+    resync->options = options;
+    resync->subprocesses = subprocesses;
+    resync->schedules = schedules;
+    resync->timer = NULL;
+    resync->syncer = 0;
+    resync->manifest = NULL;
+
+    /* Before the first download there may be no sandbox at all, in which
+     * case everything it brings counts as added. */
+    if (build_manifest(options->sandbox_dir, NULL, &resync->manifest)) {
+        log_info("starting without a sandbox manifest");
+    }
+    time_t timeout = options->sync_interval_seconds > 0
+        ? options->sync_interval_seconds
+        : RESYNC_INITIAL_TIMEOUT_SECONDS;
+    if (start_sync(resync, timeout)) {
+        log_error("error starting sandbox download");
+    } else {
+        schedules->sync_pending = 1;
+    }
+
+    if (options->sync_interval_seconds <= 0) {
+        return 0;
+    }
+    resync->timer = evtimer_new(base, resync_callback, resync);
+    if (!resync->timer) {
+        log_error("error creating sync event");
+        return -1;
+    }
+    struct timeval interval = { options->sync_interval_seconds, 0 };
+    if (event_add(resync->timer, &interval)) {
+        log_error("error scheduling sync");
+        return -1;
+    }
+    return 0;
+}
+
+void resync_stop(resync_t *resync) {
+    if (resync->timer && event_del(resync->timer)) {
+        log_error("error removing sync event");
+    }
+}
+
+int resync_destroy(resync_t *resync) {
+    if (resync->timer) {
+        event_free(resync->timer);
+        resync->timer = NULL;
+    }
+    free_manifest(resync->manifest);
+    resync->manifest = NULL;
+    return 0;
+}
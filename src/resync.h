@@ -0,0 +1,84 @@
+#ifndef CENSORSCOPE_RESYNC_H
+#define CENSORSCOPE_RESYNC_H
+
+#include <time.h>
+#include <sys/types.h>
+
+#include <openssl/sha.h>
+
+#include "options.h"
+#include "sandbox.h"
+#include "scheduling.h"
+#include "subprocesses.h"
+
+struct event;
+struct event_base;
+
+/* The longest the download at startup may take when there's no
+ * sync_interval_seconds to limit it. */
+#define RESYNC_INITIAL_TIMEOUT_SECONDS 600
+
+/* What we know about one Lua file in the sandbox directory. We only hash a
+ * file again when its modification time or size changes. */
+typedef struct resync_file {
+    char *path;
+    struct timespec mtime;
+    off_t size;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct resync_file *next;
+} resync_file_t;
+
+/* The resync manager downloads the sandbox once at startup, and again every
+ * sync_interval_seconds, so new experiments reach a running probe without a
+ * restart. The scheduler starts from the sandbox it already has rather than
+ * waiting for the first download, which can take minutes when a whole fleet
+ * boots at once. The download
+ * transport runs in a child process, so a slow rsync doesn't stall the
+ * scheduler. Afterwards we compare the sandbox against a manifest of file
+ * digests. If nothing changed we do nothing; if sandbox/main.lua changed we
+ * evaluate it again and update only the schedules whose settings changed;
+ * and we recompile every changed file so later runs inherit the new code. */
+typedef struct {
+    censorscope_options_t *options;
+    subprocesses_t *subprocesses;
+    experiment_schedules_t *schedules;
+    struct event *timer;
+    /* The running download, or 0 if there isn't one. */
+    pid_t syncer;
+    resync_file_t *manifest;
+} resync_t;
+
+/* Record the current state of the sandbox, start downloading it in a child
+ * process and, unless options->sync_interval_seconds is 0, start resyncing
+ * periodically. The schedules count as busy until the first download is done
+ * and applied.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int resync_init(resync_t *resync,
+                censorscope_options_t *options,
+                subprocesses_t *subprocesses,
+                experiment_schedules_t *schedules,
+                struct event_base *base);
+
+/* Stop resyncing, for example once there's nothing left to run. A download
+ * in progress still finishes. */
+void resync_stop(resync_t *resync);
+
+int resync_destroy(resync_t *resync);
+
+/* Evaluate sandbox/main.lua in a sandbox, leaving its table of censorscope
+ * settings on top of the stack. If main.lua is missing, broken or has no
+ * experiments table, evaluate the copy at options->main_cache instead, which
+ * holds the last main.lua that loaded. If neither loads, leave a settings
+ * table with no experiments, so the scheduler starts with nothing to run and
+ * picks up the experiments once the download brings them.
+ *
+ * Returns: 0 if main.lua or its copy loaded, -1 if we fell back to no
+ * experiments.
+ *
+ */
+int resync_load_main(sandbox_t *sandbox, const censorscope_options_t *options);
+
+#endif
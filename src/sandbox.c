@@ -3,15 +3,21 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <event2/event.h>
+
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
 
+#include "arena.h"
+#include "async.h"
+#include "chunks.h"
+#include "dns.h"
+#include "http.h"
 #include "logging.h"
+#include "results.h"
 #include "util.h"
 
-#define BYTECODE_MAGIC_NUMBER 27
-
 /* Copied from lauxlib.c */
 static int panic (lua_State *L) {
     (void)L;  /* to avoid warnings */
@@ -20,38 +26,6 @@ static int panic (lua_State *L) {
     return 0;
 }
 
-/* This is an allocation function that artificially limits the pool of memory
- * available to scripts allocate.
- *
- * References:
- * http://www.lua.org/manual/5.1/manual.html#lua_Alloc
- * http://stackoverflow.com/a/9672205
- *
- */
-static void *l_alloc_restricted(void *ud, void *ptr, size_t osize, size_t nsize) {
-    size_t *available = (size_t *)ud;
-
-    if (nsize == 0) {  /* free */
-        free(ptr);
-        *available += osize;  /* reclaim memory */
-        return NULL;
-    } else {  /* malloc */
-        if (nsize > osize && *available < (nsize - osize)) {
-            log_error("Out of memory!");
-            return NULL;
-        }
-        ptr = realloc(ptr, nsize);
-        if (ptr) {  /* reallocation successful? */
-            if (nsize > osize) {
-                *available -= (nsize - osize);
-            } else {
-                *available += (osize - nsize);
-            }
-        }
-        return ptr;
-    }
-}
-
 /* This is a debug hook that aborts the currently running script. We use it to
  * abort a script after running a certain number of instruction cycles.
  *
@@ -67,33 +41,32 @@ static void exit_hook(lua_State *L, lua_Debug *ar) {
     luaL_error(L, "instruction limit reached");
 }
 
-/* Check whether an input file is Lua bytecode. We
- * do not evaluate Lua bytecode because it can escape
- * the sandbox.
- *
- * Returns 1 if the script is valid and 0 if it is not.
- *
- */
-static int is_valid_lua_script(const char *filename) {
-    FILE *handle = fopen(filename, "r");
-    if (!handle) {
-        log_error("fopen(%s) error: %m", filename);
-        return 0;
-    }
+/* The registry key under which sandbox_set_time_limit stores the sandbox,
+ * for limit_hook to find. */
+static char limit_hook_key;
 
-    int first_byte = fgetc(handle);
-    if (fclose(handle)) {
-        log_error("fgetc(%s) error: %m", filename);
-        return 0;
+/* Like exit_hook, but called every few instructions, so it can also abort a
+ * script that runs past the sandbox's kill_at. */
+static void limit_hook(lua_State *L, lua_Debug *ar) {
+    if (ar->event != LUA_HOOKCOUNT) {
+        return;
+    }
+    lua_pushlightuserdata(L, &limit_hook_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    sandbox_t *sandbox = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (!sandbox) {
+        return;
     }
-    if (first_byte == 0) {
-        return 0;
+    if (sandbox->instructions_left >= 0) {
+        sandbox->instructions_left -= SANDBOX_HOOK_INSTRUCTIONS;
+        if (sandbox->instructions_left <= 0) {
+            luaL_error(L, "instruction limit reached");
+        }
     }
-    if (first_byte == BYTECODE_MAGIC_NUMBER) {
-        log_error("for security, we do not evaluate Lua bytecode");
-        return 0;
+    if (sandbox->kill_at && monotonic_microseconds() >= sandbox->kill_at) {
+        luaL_error(L, "time limit reached");
     }
-    return 1;
 }
 
 /* A new entry to the packages search path.
@@ -127,14 +100,28 @@ static int prepend_package_path(lua_State *L, const char* new_entry) {
 int sandbox_init(sandbox_t *sandbox,
                  const char *name,
                  const censorscope_options_t *options) {
-    if (options->max_memory > 0) {
-        sandbox->available_memory = options->max_memory;
-        sandbox->L = lua_newstate(l_alloc_restricted, &sandbox->available_memory);
-    } else {
-        sandbox->L = luaL_newstate();
-    }
+    sandbox->dns_resolvers = NULL;
+    sandbox->http = NULL;
+    sandbox->async = NULL;
+    sandbox->run_thread = NULL;
+    sandbox->suspended = 0;
+    sandbox->async_wake = NULL;
+    sandbox->async_wake_arg = NULL;
+    sandbox->results = NULL;
+    sandbox->run_id = NULL;
+    sandbox->run_experiment = NULL;
+    sandbox->environment_ref = LUA_NOREF;
+    sandbox->deadline = 0;
+    sandbox->kill_at = 0;
+    sandbox->instructions_left = -1;
+    sandbox->environment_path = NULL;
+    /* The arena enforces max_memory, counting what malloc really hands out
+     * rather than what Lua asks for. */
+    arena_init(&sandbox->arena, options->max_memory);
+    sandbox->L = lua_newstate(arena_alloc, &sandbox->arena);
     if (!sandbox->L) {
-        log_error("error calling luaL_newstate");
+        log_error("error calling lua_newstate");
+        arena_destroy(&sandbox->arena);
         return -1;
     }
     lua_atpanic(sandbox->L, &panic);
@@ -144,6 +131,11 @@ int sandbox_init(sandbox_t *sandbox,
     luaL_openlibs(sandbox->L);
     lua_pushstring(sandbox->L, name);
     lua_setglobal(sandbox->L, "SANDBOX_NAME");
+    /* Runs of sharded experiments replace these. */
+    lua_pushinteger(sandbox->L, 0);
+    lua_setglobal(sandbox->L, "SHARD_INDEX");
+    lua_pushinteger(sandbox->L, 1);
+    lua_setglobal(sandbox->L, "SHARD_COUNT");
     lua_newtable(sandbox->L);
     if (censorscope_options_lua(options, sandbox->L)) {
         log_error("error creating table of censorscope options");
@@ -165,29 +157,139 @@ int sandbox_init(sandbox_t *sandbox,
         return -1;
     }
     free(new_pattern);
+
+    sandbox->base = event_base_new();
+    if (!sandbox->base) {
+        log_error("error creating sandbox event base");
+        return -1;
+    }
+    sandbox->async_base = sandbox->base;
     return 0;
 }
 
 int sandbox_destroy(sandbox_t *sandbox) {
     lua_close(sandbox->L);
+    /* Lua has freed every object, but the chunks they came from are still
+     * allocated. */
+    arena_destroy(&sandbox->arena);
+    async_state_free(sandbox);
+    dns_resolver_cache_free(sandbox->dns_resolvers);
+    http_state_free(sandbox->http);
+    results_writer_free(sandbox->results);
+    event_base_free(sandbox->base);
+    free(sandbox->environment_path);
     return 0;
 }
 
-int sandbox_run(sandbox_t *sandbox,
-                const char *filename,
-                const char *environment) {
-    if (!is_valid_lua_script(filename)) {
+void sandbox_reset_limits(sandbox_t *sandbox,
+                          const censorscope_options_t *options) {
+    arena_reset_peak(&sandbox->arena);
+
+    /* Keep a tenth of the timeout, and at least a second, for the script to
+     * finish up after its primitives give up. */
+    double timeout = options->experiment_timeout_seconds;
+    double margin = timeout / 10 > 1 ? timeout / 10 : 1;
+    if (timeout > margin) {
+        sandbox_set_deadline(sandbox, timeout - margin);
+    } else {
+        sandbox_set_deadline(sandbox, timeout);
+    }
+
+    /* Setting the count hook again restarts its count. */
+    if (options->max_instructions > 0) {
+        lua_sethook(sandbox->L,
+                    exit_hook,
+                    LUA_MASKCOUNT,
+                    options->max_instructions);
+    }
+}
+
+void sandbox_set_time_limit(sandbox_t *sandbox,
+                            const censorscope_options_t *options,
+                            double seconds) {
+    sandbox->kill_at = seconds > 0
+        ? monotonic_microseconds() + (int64_t)(seconds * 1e6)
+        : 0;
+    sandbox->instructions_left = options->max_instructions > 0
+        ? options->max_instructions
+        : -1;
+    lua_pushlightuserdata(sandbox->L, &limit_hook_key);
+    lua_pushlightuserdata(sandbox->L, sandbox);
+    lua_rawset(sandbox->L, LUA_REGISTRYINDEX);
+    lua_sethook(sandbox->L,
+                limit_hook,
+                LUA_MASKCOUNT,
+                SANDBOX_HOOK_INSTRUCTIONS);
+}
+
+void sandbox_set_deadline(sandbox_t *sandbox, double seconds) {
+    if (seconds <= 0) {
+        sandbox->deadline = 0;
+        return;
+    }
+    sandbox->deadline = monotonic_microseconds() + (int64_t)(seconds * 1e6);
+}
+
+int64_t sandbox_time_remaining(const sandbox_t *sandbox) {
+    if (sandbox->deadline == 0) {
+        return INT64_MAX;
+    }
+    int64_t remaining = sandbox->deadline - monotonic_microseconds();
+    return remaining > 0 ? remaining : 0;
+}
+
+double sandbox_limit_seconds(const sandbox_t *sandbox, double seconds) {
+    int64_t remaining = sandbox_time_remaining(sandbox);
+    if (remaining == INT64_MAX || seconds * 1e6 < remaining) {
+        return seconds;
+    }
+    return remaining / 1e6;
+}
+
+int sandbox_push_deadline_error(lua_State *L) {
+    lua_pushnil(L);
+    lua_pushstring(L, SANDBOX_DEADLINE_ERROR);
+    return 2;
+}
+
+int sandbox_preload_environment(sandbox_t *sandbox, const char *environment) {
+    if (chunks_load(sandbox->L, environment)) {
+        log_error("%s", lua_tostring(sandbox->L, -1));
+        lua_pop(sandbox->L, 1);
         return -1;
     }
+    char *path = strdup(environment);
+    if (!path) {
+        log_error("strdup error: %m");
+        lua_pop(sandbox->L, 1);
+        return -1;
+    }
+    luaL_unref(sandbox->L, LUA_REGISTRYINDEX, sandbox->environment_ref);
+    free(sandbox->environment_path);
+    sandbox->environment_ref = luaL_ref(sandbox->L, LUA_REGISTRYINDEX);
+    sandbox->environment_path = path;
+    return 0;
+}
 
-    /* Load (but not evaluate) the code to run in the sandbox. */
-    if (luaL_loadfile(sandbox->L, filename)) {
+int sandbox_load(sandbox_t *sandbox,
+                 const char *filename,
+                 const char *environment) {
+    /* Load (but not evaluate) the code to run in the sandbox. This refuses
+     * to load bytecode, which can escape the sandbox. */
+    if (chunks_load(sandbox->L, filename)) {
         log_error("%s", lua_tostring(sandbox->L, -1));
         return -1;
     }
     if (environment) {
-        /* Load (but not evaluate) the code that creates the environment. */
-        if (luaL_loadfile(sandbox->L, environment)) {
+        if (sandbox->environment_path
+            && strcmp(environment, sandbox->environment_path) == 0) {
+            /* Reuse the code that sandbox_preload_environment compiled. */
+            lua_rawgeti(sandbox->L,
+                        LUA_REGISTRYINDEX,
+                        sandbox->environment_ref);
+        } else if (chunks_load(sandbox->L, environment)) {
+            /* Otherwise load (but not evaluate) the code that creates the
+             * environment. */
             log_error("%s", lua_tostring(sandbox->L, -1));
             return -1;
         }
@@ -209,6 +311,15 @@ int sandbox_run(sandbox_t *sandbox,
         log_error("%s", lua_tostring(sandbox->L, -1));
         return -1;
     }
+    return 0;
+}
+
+int sandbox_run(sandbox_t *sandbox,
+                const char *filename,
+                const char *environment) {
+    if (sandbox_load(sandbox, filename, environment)) {
+        return -1;
+    }
     /* Evaluate the sandbox function, which is now at the top of the stack. */
     if (lua_pcall(sandbox->L, 0, 1, 0) != 0) {
         log_error("error running %s: %s",
@@ -1,15 +1,73 @@
 #ifndef _CENSORSCOPE_SANDBOX_H_
 #define _CENSORSCOPE_SANDBOX_H_
 
+#include <stdint.h>
+#include <sys/time.h>
+
 #include "lua.h"
 
+#include "arena.h"
 #include "options.h"
 
+struct async_state;
+struct dns_resolver_cache;
+struct event_base;
+struct http_state;
+struct results_writer;
+
 typedef struct {
     lua_State *L;
-    size_t available_memory;
+    /* Every allocation of L comes from here, within options->max_memory. */
+    arena_t arena;
+    /* An event loop private to this sandbox, on which primitives like
+     * dns_lookup_batch multiplex their sockets. It is separate from the
+     * scheduler's event base, which the child inherits but must not run. */
+    struct event_base *base;
+    /* Resolvers used by dns_lookup, created on first use. */
+    struct dns_resolver_cache *dns_resolvers;
+    /* curl handles and caches used by http_get, created on first use. */
+    struct http_state *http;
+    /* Engines and results for the asynchronous primitives, created on first
+     * use and freed after every run. */
+    struct async_state *async;
+    /* The event base those engines run on. It is base, except in runs inside
+     * the scheduler's process, whose operations run on the scheduler's event
+     * base so they progress while the run is suspended. */
+    struct event_base *async_base;
+    /* For runs inside the scheduler's process, the coroutine the experiment
+     * runs in. async_wait suspends it instead of running an event loop, and
+     * async_wake is called whenever an operation finishes, so the scheduler
+     * can resume it. NULL for other runs. */
+    lua_State *run_thread;
+    int suspended;
+    void (*async_wake)(void *arg);
+    void *async_wake_arg;
+    /* Buffers records from write_result, created on first use. */
+    struct results_writer *results;
+    /* The id and experiment name of the run in progress, which the results
+     * index records, or NULL between runs. */
+    const char *run_id;
+    const char *run_experiment;
+    /* The compiled environment script set by sandbox_preload_environment, as
+     * a reference into the registry, and its filename. */
+    int environment_ref;
+    char *environment_path;
+    /* When primitives must stop waiting on the network, in monotonic
+     * microseconds, or 0 for no deadline. */
+    int64_t deadline;
+    /* Limits enforced by the hook sandbox_set_time_limit installs: when the
+     * script is aborted, or 0 for never, and how many instructions it has
+     * left, or -1 for no limit. */
+    int64_t kill_at;
+    int64_t instructions_left;
 } sandbox_t;
 
+/* Primitives return this error once the sandbox's deadline has passed. */
+#define SANDBOX_DEADLINE_ERROR "deadline exceeded"
+
+/* How often the hook from sandbox_set_time_limit checks the clock. */
+#define SANDBOX_HOOK_INSTRUCTIONS 10000
+
 /* Initialize a sandbox, which you can use to run Lua code with memory and
  * instruction count constraints.
  *
@@ -27,6 +85,65 @@ int sandbox_init(sandbox_t *sandbox,
 
 int sandbox_destroy(sandbox_t *sandbox);
 
+/* Restore the sandbox's instruction budget, which otherwise counts down across
+ * every script the sandbox runs, and restart tracking its peak memory use.
+ * This also starts the deadline for the next run, a little before the
+ * experiment timeout so the script has time to write its results before we
+ * kill it. */
+void sandbox_reset_limits(sandbox_t *sandbox,
+                          const censorscope_options_t *options);
+
+/* Abort the running script seconds from now, or never if seconds is not
+ * positive, for runs that can't be killed because they share the scheduler's
+ * process. This replaces the instruction hook with one that checks the clock
+ * every SANDBOX_HOOK_INSTRUCTIONS instructions, and still enforces
+ * options->max_instructions, so call it after sandbox_reset_limits and before
+ * creating the coroutine to run the script in, which inherits the hook. */
+void sandbox_set_time_limit(sandbox_t *sandbox,
+                            const censorscope_options_t *options,
+                            double seconds);
+
+/* Make primitives give up seconds from now, or never if seconds is not
+ * positive. Blocking primitives pass the time remaining to curl, ldns and
+ * connect as their timeout, so a script stuck on the network still finishes
+ * and keeps its results. */
+void sandbox_set_deadline(sandbox_t *sandbox, double seconds);
+
+/* Return the microseconds until the sandbox's deadline, 0 if it has passed,
+ * or INT64_MAX if there is no deadline. */
+int64_t sandbox_time_remaining(const sandbox_t *sandbox);
+
+/* Limit a timeout in seconds to the time until the deadline. */
+double sandbox_limit_seconds(const sandbox_t *sandbox, double seconds);
+
+/* Push nil and SANDBOX_DEADLINE_ERROR, for a primitive to return once
+ * sandbox_time_remaining is 0.
+ *
+ * Returns: 2, the number of values pushed.
+ *
+ */
+int sandbox_push_deadline_error(lua_State *L);
+
+/* Compile an environment script once and keep it, so later calls to
+ * sandbox_run with the same environment skip reading and parsing it. The
+ * script is still evaluated on every run, so each run gets a fresh
+ * environment table.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int sandbox_preload_environment(sandbox_t *sandbox, const char *environment);
+
+/* Load a file to run inside a sandbox and set its environment, like
+ * sandbox_run, but leave the function on the stack instead of calling it.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int sandbox_load(sandbox_t *sandbox,
+                 const char *filename,
+                 const char *environment);
+
 /* Run a file inside a sandbox with memory and instruction count constraints.
  *
  * Arguments:
@@ -1,10 +1,12 @@
 #include "scheduling.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <event2/event.h>
 
@@ -13,53 +15,372 @@
 #include "lualib.h"
 
 #include "dns.h"
+#include "index.h"
+#include "inprocess.h"
 #include "logging.h"
+#include "luautil.h"
+#include "metrics.h"
 #include "options.h"
 #include "register.h"
+#include "results.h"
 #include "sandbox.h"
 #include "subprocesses.h"
+#include "trace.h"
 #include "util.h"
+#include "workers.h"
 
-typedef struct experiment_schedule {
+/* How main.lua asks for an experiment to be scheduled. */
+typedef struct {
     lua_Integer interval_seconds;
     lua_Integer num_runs;
-    struct event *ev;
+    lua_Integer priority;
+    int coalesce;
+    /* Delay every run by a random amount up to this many seconds. */
+    lua_Integer jitter_seconds;
+    /* Start the first run this long after loading, or after one interval if
+     * negative. */
+    lua_Integer offset_seconds;
+    /* Only start runs between these times, in seconds after local midnight.
+     * The window may span midnight. If they're equal there's no window. */
+    int window_start, window_end;
+    /* Start at most rate_limit_runs runs every rate_limit_seconds, or any
+     * number if rate_limit_runs is 0. */
+    lua_Integer rate_limit_runs, rate_limit_seconds;
+    /* Split each run across this many child processes. */
+    lua_Integer shards;
+    /* Run in the scheduler's process instead of forking. */
+    int in_process;
+} schedule_settings_t;
+
+typedef struct experiment_schedule {
+    schedule_settings_t settings;
+    /* The number of runs left. */
+    lua_Integer num_runs;
+    /* When the schedule next fires, in monotonic microseconds, and its place
+     * in the heap, or -1 if it won't fire again. */
+    int64_t next_run;
+    int heap_index;
+    /* Runs started in the current rate limit period, and when it began. */
+    lua_Integer period_runs;
+    int64_t period_start;
+    /* The number of this experiment's runs waiting in the queue. */
+    int queued;
+    /* This experiment's entry in the scheduler's metrics. */
+    run_stats_t *stats;
 
     experiment_t experiment;
-    subprocesses_t *subprocesses;
+    experiment_schedules_t *schedules;
 } experiment_schedule_t;
 
-/* Return the total number of keys in a table. Adapted from
- * http://www.lua.org/manual/5.1/manual.html#lua_next
+/* A run of an experiment that is waiting for a free slot. */
+typedef struct experiment_run {
+    experiment_schedule_t *schedule;
+    /* When the run joined the queue, in monotonic microseconds. */
+    int64_t queued_at;
+    struct experiment_run *next;
+} experiment_run_t;
+
+/* A run split across several child processes. Each shard writes its results
+ * to its own file in shard_dir, and when the last one exits we merge them into
+ * results_path and record the group as a single run. */
+typedef struct {
+    char *shard_dir;
+    char *results_path;
+    const char *extension;
+    /* Every shard, and the merged file, use the run's id. */
+    char run_id[EXPERIMENT_RUN_ID_SIZE];
+    /* Our own copy, since the schedule may be reloaded and freed while its
+     * shards are still running. */
+    char *experiment;
+    int shard_count;
+    /* The number of shards still running. */
+    int remaining;
+    run_result_t result;
+    int64_t started_at;
+} shard_group_t;
+
+/* A run in a child process. */
+typedef struct {
+    experiment_schedules_t *schedules;
+    run_stats_t *stats;
+    /* The group this run is a shard of, or NULL. */
+    shard_group_t *group;
+} forked_run_t;
+
+static void on_child_exit(const subprocess_exit_t *child, void *arg);
+
+static void free_shard_group(shard_group_t *group) {
+    free(group->shard_dir);
+    free(group->results_path);
+    free(group->experiment);
+    free(group);
+}
+
+/* Create a group for a sharded run of schedule, with a fresh directory for
+ * its shards' results under results_dir/.shards, which uploads skip.
+ *
+ * Returns: the group, or NULL on failure.
  *
  */
-static int count_table_keys(lua_State *L, int table_index) {
-    if (table_index < 0) {
-        /* If table_index is a relative index, then offset it by 1 because we
-         * will be putting an additional element on the top of the stack before
-         * referencing this index. */
-        --table_index;
+static shard_group_t *new_shard_group(experiment_schedule_t *schedule) {
+    const censorscope_options_t *options = schedule->experiment.options;
+    results_format_t format;
+    if (results_format_parse(options->results_format, &format)) {
+        log_error("invalid results format");
+        return NULL;
+    }
+    shard_group_t *group = calloc(1, sizeof(shard_group_t));
+    if (!group) {
+        log_error("calloc error: %m");
+        return NULL;
     }
+    group->extension = results_format_extension(format);
+    group->shard_count = schedule->settings.shards;
+    group->result.succeeded = 1;
+    group->started_at = monotonic_microseconds();
 
-    int count = 0;
-    lua_pushnil(L);  /* first key */
-    while (lua_next(L, table_index) != 0) {
-        count++;
-        lua_pop(L, 1);
+    group->experiment = strdup(schedule->experiment.name);
+
+    /* Name the merged file like api.lua names an unsharded run's. */
+    experiment_new_run_id(group->run_id, sizeof(group->run_id));
+    group->results_path = sprintf_malloc("%s/%s-%s.%s",
+                                         options->results_dir,
+                                         schedule->experiment.name,
+                                         group->run_id,
+                                         group->extension);
+    char *shards_dir = sprintf_malloc("%s/.shards", options->results_dir);
+    if (!group->experiment || !group->results_path || !shards_dir) {
+        log_error("error allocating shard paths");
+        free(shards_dir);
+        free_shard_group(group);
+        return NULL;
+    }
+    if ((mkdir(options->results_dir, 0755) && errno != EEXIST)
+        || (mkdir(shards_dir, 0755) && errno != EEXIST)) {
+        log_error("error creating %s: %m", shards_dir);
+        free(shards_dir);
+        free_shard_group(group);
+        return NULL;
+    }
+    group->shard_dir = sprintf_malloc("%s/%s-%s-XXXXXX",
+                                      shards_dir,
+                                      schedule->experiment.name,
+                                      group->run_id);
+    free(shards_dir);
+    if (!group->shard_dir || !mkdtemp(group->shard_dir)) {
+        log_error("error creating shard directory: %m");
+        free_shard_group(group);
+        return NULL;
+    }
+    return group;
+}
+
+/* Merge every shard's results into the group's results file, in shard order,
+ * and remove the shard directory.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+static int merge_shards(const censorscope_options_t *options,
+                        shard_group_t *group) {
+    results_format_t format;
+    if (results_format_parse(options->results_format, &format)) {
+        return -1;
+    }
+    results_writer_t *writer = results_writer_new(
+            format,
+            options->segment_max_bytes,
+            options->segment_max_age_seconds);
+    if (!writer) {
+        return -1;
+    }
+    writer->run_id = group->run_id;
+    writer->experiment = group->experiment;
+    int rc = 0;
+    for (int k = 0; k < group->shard_count; ++k) {
+        char *shard_path = sprintf_malloc("%s/%d.%s",
+                                          group->shard_dir,
+                                          k,
+                                          group->extension);
+        if (!shard_path) {
+            rc = -1;
+            continue;
+        }
+        /* A shard that was killed may leave its last segment unfinished,
+         * which we drop like any other unclosed segment. */
+        for (int sequence = 0;; ++sequence) {
+            char *segment = results_segment_name(shard_path, sequence);
+            if (!segment) {
+                rc = -1;
+                break;
+            }
+            char *partial = sprintf_malloc("%s%s",
+                                           segment,
+                                           RESULTS_PARTIAL_SUFFIX);
+            if (partial && unlink(partial) == 0) {
+                log_info("dropping unfinished results in %s", partial);
+            }
+            free(partial);
+            if (access(segment, F_OK)) {
+                free(segment);
+                break;
+            }
+            if (results_writer_append_file(writer,
+                                           group->results_path,
+                                           segment)) {
+                rc = -1;
+            }
+            unlink(segment);
+            free(segment);
+        }
+        free(shard_path);
+    }
+    if (results_writer_close(writer)) {
+        rc = -1;
+    }
+    results_writer_free(writer);
+    /* The shards indexed their own segments, which are gone now. */
+    char *index = sprintf_malloc("%s/%s", group->shard_dir, INDEX_FILENAME);
+    if (index) {
+        unlink(index);
+        free(index);
     }
-    return count;
+    if (rmdir(group->shard_dir)) {
+        log_error("error removing %s: %m", group->shard_dir);
+        rc = -1;
+    }
+    return rc;
 }
 
-static void experiment_callback(evutil_socket_t fd, short what, void *arg) {
-    experiment_schedule_t *schedule = arg;
-    if (schedule->num_runs == 0) {
-        event_del(schedule->ev);
-    } else {
-        schedule->num_runs--;
+/* Fork one child per shard of a run. The group counts as a single run towards
+ * max-children and the metrics, even though it uses several processes. */
+static void start_sharded_run(experiment_schedule_t *schedule) {
+    experiment_schedules_t *schedules = schedule->schedules;
+    time_t timeout = schedule->experiment.options->experiment_timeout_seconds;
+    shard_group_t *group = new_shard_group(schedule);
+    if (!group) {
+        return;
+    }
+    for (int k = 0; k < group->shard_count; ++k) {
+        forked_run_t *run = malloc(sizeof(forked_run_t));
+        if (!run) {
+            log_error("malloc error: %m");
+            group->result.succeeded = 0;
+            break;
+        }
+        run->schedules = schedules;
+        run->stats = schedule->stats;
+        run->group = group;
+        int64_t fork_start = monotonic_microseconds();
+        int rc = subprocesses_fork(schedules->subprocesses, timeout);
+        if (rc == 0) {
+            schedule->experiment.shard_index = k;
+            schedule->experiment.shard_count = group->shard_count;
+            schedule->experiment.shard_dir = group->shard_dir;
+            strcpy(schedule->experiment.run_id, group->run_id);
+            if (experiment_run(&schedule->experiment)) {
+                exit(EXIT_FAILURE);
+            }
+            exit(EXIT_SUCCESS);
+        }
+        if (rc < 0 || subprocesses_on_exit(schedules->subprocesses,
+                                           rc,
+                                           on_child_exit,
+                                           run)) {
+            free(run);
+            group->result.succeeded = 0;
+            break;
+        }
+        trace_span("fork",
+                   schedule->experiment.name,
+                   fork_start,
+                   monotonic_microseconds());
+        ++group->remaining;
+    }
+    if (group->remaining == 0) {
+        rmdir(group->shard_dir);
+        free_shard_group(group);
+        return;
     }
+    ++schedules->running;
+    ++schedule->stats->started;
+}
+
+static void on_job_done(void *arg, void *job_arg, const run_result_t *result);
+
+/* Start a run, in this process, in a worker or in new child processes. */
+static void start_run(experiment_schedule_t *schedule) {
+    experiment_schedules_t *schedules = schedule->schedules;
     time_t timeout = schedule->experiment.options->experiment_timeout_seconds;
-    int rc = subprocesses_fork(schedule->subprocesses, timeout);
-    if (rc != 0) {
+    if (schedule->settings.in_process) {
+        /* Count the run first, since it may finish before inprocess_start
+         * returns. */
+        ++schedules->running;
+        ++schedule->stats->started;
+        if (inprocess_start(&schedule->experiment,
+                            schedules->base,
+                            on_job_done,
+                            schedules,
+                            schedule->stats)) {
+            log_error("error starting '%s' in process",
+                      schedule->experiment.name);
+            --schedules->running;
+            --schedule->stats->started;
+        }
+        return;
+    }
+    if (schedule->settings.shards > 1) {
+        /* Workers run one experiment at a time, so shards always fork. */
+        start_sharded_run(schedule);
+        return;
+    }
+    if (schedules->workers) {
+        /* Count the run first, since the pool may report it finished before
+         * worker_pool_submit returns. */
+        ++schedules->running;
+        ++schedule->stats->started;
+        if (worker_pool_submit(schedules->workers,
+                               schedule->experiment.name,
+                               timeout,
+                               schedule->stats)) {
+            log_error("error submitting '%s' to worker pool",
+                      schedule->experiment.name);
+            --schedules->running;
+            --schedule->stats->started;
+        }
+        return;
+    }
+    forked_run_t *run = malloc(sizeof(forked_run_t));
+    if (!run) {
+        log_error("malloc error: %m");
+        return;
+    }
+    run->schedules = schedules;
+    run->stats = schedule->stats;
+    run->group = NULL;
+    int64_t fork_start = monotonic_microseconds();
+    int rc = subprocesses_fork(schedules->subprocesses, timeout);
+    if (rc > 0) {
+        trace_span("fork",
+                   schedule->experiment.name,
+                   fork_start,
+                   monotonic_microseconds());
+    }
+    if (rc < 0) {
+        free(run);
+        return;
+    } else if (rc > 0) {
+        /* The child can't be reaped until we return to the event loop, so
+         * it's safe to attach the callback after forking. */
+        if (subprocesses_on_exit(schedules->subprocesses,
+                                 rc,
+                                 on_child_exit,
+                                 run)) {
+            free(run);
+            return;
+        }
+        ++schedules->running;
+        ++run->stats->started;
         return;
     }
     if (experiment_run(&schedule->experiment)) {
@@ -68,124 +389,710 @@ static void experiment_callback(evutil_socket_t fd, short what, void *arg) {
     exit(EXIT_SUCCESS);
 }
 
-static int experiment_schedule_init(experiment_schedule_t *schedule,
-                                    subprocesses_t *subprocesses,
-                                    censorscope_options_t *options,
-                                    struct event_base *base,
-                                    const char *name,
-                                    int interval_seconds,
-                                    int num_runs) {
-    schedule->subprocesses = subprocesses;
-    schedule->interval_seconds = interval_seconds;
-    schedule->num_runs = num_runs;
+/* Start queued runs until we reach the limit. */
+static void dispatch_runs(experiment_schedules_t *schedules) {
+    if (schedules->dispatching) {
+        return;
+    }
+    schedules->dispatching = 1;
+    while (schedules->queue
+           && (schedules->max_running <= 0
+               || schedules->running < schedules->max_running)) {
+        experiment_run_t *run = schedules->queue;
+        schedules->queue = run->next;
+        --run->schedule->queued;
+        experiment_schedule_t *schedule = run->schedule;
+        trace_span("queued",
+                   schedule->experiment.name,
+                   run->queued_at,
+                   monotonic_microseconds());
+        free(run);
+        start_run(schedule);
+    }
+    schedules->dispatching = 0;
+}
 
-    if (schedule->num_runs <= 0) {
-        schedule->ev = NULL;
+static void queue_run(experiment_schedule_t *schedule) {
+    experiment_schedules_t *schedules = schedule->schedules;
+    if (schedule->settings.coalesce && schedule->queued > 0) {
+        log_info("'%s' already has a run queued; skipping this one",
+                 schedule->experiment.name);
+        return;
+    }
+    experiment_run_t *run = malloc(sizeof(experiment_run_t));
+    if (!run) {
+        log_error("malloc error: %m");
+        return;
+    }
+    run->schedule = schedule;
+    run->queued_at = monotonic_microseconds();
+
+    /* Insert the run after every run with the same or higher priority. */
+    experiment_run_t **link = &schedules->queue;
+    while (*link && (*link)->schedule->settings.priority
+           >= schedule->settings.priority) {
+        link = &(*link)->next;
+    }
+    run->next = *link;
+    *link = run;
+    ++schedule->queued;
+
+    dispatch_runs(schedules);
+}
+
+/* Tell the owner if there's nothing left to run. */
+static void check_idle(experiment_schedules_t *schedules) {
+    if (!experiment_schedules_idle(schedules)) {
+        return;
+    }
+    metrics_stop(&schedules->metrics);
+    if (schedules->idle_callback) {
+        schedules->idle_callback(schedules->idle_callback_arg);
+    }
+}
+
+/* Record how a run went and start the next queued one. */
+static void run_finished(experiment_schedules_t *schedules,
+                         run_stats_t *stats,
+                         const run_result_t *result) {
+    --schedules->running;
+    metrics_record(stats, result);
+    if (trace_enabled()) {
+        int64_t now = monotonic_microseconds();
+        trace_span("run", stats->name, now - result->wall_microseconds, now);
+    }
+    log_info("run of '%s' %s after %.3f seconds "
+             "(user %.3f, system %.3f, max rss %ld KiB)",
+             stats->name,
+             result->timed_out
+                 ? "timed out"
+                 : result->succeeded ? "succeeded" : "failed",
+             result->wall_microseconds / 1e6,
+             result->user_microseconds / 1e6,
+             result->system_microseconds / 1e6,
+             result->max_rss_kilobytes);
+    dispatch_runs(schedules);
+    check_idle(schedules);
+}
+
+static void on_child_exit(const subprocess_exit_t *child, void *arg) {
+    forked_run_t *run = arg;
+    run_result_t result;
+    metrics_result_from_status(&result, child->status, &child->usage);
+    result.timed_out = child->timed_out;
+    result.wall_microseconds = child->wall_microseconds;
+    shard_group_t *group = run->group;
+    if (!group) {
+        run_finished(run->schedules, run->stats, &result);
+        free(run);
+        return;
+    }
+
+    group->result.succeeded &= result.succeeded;
+    group->result.timed_out |= result.timed_out;
+    group->result.user_microseconds += result.user_microseconds;
+    group->result.system_microseconds += result.system_microseconds;
+    if (result.max_rss_kilobytes > group->result.max_rss_kilobytes) {
+        group->result.max_rss_kilobytes = result.max_rss_kilobytes;
+    }
+    if (--group->remaining == 0) {
+        group->result.wall_microseconds = monotonic_microseconds()
+            - group->started_at;
+        if (merge_shards(run->schedules->options, group)) {
+            log_error("error merging the shards of '%s' into %s",
+                      run->stats->name,
+                      group->results_path);
+            group->result.succeeded = 0;
+        }
+        run_finished(run->schedules, run->stats, &group->result);
+        free_shard_group(group);
+    }
+    free(run);
+}
+
+static void on_job_done(void *arg,
+                        void *job_arg,
+                        const run_result_t *result) {
+    run_finished(arg, job_arg, result);
+}
+
+/* The schedules that will fire again form a binary min-heap ordered by
+ * next_run, and a single timer waits for the earliest of them, so adding,
+ * removing or firing a schedule costs O(log n) however many there are. */
+
+static void heap_set(experiment_schedules_t *schedules,
+                     int index,
+                     experiment_schedule_t *schedule) {
+    schedules->heap[index] = schedule;
+    schedule->heap_index = index;
+}
+
+static void sift_up(experiment_schedules_t *schedules, int index) {
+    experiment_schedule_t *schedule = schedules->heap[index];
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (schedules->heap[parent]->next_run <= schedule->next_run) {
+            break;
+        }
+        heap_set(schedules, index, schedules->heap[parent]);
+        index = parent;
+    }
+    heap_set(schedules, index, schedule);
+}
+
+static void sift_down(experiment_schedules_t *schedules, int index) {
+    experiment_schedule_t *schedule = schedules->heap[index];
+    for (;;) {
+        int child = 2 * index + 1;
+        if (child >= schedules->heap_count) {
+            break;
+        }
+        if (child + 1 < schedules->heap_count
+            && schedules->heap[child + 1]->next_run
+                < schedules->heap[child]->next_run) {
+            ++child;
+        }
+        if (schedule->next_run <= schedules->heap[child]->next_run) {
+            break;
+        }
+        heap_set(schedules, index, schedules->heap[child]);
+        index = child;
+    }
+    heap_set(schedules, index, schedule);
+}
+
+/* The heap has room for every schedule, so this can't fail. */
+static void heap_push(experiment_schedules_t *schedules,
+                      experiment_schedule_t *schedule) {
+    int index = schedules->heap_count++;
+    heap_set(schedules, index, schedule);
+    sift_up(schedules, index);
+}
+
+static void heap_remove(experiment_schedules_t *schedules,
+                        experiment_schedule_t *schedule) {
+    int index = schedule->heap_index;
+    if (index < 0) {
+        return;
+    }
+    schedule->heap_index = -1;
+    experiment_schedule_t *last = schedules->heap[--schedules->heap_count];
+    if (last == schedule) {
+        return;
+    }
+    heap_set(schedules, index, last);
+    sift_up(schedules, index);
+    sift_down(schedules, last->heap_index);
+}
+
+/* Point the timer at the earliest schedule. */
+static void reset_timer(experiment_schedules_t *schedules) {
+    if (schedules->heap_count == 0) {
+        if (event_del(schedules->timer)) {
+            log_error("error deleting event");
+        }
+        return;
+    }
+    int64_t delay = schedules->heap[0]->next_run - monotonic_microseconds();
+    if (delay < 0) {
+        delay = 0;
+    }
+    struct timeval timeout = { delay / 1000000, delay % 1000000 };
+    if (event_add(schedules->timer, &timeout)) {
+        log_error("error adding event.");
+    }
+}
+
+static int64_t jitter_microseconds(const schedule_settings_t *settings) {
+    if (settings->jitter_seconds <= 0) {
         return 0;
     }
+    return (int64_t)(drand48() * settings->jitter_seconds * 1000000);
+}
 
-    schedule->ev = event_new(base,
-                             -1,
-                             EV_TIMEOUT | EV_PERSIST,
-                             experiment_callback,
-                             schedule);
-    if (!schedule->ev) {
-        log_error("error calling event_new");
+/* Return how many seconds until the schedule's time-of-day window opens, or 0
+ * if it's open now. */
+static long window_delay(const schedule_settings_t *settings) {
+    if (settings->window_start == settings->window_end) {
+        return 0;
+    }
+    time_t now = time(NULL);
+    struct tm local;
+    if (!localtime_r(&now, &local)) {
+        return 0;
+    }
+    int seconds = local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+    int start = settings->window_start, end = settings->window_end;
+    int open = start < end
+        ? seconds >= start && seconds < end
+        : seconds >= start || seconds < end;
+    if (open) {
+        return 0;
+    }
+    return (start - seconds + 86400) % 86400;
+}
+
+/* Return how many seconds until the schedule's rate limit allows another
+ * run, or 0 if it allows one now. */
+static long rate_limit_delay(experiment_schedule_t *schedule, int64_t now) {
+    const schedule_settings_t *settings = &schedule->settings;
+    if (settings->rate_limit_runs <= 0) {
+        return 0;
+    }
+    int64_t period = (int64_t)settings->rate_limit_seconds * 1000000;
+    if (now - schedule->period_start >= period) {
+        schedule->period_start = now;
+        schedule->period_runs = 0;
+    }
+    if (schedule->period_runs < settings->rate_limit_runs) {
+        return 0;
+    }
+    return (schedule->period_start + period - now + 999999) / 1000000;
+}
+
+/* Handle a schedule that is due. It has already been removed from the
+ * heap. */
+static void fire_schedule(experiment_schedule_t *schedule, int64_t now) {
+    experiment_schedules_t *schedules = schedule->schedules;
+    const schedule_settings_t *settings = &schedule->settings;
+
+    /* Runs that aren't allowed yet are postponed, not dropped. */
+    long delay = window_delay(settings);
+    if (delay == 0) {
+        delay = rate_limit_delay(schedule, now);
+    }
+    if (delay > 0) {
+        log_debug("postponing '%s' by %ld seconds",
+                  schedule->experiment.name,
+                  delay);
+        schedule->next_run = now
+            + (int64_t)delay * 1000000
+            + jitter_microseconds(settings);
+        heap_push(schedules, schedule);
+        return;
+    }
+
+    ++schedule->period_runs;
+    if (--schedule->num_runs > 0) {
+        schedule->next_run = now
+            + (int64_t)settings->interval_seconds * 1000000
+            + jitter_microseconds(settings);
+        heap_push(schedules, schedule);
+    }
+    queue_run(schedule);
+}
+
+static void timer_callback(evutil_socket_t fd, short what, void *arg) {
+    experiment_schedules_t *schedules = arg;
+    int64_t now = monotonic_microseconds();
+    while (schedules->heap_count > 0 && schedules->heap[0]->next_run <= now) {
+        experiment_schedule_t *schedule = schedules->heap[0];
+        heap_remove(schedules, schedule);
+        fire_schedule(schedule, now);
+    }
+    reset_timer(schedules);
+    check_idle(schedules);
+}
+
+/* Parse a time of day like "14:30" into seconds after midnight. */
+static int parse_time_of_day(const char *string, int *seconds) {
+    int hours, minutes;
+    char extra;
+    if (sscanf(string, "%d:%d%c", &hours, &minutes, &extra) != 2
+        || hours < 0 || hours > 23 || minutes < 0 || minutes > 59) {
         return -1;
     }
+    *seconds = hours * 3600 + minutes * 60;
+    return 0;
+}
 
-    if (experiment_init(&schedule->experiment, name, options)) {
-        log_error("error initializing experiment");
+/* Read an experiment's settings from the table at the top of the stack
+ * without raising Lua errors, so we can check a new main.lua before using it.
+ *
+ * Returns: 0 on success, -1 if the settings are invalid.
+ *
+ */
+static int read_settings(lua_State *L,
+                         const censorscope_options_t *options,
+                         schedule_settings_t *settings) {
+    if (!lua_istable(L, -1)) {
+        return -1;
+    }
+    lua_getfield(L, -1, "interval_seconds");
+    lua_getfield(L, -2, "num_runs");
+    int valid = lua_isnumber(L, -1) && lua_isnumber(L, -2);
+    lua_pop(L, 2);
+    if (!valid) {
+        return -1;
+    }
+    settings->interval_seconds = optfield_integer(L, -1, "interval_seconds", 0);
+    settings->num_runs = optfield_integer(L, -1, "num_runs", 0);
+    settings->priority = optfield_integer(L, -1, "priority", 0);
+    settings->coalesce = optfield_boolean(L, -1, "coalesce", 0);
+    settings->jitter_seconds = optfield_integer(L,
+                                                -1,
+                                                "jitter_seconds",
+                                                options->jitter_seconds);
+    settings->offset_seconds = optfield_integer(L, -1, "offset_seconds", -1);
+    settings->rate_limit_runs = optfield_integer(L, -1, "rate_limit_runs", 0);
+    settings->rate_limit_seconds = optfield_integer(L,
+                                                    -1,
+                                                    "rate_limit_seconds",
+                                                    3600);
+    if (settings->rate_limit_runs > 0 && settings->rate_limit_seconds <= 0) {
+        return -1;
+    }
+    settings->shards = optfield_integer(L, -1, "shards", 1);
+    if (settings->shards < 1) {
+        return -1;
+    }
+    settings->in_process = optfield_boolean(L, -1, "in_process", 0);
+    if (settings->in_process && settings->shards > 1) {
         return -1;
     }
 
-    struct timeval next_run;
-    next_run.tv_sec = interval_seconds;
-    next_run.tv_usec = 0;
-    if (event_add(schedule->ev, &next_run)) {
-        log_error("error adding event.");
+    settings->window_start = settings->window_end = 0;
+    const char *window_start = optfield_string(L, -1, "window_start", NULL);
+    const char *window_end = optfield_string(L, -1, "window_end", NULL);
+    if (!window_start != !window_end) {
+        return -1;
+    }
+    if (window_start
+        && (parse_time_of_day(window_start, &settings->window_start)
+            || parse_time_of_day(window_end, &settings->window_end))) {
+        return -1;
+    }
+    return 0;
+}
+
+static int same_settings(const schedule_settings_t *a,
+                         const schedule_settings_t *b) {
+    return a->interval_seconds == b->interval_seconds
+        && a->num_runs == b->num_runs
+        && a->priority == b->priority
+        && a->coalesce == b->coalesce
+        && a->jitter_seconds == b->jitter_seconds
+        && a->offset_seconds == b->offset_seconds
+        && a->window_start == b->window_start
+        && a->window_end == b->window_end
+        && a->rate_limit_runs == b->rate_limit_runs
+        && a->rate_limit_seconds == b->rate_limit_seconds
+        && a->shards == b->shards
+        && a->in_process == b->in_process;
+}
+
+static int experiment_schedule_init(experiment_schedule_t *schedule,
+                                    experiment_schedules_t *schedules,
+                                    const char *name,
+                                    const schedule_settings_t *settings) {
+    schedule->schedules = schedules;
+    schedule->settings = *settings;
+    schedule->num_runs = settings->num_runs;
+    schedule->queued = 0;
+    schedule->heap_index = -1;
+    schedule->period_runs = 0;
+    schedule->period_start = monotonic_microseconds();
+    schedule->stats = metrics_stats(&schedules->metrics, name);
+    if (!schedule->stats) {
         return -1;
     }
 
+    if (experiment_init(&schedule->experiment, name, schedules->options)) {
+        log_error("error initializing experiment");
+        return -1;
+    }
+
+    if (schedule->num_runs <= 0) {
+        return 0;
+    }
+
+    /* Jitter spreads the first runs of a fleet of probes that all started at
+     * once. */
+    lua_Integer first_run = settings->offset_seconds >= 0
+        ? settings->offset_seconds
+        : settings->interval_seconds;
+    schedule->next_run = schedule->period_start
+        + (int64_t)first_run * 1000000
+        + jitter_microseconds(settings);
+    heap_push(schedules, schedule);
+
     log_info("loaded experiment '%s' with interval %ld to run %ld times",
              name,
-             interval_seconds,
-             num_runs);
+             (long)settings->interval_seconds,
+             (long)settings->num_runs);
 
     return 0;
 }
 
-static lua_Integer checkfield_integer(lua_State *L,
-                                      int table_index,
-                                      const char *key) {
-    lua_getfield(L, table_index, key);
-    lua_Integer value = luaL_checkinteger(L, -1);
-    lua_pop(L, 1);
-    return value;
+/* Drop the queued runs of one experiment. */
+static void drop_queued_runs(experiment_schedules_t *schedules,
+                             experiment_schedule_t *schedule) {
+    experiment_run_t **link = &schedules->queue;
+    while (*link) {
+        experiment_run_t *run = *link;
+        if (run->schedule == schedule) {
+            *link = run->next;
+            free(run);
+        } else {
+            link = &run->next;
+        }
+    }
+    schedule->queued = 0;
+}
+
+static void free_schedule(experiment_schedule_t *schedule) {
+    experiment_destroy(&schedule->experiment);
+    free(schedule);
+}
+
+/* Create a schedule for the experiment named name, with settings, and add it
+ * to the list. */
+static int add_schedule(experiment_schedules_t *schedules,
+                        const char *name,
+                        const schedule_settings_t *settings) {
+    if (schedules->count + 1 > schedules->capacity) {
+        int capacity = (schedules->capacity + 1) * 2;
+        experiment_schedule_t **new_schedules = realloc(
+                schedules->schedules,
+                capacity * sizeof(experiment_schedule_t *));
+        if (!new_schedules) {
+            log_error("realloc error: %m");
+            return -1;
+        }
+        schedules->schedules = new_schedules;
+        experiment_schedule_t **new_heap = realloc(
+                schedules->heap,
+                capacity * sizeof(experiment_schedule_t *));
+        if (!new_heap) {
+            log_error("realloc error: %m");
+            return -1;
+        }
+        schedules->heap = new_heap;
+        schedules->capacity = capacity;
+    }
+    experiment_schedule_t *schedule = calloc(1, sizeof(experiment_schedule_t));
+    if (!schedule) {
+        log_error("calloc error: %m");
+        return -1;
+    }
+    if (experiment_schedule_init(schedule, schedules, name, settings)) {
+        heap_remove(schedules, schedule);
+        free_schedule(schedule);
+        return -1;
+    }
+    schedules->schedules[schedules->count++] = schedule;
+    return 0;
+}
+
+/* Unschedule the experiment at an index in the list. The list is unordered,
+ * so we fill the gap with the last schedule. */
+static void remove_schedule(experiment_schedules_t *schedules, int index) {
+    experiment_schedule_t *schedule = schedules->schedules[index];
+    drop_queued_runs(schedules, schedule);
+    heap_remove(schedules, schedule);
+    free_schedule(schedule);
+    schedules->schedules[index] = schedules->schedules[--schedules->count];
+}
+
+/* Check every entry of the experiments table at the top of the stack.
+ *
+ * Returns: 0 if they are all valid, -1 otherwise.
+ *
+ */
+static int check_experiments(lua_State *L, const censorscope_options_t *options) {
+    lua_pushnil(L);  /* first key */
+    while (lua_next(L, -2) != 0) {
+        schedule_settings_t settings;
+        if (lua_type(L, -2) != LUA_TSTRING
+            || read_settings(L, options, &settings)) {
+            log_error("invalid settings for experiment '%s'",
+                      lua_type(L, -2) == LUA_TSTRING
+                          ? lua_tostring(L, -2)
+                          : "?");
+            lua_pop(L, 2);  /* Pop value and key. */
+            return -1;
+        }
+        lua_pop(L, 1);  /* Pop value. Leave key for lua_next. */
+    }
+    return 0;
 }
 
 int experiment_schedules_init(experiment_schedules_t *schedules,
                               subprocesses_t *subprocesses,
+                              worker_pool_t *workers,
                               censorscope_options_t *options,
                               struct event_base *base,
                               lua_State *L,
                               int table_index) {
-    lua_getfield(L, table_index, "experiments");
+    schedules->schedules = NULL;
+    schedules->heap = NULL;
+    schedules->count = schedules->capacity = schedules->heap_count = 0;
+    schedules->options = options;
+    schedules->base = base;
+    schedules->queue = NULL;
+    schedules->running = 0;
+    schedules->dispatching = 0;
+    schedules->subprocesses = subprocesses;
+    schedules->workers = workers;
+    schedules->idle_callback = NULL;
+    schedules->idle_callback_arg = NULL;
+    schedules->sync_pending = 0;
+    schedules->max_running = options->max_children;
+    if (workers) {
+        /* There's no point queueing runs in the pool rather than here, where
+         * we can apply priorities. */
+        if (schedules->max_running <= 0
+            || schedules->max_running > workers->count) {
+            schedules->max_running = workers->count;
+        }
+        workers->job_done = on_job_done;
+        workers->job_done_arg = schedules;
+    }
+    if (metrics_init(&schedules->metrics, options, base)) {
+        return -1;
+    }
 
-    schedules->count = count_table_keys(L, -1);
-    schedules->schedules = calloc(schedules->count,
-                                  sizeof(experiment_schedule_t));
-    if (!schedules->schedules) {
-        log_error("calloc error: %m");
+    /* Probes in a fleet must not all pick the same jitter. */
+    srand48(time(NULL) ^ getpid());
+    schedules->timer = evtimer_new(base, timer_callback, schedules);
+    if (!schedules->timer) {
+        log_error("error calling event_new");
+        return -1;
+    }
+
+    lua_getfield(L, table_index, "experiments");
+    if (check_experiments(L, options)) {
         lua_pop(L, 1);  /* Pop the experiments table. */
         return -1;
     }
 
-    int i = 0;
     lua_pushnil(L);  /* first key */
     while (lua_next(L, -2) != 0) {
-        if (experiment_schedule_init(&schedules->schedules[i],
-                                     subprocesses,
-                                     options,
-                                     base,
-                                     luaL_checkstring(L, -2),
-                                     checkfield_integer(L, -1, "interval_seconds"),
-                                     checkfield_integer(L, -1, "num_runs"))) {
+        schedule_settings_t settings;
+        read_settings(L, options, &settings);
+        if (add_schedule(schedules, lua_tostring(L, -2), &settings)) {
             log_error("error initializing experiment");
             lua_pop(L, 3);  /* Pop value, key, and experiments table. */
             return -1;
         }
 
         lua_pop(L, 1);  /* Pop value. Leave key for lua_next. */
-        ++i;
     }
 
     lua_pop(L, 1);  /* Pop the experiments table. */
 
+    reset_timer(schedules);
     return 0;
 }
 
-int experiment_schedules_stop_pending(experiment_schedules_t *schedules) {
-    int return_value = 0;
-    for (int i = 0; i < schedules->count; ++i) {
-        if (!schedules->schedules[i].ev) {
-            continue;
+int experiment_schedules_update(experiment_schedules_t *schedules,
+                                lua_State *L,
+                                int table_index) {
+    censorscope_options_t *options = schedules->options;
+    if (table_index < 0) {
+        table_index = lua_gettop(L) + table_index + 1;
+    }
+    lua_getfield(L, table_index, "experiments");
+    if (!lua_istable(L, -1)) {
+        log_error("main.lua has no experiments table");
+        lua_pop(L, 1);
+        return -1;
+    }
+
+    /* Check every entry before changing anything, since we're replacing
+     * schedules that work. */
+    if (check_experiments(L, options)) {
+        log_error("keeping old schedules");
+        lua_pop(L, 1);  /* Pop the experiments table. */
+        return -1;
+    }
+
+    /* Unschedule experiments that were removed or changed. */
+    for (int i = schedules->count - 1; i >= 0; --i) {
+        experiment_schedule_t *schedule = schedules->schedules[i];
+        lua_getfield(L, -1, schedule->experiment.name);
+        schedule_settings_t settings;
+        int keep = read_settings(L, options, &settings) == 0
+            && same_settings(&schedule->settings, &settings);
+        lua_pop(L, 1);
+        if (!keep) {
+            log_info("unloading experiment '%s'", schedule->experiment.name);
+            remove_schedule(schedules, i);
         }
-        if (event_del(schedules->schedules[i].ev)) {
-            log_error("error deleting event");
-            return_value = -1;
+    }
+
+    /* Schedule every experiment we don't have. */
+    int rc = 0;
+    lua_pushnil(L);  /* first key */
+    while (lua_next(L, -2) != 0) {
+        const char *name = lua_tostring(L, -2);
+        int found = 0;
+        for (int i = 0; i < schedules->count && !found; ++i) {
+            found = strcmp(schedules->schedules[i]->experiment.name, name) == 0;
+        }
+        schedule_settings_t settings;
+        read_settings(L, options, &settings);
+        if (!found && add_schedule(schedules, name, &settings)) {
+            log_error("error loading experiment '%s'", name);
+            rc = -1;
         }
+        lua_pop(L, 1);  /* Pop value. Leave key for lua_next. */
     }
+    lua_pop(L, 1);  /* Pop the experiments table. */
+
+    reset_timer(schedules);
+    check_idle(schedules);
+    return rc;
+}
+
+/* Drop every queued run. */
+static void clear_queue(experiment_schedules_t *schedules) {
+    while (schedules->queue) {
+        experiment_run_t *run = schedules->queue;
+        schedules->queue = run->next;
+        --run->schedule->queued;
+        free(run);
+    }
+}
+
+int experiment_schedules_stop_pending(experiment_schedules_t *schedules) {
+    clear_queue(schedules);
+    while (schedules->heap_count > 0) {
+        heap_remove(schedules, schedules->heap[0]);
+    }
+    int return_value = 0;
+    if (event_del(schedules->timer)) {
+        log_error("error deleting event");
+        return_value = -1;
+    }
+    check_idle(schedules);
     return return_value;
 }
 
+int experiment_schedules_idle(const experiment_schedules_t *schedules) {
+    return schedules->running == 0
+        && !schedules->queue
+        && schedules->heap_count == 0
+        && !schedules->sync_pending;
+}
+
+void experiment_schedules_check_idle(experiment_schedules_t *schedules) {
+    check_idle(schedules);
+}
+
 int experiment_schedules_destroy(experiment_schedules_t *schedules) {
+    clear_queue(schedules);
+    inprocess_abort_all();
+    if (schedules->workers) {
+        schedules->workers->job_done = NULL;
+    }
     for (int i = 0; i < schedules->count; ++i) {
-        experiment_destroy(&schedules->schedules[i].experiment);
-        if (schedules->schedules[i].ev) {
-            event_free(schedules->schedules[i].ev);
-        }
+        free_schedule(schedules->schedules[i]);
     }
     free(schedules->schedules);
-    return 0;
+    free(schedules->heap);
+    if (schedules->timer) {
+        event_free(schedules->timer);
+    }
+    return metrics_destroy(&schedules->metrics);
 }
@@ -4,25 +4,88 @@
 #include "lua.h"
 
 #include "experiment.h"
+#include "metrics.h"
 #include "options.h"
 #include "subprocesses.h"
+#include "workers.h"
 
 struct event_base;
+struct experiment_run;
 struct experiment_schedule;
 
 typedef struct {
-    struct experiment_schedule *schedules;
-    int count;
+    /* An array of 'capacity' pointers, the first 'count' of which are valid.
+     * Each schedule is allocated separately, so queued runs can point to it
+     * while schedules are added and removed. */
+    struct experiment_schedule **schedules;
+    int count, capacity;
+    censorscope_options_t *options;
+    struct event_base *base;
+
+    /* The schedules that will fire again, as a min-heap ordered by next run
+     * time, and the one timer that waits for the earliest of them. */
+    struct experiment_schedule **heap;
+    int heap_count;
+    struct event *timer;
+
+    /* Runs waiting for a free slot, in order of decreasing priority and FIFO
+     * among runs of equal priority. */
+    struct experiment_run *queue;
+    /* The number of runs in progress, and how many we allow at once, or 0 for
+     * no limit. */
+    int running, max_running;
+    /* Set while we're starting queued runs, so runs that finish immediately
+     * don't recurse back into the queue. */
+    int dispatching;
+
+    subprocesses_t *subprocesses;
+    worker_pool_t *workers;
+
+    /* Statistics for every experiment's runs, which outlive the schedules so
+     * reloading main.lua doesn't reset them. */
+    metrics_t metrics;
+
+    /* If set, called when the last run finishes and no more runs are
+     * scheduled, so other periodic events can stop and let the loop exit. */
+    void (*idle_callback)(void *arg);
+    void *idle_callback_arg;
+
+    /* Set while the first download of the sandbox runs, since it may bring
+     * experiments to schedule, so we don't count as idle until it's done. */
+    int sync_pending;
 } experiment_schedules_t;
 
 /* Initialize an experiments schedule.
  *
  * Arguments:
  * - schedules is the structure to initialize.
+ * - subprocesses is used to fork and time out experiment runs.
+ * - workers is a pool of workers on which to run experiments, or NULL to fork
+ *   a new process for every run.
  * - base is a libevent2 event base, with which we will schedule our
  *   experiments.
  * - L is a Lua state. The stack must contain a table of censorscope settings at
- *   table_index position. This usually comes from sandbox/main.lua.
+ *   table_index position. This usually comes from sandbox/main.lua. Each
+ *   experiment has fields interval_seconds and num_runs, and optionally:
+ *   - priority: higher runs first when runs are queued.
+ *   - coalesce: if true, a run is dropped when another run of the same
+ *     experiment is already queued.
+ *   - jitter_seconds: delay each run by a random amount up to this long.
+ *     Defaults to the jitter-seconds option.
+ *   - offset_seconds: start the first run this long after loading, instead of
+ *     after one interval.
+ *   - window_start and window_end: only start runs between these local times,
+ *     given like "02:30". The window may span midnight.
+ *   - rate_limit_runs and rate_limit_seconds: start at most this many runs in
+ *     each period of rate_limit_seconds, which defaults to an hour.
+ *   - shards: split each run across this many child processes, each with its
+ *     own SHARD_INDEX, and merge their results into one file when the last
+ *     finishes. Counts as one run towards max-children.
+ *   - in_process: if true, run in a fresh sandbox inside this process
+ *     instead of forking, for trusted experiments that run often and do
+ *     little. See inprocess.h. Can't be combined with shards, and doesn't use
+ *     the worker pool.
+ *   Runs that fall outside the window or over the rate limit are postponed.
  * - table_index the stack position of censorscope settings. It can be either a
  *   relative or absolute index.
  * Returns: 0 on success, -1 on failure.
@@ -30,13 +93,37 @@ typedef struct {
  */
 int experiment_schedules_init(experiment_schedules_t *schedules,
                               subprocesses_t *subprocesses,
+                              worker_pool_t *workers,
                               censorscope_options_t *options,
                               struct event_base *base,
                               lua_State *L,
                               int table_index);
 
+/* Bring the schedules in line with a new table of censorscope settings, as
+ * loaded from a changed sandbox/main.lua. Experiments whose settings are
+ * unchanged keep their timers; added experiments are scheduled, removed ones
+ * are unscheduled and those whose settings changed are rescheduled. Queued runs
+ * of removed or rescheduled experiments are dropped, but runs already in
+ * progress are left alone.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int experiment_schedules_update(experiment_schedules_t *schedules,
+                                lua_State *L,
+                                int table_index);
+
 int experiment_schedules_stop_pending(experiment_schedules_t *schedules);
 
+/* Return 1 if no runs are in progress, queued or scheduled and no download
+ * is pending, and 0 otherwise. */
+int experiment_schedules_idle(const experiment_schedules_t *schedules);
+
+/* Call the idle callback if the schedules are idle. Call it once the callback
+ * is set, and whenever something that experiment_schedules_idle depends on
+ * changes outside the scheduler, like sync_pending. */
+void experiment_schedules_check_idle(experiment_schedules_t *schedules);
+
 int experiment_schedules_destroy(experiment_schedules_t *schedules);
 
 /* Run experiments in an event loop. This function exits when there are no more
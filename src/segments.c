@@ -0,0 +1,438 @@
+#include "segments.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <event2/event.h>
+#include <zlib.h>
+
+#include "index.h"
+#include "logging.h"
+#include "options.h"
+#include "results.h"
+#include "scheduling.h"
+#include "subprocesses.h"
+#include "transport.h"
+#include "util.h"
+
+#define COMPRESSION_CHUNK_SIZE (64 * 1024)
+#define COMPRESSED_SUFFIX ".gz"
+
+static int has_suffix(const char *string, const char *suffix) {
+    size_t string_len = strlen(string), suffix_len = strlen(suffix);
+    return string_len >= suffix_len
+        && strcmp(string + string_len - suffix_len, suffix) == 0;
+}
+
+/* Compress source into a new file in the outbox named after it, then delete
+ * source. name is the segment's name, without any .part suffix. We write to a
+ * temporary file first so an interrupted compression never leaves a corrupt
+ * file for the transport. */
+static int compress_segment(const char *source,
+                            const char *outbox,
+                            const char *name) {
+    char *temporary = sprintf_malloc("%s/.%s%s", outbox, name, COMPRESSED_SUFFIX);
+    if (!temporary) {
+        log_error("error allocating segment name");
+        return -1;
+    }
+    int input = open(source, O_RDONLY | O_CLOEXEC);
+    if (input < 0) {
+        log_error("error opening %s: %m", source);
+        free(temporary);
+        return -1;
+    }
+    gzFile output = gzopen(temporary, "wb");
+    if (!output) {
+        log_error("error opening %s", temporary);
+        close(input);
+        free(temporary);
+        return -1;
+    }
+
+    int rc = 0;
+    char chunk[COMPRESSION_CHUNK_SIZE];
+    for (;;) {
+        ssize_t len = read(input, chunk, sizeof(chunk));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0) {
+            log_error("error reading %s: %m", source);
+            rc = -1;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+        if (gzwrite(output, chunk, len) != len) {
+            log_error("error compressing %s", source);
+            rc = -1;
+            break;
+        }
+    }
+    close(input);
+    if (gzclose(output) != Z_OK) {
+        log_error("error writing %s", temporary);
+        rc = -1;
+    }
+    if (rc) {
+        unlink(temporary);
+        free(temporary);
+        return -1;
+    }
+
+    /* Segments of different runs may share a name if an earlier one has
+     * already been uploaded, so don't overwrite anything in the outbox. */
+    char *destination = NULL;
+    for (int i = 0; !destination; ++i) {
+        if (i == 0) {
+            destination = sprintf_malloc("%s/%s%s",
+                                         outbox,
+                                         name,
+                                         COMPRESSED_SUFFIX);
+        } else {
+            destination = sprintf_malloc("%s/%s.%d%s",
+                                         outbox,
+                                         name,
+                                         i,
+                                         COMPRESSED_SUFFIX);
+        }
+        if (!destination) {
+            log_error("error allocating segment name");
+            unlink(temporary);
+            free(temporary);
+            return -1;
+        }
+        if (access(destination, F_OK) == 0) {
+            free(destination);
+            destination = NULL;
+        }
+    }
+    if (rename(temporary, destination)) {
+        log_error("error renaming %s: %m", temporary);
+        rc = -1;
+    } else if (unlink(source)) {
+        log_error("error deleting %s: %m", source);
+        rc = -1;
+    }
+    free(destination);
+    free(temporary);
+    return rc;
+}
+
+/* Move every closed segment in results_dir into the outbox. */
+static int collect_segments(const censorscope_options_t *options,
+                            const char *outbox,
+                            int include_partial) {
+    DIR *dir = opendir(options->results_dir);
+    if (!dir) {
+        if (errno == ENOENT) {
+            return 0;  /* Nothing has written any results yet. */
+        }
+        log_error("error opening %s: %m", options->results_dir);
+        return -1;
+    }
+
+    time_t abandoned_before = 0;
+    if (options->experiment_timeout_seconds > 0) {
+        abandoned_before = time(NULL) - options->experiment_timeout_seconds;
+    }
+
+    int rc = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char *path = sprintf_malloc("%s/%s", options->results_dir, entry->d_name);
+        if (!path) {
+            log_error("error allocating segment name");
+            rc = -1;
+            break;
+        }
+        struct stat info;
+        if (stat(path, &info) || !S_ISREG(info.st_mode)) {
+            free(path);
+            continue;
+        }
+
+        char *name = strdup(entry->d_name);
+        if (!name) {
+            log_error("strdup error: %m");
+            free(path);
+            rc = -1;
+            break;
+        }
+        int ship = 1;
+        if (has_suffix(name, RESULTS_PARTIAL_SUFFIX)) {
+            /* A run is still writing this segment unless it was killed. */
+            ship = include_partial
+                || (abandoned_before > 0 && info.st_mtime < abandoned_before);
+            name[strlen(name) - strlen(RESULTS_PARTIAL_SUFFIX)] = '\0';
+        }
+        if (ship && compress_segment(path, outbox, name)) {
+            rc = -1;
+        }
+        free(name);
+        free(path);
+    }
+    closedir(dir);
+    return rc;
+}
+
+/* Return a NULL-terminated array of the compressed segments in the outbox,
+ * or NULL on failure. */
+static char **list_outbox(const char *outbox) {
+    DIR *dir = opendir(outbox);
+    if (!dir) {
+        log_error("error opening %s: %m", outbox);
+        return NULL;
+    }
+    int count = 0, capacity = 8;
+    char **paths = malloc(capacity * sizeof(char *));
+    if (!paths) {
+        log_error("malloc error: %m");
+        closedir(dir);
+        return NULL;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.'
+            || !has_suffix(entry->d_name, COMPRESSED_SUFFIX)) {
+            continue;
+        }
+        if (count + 1 >= capacity) {
+            capacity *= 2;
+            char **new_paths = realloc(paths, capacity * sizeof(char *));
+            if (!new_paths) {
+                log_error("realloc error: %m");
+                break;
+            }
+            paths = new_paths;
+        }
+        paths[count] = sprintf_malloc("%s/%s", outbox, entry->d_name);
+        if (!paths[count]) {
+            log_error("error allocating segment name");
+            break;
+        }
+        ++count;
+    }
+    paths[count] = NULL;
+    closedir(dir);
+    return paths;
+}
+
+/* Find the index entry for a compressed segment in the outbox. Its name is
+ * the segment's, plus COMPRESSED_SUFFIX and maybe a number that
+ * compress_segment added to keep it from replacing another file. */
+static const index_entry_t *find_outbox_entry(const results_index_t *index,
+                                              const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *name = strdup(slash ? slash + 1 : path);
+    if (!name) {
+        log_error("strdup error: %m");
+        return NULL;
+    }
+    name[strlen(name) - strlen(COMPRESSED_SUFFIX)] = '\0';
+    const index_entry_t *entry = index_find(index, name);
+    char *dot = strrchr(name, '.');
+    if (!entry && dot && dot[1]
+        && strspn(dot + 1, "0123456789") == strlen(dot + 1)) {
+        *dot = '\0';
+        entry = index_find(index, name);
+    }
+    free(name);
+    return entry;
+}
+
+/* Upload the compressed segments in the outbox and delete them afterwards,
+ * skipping those the index says were already uploaded. */
+static int upload_outbox(const censorscope_options_t *options,
+                         const char *outbox) {
+    /* Only delete what was there when the upload started. */
+    char **paths = list_outbox(outbox);
+    if (!paths) {
+        return -1;
+    }
+    int count = 0;
+    while (paths[count]) {
+        ++count;
+    }
+    /* If the index can't be read, it's left empty and we still upload
+     * everything, just without the details. */
+    results_index_t index;
+    index_load(&index, options->results_dir);
+    const index_entry_t **entries = calloc(count + 1,
+                                           sizeof(index_entry_t *));
+    if (!entries) {
+        log_error("calloc error: %m");
+        index_free(&index);
+        for (char **path = paths; *path; ++path) {
+            free(*path);
+        }
+        free(paths);
+        return -1;
+    }
+
+    /* An earlier upload may have sent a file and then stopped before
+     * deleting it. */
+    int unsent = 0;
+    for (int i = 0; i < count; ++i) {
+        const index_entry_t *entry = find_outbox_entry(&index, paths[i]);
+        if (entry && entry->uploaded) {
+            log_info("%s was already uploaded", paths[i]);
+            unlink(paths[i]);
+            free(paths[i]);
+            continue;
+        }
+        paths[unsent] = paths[i];
+        entries[unsent] = entry;
+        ++unsent;
+    }
+    paths[unsent] = NULL;
+
+    int rc = 0;
+    if (unsent > 0) {
+        transport_t transport;
+        if (transport_init(&transport, options, options->upload_transport)) {
+            log_error("error initializing transport");
+            rc = -1;
+        } else {
+            if (transport_upload(&transport, outbox, paths, entries)) {
+                log_error("error uploading results");
+                rc = -1;
+            } else {
+                for (int i = 0; i < unsent; ++i) {
+                    if (entries[i]
+                        && index_mark_uploaded(options->results_dir,
+                                               entries[i]->segment)) {
+                        rc = -1;
+                    }
+                    /* Some transports move the files themselves. */
+                    if (unlink(paths[i]) && errno != ENOENT) {
+                        log_error("error deleting %s: %m", paths[i]);
+                    }
+                }
+            }
+            transport_destroy(&transport);
+        }
+    }
+    for (char **path = paths; *path; ++path) {
+        free(*path);
+    }
+    free(paths);
+    free(entries);
+    index_free(&index);
+    return rc;
+}
+
+int segments_upload(const censorscope_options_t *options, int include_partial) {
+    char *outbox = sprintf_malloc("%s/%s", options->results_dir, SEGMENTS_OUTBOX);
+    if (!outbox) {
+        log_error("error allocating outbox name");
+        return -1;
+    }
+    if (mkdir(outbox, 0755) && errno != EEXIST) {
+        if (errno != ENOENT) {
+            log_error("error creating %s: %m", outbox);
+            free(outbox);
+            return -1;
+        }
+        free(outbox);
+        return 0;  /* There's no results_dir yet. */
+    }
+
+    int rc = collect_segments(options, outbox, include_partial);
+    if (upload_outbox(options, outbox)) {
+        rc = -1;
+    }
+    /* No experiments are running, so nothing else is adding to the index. */
+    if (include_partial && index_compact(options->results_dir)) {
+        rc = -1;
+    }
+    free(outbox);
+    return rc;
+}
+
+static void on_uploader_exit(const subprocess_exit_t *child,
+                             void *arg) {
+    segments_t *segments = arg;
+    segments->uploader = 0;
+}
+
+static void upload_callback(evutil_socket_t fd, short what, void *arg) {
+    segments_t *segments = arg;
+    const censorscope_options_t *options = segments->options;
+
+    if (segments->uploader > 0) {
+        log_info("upload by pid %d is still running; skipping this one",
+                 segments->uploader);
+    } else {
+        /* An upload that takes longer than the interval has probably hung. */
+        pid_t pid = subprocesses_fork(segments->subprocesses,
+                                      options->upload_interval_seconds);
+        if (pid == 0) {
+            exit(segments_upload(options, 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+        } else if (pid > 0) {
+            segments->uploader = pid;
+            subprocesses_on_exit(segments->subprocesses,
+                                 pid,
+                                 on_uploader_exit,
+                                 segments);
+        }
+    }
+
+    struct timeval interval = { options->upload_interval_seconds, 0 };
+    if (event_add(segments->timer, &interval)) {
+        log_error("error scheduling upload");
+    }
+}
+
+int segments_init(segments_t *segments,
+                  const censorscope_options_t *options,
+                  subprocesses_t *subprocesses,
+                  experiment_schedules_t *schedules,
+                  struct event_base *base) {
+    segments->options = options;
+    segments->subprocesses = subprocesses;
+    segments->timer = NULL;
+    segments->uploader = 0;
+    if (options->upload_interval_seconds <= 0
+        || experiment_schedules_idle(schedules)) {
+        return 0;
+    }
+
+    segments->timer = evtimer_new(base, upload_callback, segments);
+    if (!segments->timer) {
+        log_error("error creating upload event");
+        return -1;
+    }
+    struct timeval interval = { options->upload_interval_seconds, 0 };
+    if (event_add(segments->timer, &interval)) {
+        log_error("error scheduling upload");
+        return -1;
+    }
+    return 0;
+}
+
+void segments_stop(segments_t *segments) {
+    if (segments->timer && event_del(segments->timer)) {
+        log_error("error removing upload event");
+    }
+}
+
+int segments_destroy(segments_t *segments) {
+    if (segments->timer) {
+        event_free(segments->timer);
+        segments->timer = NULL;
+    }
+    return 0;
+}
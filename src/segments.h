@@ -0,0 +1,64 @@
+#ifndef CENSORSCOPE_SEGMENTS_H
+#define CENSORSCOPE_SEGMENTS_H
+
+#include <sys/types.h>
+
+#include "options.h"
+#include "scheduling.h"
+#include "subprocesses.h"
+
+struct event;
+struct event_base;
+
+/* Closed segments are compressed into this subdirectory of results_dir, which
+ * is what we hand to the upload transport. */
+#define SEGMENTS_OUTBOX "outbox"
+
+/* The segment manager periodically ships closed results segments, so results
+ * don't pile up on the device until censorscope exits. Every
+ * upload_interval_seconds it forks an uploader, which compresses each closed
+ * segment in results_dir into the outbox with gzip, runs the upload transport
+ * on the outbox and deletes the files it uploaded. The results index (see
+ * index.h) records what was uploaded, so a file is never sent twice, and
+ * gives the transport each file's run, offset and checksum. */
+typedef struct {
+    const censorscope_options_t *options;
+    subprocesses_t *subprocesses;
+    struct event *timer;
+    /* The running uploader, or 0 if there isn't one. */
+    pid_t uploader;
+} segments_t;
+
+/* Start uploading periodically. Does nothing if options->upload_interval_seconds
+ * is 0, or if the schedules have nothing to run.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int segments_init(segments_t *segments,
+                  const censorscope_options_t *options,
+                  subprocesses_t *subprocesses,
+                  experiment_schedules_t *schedules,
+                  struct event_base *base);
+
+/* Compress closed segments into the outbox, upload the outbox and delete what
+ * was uploaded, all in this process.
+ *
+ * Arguments:
+ * - include_partial says to also ship segments that are still named .part.
+ *   Pass it once no experiments are running, to ship what killed runs left
+ *   behind. Otherwise only .part segments older than the experiment timeout
+ *   are shipped, since their writer can't still be running. It also lets
+ *   us compact the results index, since nothing else is writing to it.
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int segments_upload(const censorscope_options_t *options, int include_partial);
+
+/* Stop uploading, for example once there's nothing left to run. Whatever is
+ * left is uploaded at exit. */
+void segments_stop(segments_t *segments);
+
+int segments_destroy(segments_t *segments);
+
+#endif
@@ -0,0 +1,518 @@
+#include "serialize.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+/* Tables we're in the middle of encoding, so we can detect cycles. */
+typedef struct {
+    const void *tables[SERIALIZE_MAX_DEPTH];
+    int depth;
+} ancestors_t;
+
+void serialize_buffer_init(serialize_buffer_t *buffer) {
+    buffer->data = NULL;
+    buffer->len = buffer->capacity = 0;
+}
+
+int serialize_buffer_append(serialize_buffer_t *buffer,
+                            const void *data,
+                            size_t len) {
+    if (buffer->len + len > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 256;
+        while (capacity < buffer->len + len) {
+            capacity *= 2;
+        }
+        char *new_data = realloc(buffer->data, capacity);
+        if (!new_data) {
+            return -1;
+        }
+        buffer->data = new_data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return 0;
+}
+
+void serialize_buffer_free(serialize_buffer_t *buffer) {
+    free(buffer->data);
+    serialize_buffer_init(buffer);
+}
+
+static int append_string(serialize_buffer_t *buffer, const char *string) {
+    return serialize_buffer_append(buffer, string, strlen(string));
+}
+
+static int absolute_index(lua_State *L, int index) {
+    if (index > 0 || index <= LUA_REGISTRYINDEX) {
+        return index;
+    }
+    return lua_gettop(L) + index + 1;
+}
+
+/* Return the length n of a table if its keys are exactly 1..n, or -1 if it
+ * isn't an array. */
+static int array_length(lua_State *L, int index) {
+    int length = lua_objlen(L, index);
+    int count = 0;
+    lua_pushnil(L);  /* first key */
+    while (lua_next(L, index) != 0) {
+        lua_pop(L, 1);  /* Pop value. Leave key for lua_next. */
+        if (lua_type(L, -1) != LUA_TNUMBER) {
+            lua_pop(L, 1);
+            return -1;
+        }
+        lua_Number key = lua_tonumber(L, -1);
+        if (key != floor(key) || key < 1 || key > length) {
+            lua_pop(L, 1);
+            return -1;
+        }
+        ++count;
+    }
+    return count == length ? length : -1;
+}
+
+/* Push a table onto the ancestors, failing if we're already inside it or if
+ * it's nested too deeply. The caller decrements ancestors->depth when it has
+ * finished with the table. */
+static int enter_table(lua_State *L,
+                       int index,
+                       ancestors_t *ancestors,
+                       const char **error) {
+    const void *table = lua_topointer(L, index);
+    for (int i = 0; i < ancestors->depth; ++i) {
+        if (ancestors->tables[i] == table) {
+            *error = "cannot serialize a table that contains itself";
+            return -1;
+        }
+    }
+    if (ancestors->depth >= SERIALIZE_MAX_DEPTH) {
+        *error = "tables are nested too deeply to serialize";
+        return -1;
+    }
+    luaL_checkstack(L, 4, "tables are nested too deeply to serialize");
+    ancestors->tables[ancestors->depth++] = table;
+    return 0;
+}
+
+static int json_number(serialize_buffer_t *buffer, lua_Number number) {
+    char formatted[32];
+    if (isnan(number) || isinf(number)) {
+        return append_string(buffer, "null");
+    }
+    if (number == floor(number) && fabs(number) < 9007199254740992.0) {
+        snprintf(formatted, sizeof(formatted), "%lld", (long long)number);
+    } else {
+        snprintf(formatted, sizeof(formatted), "%.17g", number);
+    }
+    return append_string(buffer, formatted);
+}
+
+static int json_string(serialize_buffer_t *buffer,
+                       const char *string,
+                       size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    if (serialize_buffer_append(buffer, "\"", 1)) {
+        return -1;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = string[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        /* Copy the run of characters that need no escaping in one go. */
+        if (serialize_buffer_append(buffer, string + start, i - start)) {
+            return -1;
+        }
+        start = i + 1;
+        char escaped[7] = { '\\', c, 0 };
+        switch (c) {
+        case '"':
+        case '\\':
+            break;
+        case '\n':
+            escaped[1] = 'n';
+            break;
+        case '\r':
+            escaped[1] = 'r';
+            break;
+        case '\t':
+            escaped[1] = 't';
+            break;
+        default:
+            escaped[1] = 'u';
+            escaped[2] = '0';
+            escaped[3] = '0';
+            escaped[4] = hex[c >> 4];
+            escaped[5] = hex[c & 0xf];
+            escaped[6] = 0;
+        }
+        if (append_string(buffer, escaped)) {
+            return -1;
+        }
+    }
+    if (serialize_buffer_append(buffer, string + start, len - start)) {
+        return -1;
+    }
+    return serialize_buffer_append(buffer, "\"", 1);
+}
+
+int serialize_json_string(serialize_buffer_t *buffer,
+                          const char *string,
+                          size_t len) {
+    return json_string(buffer, string, len);
+}
+
+static int json_value(lua_State *L,
+                      int index,
+                      serialize_buffer_t *buffer,
+                      ancestors_t *ancestors,
+                      const char **error);
+
+static int json_table(lua_State *L,
+                      int index,
+                      serialize_buffer_t *buffer,
+                      ancestors_t *ancestors,
+                      const char **error) {
+    if (enter_table(L, index, ancestors, error)) {
+        return -1;
+    }
+
+    int length = array_length(L, index);
+    if (length > 0) {
+        if (serialize_buffer_append(buffer, "[", 1)) {
+            goto out_of_memory;
+        }
+        for (int i = 1; i <= length; ++i) {
+            if (i > 1 && serialize_buffer_append(buffer, ",", 1)) {
+                goto out_of_memory;
+            }
+            lua_rawgeti(L, index, i);
+            int rc = json_value(L, -1, buffer, ancestors, error);
+            lua_pop(L, 1);
+            if (rc) {
+                return -1;
+            }
+        }
+        if (serialize_buffer_append(buffer, "]", 1)) {
+            goto out_of_memory;
+        }
+    } else {
+        if (serialize_buffer_append(buffer, "{", 1)) {
+            goto out_of_memory;
+        }
+        int first = 1;
+        lua_pushnil(L);  /* first key */
+        while (lua_next(L, index) != 0) {
+            if (!first && serialize_buffer_append(buffer, ",", 1)) {
+                lua_pop(L, 2);
+                goto out_of_memory;
+            }
+            first = 0;
+            int rc;
+            if (lua_type(L, -2) == LUA_TSTRING) {
+                size_t key_len;
+                const char *key = lua_tolstring(L, -2, &key_len);
+                rc = json_string(buffer, key, key_len);
+            } else if (lua_type(L, -2) == LUA_TNUMBER) {
+                /* Convert a copy, since lua_tolstring would confuse
+                 * lua_next by changing the key itself. */
+                lua_pushvalue(L, -2);
+                size_t key_len;
+                const char *key = lua_tolstring(L, -1, &key_len);
+                rc = json_string(buffer, key, key_len);
+                lua_pop(L, 1);
+            } else {
+                *error = "only string and number keys can be serialized";
+                lua_pop(L, 2);
+                return -1;
+            }
+            if (rc || serialize_buffer_append(buffer, ":", 1)) {
+                lua_pop(L, 2);
+                goto out_of_memory;
+            }
+            rc = json_value(L, -1, buffer, ancestors, error);
+            lua_pop(L, 1);  /* Pop value. Leave key for lua_next. */
+            if (rc) {
+                lua_pop(L, 1);
+                return -1;
+            }
+        }
+        if (serialize_buffer_append(buffer, "}", 1)) {
+            goto out_of_memory;
+        }
+    }
+
+    --ancestors->depth;
+    return 0;
+
+out_of_memory:
+    *error = "out of memory while serializing";
+    return -1;
+}
+
+static int json_value(lua_State *L,
+                      int index,
+                      serialize_buffer_t *buffer,
+                      ancestors_t *ancestors,
+                      const char **error) {
+    index = absolute_index(L, index);
+    int rc;
+    switch (lua_type(L, index)) {
+    case LUA_TNIL:
+    case LUA_TNONE:
+        rc = append_string(buffer, "null");
+        break;
+    case LUA_TBOOLEAN:
+        rc = append_string(buffer, lua_toboolean(L, index) ? "true" : "false");
+        break;
+    case LUA_TNUMBER:
+        rc = json_number(buffer, lua_tonumber(L, index));
+        break;
+    case LUA_TSTRING: {
+        size_t len;
+        const char *string = lua_tolstring(L, index, &len);
+        rc = json_string(buffer, string, len);
+        break;
+    }
+    case LUA_TTABLE:
+        return json_table(L, index, buffer, ancestors, error);
+    default:
+        *error = "only nil, booleans, numbers, strings and tables can be "
+                 "serialized";
+        return -1;
+    }
+    if (rc) {
+        *error = "out of memory while serializing";
+        return -1;
+    }
+    return 0;
+}
+
+int serialize_json(lua_State *L,
+                   int index,
+                   serialize_buffer_t *buffer,
+                   const char **error) {
+    ancestors_t ancestors;
+    ancestors.depth = 0;
+    return json_value(L, index, buffer, &ancestors, error);
+}
+
+/* Append a MessagePack type byte followed by a big-endian integer of size
+ * bytes. */
+static int msgpack_header(serialize_buffer_t *buffer,
+                          unsigned char type,
+                          uint64_t value,
+                          int size) {
+    unsigned char header[9];
+    header[0] = type;
+    for (int i = 0; i < size; ++i) {
+        header[size - i] = value >> (8 * i);
+    }
+    return serialize_buffer_append(buffer, header, size + 1);
+}
+
+/* Append the header of a string, array or map, using the smallest encoding
+ * for its length. fixed is the fix* type byte and limit its largest length;
+ * types holds the 8-, 16- and 32-bit length types, where strings are the only
+ * type with an 8-bit form. */
+static int msgpack_length(serialize_buffer_t *buffer,
+                          size_t length,
+                          unsigned char fixed,
+                          size_t limit,
+                          const unsigned char types[3]) {
+    if (length <= limit) {
+        unsigned char header = fixed | length;
+        return serialize_buffer_append(buffer, &header, 1);
+    } else if (types[0] && length <= UINT8_MAX) {
+        return msgpack_header(buffer, types[0], length, 1);
+    } else if (length <= UINT16_MAX) {
+        return msgpack_header(buffer, types[1], length, 2);
+    } else if (length <= UINT32_MAX) {
+        return msgpack_header(buffer, types[2], length, 4);
+    }
+    return -1;
+}
+
+static int msgpack_number(serialize_buffer_t *buffer, lua_Number number) {
+    if (number != floor(number) || fabs(number) >= 9007199254740992.0) {
+        union {
+            double d;
+            uint64_t u;
+        } bits;
+        bits.d = number;
+        return msgpack_header(buffer, 0xcb, bits.u, 8);
+    }
+    int64_t integer = number;
+    if (integer >= 0) {
+        if (integer <= 0x7f) {
+            return msgpack_header(buffer, integer, 0, 0);
+        } else if (integer <= UINT8_MAX) {
+            return msgpack_header(buffer, 0xcc, integer, 1);
+        } else if (integer <= UINT16_MAX) {
+            return msgpack_header(buffer, 0xcd, integer, 2);
+        } else if (integer <= UINT32_MAX) {
+            return msgpack_header(buffer, 0xce, integer, 4);
+        }
+        return msgpack_header(buffer, 0xcf, integer, 8);
+    }
+    if (integer >= -32) {
+        return msgpack_header(buffer, (unsigned char)integer, 0, 0);
+    } else if (integer >= INT8_MIN) {
+        return msgpack_header(buffer, 0xd0, integer, 1);
+    } else if (integer >= INT16_MIN) {
+        return msgpack_header(buffer, 0xd1, integer, 2);
+    } else if (integer >= INT32_MIN) {
+        return msgpack_header(buffer, 0xd2, integer, 4);
+    }
+    return msgpack_header(buffer, 0xd3, integer, 8);
+}
+
+static int msgpack_value(lua_State *L,
+                         int index,
+                         serialize_buffer_t *buffer,
+                         ancestors_t *ancestors,
+                         const char **error);
+
+static int msgpack_table(lua_State *L,
+                         int index,
+                         serialize_buffer_t *buffer,
+                         ancestors_t *ancestors,
+                         const char **error) {
+    static const unsigned char array_types[3] = { 0, 0xdc, 0xdd };
+    static const unsigned char map_types[3] = { 0, 0xde, 0xdf };
+
+    if (enter_table(L, index, ancestors, error)) {
+        return -1;
+    }
+
+    int length = array_length(L, index);
+    if (length > 0) {
+        if (msgpack_length(buffer, length, 0x90, 15, array_types)) {
+            goto out_of_memory;
+        }
+        for (int i = 1; i <= length; ++i) {
+            lua_rawgeti(L, index, i);
+            int rc = msgpack_value(L, -1, buffer, ancestors, error);
+            lua_pop(L, 1);
+            if (rc) {
+                return -1;
+            }
+        }
+    } else {
+        /* Maps start with their size, so count the pairs first. */
+        size_t pairs = 0;
+        lua_pushnil(L);  /* first key */
+        while (lua_next(L, index) != 0) {
+            lua_pop(L, 1);
+            ++pairs;
+        }
+        if (msgpack_length(buffer, pairs, 0x80, 15, map_types)) {
+            goto out_of_memory;
+        }
+        lua_pushnil(L);  /* first key */
+        while (lua_next(L, index) != 0) {
+            /* Encoding a key never changes it, so lua_next still works. */
+            if (msgpack_value(L, -2, buffer, ancestors, error)
+                || msgpack_value(L, -1, buffer, ancestors, error)) {
+                lua_pop(L, 2);
+                return -1;
+            }
+            lua_pop(L, 1);  /* Pop value. Leave key for lua_next. */
+        }
+    }
+
+    --ancestors->depth;
+    return 0;
+
+out_of_memory:
+    *error = "out of memory while serializing";
+    return -1;
+}
+
+static int msgpack_value(lua_State *L,
+                         int index,
+                         serialize_buffer_t *buffer,
+                         ancestors_t *ancestors,
+                         const char **error) {
+    static const unsigned char string_types[3] = { 0xd9, 0xda, 0xdb };
+
+    index = absolute_index(L, index);
+    int rc;
+    switch (lua_type(L, index)) {
+    case LUA_TNIL:
+    case LUA_TNONE:
+        rc = msgpack_header(buffer, 0xc0, 0, 0);
+        break;
+    case LUA_TBOOLEAN:
+        rc = msgpack_header(buffer, lua_toboolean(L, index) ? 0xc3 : 0xc2, 0, 0);
+        break;
+    case LUA_TNUMBER:
+        rc = msgpack_number(buffer, lua_tonumber(L, index));
+        break;
+    case LUA_TSTRING: {
+        size_t len;
+        const char *string = lua_tolstring(L, index, &len);
+        rc = msgpack_length(buffer, len, 0xa0, 31, string_types)
+            || serialize_buffer_append(buffer, string, len);
+        break;
+    }
+    case LUA_TTABLE:
+        return msgpack_table(L, index, buffer, ancestors, error);
+    default:
+        *error = "only nil, booleans, numbers, strings and tables can be "
+                 "serialized";
+        return -1;
+    }
+    if (rc) {
+        *error = "out of memory while serializing";
+        return -1;
+    }
+    return 0;
+}
+
+int serialize_msgpack(lua_State *L,
+                      int index,
+                      serialize_buffer_t *buffer,
+                      const char **error) {
+    ancestors_t ancestors;
+    ancestors.depth = 0;
+    return msgpack_value(L, index, buffer, &ancestors, error);
+}
+
+/* Run an encoder on the first argument and return the result to Lua. */
+static int encode(lua_State *L,
+                  int (*encoder)(lua_State *,
+                                 int,
+                                 serialize_buffer_t *,
+                                 const char **)) {
+    luaL_checkany(L, 1);
+    serialize_buffer_t buffer;
+    serialize_buffer_init(&buffer);
+    const char *error = NULL;
+    if (encoder(L, 1, &buffer, &error)) {
+        serialize_buffer_free(&buffer);
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+    lua_pushlstring(L, buffer.data ? buffer.data : "", buffer.len);
+    serialize_buffer_free(&buffer);
+    lua_pushnil(L);
+    return 2;
+}
+
+int l_encode_json(lua_State *L) {
+    return encode(L, serialize_json);
+}
+
+int l_encode_msgpack(lua_State *L) {
+    return encode(L, serialize_msgpack);
+}
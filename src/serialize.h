@@ -0,0 +1,86 @@
+#ifndef CENSORSCOPE_SERIALIZE_H
+#define CENSORSCOPE_SERIALIZE_H
+
+#include <stddef.h>
+
+#include "lua.h"
+
+/* Tables nested deeper than this are an error. */
+#define SERIALIZE_MAX_DEPTH 32
+
+/* A growable buffer for serialized output. It's allocated outside the Lua
+ * allocator, so serializing doesn't count against a sandbox's memory limit. */
+typedef struct {
+    char *data;
+    size_t len, capacity;
+} serialize_buffer_t;
+
+void serialize_buffer_init(serialize_buffer_t *buffer);
+
+/* Append bytes, growing the buffer geometrically.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int serialize_buffer_append(serialize_buffer_t *buffer,
+                            const void *data,
+                            size_t len);
+
+void serialize_buffer_free(serialize_buffer_t *buffer);
+
+/* Append a string to a buffer as a quoted, escaped JSON string.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int serialize_json_string(serialize_buffer_t *buffer,
+                          const char *string,
+                          size_t len);
+
+/* Append the value at index to a buffer as JSON. Tables whose keys are
+ * exactly 1..n become arrays and other tables become objects; nil becomes
+ * null, as do numbers that JSON can't represent.
+ *
+ * Arguments:
+ * - index is the stack position of the value to encode.
+ * - buffer receives the output. On failure it may hold partial output.
+ * - error is set to a static error message on failure, for example if the
+ *   value contains a cycle, a function, or is nested too deeply.
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int serialize_json(lua_State *L,
+                   int index,
+                   serialize_buffer_t *buffer,
+                   const char **error);
+
+/* Append the value at index to a buffer as MessagePack. Arrays are detected
+ * the same way as serialize_json, integers use the smallest encoding that
+ * holds them and other numbers are 64-bit floats.
+ *
+ * Arguments:
+ * - index, buffer and error are as for serialize_json.
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int serialize_msgpack(lua_State *L,
+                      int index,
+                      serialize_buffer_t *buffer,
+                      const char **error);
+
+/* Encode a value as JSON.
+ *
+ * Lua arguments:
+ * - value is a string, number, boolean, nil or table of those types.
+ * Lua returns:
+ * - the encoded string, or nil on error.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_encode_json(lua_State *L);
+
+/* Encode a value as MessagePack. The arguments and returns are the same as
+ * for l_encode_json. */
+int l_encode_msgpack(lua_State *L);
+
+#endif
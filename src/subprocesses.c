@@ -4,99 +4,364 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include <event2/event.h>
 
 #include "logging.h"
+#include "util.h"
 
 /* This tracks state for a single subprocess. */
 typedef struct child_info {
     /* The pid of the subprocess. */
     pid_t pid;
-    /* The subprocess's termination event. */
-    struct event *ev;
-    /* A link back to the global subprocesses structure. We need this so a
-     * child_info_t can remove itself for the subprocesses list. */
-    subprocesses_t *subprocesses;
+    /* When we should kill the subprocess, in monotonic microseconds, and its
+     * place in the deadline heap, or -1 if it has no timeout. */
+    int64_t deadline;
+    int heap_index;
+    /* When we forked the child, in monotonic microseconds. */
+    int64_t started_at;
+    /* If set, called instead of the global exit callback when this child has
+     * been reaped. */
+    subprocess_exit_callback exit_callback;
+    void *exit_callback_arg;
+    /* The next child in the same hash bucket, or the next free slot. */
+    struct child_info *next;
 } child_info_t;
 
-/* For every subprocess, we register an event that kills that subprocess after a
- * timeout. This function removes that event for one subprocess. You should
- * call this function immediately after you reap the child using waitpid.
- *
- */
-static void remove_subprocess_killer(subprocesses_t *subprocesses, pid_t pid) {
-    int pids_matched = 0;
-    for (int i = subprocesses->count - 1; i >= 0; --i) {
-        if (subprocesses->children[i].pid != pid) {
-            continue;
+typedef struct child_slab {
+    child_info_t children[SUBPROCESSES_SLAB_SIZE];
+    struct child_slab *next;
+} child_slab_t;
+
+/* Pids are usually handed out sequentially, so their low bits spread them
+ * evenly over the buckets. */
+static child_info_t **bucket(subprocesses_t *subprocesses, pid_t pid) {
+    return &subprocesses->buckets[pid & (subprocesses->bucket_count - 1)];
+}
+
+static child_info_t *find_subprocess(subprocesses_t *subprocesses, pid_t pid) {
+    for (child_info_t *info = *bucket(subprocesses, pid);
+         info;
+         info = info->next) {
+        if (info->pid == pid) {
+            return info;
+        }
+    }
+    return NULL;
+}
+
+/* Double the number of buckets once there are more children than buckets. If
+ * we can't, the chains just get longer; subprocesses_init allocates the first
+ * buckets, so there always are some. */
+static void grow_buckets(subprocesses_t *subprocesses) {
+    if (subprocesses->count < subprocesses->bucket_count) {
+        return;
+    }
+    int bucket_count = subprocesses->bucket_count * 2;
+    child_info_t **buckets = calloc(bucket_count, sizeof(child_info_t *));
+    if (!buckets) {
+        log_error("calloc: %m");
+        return;
+    }
+    for (int i = 0; i < subprocesses->bucket_count; ++i) {
+        child_info_t *info = subprocesses->buckets[i];
+        while (info) {
+            child_info_t *next = info->next;
+            child_info_t **head = &buckets[info->pid & (bucket_count - 1)];
+            info->next = *head;
+            *head = info;
+            info = next;
+        }
+    }
+    free(subprocesses->buckets);
+    subprocesses->buckets = buckets;
+    subprocesses->bucket_count = bucket_count;
+}
+
+static void hash_remove(subprocesses_t *subprocesses, child_info_t *info) {
+    child_info_t **link = bucket(subprocesses, info->pid);
+    while (*link != info) {
+        link = &(*link)->next;
+    }
+    *link = info->next;
+}
+
+/* Take a free slot, allocating a new slab if there are none. */
+static child_info_t *allocate_child(subprocesses_t *subprocesses) {
+    if (!subprocesses->free_children) {
+        int capacity = subprocesses->capacity + SUBPROCESSES_SLAB_SIZE;
+        child_info_t **deadlines = realloc(subprocesses->deadlines,
+                                           capacity * sizeof(child_info_t *));
+        if (!deadlines) {
+            log_error("realloc: %m");
+            return NULL;
+        }
+        subprocesses->deadlines = deadlines;
+        child_slab_t *slab = malloc(sizeof(child_slab_t));
+        if (!slab) {
+            log_error("malloc: %m");
+            return NULL;
+        }
+        slab->next = subprocesses->slabs;
+        subprocesses->slabs = slab;
+        subprocesses->capacity = capacity;
+        for (int i = SUBPROCESSES_SLAB_SIZE - 1; i >= 0; --i) {
+            slab->children[i].next = subprocesses->free_children;
+            subprocesses->free_children = &slab->children[i];
+        }
+    }
+    child_info_t *info = subprocesses->free_children;
+    subprocesses->free_children = info->next;
+    info->pid = 0;
+    info->heap_index = -1;
+    info->exit_callback = NULL;
+    info->exit_callback_arg = NULL;
+    info->next = NULL;
+    return info;
+}
+
+static void free_child(subprocesses_t *subprocesses, child_info_t *info) {
+    info->next = subprocesses->free_children;
+    subprocesses->free_children = info;
+}
+
+/* The children with a timeout form a binary min-heap ordered by deadline, like
+ * the scheduler's experiments. */
+
+static void heap_set(subprocesses_t *subprocesses,
+                     int index,
+                     child_info_t *info) {
+    subprocesses->deadlines[index] = info;
+    info->heap_index = index;
+}
+
+static void sift_up(subprocesses_t *subprocesses, int index) {
+    child_info_t *info = subprocesses->deadlines[index];
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (subprocesses->deadlines[parent]->deadline <= info->deadline) {
+            break;
         }
-        ++pids_matched;
+        heap_set(subprocesses, index, subprocesses->deadlines[parent]);
+        index = parent;
+    }
+    heap_set(subprocesses, index, info);
+}
 
-        /* This is the important line. */
-        event_free(subprocesses->children[i].ev);
+static void sift_down(subprocesses_t *subprocesses, int index) {
+    child_info_t *info = subprocesses->deadlines[index];
+    for (;;) {
+        int child = 2 * index + 1;
+        if (child >= subprocesses->armed) {
+            break;
+        }
+        if (child + 1 < subprocesses->armed
+            && subprocesses->deadlines[child + 1]->deadline
+                < subprocesses->deadlines[child]->deadline) {
+            ++child;
+        }
+        if (info->deadline <= subprocesses->deadlines[child]->deadline) {
+            break;
+        }
+        heap_set(subprocesses, index, subprocesses->deadlines[child]);
+        index = child;
+    }
+    heap_set(subprocesses, index, info);
+}
 
-        /* Remove the child by swapping it to the end of the list of children
-         * and decrementing the list length. This is ok to do because the list
-         * of children is unordered. */
-        subprocesses->children[i] = subprocesses->children[subprocesses->count - 1];
-        --subprocesses->count;
+/* Point the timer at the earliest deadline. */
+static int reset_timer(subprocesses_t *subprocesses) {
+    if (subprocesses->armed == 0) {
+        if (event_del(subprocesses->timer)) {
+            log_error("error calling event_del");
+            return -1;
+        }
+        return 0;
+    }
+    int64_t delay = subprocesses->deadlines[0]->deadline
+        - monotonic_microseconds();
+    if (delay < 0) {
+        delay = 0;
     }
-    assert(pids_matched == 1);  /* Sanity check. */
+    struct timeval timeout = { delay / 1000000, delay % 1000000 };
+    if (event_add(subprocesses->timer, &timeout)) {
+        log_error("error calling event_add");
+        return -1;
+    }
+    return 0;
+}
+
+/* Whether some child needs reaping as soon as it exits: one with a timeout,
+ * or one whose exit callback is waiting for it. */
+static int watching(const subprocesses_t *subprocesses) {
+    return subprocesses->armed > 0
+        || subprocesses->waiting > 0
+        || (subprocesses->exit_callback && subprocesses->count > 0);
+}
 
-    /* When there are no subprocesses outstanding, deactivate the SIGCHLD
-     * handler. Doing so lets event_base_dispatch exit when there are no
-     * remaining events to handle. If we didn't remove this signal handler, then
-     * event_base_dispatch could hang around indefinitely waiting for SIGCHLD
-     * events that will never come. */
-    if (subprocesses->count == 0) {
+/* Add or remove the SIGCHLD handler after watching may have changed. */
+static int update_sigchld(subprocesses_t *subprocesses, int was_watching) {
+    int now_watching = watching(subprocesses);
+    if (!was_watching && now_watching) {
+        /* It's ok to evsignal_add multiple times on the same event. */
+        if (evsignal_add(subprocesses->sigchld_event, NULL)) {
+            log_error("error adding SIGCHLD event handler");
+            return -1;
+        }
+        /* A child may have exited while we weren't listening, so look for
+         * it from the event loop. */
+        event_active(subprocesses->sigchld_event, EV_SIGNAL, 1);
+    } else if (was_watching && !now_watching) {
+        /* When no subprocesses need watching, deactivate the SIGCHLD
+         * handler. Doing so lets event_base_dispatch exit when there are no
+         * remaining events to handle. If we didn't remove this signal
+         * handler, then event_base_dispatch could hang around indefinitely
+         * waiting for SIGCHLD events that will never come. */
         if (evsignal_del(subprocesses->sigchld_event)) {
             log_error("error removing SIGCHLD event handler");
+            return -1;
         }
     }
+    return 0;
 }
 
-/* This is a callback that kills a child process after a timeout. */
-static void kill_subprocess(evutil_socket_t fd, short what, void *arg) {
-    child_info_t *info = (child_info_t *)arg;
+/* Give a child a deadline, or take it away if deadline is negative, and keep
+ * the SIGCHLD handler active while any child has one. */
+static int set_deadline(subprocesses_t *subprocesses,
+                        child_info_t *info,
+                        int64_t deadline) {
+    int was_watching = watching(subprocesses);
+    if (deadline < 0) {
+        int index = info->heap_index;
+        if (index < 0) {
+            return 0;
+        }
+        info->heap_index = -1;
+        child_info_t *last = subprocesses->deadlines[--subprocesses->armed];
+        if (last != info) {
+            heap_set(subprocesses, index, last);
+            sift_up(subprocesses, index);
+            sift_down(subprocesses, last->heap_index);
+        }
+    } else if (info->heap_index < 0) {
+        info->deadline = deadline;
+        int index = subprocesses->armed++;
+        heap_set(subprocesses, index, info);
+        sift_up(subprocesses, index);
+    } else {
+        info->deadline = deadline;
+        sift_up(subprocesses, info->heap_index);
+        sift_down(subprocesses, info->heap_index);
+    }
+
+    if (update_sigchld(subprocesses, was_watching)) {
+        return -1;
+    }
+    return reset_timer(subprocesses);
+}
+
+/* Stop tracking a child and pass its status and resource usage to its exit
+ * callback. You should call this function immediately after you reap the child
+ * using wait4.
+ *
+ */
+static void remove_subprocess(subprocesses_t *subprocesses,
+                              pid_t pid,
+                              int status,
+                              const struct rusage *usage,
+                              int timed_out) {
+    child_info_t *info = find_subprocess(subprocesses, pid);
+    assert(info);  /* Sanity check. */
+
+    subprocess_exit_t child;
+    child.pid = pid;
+    child.status = status;
+    child.timed_out = timed_out;
+    child.usage = *usage;
+    child.wall_microseconds = monotonic_microseconds() - info->started_at;
+
+    subprocess_exit_callback exit_callback = subprocesses->exit_callback;
+    void *exit_callback_arg = subprocesses->exit_callback_arg;
+    if (info->exit_callback) {
+        exit_callback = info->exit_callback;
+        exit_callback_arg = info->exit_callback_arg;
+    }
+
+    set_deadline(subprocesses, info, -1);
+    int was_watching = watching(subprocesses);
+    if (info->exit_callback) {
+        --subprocesses->waiting;
+    }
+    hash_remove(subprocesses, info);
+    free_child(subprocesses, info);
+    --subprocesses->count;
+    update_sigchld(subprocesses, was_watching);
 
-    int pid = waitpid(info->pid, NULL, WNOHANG);
+    if (exit_callback) {
+        exit_callback(&child, exit_callback_arg);
+    }
+}
+
+/* Kill a child whose timeout has expired. */
+static void kill_subprocess(subprocesses_t *subprocesses, child_info_t *info) {
+    pid_t child_pid = info->pid;
+    int status;
+    struct rusage usage;
+    int pid = wait4(child_pid, &status, WNOHANG, &usage);
     if (pid == -1) {
         log_error("pid %d is not a child; has it already been reaped?",
-                  info->pid);
+                  child_pid);
+        set_deadline(subprocesses, info, -1);
         return;
     }
 
     /* The child process might have already exited naturally. We will normally
      * wait on such a processes in sigchld_handler, but there's a chance that
-     * the process exited after libevent dispatched to kill_subprocess. */
-    if (pid == info->pid) {
-        log_info("pid %d has already exited", info->pid);
-        remove_subprocess_killer(info->subprocesses, info->pid);
+     * the process exited after libevent dispatched to timeout_callback. */
+    if (pid == child_pid) {
+        log_info("pid %d has already exited", child_pid);
+        remove_subprocess(subprocesses, child_pid, status, &usage, 0);
         return;
     }
 
     /* Kill the child. We kill the entire process group to minimize the
      * possibility of stray sub-sub-processes. This works because all children
      * call setsid upon forking. */
-    log_info("pid %d has not exited yet; killing it now", info->pid);
-    pid_t process_group = -1 * info->pid;
-    if (kill(process_group, SIGKILL) || kill(info->pid, SIGKILL)) {
+    log_info("pid %d has not exited yet; killing it now", child_pid);
+    pid_t process_group = -1 * child_pid;
+    if (kill(process_group, SIGKILL) || kill(child_pid, SIGKILL)) {
         log_error("kill: %m");
+        set_deadline(subprocesses, info, -1);
         return;
     }
     /* Reap the pid of the newly killed child. Run in a loop
-     * in case a signal interrupts the call to waitpid. */
+     * in case a signal interrupts the call to wait4. */
     do {
-        pid = waitpid(info->pid, NULL, 0);
+        pid = wait4(child_pid, &status, 0, &usage);
     } while(pid == -1 && errno == EINTR);
     if (pid == -1) {
-        log_error("waitpid: %m");
+        log_error("wait4: %m");
+        set_deadline(subprocesses, info, -1);
         return;
     }
-    remove_subprocess_killer(info->subprocesses, info->pid);
+    remove_subprocess(subprocesses, child_pid, status, &usage, 1);
+}
+
+/* This is a callback that kills every child whose timeout has expired. */
+static void timeout_callback(evutil_socket_t fd, short what, void *arg) {
+    subprocesses_t *subprocesses = (subprocesses_t *)arg;
+    int64_t now = monotonic_microseconds();
+    /* Killing a child runs its exit callback, which may fork or change
+     * timeouts, so look at the top of the heap afresh every time. */
+    while (subprocesses->armed > 0
+           && subprocesses->deadlines[0]->deadline <= now) {
+        kill_subprocess(subprocesses, subprocesses->deadlines[0]);
+    }
+    reset_timer(subprocesses);
 }
 
 static void sigchld_handler(evutil_socket_t fd, short what, void *arg) {
@@ -105,56 +370,81 @@ static void sigchld_handler(evutil_socket_t fd, short what, void *arg) {
     /* We might only receive a single SIGCHLD for several exiting children, so
      * we try to reap as many children as possible. */
     pid_t pid;
-    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+    int status;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
         log_info("reaping pid %d", pid);
-        remove_subprocess_killer(subprocesses, pid);
+        remove_subprocess(subprocesses, pid, status, &usage, 0);
     }
     if (pid < 0 && errno != ECHILD) {  /* ECHILD isn't an error in this case. */
-        log_error("waitpid: %m");
+        log_error("wait4: %m");
     }
 }
 
 int subprocesses_init(subprocesses_t *subprocesses, struct event_base *base) {
-    subprocesses->children = NULL;
+    subprocesses->slabs = NULL;
+    subprocesses->free_children = NULL;
     subprocesses->count = 0;
     subprocesses->capacity = 0;
+    subprocesses->buckets = calloc(SUBPROCESSES_SLAB_SIZE,
+                                   sizeof(struct child_info *));
+    if (!subprocesses->buckets) {
+        log_error("calloc: %m");
+        return -1;
+    }
+    subprocesses->bucket_count = SUBPROCESSES_SLAB_SIZE;
+    subprocesses->deadlines = NULL;
+    subprocesses->armed = 0;
+    subprocesses->waiting = 0;
+    subprocesses->exit_callback = NULL;
+    subprocesses->exit_callback_arg = NULL;
     subprocesses->base = base;
 
+    subprocesses->timer = evtimer_new(base, timeout_callback, subprocesses);
+    if (!subprocesses->timer) {
+        log_error("error creating timeout event");
+        free(subprocesses->buckets);
+        return -1;
+    }
     subprocesses->sigchld_event = evsignal_new(base,
                                                SIGCHLD,
                                                sigchld_handler,
                                                subprocesses);
     if (!subprocesses->sigchld_event) {
         log_error("error creating SIGCHLD event handler");
+        event_free(subprocesses->timer);
+        free(subprocesses->buckets);
         return -1;
     }
     return 0;
 }
 
 int subprocesses_fork(subprocesses_t *subprocesses, time_t timeout_seconds) {
-    /* Grow the list of subprocesses as needed. */
-    if (subprocesses->count + 1 > subprocesses->capacity) {
-        subprocesses->capacity = (subprocesses->capacity + 1) * 2;
-        subprocesses->children = realloc(
-                subprocesses->children,
-                subprocesses->capacity * sizeof(child_info_t));
-        if (!subprocesses->children) {
-            log_error("realloc: %m");
-            return -1;
-        }
+    child_info_t *info = allocate_child(subprocesses);
+    if (!info) {
+        return -1;
     }
 
-    /* Ensure subprocess killer gets run after a timeout. It's ok to
-     * evsignal_add multiple times on the same event. Install this handler
-     * before forking just in case the child exits really quickly. */
-    if (evsignal_add(subprocesses->sigchld_event, NULL)) {
-        log_error("error adding SIGCHLD event handler");
+    /* Install the SIGCHLD handler before forking just in case the child exits
+     * really quickly. A slot that isn't in the hash table yet can still be in
+     * the heap; the timer can't fire before we return to the event loop. */
+    if (timeout_seconds > 0
+        && set_deadline(subprocesses,
+                        info,
+                        monotonic_microseconds()
+                            + (int64_t)timeout_seconds * 1000000)) {
+        set_deadline(subprocesses, info, -1);
+        free_child(subprocesses, info);
         return -1;
     }
 
+    /* Otherwise the child would inherit buffered messages and log them too. */
+    logging_flush();
     pid_t pid = fork();
     if (pid < 0) {
         log_error("fork: %m");
+        set_deadline(subprocesses, info, -1);
+        free_child(subprocesses, info);
         return -1;
     } else if (pid == 0) {
         /* We are the child process. */
@@ -172,26 +462,72 @@ int subprocesses_fork(subprocesses_t *subprocesses, time_t timeout_seconds) {
     /* We are the parent process. */
     log_info("spawned child pid %d", pid);
 
-    /* Schedule an event to kill the child after a timeout. */
-    child_info_t *info = &subprocesses->children[subprocesses->count];
     info->pid = pid;
-    info->ev = event_new(subprocesses->base,
-                         -1,
-                         EV_TIMEOUT,
-                         kill_subprocess,
-                         info);
-    if (!info->ev) {
-        log_error("error creating timeout event");
+    info->started_at = monotonic_microseconds();
+    int was_watching = watching(subprocesses);
+    ++subprocesses->count;
+    grow_buckets(subprocesses);
+    child_info_t **head = bucket(subprocesses, pid);
+    info->next = *head;
+    *head = info;
+    update_sigchld(subprocesses, was_watching);
+    return pid;
+}
+
+int subprocesses_set_timeout(subprocesses_t *subprocesses,
+                             pid_t pid,
+                             time_t timeout_seconds) {
+    child_info_t *info = find_subprocess(subprocesses, pid);
+    if (!info) {
+        log_error("pid %d is not a child", pid);
+        return -1;
+    }
+    if (timeout_seconds <= 0) {
+        return set_deadline(subprocesses, info, -1);
+    }
+    return set_deadline(subprocesses,
+                        info,
+                        monotonic_microseconds()
+                            + (int64_t)timeout_seconds * 1000000);
+}
+
+int subprocesses_on_exit(subprocesses_t *subprocesses,
+                         pid_t pid,
+                         subprocess_exit_callback callback,
+                         void *arg) {
+    child_info_t *info = find_subprocess(subprocesses, pid);
+    if (!info) {
+        log_error("pid %d is not a child", pid);
         return -1;
     }
-    struct timeval kill_timeout = { timeout_seconds, 0 };
-    if (event_add(info->ev, &kill_timeout)) {
-        log_info("error calling event_add");
-        event_free(info->ev);
+    int was_watching = watching(subprocesses);
+    if (!info->exit_callback && callback) {
+        ++subprocesses->waiting;
+    } else if (info->exit_callback && !callback) {
+        --subprocesses->waiting;
+    }
+    info->exit_callback = callback;
+    info->exit_callback_arg = arg;
+    return update_sigchld(subprocesses, was_watching);
+}
+
+int subprocesses_reap(subprocesses_t *subprocesses, pid_t pid) {
+    if (!find_subprocess(subprocesses, pid)) {
+        return 0;
+    }
+    pid_t reaped;
+    int status;
+    struct rusage usage;
+    do {
+        reaped = wait4(pid, &status, 0, &usage);
+    } while (reaped == -1 && errno == EINTR);
+    if (reaped == -1) {
+        log_error("wait4: %m");
         return -1;
     }
-    ++subprocesses->count;
-    return pid;
+    log_info("reaping pid %d", pid);
+    remove_subprocess(subprocesses, pid, status, &usage, 0);
+    return 0;
 }
 
 int subprocesses_destroy(subprocesses_t *subprocesses) {
@@ -199,7 +535,15 @@ int subprocesses_destroy(subprocesses_t *subprocesses) {
         log_error("not all subprocesses have exited");
         return -1;
     }
-    free(subprocesses->children);
+    while (subprocesses->slabs) {
+        child_slab_t *next = subprocesses->slabs->next;
+        free(subprocesses->slabs);
+        subprocesses->slabs = next;
+    }
+    subprocesses->free_children = NULL;
+    free(subprocesses->buckets);
+    free(subprocesses->deadlines);
+    event_free(subprocesses->timer);
     event_free(subprocesses->sigchld_event);
     return 0;
 }
@@ -1,25 +1,74 @@
 #ifndef CENSORSCOPE_SUBPROCESSES_H
 #define CENSORSCOPE_SUBPROCESSES_H
 
+#include <stdint.h>
 #include <time.h>
+#include <sys/resource.h>
+#include <sys/types.h>
 
 #include "options.h"
 
-struct child_info_t;
+struct child_info;
+struct child_slab;
 struct event;
 struct event_base;
 
-/* This tracks state of subprocesses so we can terminate them after a imeout. */
+/* Children are tracked in slabs of this many slots. */
+#define SUBPROCESSES_SLAB_SIZE 32
+
+/* How a child ended, as passed to exit callbacks. */
+typedef struct {
+    pid_t pid;
+    /* The status from wait4. */
+    int status;
+    /* Set if we killed the child because its timeout expired. */
+    int timed_out;
+    /* The child's resource usage from wait4, and the time between forking
+     * and reaping it. */
+    struct rusage usage;
+    int64_t wall_microseconds;
+} subprocess_exit_t;
+
+typedef void (*subprocess_exit_callback)(const subprocess_exit_t *child,
+                                         void *arg);
+
+/* This tracks state of subprocesses so we can terminate them after a timeout.
+ *
+ * Each child gets a slot in a slab that never moves, so pointers to it stay
+ * valid, and slots are reused, so forking doesn't allocate once there are
+ * enough of them. A hash table finds a child's slot from its pid, and the
+ * children with a pending timeout form a min-heap ordered by deadline, with a
+ * single timer waiting for the earliest. */
 typedef struct {
-    /* An array of 'capacity' elements, the first 'count' of which are valid. */
-    struct child_info *children;
+    /* Every slab we've allocated, and the slots in them that are unused. */
+    struct child_slab *slabs;
+    struct child_info *free_children;
+    /* The number of children we're tracking, and the number of slots. */
     int count, capacity;
+    /* A chained hash table from pid to child. bucket_count is a power of
+     * two, and never 0. */
+    struct child_info **buckets;
+    int bucket_count;
+    /* The children with a pending timeout, as a min-heap ordered by
+     * deadline. This has room for every slot, so adding to it can't fail. */
+    struct child_info **deadlines;
+    int armed;
+    /* The number of children with their own exit callback. We only watch for
+     * SIGCHLD while some child has a timeout or an exit callback, so idle
+     * long-lived children don't keep the event loop running. */
+    int waiting;
 
     /* We need this to add and remove timeout events. */
     struct event_base *base;
-    /* This is the event for the SIGCHLD handler, which we use to remove timeout
-     * events when subprocesses exit early. */
+    /* Fires at the earliest deadline to kill the children that are late. */
+    struct event *timer;
+    /* This is the event for the SIGCHLD handler, which we use to reap
+     * children, and remove them from the heap when they exit early. */
     struct event *sigchld_event;
+
+    /* If set, called with how every child ended after it has been reaped. */
+    subprocess_exit_callback exit_callback;
+    void *exit_callback_arg;
 } subprocesses_t;
 
 /* Initialize state needed to manage subprocesses.
@@ -38,13 +87,45 @@ int subprocesses_init(subprocesses_t *subprocesses, struct event_base *base);
  *
  * Arguments:
  * - subprocesses is the state used to schedule kill events.
- * - timeout_seconds; the parent will kill the child after this many seconds.
+ * - timeout_seconds; the parent will kill the child after this many seconds,
+ *   or never if it is not positive.
  * Returns -1 on error, 0 to the child on success, and a positive integer to the
  * parent on success.
  *
  */
 int subprocesses_fork(subprocesses_t *subprocesses, time_t timeout_seconds);
 
+/* Restart a child's timeout, so the parent kills it timeout_seconds from now.
+ * A timeout that is not positive cancels the kill. Long-lived children use
+ * this to apply a timeout to each unit of work.
+ *
+ * Returns 0 on success and -1 if pid is not a child or there were errors.
+ *
+ */
+int subprocesses_set_timeout(subprocesses_t *subprocesses,
+                             pid_t pid,
+                             time_t timeout_seconds);
+
+/* Call callback with arg once a child has been reaped, instead of the global
+ * exit_callback. Children of the event loop can't exit before this is called,
+ * since they are only reaped from the loop.
+ *
+ * Returns 0 on success and -1 if pid is not a child.
+ *
+ */
+int subprocesses_on_exit(subprocesses_t *subprocesses,
+                         pid_t pid,
+                         subprocess_exit_callback callback,
+                         void *arg);
+
+/* Wait for a child that is known to be exiting and stop tracking it. This
+ * does nothing if the child has already been reaped.
+ *
+ * Returns 0 on success and -1 on failure.
+ *
+ */
+int subprocesses_reap(subprocesses_t *subprocesses, pid_t pid);
+
 /* Destroy the subprocess state. All subprocesses must have exited before
  * calling this function.
  *
@@ -0,0 +1,271 @@
+#include "targets.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "logging.h"
+#include "util.h"
+
+#define TARGETS_EXTENSION ".txt"
+
+static targets_list_t *cache = NULL;
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Find the first entry at or after offset. On success, set the entry and the
+ * offset just past its line. */
+static int scan_entry(const char *data,
+                      size_t size,
+                      size_t *offset,
+                      const char **entry,
+                      size_t *len) {
+    while (*offset < size) {
+        const char *line = data + *offset;
+        const char *newline = memchr(line, '\n', size - *offset);
+        size_t line_len = newline ? (size_t)(newline - line) : size - *offset;
+        *offset += line_len + (newline ? 1 : 0);
+
+        while (line_len > 0 && is_space(line[0])) {
+            ++line;
+            --line_len;
+        }
+        while (line_len > 0 && is_space(line[line_len - 1])) {
+            --line_len;
+        }
+        if (line_len == 0 || line[0] == '#') {
+            continue;
+        }
+        *entry = line;
+        *len = line_len;
+        return 1;
+    }
+    return 0;
+}
+
+/* Count the entries and record the checkpoints. */
+static int index_list(targets_list_t *list) {
+    size_t capacity = 16;
+    list->checkpoints = malloc(capacity * sizeof(size_t));
+    if (!list->checkpoints) {
+        return -1;
+    }
+    size_t offset = 0;
+    for (;;) {
+        size_t start = offset;
+        const char *entry;
+        size_t len;
+        if (!scan_entry(list->data, list->size, &offset, &entry, &len)) {
+            return 0;
+        }
+        if (list->count % TARGETS_CHECKPOINT_INTERVAL == 0) {
+            size_t checkpoint = list->count / TARGETS_CHECKPOINT_INTERVAL;
+            if (checkpoint == capacity) {
+                capacity *= 2;
+                size_t *checkpoints = realloc(list->checkpoints,
+                                              capacity * sizeof(size_t));
+                if (!checkpoints) {
+                    return -1;
+                }
+                list->checkpoints = checkpoints;
+            }
+            /* Skipped lines before the entry don't matter; seeking scans
+             * past them again. */
+            list->checkpoints[checkpoint] = start;
+        }
+        ++list->count;
+    }
+}
+
+static void unmap_list(targets_list_t *list) {
+    if (list->data) {
+        munmap((void *)list->data, list->size);
+    }
+    free(list->checkpoints);
+    free(list->path);
+    free(list);
+}
+
+static void uncache_list(targets_list_t *list) {
+    targets_list_t **link = &cache;
+    while (*link != list) {
+        link = &(*link)->next;
+    }
+    *link = list->next;
+    list->next = NULL;
+    list->cached = 0;
+    if (list->refs == 0) {
+        unmap_list(list);
+    }
+}
+
+static targets_list_t *map_list(const char *path, const struct stat *info) {
+    targets_list_t *list = calloc(1, sizeof(targets_list_t));
+    if (!list) {
+        log_error("calloc error: %m");
+        return NULL;
+    }
+    list->path = strdup(path);
+    if (!list->path) {
+        log_error("strdup error: %m");
+        free(list);
+        return NULL;
+    }
+    list->mtime = info->st_mtim;
+    list->size = info->st_size;
+
+    if (list->size > 0) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            log_error("error opening %s: %m", path);
+            unmap_list(list);
+            return NULL;
+        }
+        void *data = mmap(NULL, list->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            log_error("error mapping %s: %m", path);
+            unmap_list(list);
+            return NULL;
+        }
+        /* We scan the whole list to index it, and iterate in order. */
+        madvise(data, list->size, MADV_SEQUENTIAL);
+        list->data = data;
+    }
+    if (index_list(list)) {
+        log_error("error indexing %s", path);
+        unmap_list(list);
+        return NULL;
+    }
+    return list;
+}
+
+char *targets_filename(const char *sandbox_dir, const char *name) {
+    if (!is_valid_module_name(name) || name[0] == '\0') {
+        return NULL;
+    }
+    size_t len = strlen(name);
+    size_t extension_len = strlen(TARGETS_EXTENSION);
+    if (len > extension_len
+        && strcmp(name + len - extension_len, TARGETS_EXTENSION) == 0) {
+        len -= extension_len;
+    }
+    return sprintf_malloc("%s/%.*s%s",
+                          sandbox_dir,
+                          (int)len,
+                          name,
+                          TARGETS_EXTENSION);
+}
+
+targets_list_t *targets_open(const char *path) {
+    struct stat info;
+    if (stat(path, &info)) {
+        log_error("cannot stat %s: %m", path);
+        return NULL;
+    }
+    if (!S_ISREG(info.st_mode)) {
+        log_error("%s is not a regular file", path);
+        return NULL;
+    }
+
+    for (targets_list_t *list = cache; list; list = list->next) {
+        if (strcmp(list->path, path) != 0) {
+            continue;
+        }
+        if (list->size == info.st_size
+            && list->mtime.tv_sec == info.st_mtim.tv_sec
+            && list->mtime.tv_nsec == info.st_mtim.tv_nsec) {
+            ++list->refs;
+            return list;
+        }
+        uncache_list(list);
+        break;
+    }
+
+    targets_list_t *list = map_list(path, &info);
+    if (!list) {
+        return NULL;
+    }
+    list->refs = 1;
+    list->cached = 1;
+    list->next = cache;
+    cache = list;
+    return list;
+}
+
+void targets_release(targets_list_t *list) {
+    if (--list->refs == 0 && !list->cached) {
+        unmap_list(list);
+    }
+}
+
+int targets_preload_directory(const char *directory) {
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        log_error("error opening %s: %m", directory);
+        return -1;
+    }
+    size_t extension_len = strlen(TARGETS_EXTENSION);
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        size_t len = strlen(entry->d_name);
+        if (len <= extension_len
+            || strcmp(entry->d_name + len - extension_len,
+                      TARGETS_EXTENSION) != 0) {
+            continue;
+        }
+        char *path = sprintf_malloc("%s/%s", directory, entry->d_name);
+        if (!path) {
+            log_error("error allocating target list path");
+            continue;
+        }
+        targets_list_t *list = targets_open(path);
+        if (list) {
+            log_debug("mapped %zu targets from %s", list->count, path);
+            targets_release(list);
+        }
+        free(path);
+    }
+    closedir(dir);
+    return 0;
+}
+
+void targets_free() {
+    while (cache) {
+        uncache_list(cache);
+    }
+}
+
+void targets_seek(const targets_list_t *list,
+                  size_t index,
+                  targets_cursor_t *cursor) {
+    if (index >= list->count) {
+        cursor->offset = list->size;
+        cursor->index = list->count;
+        return;
+    }
+    size_t checkpoint = index / TARGETS_CHECKPOINT_INTERVAL;
+    cursor->offset = list->checkpoints[checkpoint];
+    cursor->index = checkpoint * TARGETS_CHECKPOINT_INTERVAL;
+    const char *entry;
+    size_t len;
+    while (cursor->index < index) {
+        targets_next(list, cursor, &entry, &len);
+    }
+}
+
+int targets_next(const targets_list_t *list,
+                 targets_cursor_t *cursor,
+                 const char **entry,
+                 size_t *len) {
+    if (!scan_entry(list->data, list->size, &cursor->offset, entry, len)) {
+        return 0;
+    }
+    ++cursor->index;
+    return 1;
+}
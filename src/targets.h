@@ -0,0 +1,93 @@
+#ifndef CENSORSCOPE_TARGETS_H
+#define CENSORSCOPE_TARGETS_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Target lists are plain text files in the sandbox directory with one entry,
+ * like a domain or URL, per line. Blank lines and lines starting with '#' are
+ * skipped, and entries are trimmed of surrounding whitespace.
+ *
+ * Unlike Lua modules, lists are never loaded into the Lua heap. We map each
+ * file read-only and keep it mapped for the life of the process, keyed by
+ * path, modification time and size. The parent maps every list before
+ * forking, so children inherit the mappings and every process shares one copy
+ * of each list in the page cache. Sandbox updates must replace list files
+ * rather than rewrite them in place, as rsync does, since truncating a mapped
+ * file would crash the processes reading it. */
+
+/* Every this many entries we remember the entry's offset, so seeking costs at
+ * most this many lines of scanning. */
+#define TARGETS_CHECKPOINT_INTERVAL 1024
+
+typedef struct targets_list {
+    char *path;
+    struct timespec mtime;
+    off_t size;
+    /* The mapped file, or NULL if it is empty. */
+    const char *data;
+    /* The number of entries. */
+    size_t count;
+    /* The offset of every TARGETS_CHECKPOINT_INTERVAL'th entry. */
+    size_t *checkpoints;
+    /* The number of targets_open calls not yet released, and whether the list
+     * is still in the cache. Lists are unmapped once they are neither. */
+    int refs;
+    int cached;
+    struct targets_list *next;
+} targets_list_t;
+
+/* A position in a list: the byte offset and number of the next entry. */
+typedef struct {
+    size_t offset;
+    size_t index;
+} targets_cursor_t;
+
+/* Format the filename of a list in the sandbox directory. The name may be
+ * given with or without its .txt extension.
+ *
+ * Returns: the path allocated with malloc, which you must free, or NULL if
+ * the name is invalid or allocation failed.
+ *
+ */
+char *targets_filename(const char *sandbox_dir, const char *name);
+
+/* Map a list, or reuse the cached mapping if the file hasn't changed.
+ *
+ * Returns: the list, which you must release with targets_release, or NULL on
+ * failure.
+ *
+ */
+targets_list_t *targets_open(const char *path);
+
+void targets_release(targets_list_t *list);
+
+/* Map every .txt file in a directory, so children inherit the mappings.
+ *
+ * Returns: 0 on success, -1 if the directory could not be read.
+ *
+ */
+int targets_preload_directory(const char *directory);
+
+/* Drop every list from the cache, unmapping those nobody holds open. */
+void targets_free();
+
+/* Position a cursor before the entry with the given 0-based index, or at the
+ * end if there are fewer entries. */
+void targets_seek(const targets_list_t *list,
+                  size_t index,
+                  targets_cursor_t *cursor);
+
+/* Read the entry at a cursor and advance past it. The entry points into the
+ * mapping and is not NUL terminated.
+ *
+ * Returns: 1 if there was an entry, 0 at the end of the list.
+ *
+ */
+int targets_next(const targets_list_t *list,
+                 targets_cursor_t *cursor,
+                 const char **entry,
+                 size_t *len);
+
+#endif
@@ -1,7 +1,9 @@
 #include "tcp.h"
 
+#include <event2/event.h>
 #include <event2/util.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -13,40 +15,606 @@
 #include "lua.h"
 #include "lauxlib.h"
 
+#include "async.h"
+#include "logging.h"
+#include "luautil.h"
+#include "ratelimit.h"
+#include "sandbox.h"
+#include "util.h"
+
+#define DEFAULT_BATCH_WINDOW 64
+#define DEFAULT_BATCH_TIMEOUT_SECONDS 5
+/* About how big a SYN is, with its IP header and options. */
+#define TCP_SYN_BYTES 60
+
+int tcp_parse_address(const char *ip,
+                      int port,
+                      struct sockaddr_storage *address,
+                      int *address_len) {
+    if (port < 0 || port > 65535) {
+        return -1;
+    }
+    memset(address, 0, sizeof(*address));
+    struct sockaddr_in *sin = (struct sockaddr_in *)address;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)address;
+    if (evutil_inet_pton(AF_INET, ip, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        *address_len = sizeof(*sin);
+    } else if (evutil_inet_pton(AF_INET6, ip, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        *address_len = sizeof(*sin6);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Describe why a connect failed. A RST gives ECONNREFUSED, and ICMP
+ * unreachable messages give EHOSTUNREACH or ENETUNREACH. */
+static const char *connect_error(int error) {
+    switch (error) {
+    case ECONNREFUSED:
+        return "connection refused";
+    case ETIMEDOUT:
+        return "timeout";
+    case EHOSTUNREACH:
+        return "host unreachable";
+    case ENETUNREACH:
+        return "network unreachable";
+    case ECONNRESET:
+        return "connection reset";
+    case EACCES:
+    case EPERM:
+        return "permission denied";
+    default:
+        return "error connecting";
+    }
+}
+
+static void active_list_remove(tcp_connection_t *connection) {
+    tcp_engine_t *engine = connection->engine;
+    if (connection->prev) {
+        connection->prev->next = connection->next;
+    } else {
+        engine->active = connection->next;
+    }
+    if (connection->next) {
+        connection->next->prev = connection->prev;
+    }
+    connection->prev = connection->next = NULL;
+}
+
+static void release_socket(tcp_connection_t *connection) {
+    if (connection->ev) {
+        event_free(connection->ev);
+        connection->ev = NULL;
+    }
+    if (connection->fd >= 0) {
+        evutil_closesocket(connection->fd);
+        connection->fd = -1;
+    }
+}
+
+static void start_pending(tcp_engine_t *engine);
+
+/* Tell the rate limiter whether the destination answered our SYN. */
+static void report_connection(const tcp_connection_t *connection, int lost) {
+    char key[RATELIMIT_KEY_SIZE];
+    ratelimit_address_key((const struct sockaddr *)&connection->address,
+                          key,
+                          sizeof(key));
+    ratelimit_report(key, lost, lost ? 0 : TCP_SYN_BYTES);
+}
+
+/* Finish a connection in progress: close its socket, hand it to the callback
+ * and let the next pending connection take its slot. */
+static void finish_connection(tcp_connection_t *connection,
+                              const char *error) {
+    tcp_engine_t *engine = connection->engine;
+
+    connection->rtt_microseconds = monotonic_microseconds()
+                                 - connection->started_at;
+    release_socket(connection);
+    active_list_remove(connection);
+    --engine->in_flight;
+    --engine->outstanding;
+
+    connection->error = error;
+    connection->finished = 1;
+    connection->callback(connection, connection->callback_arg);
+    start_pending(engine);
+}
+
+static void on_connect_event(evutil_socket_t fd, short what, void *arg) {
+    tcp_connection_t *connection = arg;
+
+    if (what & EV_TIMEOUT) {
+        report_connection(connection, 1);
+        finish_connection(connection, "timeout");
+        return;
+    }
+
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len)) {
+        finish_connection(connection, "error reading socket status");
+        return;
+    }
+    report_connection(connection, error == ETIMEDOUT);
+    finish_connection(connection, error ? connect_error(error) : NULL);
+}
+
+/* Move a connection from the pending queue and start connecting. */
+static void start_connection(tcp_connection_t *connection) {
+    tcp_engine_t *engine = connection->engine;
+
+    connection->prev = NULL;
+    connection->next = engine->active;
+    if (engine->active) {
+        engine->active->prev = connection;
+    }
+    engine->active = connection;
+    ++engine->in_flight;
+    connection->started_at = monotonic_microseconds();
+
+    connection->fd = socket(connection->address.ss_family, SOCK_STREAM, 0);
+    if (connection->fd < 0) {
+        finish_connection(connection, "error creating socket");
+        return;
+    }
+    if (evutil_make_socket_nonblocking(connection->fd)
+        || evutil_make_socket_closeonexec(connection->fd)) {
+        finish_connection(connection, "error configuring socket");
+        return;
+    }
+    if (connect(connection->fd,
+                (struct sockaddr *)&connection->address,
+                connection->address_len) == 0) {
+        report_connection(connection, 0);
+        finish_connection(connection, NULL);
+        return;
+    }
+    /* Reporting to the rate limiter may change errno. */
+    int error = errno;
+    if (error == ECONNREFUSED) {
+        report_connection(connection, 0);
+    }
+    if (error != EINPROGRESS) {
+        finish_connection(connection, connect_error(error));
+        return;
+    }
+    connection->ev = event_new(engine->base,
+                               connection->fd,
+                               EV_WRITE,
+                               on_connect_event,
+                               connection);
+    if (!connection->ev || event_add(connection->ev, &engine->timeout)) {
+        finish_connection(connection, "error adding event");
+        return;
+    }
+}
+
+static void start_pending(tcp_engine_t *engine) {
+    if (engine->starting) {
+        return;
+    }
+    engine->starting = 1;
+    while (engine->pending_head && engine->in_flight < engine->window) {
+        tcp_connection_t *connection = engine->pending_head;
+        char key[RATELIMIT_KEY_SIZE];
+        ratelimit_address_key((const struct sockaddr *)&connection->address,
+                              key,
+                              sizeof(key));
+        int64_t wait = ratelimit_acquire(key, TCP_SYN_BYTES);
+        if (wait > 0) {
+            struct timeval delay = { wait / 1000000, wait % 1000000 };
+            if (event_add(engine->pace, &delay)) {
+                log_error("error scheduling TCP connection");
+            }
+            break;
+        }
+        engine->pending_head = connection->next;
+        if (!engine->pending_head) {
+            engine->pending_tail = NULL;
+        }
+        connection->next = NULL;
+        start_connection(connection);
+    }
+    engine->starting = 0;
+}
+
+static void on_pace_event(evutil_socket_t fd, short what, void *arg) {
+    start_pending(arg);
+}
+
+int tcp_engine_init(tcp_engine_t *engine,
+                    struct event_base *base,
+                    int window,
+                    struct timeval timeout) {
+    if (window < 1) {
+        log_error("invalid TCP engine parameters");
+        return -1;
+    }
+    engine->base = base;
+    engine->window = window;
+    engine->timeout = timeout;
+    engine->pending_head = engine->pending_tail = NULL;
+    engine->active = NULL;
+    engine->in_flight = 0;
+    engine->outstanding = 0;
+    engine->starting = 0;
+    engine->pace = evtimer_new(base, on_pace_event, engine);
+    if (!engine->pace) {
+        log_error("error creating TCP pacing event");
+        return -1;
+    }
+    return 0;
+}
+
+tcp_connection_t *tcp_engine_submit(tcp_engine_t *engine,
+                                    const struct sockaddr_storage *address,
+                                    int address_len,
+                                    tcp_connection_callback callback,
+                                    void *callback_arg) {
+    tcp_connection_t *connection = calloc(1, sizeof(tcp_connection_t));
+    if (!connection) {
+        return NULL;
+    }
+    connection->fd = -1;
+    connection->engine = engine;
+    connection->callback = callback;
+    connection->callback_arg = callback_arg;
+    memcpy(&connection->address, address, sizeof(connection->address));
+    connection->address_len = address_len;
+    connection->submitted_at = monotonic_microseconds();
+
+    if (engine->pending_tail) {
+        engine->pending_tail->next = connection;
+    } else {
+        engine->pending_head = connection;
+    }
+    engine->pending_tail = connection;
+    ++engine->outstanding;
+
+    start_pending(engine);
+    return connection;
+}
+
+int tcp_engine_run(tcp_engine_t *engine) {
+    while (engine->outstanding > 0) {
+        if (event_base_loop(engine->base, EVLOOP_ONCE) == -1) {
+            log_error("error running TCP event loop");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int tcp_engine_destroy(tcp_engine_t *engine) {
+    while (engine->active) {
+        tcp_connection_t *connection = engine->active;
+        release_socket(connection);
+        active_list_remove(connection);
+        tcp_connection_free(connection);
+    }
+    while (engine->pending_head) {
+        tcp_connection_t *connection = engine->pending_head;
+        engine->pending_head = connection->next;
+        tcp_connection_free(connection);
+    }
+    engine->pending_tail = NULL;
+    engine->in_flight = 0;
+    engine->outstanding = 0;
+    if (engine->pace) {
+        event_free(engine->pace);
+        engine->pace = NULL;
+    }
+    return 0;
+}
+
+void tcp_connection_free(tcp_connection_t *connection) {
+    free(connection);
+}
+
+/* Push the timing of a connection that was submitted at submitted_at, started
+ * connecting at started_at and finished connect_microseconds later. */
+static void push_timing(lua_State *L,
+                        int64_t submitted_at,
+                        int64_t started_at,
+                        int64_t connect_microseconds) {
+    lua_createtable(L, 0, 4);
+    lua_pushnumber(L, submitted_at);
+    lua_setfield(L, -2, "started_at");
+    lua_pushnumber(L, started_at - submitted_at);
+    lua_setfield(L, -2, "queued_microseconds");
+    lua_pushnumber(L, connect_microseconds);
+    lua_setfield(L, -2, "connect_microseconds");
+    lua_pushnumber(L, started_at - submitted_at + connect_microseconds);
+    lua_setfield(L, -2, "total_microseconds");
+}
+
+static void push_connection_timing(lua_State *L,
+                                   const tcp_connection_t *connection) {
+    push_timing(L,
+                connection->submitted_at,
+                connection->started_at,
+                connection->rtt_microseconds);
+}
+
 int l_tcp_connect(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
     evutil_socket_t sock;
-    struct sockaddr_in sin;
+    struct sockaddr_storage address;
+    int address_len;
 
     const char *ip = luaL_checkstring(L, 1);
     const int port = luaL_checkinteger(L, 2);
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
 
-    memset(&sin, 0, sizeof(sin));
-
-    sin.sin_family = AF_INET;
-    /* this breaks for ipv6, use inet_pton */
-    if (inet_aton(ip, &sin.sin_addr) == 0) {
+    if (tcp_parse_address(ip, port, &address, &address_len)) {
         lua_pushnil(L);
         lua_pushstring(L, "error invalid ip address");
         return 2;
     }
 
-    sin.sin_port = htons(port);
+    char key[RATELIMIT_KEY_SIZE];
+    ratelimit_address_key((struct sockaddr *)&address, key, sizeof(key));
+    if (ratelimit_wait(key, TCP_SYN_BYTES, sandbox_time_remaining(sandbox))) {
+        return sandbox_push_deadline_error(L);
+    }
+    int64_t remaining = sandbox_time_remaining(sandbox);
+    if (remaining == 0) {
+        return sandbox_push_deadline_error(L);
+    }
 
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((sock = socket(address.ss_family, SOCK_STREAM, 0)) < 0) {
         lua_pushnil(L);
         lua_pushstring(L, "error creating socket");
         return 2;
     }
 
-    if (connect(sock, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+    /* A blocking connect gives up after the send timeout, so use it to stop at
+     * the sandbox's deadline. */
+    if (remaining != INT64_MAX) {
+        struct timeval timeout = timeval_from_seconds(remaining / 1e6);
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    int64_t started_at = monotonic_microseconds();
+    int rc = connect(sock, (struct sockaddr*)&address, address_len);
+    int64_t connect_microseconds = monotonic_microseconds() - started_at;
+    /* A connect stopped by the send timeout fails with EINPROGRESS. */
+    int lost = rc < 0 && (errno == ETIMEDOUT || errno == EINPROGRESS);
+    evutil_closesocket(sock);
+    ratelimit_report(key, lost, lost ? 0 : TCP_SYN_BYTES);
+    if (rc < 0) {
         lua_pushnil(L);
         lua_pushstring(L, "error connecting to ip");
-        evutil_closesocket(sock);
+    } else {
+        lua_pushboolean(L, 1);
+        lua_pushnil(L);
+    }
+    push_timing(L, started_at, started_at, connect_microseconds);
+    return 3;
+}
+
+static void batch_connection_done(tcp_connection_t *connection, void *arg) {
+    /* Nothing to do; we collect results once the whole batch has finished. */
+}
+
+int l_tcp_connect_batch(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int window = optfield_integer(L, 2, "window", DEFAULT_BATCH_WINDOW);
+    double timeout = optfield_number(L,
+                                     2,
+                                     "timeout",
+                                     DEFAULT_BATCH_TIMEOUT_SECONDS);
+    luaL_argcheck(L, window > 0, 2, "window must be positive");
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
+
+    size_t count = lua_objlen(L, 1);
+    for (size_t i = 1; i <= count; ++i) {
+        lua_rawgeti(L, 1, i);
+        if (lua_type(L, -1) != LUA_TTABLE) {
+            return luaL_argerror(L, 1, "targets must be tables");
+        }
+        lua_getfield(L, -1, "ip");
+        lua_getfield(L, -2, "port");
+        if (lua_type(L, -2) != LUA_TSTRING || !lua_isnumber(L, -1)) {
+            return luaL_argerror(L, 1, "targets need an ip and a port");
+        }
+        lua_pop(L, 3);
+    }
+
+    tcp_engine_t engine;
+    if (tcp_engine_init(&engine,
+                        sandbox->base,
+                        window,
+                        timeval_from_seconds(
+                                sandbox_limit_seconds(sandbox, timeout)))) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating TCP engine");
+        return 2;
+    }
+    tcp_connection_t **connections = calloc(count ? count : 1,
+                                            sizeof(tcp_connection_t *));
+    if (!connections) {
+        tcp_engine_destroy(&engine);
+        lua_pushnil(L);
+        lua_pushstring(L, "error allocating connections");
+        return 2;
+    }
+    /* Targets that we couldn't parse or submit get this error instead. */
+    const char **errors = calloc(count ? count : 1, sizeof(const char *));
+    if (!errors) {
+        tcp_engine_destroy(&engine);
+        free(connections);
+        lua_pushnil(L);
+        lua_pushstring(L, "error allocating connections");
         return 2;
     }
 
-    evutil_closesocket(sock);
-    lua_pushboolean(L, 1);
+    lua_settop(L, 2);
+    for (size_t i = 0; i < count; ++i) {
+        lua_rawgeti(L, 1, i + 1);
+        lua_getfield(L, -1, "ip");
+        lua_getfield(L, -2, "port");
+        struct sockaddr_storage address;
+        int address_len;
+        if (tcp_parse_address(lua_tostring(L, -2),
+                              lua_tointeger(L, -1),
+                              &address,
+                              &address_len)) {
+            errors[i] = "error invalid ip address";
+        } else {
+            connections[i] = tcp_engine_submit(&engine,
+                                               &address,
+                                               address_len,
+                                               batch_connection_done,
+                                               NULL);
+            if (!connections[i]) {
+                errors[i] = "error allocating connection";
+            }
+        }
+        lua_pop(L, 3);
+    }
+
+    if (tcp_engine_run(&engine)) {
+        /* Finished connections belong to us; the engine frees the rest. */
+        for (size_t i = 0; i < count; ++i) {
+            if (connections[i] && connections[i]->finished) {
+                tcp_connection_free(connections[i]);
+            }
+        }
+        tcp_engine_destroy(&engine);
+        free(connections);
+        free(errors);
+        lua_pushnil(L);
+        lua_pushstring(L, "error running TCP connects");
+        return 2;
+    }
+
+    lua_createtable(L, count, 0);  /* The results array, at index 3. */
+    for (size_t i = 0; i < count; ++i) {
+        lua_createtable(L, 0, 6);
+        lua_rawgeti(L, 1, i + 1);
+        lua_getfield(L, -1, "ip");
+        lua_setfield(L, -3, "ip");
+        lua_getfield(L, -1, "port");
+        lua_setfield(L, -3, "port");
+        lua_pop(L, 1);
+
+        const char *error = errors[i];
+        if (connections[i]) {
+            error = connections[i]->error;
+            lua_pushnumber(L, connections[i]->rtt_microseconds);
+            lua_setfield(L, -2, "rtt_microseconds");
+            push_connection_timing(L, connections[i]);
+            lua_setfield(L, -2, "timing");
+            tcp_connection_free(connections[i]);
+        }
+        lua_pushboolean(L, error == NULL);
+        lua_setfield(L, -2, "connected");
+        if (error) {
+            lua_pushstring(L, error);
+            lua_setfield(L, -2, "error");
+        }
+        lua_rawseti(L, 3, i + 1);
+    }
+    free(connections);
+    free(errors);
+    tcp_engine_destroy(&engine);
+
+    lua_pushnil(L);
+    return 2;
+}
+
+/* Push what tcp_connect would return for a finished connection. */
+static void push_async_connection(lua_State *L, void *data) {
+    const tcp_connection_t *connection = data;
+    if (connection->error) {
+        lua_pushnil(L);
+        lua_pushstring(L, connection->error);
+    } else {
+        lua_pushboolean(L, 1);
+        lua_pushnil(L);
+    }
+    push_connection_timing(L, connection);
+}
+
+static void free_async_connection(void *data) {
+    tcp_connection_free(data);
+}
+
+static void async_connection_done(tcp_connection_t *connection, void *arg) {
+    async_op_finish(arg, connection);
+}
+
+int l_tcp_connect_async(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    const char *ip = luaL_checkstring(L, 1);
+    const int port = luaL_checkinteger(L, 2);
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
+
+    struct sockaddr_storage address;
+    int address_len;
+    if (tcp_parse_address(ip, port, &address, &address_len)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error invalid ip address");
+        return 2;
+    }
+
+    async_state_t *state = async_sandbox_state(sandbox);
+    if (!state) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error creating async state");
+        return 2;
+    }
+    if (!state->tcp) {
+        state->tcp = malloc(sizeof(tcp_engine_t));
+        if (!state->tcp
+            || tcp_engine_init(state->tcp,
+                               sandbox->async_base,
+                               DEFAULT_BATCH_WINDOW,
+                               timeval_from_seconds(sandbox_limit_seconds(
+                                       sandbox,
+                                       DEFAULT_BATCH_TIMEOUT_SECONDS)))) {
+            free(state->tcp);
+            state->tcp = NULL;
+            lua_pushnil(L);
+            lua_pushstring(L, "error creating TCP engine");
+            return 2;
+        }
+    }
+
+    async_op_t *op = async_op_new(state,
+                                  push_async_connection,
+                                  free_async_connection);
+    if (!op) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error allocating operation");
+        return 2;
+    }
+    if (!tcp_engine_submit(state->tcp,
+                           &address,
+                           address_len,
+                           async_connection_done,
+                           op)) {
+        async_op_cancel(op);
+        lua_pushnil(L);
+        lua_pushstring(L, "error allocating connection");
+        return 2;
+    }
+    lua_pushnumber(L, op->id);
     lua_pushnil(L);
     return 2;
 }
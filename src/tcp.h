@@ -1,8 +1,164 @@
 #ifndef CENSORSCOPE_TCP_H_
 #define CENSORSCOPE_TCP_H_
 
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <event2/util.h>
+
 #include "lua.h"
 
+struct event;
+struct event_base;
+
+typedef struct tcp_engine tcp_engine_t;
+typedef struct tcp_connection tcp_connection_t;
+
+/* Called exactly once for every submitted connection attempt, after it has
+ * either connected or failed. The callback owns the connection and must
+ * eventually free it with tcp_connection_free. */
+typedef void (*tcp_connection_callback)(tcp_connection_t *connection,
+                                        void *arg);
+
+/* This tracks a single connection attempt. */
+struct tcp_connection {
+    /* The address we're connecting to. */
+    struct sockaddr_storage address;
+    int address_len;
+
+    /* These are valid once the callback has run. error is NULL if we
+     * connected, and otherwise points to a static string. */
+    const char *error;
+    /* The time between starting the connect and learning its outcome. */
+    int64_t rtt_microseconds;
+    /* When the connection was submitted, in monotonic microseconds. It waits
+     * for a slot in the window until started_at. */
+    int64_t submitted_at;
+
+    /* Internal state. */
+    tcp_engine_t *engine;
+    tcp_connection_callback callback;
+    void *callback_arg;
+    evutil_socket_t fd;
+    struct event *ev;
+    int64_t started_at;
+    int finished;
+    tcp_connection_t *prev, *next;
+};
+
+/* The TCP engine opens non-blocking sockets and waits for their connects to
+ * complete on a libevent event base. At most 'window' connects are in progress
+ * at once; the rest wait in a FIFO queue. Connections also wait there until
+ * the rate limiter lets their SYNs go. */
+struct tcp_engine {
+    struct event_base *base;
+    int window;
+    struct timeval timeout;
+
+    /* Connections waiting for a free slot in the window. */
+    tcp_connection_t *pending_head, *pending_tail;
+    /* Connections whose connects are in progress. */
+    tcp_connection_t *active;
+    int in_flight;
+    /* The number of submitted connections whose callbacks have not run. */
+    int outstanding;
+    /* Set while we're starting connects, so connects that fail immediately
+     * don't recurse back into start_pending. */
+    int starting;
+    /* Fires when the rate limiter will let the next pending connection go. */
+    struct event *pace;
+};
+
+/* Initialize a TCP engine.
+ *
+ * Arguments:
+ * - base is the event base on which we will wait for connects.
+ * - window is the maximum number of connects in progress at once.
+ * - timeout is how long to wait for each connect.
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int tcp_engine_init(tcp_engine_t *engine,
+                    struct event_base *base,
+                    int window,
+                    struct timeval timeout);
+
+/* Queue a connection attempt.
+ *
+ * Returns: the new connection, or NULL if it could not be allocated. The
+ * callback won't run for connections that could not be allocated.
+ *
+ */
+tcp_connection_t *tcp_engine_submit(tcp_engine_t *engine,
+                                    const struct sockaddr_storage *address,
+                                    int address_len,
+                                    tcp_connection_callback callback,
+                                    void *callback_arg);
+
+/* Run the event loop until every submitted connection has finished.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int tcp_engine_run(tcp_engine_t *engine);
+
+/* Abandon every unfinished connection without running its callback. */
+int tcp_engine_destroy(tcp_engine_t *engine);
+
+void tcp_connection_free(tcp_connection_t *connection);
+
+/* Parse a numeric IPv4 or IPv6 address and a port.
+ *
+ * Returns: 0 on success, -1 if the address could not be parsed.
+ *
+ */
+int tcp_parse_address(const char *ip,
+                      int port,
+                      struct sockaddr_storage *address,
+                      int *address_len);
+
+/* Connect to an address, blocking until we connect or the sandbox's deadline
+ * passes. Expects the sandbox as its first upvalue.
+ *
+ * Lua arguments:
+ * - ip and port are the address to connect to.
+ * Lua returns:
+ * - true if we connected; nil on error.
+ * - an error message, or nil if no errors occurred.
+ * - a table with fields started_at (in monotonic microseconds),
+ *   queued_microseconds, connect_microseconds and total_microseconds, also
+ *   once a connect has failed.
+ *
+ */
 int l_tcp_connect(lua_State *L);
 
+/* Connect to many addresses concurrently. Expects the sandbox as its first
+ * upvalue.
+ *
+ * Lua arguments:
+ * - targets is an array of tables with fields ip and port.
+ * - opts is an optional table with fields window and timeout (in seconds).
+ * Lua returns:
+ * - an array with a table for each target, in order, with fields ip, port,
+ *   connected, rtt_microseconds, timing (as for tcp_connect) and error.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_tcp_connect_batch(lua_State *L);
+
+/* Start a connect like tcp_connect without waiting for it. Unlike
+ * tcp_connect, it gives up after a timeout. Expects the sandbox as its first
+ * upvalue.
+ *
+ * Lua arguments:
+ * - ip and port are the address to connect to.
+ * Lua returns:
+ * - an operation id to wait for with async_wait, whose value is true if we
+ *   connected and whose timing is as for tcp_connect; nil on error.
+ * - an error message, or nil if no errors occurred.
+ *
+ */
+int l_tcp_connect_async(lua_State *L);
+
 #endif
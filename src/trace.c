@@ -0,0 +1,77 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "serialize.h"
+
+#define TRACE_MAX_LINE 512
+
+static int trace_fd = -1;
+
+int trace_open(const char *path) {
+    if (path[0] == '\0') {
+        return 0;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        log_error("error opening trace file %s: %m", path);
+        return -1;
+    }
+    return 0;
+}
+
+void trace_close() {
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+int trace_enabled() {
+    return trace_fd >= 0;
+}
+
+void trace_span(const char *name,
+                const char *experiment,
+                int64_t start,
+                int64_t end) {
+    if (trace_fd < 0) {
+        return;
+    }
+    /* Span names are literals in our code, but experiment names come from
+     * the downloaded main.lua and may need escaping. */
+    serialize_buffer_t escaped;
+    serialize_buffer_init(&escaped);
+    if (serialize_json_string(&escaped, experiment, strlen(experiment))) {
+        serialize_buffer_free(&escaped);
+        return;
+    }
+    char line[TRACE_MAX_LINE];
+    int len = snprintf(line,
+                       sizeof(line),
+                       "{\"name\":\"%s\",\"experiment\":%.*s,\"pid\":%ld,"
+                       "\"start_us\":%lld,\"duration_us\":%lld}\n",
+                       name,
+                       (int)escaped.len,
+                       escaped.data,
+                       (long)getpid(),
+                       (long long)start,
+                       (long long)(end - start));
+    serialize_buffer_free(&escaped);
+    if (len < 0 || len >= (int)sizeof(line)) {
+        return;
+    }
+    /* One write per span, so concurrent appenders don't interleave. */
+    ssize_t rc;
+    do {
+        rc = write(trace_fd, line, len);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        log_error("error writing trace file: %m");
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef CENSORSCOPE_TRACE_H
+#define CENSORSCOPE_TRACE_H
+
+#include <stdint.h>
+
+/* The trace file records spans of the scheduler's and experiments' work, one
+ * JSON object per line with fields name, experiment, pid, start_us and
+ * duration_us. start_us is in monotonic microseconds, so spans from the
+ * parent and its children line up. Children inherit the file, and each span
+ * is a single append, so their lines don't interleave. */
+
+/* Start tracing to path, or leave tracing off if path is empty.
+ *
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int trace_open(const char *path);
+
+/* Stop tracing and close the trace file. */
+void trace_close();
+
+/* Returns: 1 if spans are being recorded, 0 otherwise. */
+int trace_enabled();
+
+/* Record that the span called name, of the given experiment, ran from start
+ * to end, both in monotonic microseconds. Does nothing if tracing is off. */
+void trace_span(const char *name,
+                const char *experiment,
+                int64_t start,
+                int64_t end);
+
+#endif
@@ -0,0 +1,567 @@
+#include "traceroute.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+#include <ldns/ldns.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "logging.h"
+#include "luautil.h"
+#include "ratelimit.h"
+#include "sandbox.h"
+#include "tcp.h"
+#include "util.h"
+
+#define DEFAULT_FIRST_TTL 1
+#define DEFAULT_MAX_TTL 30
+#define DEFAULT_TIMEOUT_SECONDS 3
+#define DEFAULT_DOMAIN "example.com"
+#define DEFAULT_PATH "/"
+
+/* We keep this much of the first reply to each probe. It holds any DNS reply
+ * over UDP. */
+#define HEAD_BYTES 512
+
+typedef enum {
+    PROBE_DNS,
+    PROBE_HTTP,
+} probe_protocol_t;
+
+struct sweep;
+
+/* One probe, sent with one TTL. */
+typedef struct {
+    int ttl;
+    evutil_socket_t fd;
+    struct event *ev;
+    struct sweep *sweep;
+    /* Set while an HTTP probe is connecting with the normal TTL. */
+    int connecting;
+    /* Set once we've seen an ICMP error or a reply, or given up. */
+    int finished;
+    /* A static string if the probe couldn't be sent, or NULL. */
+    const char *error;
+    int64_t sent_at;
+
+    /* The first ICMP error about the probe, if icmp_at isn't 0. HTTP probes
+     * only learn that one arrived, so hop is empty and icmp_type and
+     * icmp_code are -1. */
+    int64_t icmp_at;
+    char hop[INET6_ADDRSTRLEN];
+    int icmp_type, icmp_code;
+
+    /* Replies, from the target or from a censor that injected them. */
+    int responses;
+    int64_t response_at;
+    size_t response_size;
+    uint8_t head[HEAD_BYTES];
+    size_t head_len;
+    int reset;
+} probe_t;
+
+typedef struct sweep {
+    probe_protocol_t protocol;
+    struct sockaddr_storage address;
+    int address_len;
+    /* What every probe sends. */
+    uint8_t *payload;
+    size_t payload_len;
+    int64_t started_at;
+    /* The number of probes that haven't finished. */
+    int outstanding;
+    int timed_out;
+} sweep_t;
+
+static void finish_probe(probe_t *probe) {
+    if (!probe->finished) {
+        probe->finished = 1;
+        --probe->sweep->outstanding;
+    }
+}
+
+static void fail_probe(probe_t *probe, const char *error) {
+    probe->error = error;
+    if (probe->ev) {
+        event_del(probe->ev);
+    }
+    finish_probe(probe);
+}
+
+/* Set the TTL, or hop limit, of the probe's packets. */
+static int set_ttl(probe_t *probe, int ttl) {
+    if (probe->sweep->address.ss_family == AF_INET6) {
+        return setsockopt(probe->fd,
+                          IPPROTO_IPV6,
+                          IPV6_UNICAST_HOPS,
+                          &ttl,
+                          sizeof(ttl));
+    }
+    return setsockopt(probe->fd, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
+}
+
+/* Record the ICMP errors queued on the probe's socket. Only the first one
+ * counts, but we drain them all so the socket stops being readable. */
+static void read_errors(probe_t *probe) {
+    for (;;) {
+        uint8_t data[1];
+        char control[512];
+        struct iovec iov = { data, sizeof(data) };
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(probe->fd, &message, MSG_ERRQUEUE) < 0) {
+            return;
+        }
+        struct cmsghdr *cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&message);
+             cmsg;
+             cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (!(cmsg->cmsg_level == IPPROTO_IP
+                  && cmsg->cmsg_type == IP_RECVERR)
+                && !(cmsg->cmsg_level == IPPROTO_IPV6
+                     && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err *error = (void *)CMSG_DATA(cmsg);
+            if ((error->ee_origin != SO_EE_ORIGIN_ICMP
+                 && error->ee_origin != SO_EE_ORIGIN_ICMP6)
+                || probe->icmp_at) {
+                continue;
+            }
+            probe->icmp_at = monotonic_microseconds();
+            probe->icmp_type = error->ee_type;
+            probe->icmp_code = error->ee_code;
+            struct sockaddr *offender = SO_EE_OFFENDER(error);
+            const void *address = offender->sa_family == AF_INET6
+                ? (void *)&((struct sockaddr_in6 *)offender)->sin6_addr
+                : (void *)&((struct sockaddr_in *)offender)->sin_addr;
+            if (!evutil_inet_ntop(offender->sa_family,
+                                  address,
+                                  probe->hop,
+                                  sizeof(probe->hop))) {
+                probe->hop[0] = '\0';
+            }
+            finish_probe(probe);
+        }
+    }
+}
+
+/* Handle an error a receive on an HTTP probe's socket returned. TCP sockets
+ * don't queue ICMP errors like datagram sockets do. With IP_RECVERR set the
+ * kernel reports them right away as the socket's error instead, without the
+ * router's address, so a time-exceeded reply shows up as EHOSTUNREACH. */
+static void record_stream_error(probe_t *probe, int error) {
+    if (error != EHOSTUNREACH && error != ENETUNREACH) {
+        fail_probe(probe, "error receiving reply");
+        return;
+    }
+    if (!probe->icmp_at) {
+        probe->icmp_at = monotonic_microseconds();
+        probe->hop[0] = '\0';
+        probe->icmp_type = probe->icmp_code = -1;
+    }
+    event_del(probe->ev);
+    finish_probe(probe);
+}
+
+static void record_reply(probe_t *probe, const uint8_t *data, size_t len) {
+    if (probe->responses == 0) {
+        probe->response_at = monotonic_microseconds();
+        probe->responses = 1;
+    } else if (probe->sweep->protocol == PROBE_DNS) {
+        /* A second answer to one query is a sign of injection, but we only
+         * keep the first. A stream is one reply however many reads it
+         * takes. */
+        ++probe->responses;
+        probe->response_size += len;
+        return;
+    }
+    size_t room = HEAD_BYTES - probe->head_len;
+    memcpy(probe->head + probe->head_len, data, len < room ? len : room);
+    probe->head_len += len < room ? len : room;
+    probe->response_size += len;
+    finish_probe(probe);
+}
+
+static int send_payload(probe_t *probe) {
+    sweep_t *sweep = probe->sweep;
+    probe->sent_at = monotonic_microseconds();
+    ssize_t len = send(probe->fd,
+                       sweep->payload,
+                       sweep->payload_len,
+                       MSG_NOSIGNAL);
+    return len == (ssize_t)sweep->payload_len ? 0 : -1;
+}
+
+static void on_probe_event(evutil_socket_t fd, short what, void *arg) {
+    probe_t *probe = arg;
+    if (probe->connecting) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len)
+            || error) {
+            fail_probe(probe, "error connecting");
+            return;
+        }
+        /* Only the request is TTL-limited, so the handshake reaches the
+         * target whatever the TTL. */
+        probe->connecting = 0;
+        event_del(probe->ev);
+        if (set_ttl(probe, probe->ttl)
+            || send_payload(probe)
+            || event_assign(probe->ev,
+                            event_get_base(probe->ev),
+                            fd,
+                            EV_READ | EV_PERSIST,
+                            on_probe_event,
+                            probe)
+            || event_add(probe->ev, NULL)) {
+            fail_probe(probe, "error sending probe");
+        }
+        return;
+    }
+
+    read_errors(probe);
+    uint8_t buffer[4096];
+    for (;;) {
+        ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+        if (len > 0) {
+            record_reply(probe, buffer, len);
+            continue;
+        }
+        if (len == 0 && probe->sweep->protocol == PROBE_HTTP) {
+            /* The connection was closed. */
+            event_del(probe->ev);
+            finish_probe(probe);
+        } else if (len < 0 && errno == ECONNRESET) {
+            if (probe->responses == 0) {
+                probe->response_at = monotonic_microseconds();
+            }
+            probe->reset = 1;
+            event_del(probe->ev);
+            finish_probe(probe);
+        } else if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len < 0
+                   && probe->sweep->protocol == PROBE_HTTP
+                   && errno != EAGAIN
+                   && errno != EWOULDBLOCK) {
+            record_stream_error(probe, errno);
+        }
+        /* On DNS probes, other errors like EHOSTUNREACH repeat the ICMP
+         * errors we just read. */
+        return;
+    }
+}
+
+static void start_probe(probe_t *probe, struct event_base *base) {
+    sweep_t *sweep = probe->sweep;
+    int type = sweep->protocol == PROBE_DNS ? SOCK_DGRAM : SOCK_STREAM;
+    probe->fd = socket(sweep->address.ss_family, type, 0);
+    if (probe->fd < 0) {
+        fail_probe(probe, "error creating socket");
+        return;
+    }
+    int on = 1;
+    int rc = sweep->address.ss_family == AF_INET6
+        ? setsockopt(probe->fd, IPPROTO_IPV6, IPV6_RECVERR, &on, sizeof(on))
+        : setsockopt(probe->fd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on));
+    if (rc || evutil_make_socket_nonblocking(probe->fd)) {
+        fail_probe(probe, "error configuring socket");
+        return;
+    }
+    short events = EV_READ | EV_PERSIST;
+    if (sweep->protocol == PROBE_DNS) {
+        if (set_ttl(probe, probe->ttl)
+            || connect(probe->fd,
+                       (struct sockaddr *)&sweep->address,
+                       sweep->address_len)
+            || send_payload(probe)) {
+            fail_probe(probe, "error sending probe");
+            return;
+        }
+    } else {
+        if (connect(probe->fd,
+                    (struct sockaddr *)&sweep->address,
+                    sweep->address_len)
+            && errno != EINPROGRESS) {
+            fail_probe(probe, "error connecting");
+            return;
+        }
+        probe->connecting = 1;
+        events = EV_WRITE;
+    }
+    probe->ev = event_new(base, probe->fd, events, on_probe_event, probe);
+    if (!probe->ev || event_add(probe->ev, NULL)) {
+        fail_probe(probe, "error adding event");
+    }
+}
+
+static void on_sweep_timeout(evutil_socket_t fd, short what, void *arg) {
+    sweep_t *sweep = arg;
+    sweep->timed_out = 1;
+}
+
+/* Build the bytes every probe sends.
+ *
+ * Returns: 0 on success, or -1 with error set to a static string.
+ *
+ */
+static int build_payload(sweep_t *sweep,
+                         const char *domain,
+                         const char *path,
+                         const char **error) {
+    if (sweep->protocol == PROBE_HTTP) {
+        char *request = sprintf_malloc("GET %s HTTP/1.1\r\n"
+                                       "Host: %s\r\n"
+                                       "Connection: close\r\n"
+                                       "\r\n",
+                                       path,
+                                       domain);
+        if (!request) {
+            *error = "error allocating request";
+            return -1;
+        }
+        sweep->payload = (uint8_t *)request;
+        sweep->payload_len = strlen(request);
+        return 0;
+    }
+
+    ldns_rdf *name = ldns_dname_new_frm_str(domain);
+    if (!name) {
+        *error = "error parsing domain name";
+        return -1;
+    }
+    /* The packet takes ownership of the name. */
+    ldns_pkt *pkt = ldns_pkt_query_new(name,
+                                       LDNS_RR_TYPE_A,
+                                       LDNS_RR_CLASS_IN,
+                                       LDNS_RD);
+    if (!pkt) {
+        *error = "error creating query";
+        return -1;
+    }
+    ldns_pkt_set_random_id(pkt);
+    ldns_status status = ldns_pkt2wire(&sweep->payload,
+                                       pkt,
+                                       &sweep->payload_len);
+    ldns_pkt_free(pkt);
+    if (status != LDNS_STATUS_OK) {
+        *error = "error encoding query";
+        return -1;
+    }
+    return 0;
+}
+
+/* Set the rcode and addresses fields of the table at the top of the stack
+ * from the first DNS reply to a probe. */
+static void push_dns_reply(lua_State *L, const probe_t *probe) {
+    ldns_pkt *pkt;
+    if (ldns_wire2pkt(&pkt, probe->head, probe->head_len) != LDNS_STATUS_OK) {
+        return;
+    }
+    ldns_lookup_table *rcode = ldns_lookup_by_id(ldns_rcodes,
+                                                 ldns_pkt_get_rcode(pkt));
+    lua_pushstring(L, rcode ? rcode->name : "UNKNOWN");
+    lua_setfield(L, -2, "rcode");
+    lua_newtable(L);
+    ldns_rr_list *results = ldns_pkt_rr_list_by_type(pkt,
+                                                     LDNS_RR_TYPE_A,
+                                                     LDNS_SECTION_ANSWER);
+    if (results) {
+        for (size_t i = 0; i < ldns_rr_list_rr_count(results); ++i) {
+            ldns_rdf *a_record = ldns_rr_a_address(ldns_rr_list_rr(results, i));
+            char *ip_address = ldns_rdf2str(a_record);
+            if (!ip_address) {
+                continue;
+            }
+            lua_pushstring(L, ip_address);
+            free(ip_address);
+            lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+        }
+        ldns_rr_list_deep_free(results);
+    }
+    lua_setfield(L, -2, "addresses");
+    ldns_pkt_free(pkt);
+}
+
+static void push_probe(lua_State *L, const probe_t *probe) {
+    const sweep_t *sweep = probe->sweep;
+    lua_createtable(L, 0, 12);
+    lua_pushinteger(L, probe->ttl);
+    lua_setfield(L, -2, "ttl");
+    if (probe->error) {
+        lua_pushstring(L, probe->error);
+        lua_setfield(L, -2, "error");
+    }
+    if (probe->sent_at) {
+        lua_pushnumber(L, probe->sent_at - sweep->started_at);
+        lua_setfield(L, -2, "sent_microseconds");
+    }
+    if (probe->icmp_at) {
+        if (probe->hop[0]) {
+            lua_pushstring(L, probe->hop);
+            lua_setfield(L, -2, "hop");
+        }
+        if (probe->icmp_type >= 0) {
+            lua_pushinteger(L, probe->icmp_type);
+            lua_setfield(L, -2, "icmp_type");
+            lua_pushinteger(L, probe->icmp_code);
+            lua_setfield(L, -2, "icmp_code");
+        }
+        lua_pushnumber(L, probe->icmp_at - sweep->started_at);
+        lua_setfield(L, -2, "hop_microseconds");
+    }
+    lua_pushinteger(L, probe->responses);
+    lua_setfield(L, -2, "responses");
+    if (probe->response_at) {
+        lua_pushnumber(L, probe->response_at - sweep->started_at);
+        lua_setfield(L, -2, "response_microseconds");
+        lua_pushnumber(L, probe->response_size);
+        lua_setfield(L, -2, "response_size");
+    }
+    if (sweep->protocol == PROBE_HTTP) {
+        lua_pushboolean(L, probe->reset);
+        lua_setfield(L, -2, "reset");
+        if (probe->head_len > 0) {
+            lua_pushlstring(L, (const char *)probe->head, probe->head_len);
+            lua_setfield(L, -2, "head");
+        }
+    } else if (probe->responses > 0) {
+        push_dns_reply(L, probe);
+    }
+}
+
+int l_ttl_probe(lua_State *L) {
+    sandbox_t *sandbox = lua_touserdata(L, lua_upvalueindex(1));
+    const char *target = luaL_checkstring(L, 1);
+    const char *protocol = luaL_checkstring(L, 2);
+    sweep_t sweep;
+    memset(&sweep, 0, sizeof(sweep));
+    if (strcmp(protocol, "dns") == 0) {
+        sweep.protocol = PROBE_DNS;
+    } else if (strcmp(protocol, "http") == 0) {
+        sweep.protocol = PROBE_HTTP;
+    } else {
+        return luaL_argerror(L, 2, "protocol must be \"dns\" or \"http\"");
+    }
+    int port = optfield_integer(L,
+                                3,
+                                "port",
+                                sweep.protocol == PROBE_DNS ? 53 : 80);
+    const char *domain = optfield_string(L, 3, "domain", DEFAULT_DOMAIN);
+    const char *path = optfield_string(L, 3, "path", DEFAULT_PATH);
+    int first_ttl = optfield_integer(L, 3, "first_ttl", DEFAULT_FIRST_TTL);
+    int max_ttl = optfield_integer(L, 3, "max_ttl", DEFAULT_MAX_TTL);
+    double timeout = optfield_number(L,
+                                     3,
+                                     "timeout",
+                                     DEFAULT_TIMEOUT_SECONDS);
+    luaL_argcheck(L,
+                  first_ttl >= 1 && first_ttl <= max_ttl && max_ttl <= 255,
+                  3,
+                  "TTLs must satisfy 1 <= first_ttl <= max_ttl <= 255");
+    if (sandbox_time_remaining(sandbox) == 0) {
+        return sandbox_push_deadline_error(L);
+    }
+    if (tcp_parse_address(target, port, &sweep.address, &sweep.address_len)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "error invalid ip address");
+        return 2;
+    }
+    const char *error = NULL;
+    if (build_payload(&sweep, domain, path, &error)) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+
+    int count = max_ttl - first_ttl + 1;
+    probe_t *probes = calloc(count, sizeof(probe_t));
+    struct event *timer = evtimer_new(sandbox->base, on_sweep_timeout, &sweep);
+    struct timeval wait = timeval_from_seconds(
+            sandbox_limit_seconds(sandbox, timeout));
+    if (!probes || !timer || evtimer_add(timer, &wait)) {
+        free(probes);
+        if (timer) {
+            event_free(timer);
+        }
+        free(sweep.payload);
+        lua_pushnil(L);
+        lua_pushstring(L, "error allocating probes");
+        return 2;
+    }
+
+    /* Send every probe before waiting for any replies. Probes only draw on
+     * the device's budget, since pacing them per destination would spread
+     * the sweep out and most of them never reach the target anyway. */
+    sweep.started_at = monotonic_microseconds();
+    sweep.outstanding = count;
+    for (int i = 0; i < count; ++i) {
+        probes[i].ttl = first_ttl + i;
+        probes[i].fd = -1;
+        probes[i].sweep = &sweep;
+        if (ratelimit_wait(NULL,
+                           sweep.payload_len,
+                           sandbox_time_remaining(sandbox))) {
+            fail_probe(&probes[i], "rate limited past deadline");
+            continue;
+        }
+        start_probe(&probes[i], sandbox->base);
+    }
+    while (sweep.outstanding > 0 && !sweep.timed_out && !error) {
+        if (event_base_loop(sandbox->base, EVLOOP_ONCE) == -1) {
+            error = "error running event loop";
+        }
+    }
+    int64_t finished_at = monotonic_microseconds();
+
+    if (!error) {
+        lua_createtable(L, count, 0);
+        for (int i = 0; i < count; ++i) {
+            push_probe(L, &probes[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        if (probes[i].ev) {
+            event_free(probes[i].ev);
+        }
+        if (probes[i].fd >= 0) {
+            evutil_closesocket(probes[i].fd);
+        }
+    }
+    event_free(timer);
+    free(probes);
+    free(sweep.payload);
+    if (error) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+
+    lua_pushnil(L);
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, sweep.started_at);
+    lua_setfield(L, -2, "started_at");
+    lua_pushnumber(L, finished_at - sweep.started_at);
+    lua_setfield(L, -2, "total_microseconds");
+    return 3;
+}
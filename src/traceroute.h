@@ -0,0 +1,44 @@
+#ifndef CENSORSCOPE_TRACEROUTE_H_
+#define CENSORSCOPE_TRACEROUTE_H_
+
+#include "lua.h"
+
+/* Send the same probe to a target with every TTL in a range at once, to find
+ * the hop where a censor sits. Each probe has its own non-blocking socket with
+ * IP_RECVERR set, so the ICMP time-exceeded replies from routers arrive on the
+ * socket's error queue and no raw sockets or privileges are needed. TCP
+ * sockets report such a reply only as an error, without the router's
+ * address, so HTTP probes know that a hop answered but not which. All
+ * probes wait on the sandbox's event base together, so a sweep of 30 hops
+ * takes about one round trip instead of 30.
+ *
+ * DNS probes send an A query over UDP with the TTL limited. HTTP probes
+ * connect with the normal TTL and only limit the TTL of the GET request, so a
+ * censor that injects a reset or block page reveals itself at the first TTL
+ * that reaches it. Expects the sandbox as its first upvalue.
+ *
+ * Lua arguments:
+ * - target is an IPv4 or IPv6 address.
+ * - protocol is "dns" or "http".
+ * - opts is an optional table with these fields:
+ *   - port is the port to probe (default 53 for DNS and 80 for HTTP).
+ *   - domain is the name to query, or the HTTP Host (default "example.com").
+ *   - path is the HTTP path to request (default "/").
+ *   - first_ttl and max_ttl give the TTLs to try (default 1 and 30).
+ *   - timeout is how many seconds to wait for replies (default 3).
+ * Lua returns:
+ * - an array with a table for every TTL, in order, with fields ttl, and where
+ *   they apply sent_microseconds; hop_microseconds for the first ICMP
+ *   error, with hop, icmp_type and icmp_code for DNS; responses,
+ *   response_size and response_microseconds for replies from the target or
+ *   an injector, with rcode and addresses for DNS and head (the start of the
+ *   reply) and reset for HTTP; and error if the probe couldn't be sent.
+ *   Times are in microseconds since the sweep started. nil on error.
+ * - an error message, or nil if no errors occurred.
+ * - a table with fields started_at (see monotonic_microseconds) and
+ *   total_microseconds.
+ *
+ */
+int l_ttl_probe(lua_State *L);
+
+#endif
@@ -1,5 +1,6 @@
 #include "transport.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "lua.h"
@@ -52,10 +53,44 @@ int transport_download(transport_t *transport) {
     return 0;
 }
 
-int transport_upload(transport_t *transport) {
+/* Push a table describing a file to upload. */
+static void push_file(lua_State *L,
+                      const char *path,
+                      const index_entry_t *entry) {
+    lua_newtable(L);
+    lua_pushstring(L, path);
+    lua_setfield(L, -2, "path");
+    if (!entry) {
+        return;
+    }
+    lua_pushstring(L, entry->segment);
+    lua_setfield(L, -2, "segment");
+    lua_pushstring(L, entry->run_id);
+    lua_setfield(L, -2, "run_id");
+    lua_pushstring(L, entry->experiment);
+    lua_setfield(L, -2, "experiment");
+    lua_pushnumber(L, entry->offset);
+    lua_setfield(L, -2, "offset");
+    lua_pushnumber(L, entry->bytes);
+    lua_setfield(L, -2, "bytes");
+    char crc32[9];
+    snprintf(crc32, sizeof(crc32), "%08x", (unsigned)entry->crc32);
+    lua_pushstring(L, crc32);
+    lua_setfield(L, -2, "crc32");
+}
+
+int transport_upload(transport_t *transport,
+                     const char *results_path,
+                     char **paths,
+                     const index_entry_t **entries) {
     lua_getfield(transport->L, -1, "upload_results");
-    lua_pushstring(transport->L, transport->options->results_dir);
-    if (lua_pcall(transport->L, 1, 0, 0)) {
+    lua_pushstring(transport->L, results_path);
+    lua_newtable(transport->L);
+    for (int i = 0; paths[i]; ++i) {
+        push_file(transport->L, paths[i], entries[i]);
+        lua_rawseti(transport->L, -2, i + 1);
+    }
+    if (lua_pcall(transport->L, 2, 0, 0)) {
         log_error("error uploading results: %s",
                   luaL_checkstring(transport->L, -1));
         lua_pop(transport->L, 1);
@@ -3,6 +3,7 @@
 
 #include "lua.h"
 
+#include "index.h"
 #include "options.h"
 
 typedef struct {
@@ -18,6 +19,21 @@ int transport_destroy(transport_t *transport);
 
 int transport_download(transport_t *transport);
 
-int transport_upload(transport_t *transport);
+/* Upload the results files in a directory. The transport's upload_results
+ * gets the directory and an array with a table for each file to upload, with
+ * field path, and when the results index knows the file's segment also
+ * segment, run_id, experiment, offset, bytes and crc32 (in hex), so it can
+ * send just those files and tell the server what they hold.
+ *
+ * Arguments:
+ * - paths is a NULL-terminated array of the files to upload.
+ * - entries has the index entry for each path, or NULL where there is none.
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int transport_upload(transport_t *transport,
+                     const char *results_path,
+                     char **paths,
+                     const index_entry_t **entries);
 
 #endif
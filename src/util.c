@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 char *sprintf_malloc(const char *format, ...) {
     va_list ap;
@@ -47,3 +48,19 @@ char *module_filename(const char *sandbox_dir, const char *module) {
     }
     return filename;
 }
+
+struct timeval timeval_from_seconds(double seconds) {
+    struct timeval tv = { 0, 0 };
+    if (seconds <= 0) {
+        return tv;
+    }
+    tv.tv_sec = (time_t)seconds;
+    tv.tv_usec = (suseconds_t)((seconds - tv.tv_sec) * 1000000);
+    return tv;
+}
+
+int64_t monotonic_microseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -1,6 +1,9 @@
 #ifndef CENSORSCOPE_UTIL_H
 #define CENSORSCOPE_UTIL_H
 
+#include <stdint.h>
+#include <sys/time.h>
+
 /* Like sprintf, but automatically allocate enough memory to store the resulting
  * string.
  *
@@ -28,4 +31,16 @@ int is_valid_module_name(const char *name);
  */
 char *module_filename(const char *sandbox_dir, const char *module);
 
+/* Convert a (possibly fractional) number of seconds, as passed in from Lua, to
+ * a struct timeval. Negative values are clamped to zero.
+ *
+ */
+struct timeval timeval_from_seconds(double seconds);
+
+/* Return the current value of CLOCK_MONOTONIC in microseconds. Use this to
+ * measure durations; it is unaffected by changes to the wall clock.
+ *
+ */
+int64_t monotonic_microseconds();
+
 #endif
@@ -0,0 +1,401 @@
+#include "workers.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "experiment.h"
+#include "logging.h"
+#include "options.h"
+#include "sandbox.h"
+#include "subprocesses.h"
+#include "util.h"
+
+/* Jobs are sent as the bare experiment name, one name per datagram. */
+#define WORKER_MAX_NAME_LENGTH 255
+
+/* A worker sends this back after every job. */
+typedef struct {
+    /* 0 if the experiment ran successfully, -1 if not. */
+    int32_t status;
+    /* Set if the worker is about to exit so we can replace it. */
+    int32_t recycle;
+    /* The CPU time the run used, and the worker's peak resident set size
+     * afterwards. */
+    int64_t user_microseconds, system_microseconds;
+    int64_t max_rss_kilobytes;
+} worker_reply_t;
+
+static int64_t timeval_microseconds(const struct timeval *tv) {
+    return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/* Return the peak resident set size of this process, in bytes. */
+static size_t peak_memory_bytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return 0;
+    }
+    return (size_t)usage.ru_maxrss * 1024;  /* ru_maxrss is in kilobytes. */
+}
+
+/* This is the main loop of a worker process. It runs one experiment for each
+ * name it receives, until the pool closes the socket or it's time to replace
+ * this worker. */
+static void worker_main(censorscope_options_t *options, evutil_socket_t fd) {
+    experiment_set_limits(options);
+
+    sandbox_t sandbox;
+    if (experiment_sandbox_init(&sandbox, "worker", options)) {
+        log_error("error initializing worker sandbox");
+        exit(EXIT_FAILURE);
+    }
+    size_t baseline_memory = peak_memory_bytes();
+
+    long runs = 0;
+    char name[WORKER_MAX_NAME_LENGTH + 1];
+    for (;;) {
+        ssize_t length = recv(fd, name, WORKER_MAX_NAME_LENGTH, 0);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            break;
+        }
+        name[length] = '\0';
+
+        worker_reply_t reply = { 0, 0, 0, 0, 0 };
+        struct rusage before, after;
+        getrusage(RUSAGE_SELF, &before);
+        experiment_t experiment;
+        if (experiment_init(&experiment, name, options)) {
+            log_error("error initializing experiment '%s'", name);
+            reply.status = -1;
+        } else {
+            reply.status = experiment_run_in_sandbox(&experiment, &sandbox);
+            experiment_destroy(&experiment);
+        }
+        if (getrusage(RUSAGE_SELF, &after) == 0) {
+            reply.user_microseconds = timeval_microseconds(&after.ru_utime)
+                - timeval_microseconds(&before.ru_utime);
+            reply.system_microseconds = timeval_microseconds(&after.ru_stime)
+                - timeval_microseconds(&before.ru_stime);
+            reply.max_rss_kilobytes = after.ru_maxrss;
+        }
+
+        ++runs;
+        size_t growth = peak_memory_bytes() - baseline_memory;
+        if (runs >= options->worker_max_runs
+            || (options->worker_max_memory_growth > 0
+                && growth > options->worker_max_memory_growth)) {
+            reply.recycle = 1;
+        }
+        /* The worker idles until its next job, so don't hold this one's log. */
+        logging_flush();
+        if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply)) {
+            break;
+        }
+        if (reply.recycle) {
+            break;
+        }
+    }
+
+    sandbox_destroy(&sandbox);
+    exit(EXIT_SUCCESS);
+}
+
+static void free_job(worker_job_t *job) {
+    free(job->name);
+    free(job);
+}
+
+/* Free a job that has finished or failed, and tell the pool's owner. */
+static void finish_job(worker_pool_t *pool,
+                       worker_job_t *job,
+                       const run_result_t *result) {
+    void *job_arg = job->arg;
+    free_job(job);
+    if (pool->job_done) {
+        pool->job_done(pool->job_done_arg, job_arg, result);
+    }
+}
+
+/* Close our end of a worker's socket, which tells it to exit, and wait for
+ * it. */
+static void stop_worker(worker_t *worker) {
+    if (worker->ev) {
+        event_free(worker->ev);
+        worker->ev = NULL;
+    }
+    if (worker->fd >= 0) {
+        evutil_closesocket(worker->fd);
+        worker->fd = -1;
+    }
+    if (worker->pid > 0) {
+        subprocesses_reap(worker->pool->subprocesses, worker->pid);
+        worker->pid = 0;
+    }
+}
+
+static void dispatch_pending(worker_pool_t *pool);
+
+static void on_worker_event(evutil_socket_t fd, short what, void *arg) {
+    worker_t *worker = arg;
+    worker_pool_t *pool = worker->pool;
+
+    worker_reply_t reply;
+    ssize_t length = recv(fd, &reply, sizeof(reply), 0);
+    if (length < 0 && (errno == EAGAIN
+                       || errno == EWOULDBLOCK
+                       || errno == EINTR)) {
+        return;
+    }
+
+    worker_job_t *job = worker->job;
+    worker->job = NULL;
+    run_result_t result = { 0, 0, 0, 0, 0, 0 };
+    result.wall_microseconds = monotonic_microseconds() - job->started_at;
+    if (length != sizeof(reply)) {
+        /* The worker exited without replying, usually because subprocesses
+         * killed it after the timeout. */
+        log_error("worker pid %d exited while running '%s'",
+                  worker->pid,
+                  job->name);
+        result.timed_out = job->timeout_seconds > 0
+            && result.wall_microseconds
+                >= (int64_t)job->timeout_seconds * 1000000;
+        stop_worker(worker);
+    } else {
+        result.succeeded = reply.status == 0;
+        result.user_microseconds = reply.user_microseconds;
+        result.system_microseconds = reply.system_microseconds;
+        result.max_rss_kilobytes = reply.max_rss_kilobytes;
+        if (reply.status) {
+            log_error("error running experiment '%s' in worker pid %d",
+                      job->name,
+                      worker->pid);
+        }
+        if (event_del(worker->ev)
+            || subprocesses_set_timeout(pool->subprocesses, worker->pid, 0)) {
+            log_error("error idling worker pid %d", worker->pid);
+            stop_worker(worker);
+        } else if (reply.recycle) {
+            log_info("replacing worker pid %d", worker->pid);
+            stop_worker(worker);
+        }
+    }
+    finish_job(pool, job, &result);
+
+    dispatch_pending(pool);
+}
+
+static int start_worker(worker_pool_t *pool, worker_t *worker) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds)) {
+        log_error("socketpair: %m");
+        return -1;
+    }
+
+    /* Workers only have a timeout while they're running a job. */
+    pid_t pid = subprocesses_fork(pool->subprocesses, 0);
+    if (pid < 0) {
+        evutil_closesocket(fds[0]);
+        evutil_closesocket(fds[1]);
+        return -1;
+    } else if (pid == 0) {
+        /* We are the worker. Close the parent's sockets, including those of
+         * the other workers, so each worker sees the end of its own socket
+         * when the parent closes it. */
+        evutil_closesocket(fds[0]);
+        for (int i = 0; i < pool->count; ++i) {
+            if (pool->workers[i].fd >= 0) {
+                evutil_closesocket(pool->workers[i].fd);
+            }
+        }
+        worker_main(pool->options, fds[1]);
+    }
+
+    evutil_closesocket(fds[1]);
+    worker->pid = pid;
+    worker->fd = fds[0];
+    if (evutil_make_socket_nonblocking(worker->fd)
+        || evutil_make_socket_closeonexec(worker->fd)) {
+        log_error("error configuring worker socket");
+        stop_worker(worker);
+        return -1;
+    }
+    worker->ev = event_new(pool->base,
+                           worker->fd,
+                           EV_READ | EV_PERSIST,
+                           on_worker_event,
+                           worker);
+    if (!worker->ev) {
+        log_error("error creating worker event");
+        stop_worker(worker);
+        return -1;
+    }
+    return 0;
+}
+
+/* Send a job to an idle worker. */
+static int start_job(worker_t *worker, worker_job_t *job) {
+    worker_pool_t *pool = worker->pool;
+
+    size_t length = strlen(job->name);
+    ssize_t sent = send(worker->fd, job->name, length, MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+        /* The worker exited while it was idle. Replace it and try again. */
+        log_info("worker pid %d has exited; replacing it", worker->pid);
+        stop_worker(worker);
+        if (start_worker(pool, worker)) {
+            return -1;
+        }
+        sent = send(worker->fd, job->name, length, MSG_NOSIGNAL);
+    }
+    if (sent != (ssize_t)length) {
+        log_error("error sending job to worker pid %d", worker->pid);
+        stop_worker(worker);
+        return -1;
+    }
+
+    if (subprocesses_set_timeout(pool->subprocesses,
+                                 worker->pid,
+                                 job->timeout_seconds)
+        || event_add(worker->ev, NULL)) {
+        log_error("error waiting for worker pid %d", worker->pid);
+        stop_worker(worker);
+        return -1;
+    }
+    worker->job = job;
+    job->started_at = monotonic_microseconds();
+    log_info("running '%s' in worker pid %d", job->name, worker->pid);
+    return 0;
+}
+
+/* Return an idle worker, starting a new one if there's room, or NULL if every
+ * worker is busy. */
+static worker_t *idle_worker(worker_pool_t *pool) {
+    worker_t *empty = NULL;
+    for (int i = 0; i < pool->count; ++i) {
+        worker_t *worker = &pool->workers[i];
+        if (worker->pid > 0 && !worker->job) {
+            return worker;
+        }
+        if (worker->pid == 0 && !empty) {
+            empty = worker;
+        }
+    }
+    if (empty && start_worker(pool, empty)) {
+        return NULL;
+    }
+    return empty;
+}
+
+static void dispatch_pending(worker_pool_t *pool) {
+    while (pool->pending_head) {
+        worker_t *worker = idle_worker(pool);
+        if (!worker) {
+            return;
+        }
+        worker_job_t *job = pool->pending_head;
+        pool->pending_head = job->next;
+        if (!pool->pending_head) {
+            pool->pending_tail = NULL;
+        }
+        job->next = NULL;
+        if (start_job(worker, job)) {
+            log_error("dropping run of '%s'", job->name);
+            run_result_t result = { 0, 0, 0, 0, 0, 0 };
+            finish_job(pool, job, &result);
+        }
+    }
+}
+
+int worker_pool_init(worker_pool_t *pool,
+                     subprocesses_t *subprocesses,
+                     censorscope_options_t *options,
+                     struct event_base *base) {
+    if (options->workers < 1) {
+        log_error("a worker pool needs at least one worker");
+        return -1;
+    }
+    pool->workers = calloc(options->workers, sizeof(worker_t));
+    if (!pool->workers) {
+        log_error("calloc error: %m");
+        return -1;
+    }
+    pool->count = options->workers;
+    for (int i = 0; i < pool->count; ++i) {
+        pool->workers[i].fd = -1;
+        pool->workers[i].pool = pool;
+    }
+    pool->options = options;
+    pool->subprocesses = subprocesses;
+    pool->base = base;
+    pool->pending_head = pool->pending_tail = NULL;
+    pool->job_done = NULL;
+    pool->job_done_arg = NULL;
+    return 0;
+}
+
+int worker_pool_submit(worker_pool_t *pool,
+                       const char *name,
+                       time_t timeout_seconds,
+                       void *arg) {
+    if (strlen(name) > WORKER_MAX_NAME_LENGTH) {
+        log_error("experiment name '%s' is too long for a worker", name);
+        return -1;
+    }
+    worker_job_t *job = calloc(1, sizeof(worker_job_t));
+    if (!job) {
+        log_error("calloc error: %m");
+        return -1;
+    }
+    job->name = strdup(name);
+    if (!job->name) {
+        log_error("strdup error: %m");
+        free(job);
+        return -1;
+    }
+    job->timeout_seconds = timeout_seconds;
+    job->arg = arg;
+
+    if (pool->pending_tail) {
+        pool->pending_tail->next = job;
+    } else {
+        pool->pending_head = job;
+    }
+    pool->pending_tail = job;
+
+    dispatch_pending(pool);
+    return 0;
+}
+
+int worker_pool_destroy(worker_pool_t *pool) {
+    for (int i = 0; i < pool->count; ++i) {
+        worker_t *worker = &pool->workers[i];
+        if (worker->job) {
+            free_job(worker->job);
+            worker->job = NULL;
+        }
+        stop_worker(worker);
+    }
+    while (pool->pending_head) {
+        worker_job_t *job = pool->pending_head;
+        pool->pending_head = job->next;
+        free_job(job);
+    }
+    pool->pending_tail = NULL;
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->count = 0;
+    return 0;
+}
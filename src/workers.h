@@ -0,0 +1,102 @@
+#ifndef CENSORSCOPE_WORKERS_H
+#define CENSORSCOPE_WORKERS_H
+
+#include <time.h>
+#include <sys/types.h>
+
+#include <event2/util.h>
+
+#include "metrics.h"
+#include "options.h"
+#include "subprocesses.h"
+
+struct event;
+struct event_base;
+struct worker_pool;
+
+/* A request to run one experiment in a worker. */
+typedef struct worker_job {
+    char *name;
+    time_t timeout_seconds;
+    /* Passed back to job_done with the job's result. */
+    void *arg;
+    /* When the job was sent to a worker, in monotonic microseconds. */
+    int64_t started_at;
+    struct worker_job *next;
+} worker_job_t;
+
+/* This tracks a single long-lived worker process. */
+typedef struct worker {
+    /* The worker's pid, or 0 if this slot has no running worker. */
+    pid_t pid;
+    /* Our end of the socket pair we use to send jobs and receive replies. */
+    evutil_socket_t fd;
+    /* Fires when the worker replies or exits. It is only pending while the
+     * worker is running a job. */
+    struct event *ev;
+    /* The job the worker is running, or NULL if it is idle. */
+    worker_job_t *job;
+    struct worker_pool *pool;
+} worker_t;
+
+/* A worker pool runs experiments in long-lived child processes, each with a
+ * sandbox that already has the primitives registered and api.lua compiled, so
+ * a run doesn't pay for creating and initializing an interpreter. Workers are
+ * started on demand, and replaced after options->worker_max_runs runs or when
+ * their memory grows by options->worker_max_memory_growth; jobs wait in a FIFO
+ * queue while every worker is busy.
+ *
+ * Each job gets the same timeout as a forked experiment: if a worker hasn't
+ * replied in time, subprocesses kills it and the pool starts a new one. */
+typedef struct worker_pool {
+    worker_t *workers;
+    int count;
+
+    censorscope_options_t *options;
+    subprocesses_t *subprocesses;
+    struct event_base *base;
+
+    /* Jobs waiting for an idle worker. */
+    worker_job_t *pending_head, *pending_tail;
+
+    /* If set, called whenever a submitted job finishes or is dropped, with the
+     * job's arg and how the run went. */
+    void (*job_done)(void *arg, void *job_arg, const run_result_t *result);
+    void *job_done_arg;
+} worker_pool_t;
+
+/* Initialize a worker pool. No workers start until the first job arrives.
+ *
+ * Arguments:
+ * - subprocesses tracks the workers and enforces job timeouts.
+ * - options supplies the options for each worker's sandbox, and the pool's
+ *   size and recycling limits.
+ * - base is the scheduler's event base, on which we wait for replies.
+ * Returns: 0 on success, -1 on failure.
+ *
+ */
+int worker_pool_init(worker_pool_t *pool,
+                     subprocesses_t *subprocesses,
+                     censorscope_options_t *options,
+                     struct event_base *base);
+
+/* Run an experiment on the next idle worker.
+ *
+ * Arguments:
+ * - name is the name of the experiment to run.
+ * - timeout_seconds is how long the experiment may run before we kill its
+ *   worker.
+ * - arg is passed to job_done when the job finishes.
+ * Returns: 0 if the job was started or queued, -1 on failure.
+ *
+ */
+int worker_pool_submit(worker_pool_t *pool,
+                       const char *name,
+                       time_t timeout_seconds,
+                       void *arg);
+
+/* Stop every worker and wait for them to exit, dropping queued jobs. Call
+ * this after the event loop has finished. */
+int worker_pool_destroy(worker_pool_t *pool);
+
+#endif
@@ -3,7 +3,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "../src/arena.h"
+#include "../src/index.h"
+#include "../src/logging.h"
+#include "../src/options.h"
+#include "../src/ratelimit.h"
+#include "../src/targets.h"
 #include "../src/util.h"
 
 void test_is_valid_module_name(void *ptr) {
@@ -17,8 +25,286 @@ end:
     ;
 }
 
+void test_arena_reuses_blocks(void *ptr) {
+    arena_t arena;
+    arena_init(&arena, 0);
+
+    char *a = arena_alloc(&arena, NULL, 0, 20);
+    tt_assert(a);
+    memset(a, 'x', 20);
+    tt_int_op(arena.used, ==, 20);
+    tt_int_op(arena.reserved, >=, ARENA_CHUNK_SIZE);
+
+    /* Growing within the size class keeps the block. */
+    tt_ptr_op(arena_alloc(&arena, a, 20, 30), ==, a);
+
+    /* Growing out of it moves the block and keeps its contents. */
+    char *b = arena_alloc(&arena, a, 30, 100);
+    tt_assert(b);
+    tt_ptr_op(b, !=, a);
+    tt_int_op(b[19], ==, 'x');
+
+    /* Freed blocks are reused by the next allocation in their class. */
+    arena_alloc(&arena, b, 100, 0);
+    tt_ptr_op(arena_alloc(&arena, NULL, 0, 97), ==, b);
+
+    /* Large blocks come from malloc. */
+    size_t reserved = arena.reserved;
+    char *large = arena_alloc(&arena, NULL, 0, 4096);
+    tt_assert(large);
+    tt_int_op(arena.reserved, ==, reserved + 4096 + ARENA_MALLOC_OVERHEAD);
+    arena_alloc(&arena, large, 4096, 0);
+    tt_int_op(arena.reserved, ==, reserved);
+    tt_int_op(arena.peak_reserved, ==, reserved + 4096 + ARENA_MALLOC_OVERHEAD);
+
+end:
+    arena_destroy(&arena);
+}
+
+void test_arena_limit(void *ptr) {
+    arena_t arena;
+    arena_init(&arena, 4096);
+
+    /* Near the limit, chunks shrink to fit. */
+    void *small = arena_alloc(&arena, NULL, 0, 64);
+    tt_assert(small);
+    tt_int_op(arena.reserved, <=, 4096);
+
+    tt_ptr_op(arena_alloc(&arena, NULL, 0, 8192), ==, NULL);
+    tt_int_op(arena.reserved, <=, 4096);
+
+    /* Shrinking never fails, even at the limit. */
+    void *blocks[256];
+    int count = 0;
+    while (count < 256
+           && (blocks[count] = arena_alloc(&arena, NULL, 0, 512))) {
+        ++count;
+    }
+    tt_int_op(count, <, 256);
+    tt_int_op(arena.reserved, <=, 4096);
+    tt_assert(arena_alloc(&arena, blocks[0], 512, 16));
+
+end:
+    arena_destroy(&arena);
+}
+
+void test_arena_shrink_at_limit(void *ptr) {
+    arena_t arena;
+    arena_init(&arena, 16384);
+
+    char *large = arena_alloc(&arena, NULL, 0, 8192);
+    tt_assert(large);
+    memset(large, 'x', 8192);
+    /* Use up the rest of the limit with small blocks. */
+    int count = 0;
+    while (count < 100000 && arena_alloc(&arena, NULL, 0, 16)) {
+        ++count;
+    }
+    tt_int_op(count, <, 100000);
+    size_t reserved = arena.reserved;
+
+    /* Shrinking the large block into a small class gives its memory back. */
+    char *small = arena_alloc(&arena, large, 8192, 100);
+    tt_assert(small);
+    tt_int_op(small[99], ==, 'x');
+    tt_int_op(arena.reserved, <, reserved - 4096);
+    tt_int_op(arena.reserved, <=, 16384);
+
+end:
+    arena_destroy(&arena);
+}
+
+void test_log_site_allowed(void *ptr) {
+    int allowed = 0;
+    for (int i = 0; i < 3 * LOGGING_SITE_BURST; ++i) {
+        allowed += log_site_allowed("busy.lua", 7);
+    }
+    /* The burst could straddle a second, which allows a second burst. */
+    tt_int_op(allowed, >=, LOGGING_SITE_BURST);
+    tt_int_op(allowed, <=, 2 * LOGGING_SITE_BURST);
+
+    /* Other lines of the same script have their own budget. */
+    tt_int_op(log_site_allowed("busy.lua", 8), ==, 1);
+
+end:
+    ;
+}
+
+void test_targets(void *ptr) {
+    char path[] = "/tmp/censorscope-targets-XXXXXX";
+    targets_list_t *list = NULL;
+    int fd = mkstemp(path);
+    tt_assert(fd >= 0);
+    FILE *file = fdopen(fd, "w");
+    tt_assert(file);
+    fprintf(file, "# a comment\n\n");
+    for (int i = 0; i < 3 * TARGETS_CHECKPOINT_INTERVAL; ++i) {
+        fprintf(file, i % 2 ? "  example%d.com\r\n" : "example%d.com\n", i);
+    }
+    fprintf(file, "last.com");
+    fclose(file);
+
+    list = targets_open(path);
+    tt_assert(list);
+    tt_int_op(list->count, ==, 3 * TARGETS_CHECKPOINT_INTERVAL + 1);
+
+    targets_cursor_t cursor;
+    const char *entry;
+    size_t len;
+    targets_seek(list, 0, &cursor);
+    tt_int_op(targets_next(list, &cursor, &entry, &len), ==, 1);
+    tt_int_op(len, ==, strlen("example0.com"));
+    tt_assert(memcmp(entry, "example0.com", len) == 0);
+
+    /* Seeking past a checkpoint lands on the right entry, trimmed. */
+    targets_seek(list, TARGETS_CHECKPOINT_INTERVAL + 1, &cursor);
+    tt_int_op(targets_next(list, &cursor, &entry, &len), ==, 1);
+    char expected[32];
+    snprintf(expected,
+             sizeof(expected),
+             "example%d.com",
+             TARGETS_CHECKPOINT_INTERVAL + 1);
+    tt_int_op(len, ==, strlen(expected));
+    tt_assert(memcmp(entry, expected, len) == 0);
+
+    targets_seek(list, list->count - 1, &cursor);
+    tt_int_op(targets_next(list, &cursor, &entry, &len), ==, 1);
+    tt_assert(len == strlen("last.com") && memcmp(entry, "last.com", len) == 0);
+    tt_int_op(targets_next(list, &cursor, &entry, &len), ==, 0);
+
+    /* Opening an unchanged file reuses its mapping. */
+    targets_list_t *again = targets_open(path);
+    tt_ptr_op(again, ==, list);
+    targets_release(again);
+
+end:
+    if (list) {
+        targets_release(list);
+    }
+    targets_free();
+    unlink(path);
+}
+
+void test_targets_filename(void *ptr) {
+    char *filename = targets_filename("sandbox", "top1m");
+    tt_str_op(filename, ==, "sandbox/top1m.txt");
+    free(filename);
+    filename = targets_filename("sandbox", "top1m.txt");
+    tt_str_op(filename, ==, "sandbox/top1m.txt");
+    free(filename);
+    tt_ptr_op(targets_filename("sandbox", "../top1m"), ==, NULL);
+
+end:
+    ;
+}
+
+void test_index(void *ptr) {
+    char directory[] = "/tmp/censorscope-index-XXXXXX";
+    results_index_t index = { NULL, 0, 0 };
+    char *path = NULL;
+    tt_assert(mkdtemp(directory));
+    path = sprintf_malloc("%s/%s", directory, INDEX_FILENAME);
+    tt_assert(path);
+
+    /* A directory without an index has no segments. */
+    tt_int_op(index_load(&index, directory), ==, 0);
+    tt_int_op(index.count, ==, 0);
+
+    index_entry_t first = {
+        "dns-1.txt", "20150101-120000-42-0", "dns", 0, 100, 0xdeadbeef, 0
+    };
+    index_entry_t second = {
+        "dns-1-1.txt", "20150101-120000-42-0", "dns", 100, 20, 0x1234, 0
+    };
+    tt_int_op(index_add_segment(directory, &first), ==, 0);
+    tt_int_op(index_add_segment(directory, &second), ==, 0);
+    tt_int_op(index_mark_uploaded(directory, "dns-1.txt"), ==, 0);
+    first.segment = "bad\tname";
+    tt_int_op(index_add_segment(directory, &first), ==, -1);
+
+    tt_int_op(index_load(&index, directory), ==, 0);
+    tt_int_op(index.count, ==, 2);
+    const index_entry_t *entry = index_find(&index, "dns-1-1.txt");
+    tt_assert(entry);
+    tt_str_op(entry->run_id, ==, "20150101-120000-42-0");
+    tt_str_op(entry->experiment, ==, "dns");
+    tt_int_op(entry->offset, ==, 100);
+    tt_int_op(entry->bytes, ==, 20);
+    tt_int_op(entry->crc32, ==, 0x1234);
+    tt_int_op(entry->uploaded, ==, 0);
+    tt_int_op(index_find(&index, "dns-1.txt")->uploaded, ==, 1);
+    index_free(&index);
+
+    /* Compacting keeps only what is left to upload. */
+    tt_int_op(index_compact(directory), ==, 0);
+    tt_int_op(index_load(&index, directory), ==, 0);
+    tt_int_op(index.count, ==, 1);
+    tt_str_op(index.entries[0].segment, ==, "dns-1-1.txt");
+
+end:
+    index_free(&index);
+    if (path) {
+        unlink(path);
+        free(path);
+    }
+    rmdir(directory);
+}
+
+void test_ratelimit(void *ptr) {
+    censorscope_options_t options;
+    memset(&options, 0, sizeof(options));
+
+    /* Nothing is limited by default. */
+    tt_int_op(ratelimit_init(&options), ==, 0);
+    for (int i = 0; i < 100; ++i) {
+        tt_int_op(ratelimit_acquire("192.0.2.1", 1000), ==, 0);
+    }
+
+    /* The device's budget lets a burst through, then makes us wait. */
+    options.max_packets_per_second = 10;
+    tt_int_op(ratelimit_init(&options), ==, 0);
+    tt_int_op(ratelimit_acquire(NULL, 100), ==, 0);
+    tt_int_op(ratelimit_acquire(NULL, 100), ==, 0);
+    tt_int_op(ratelimit_acquire(NULL, 100), >, 0);
+    tt_int_op(ratelimit_wait(NULL, 100, 1000), ==, -1);
+
+    /* So does each destination's, independently of the others. */
+    options.max_packets_per_second = 0;
+    options.destination_packets_per_second = 10;
+    tt_int_op(ratelimit_init(&options), ==, 0);
+    tt_int_op(ratelimit_acquire("192.0.2.1", 100), ==, 0);
+    tt_int_op(ratelimit_acquire("192.0.2.1", 100), ==, 0);
+    tt_int_op(ratelimit_acquire("192.0.2.1", 100), >, 0);
+    tt_int_op(ratelimit_acquire("192.0.2.2", 100), ==, 0);
+
+    /* A loss halves the destination's rate, which leaves room for only one
+     * packet in the burst. */
+    ratelimit_report("192.0.2.3", 1, 0);
+    tt_int_op(ratelimit_acquire("192.0.2.3", 100), ==, 0);
+    tt_int_op(ratelimit_acquire("192.0.2.3", 100), >, 0);
+
+    char key[RATELIMIT_KEY_SIZE];
+    ratelimit_url_key("https://example.com:8443/path?q", key, sizeof(key));
+    tt_str_op(key, ==, "example.com");
+    ratelimit_url_key("http://user:pass@[::1]:80/x", key, sizeof(key));
+    tt_str_op(key, ==, "::1");
+    ratelimit_url_key("example.com", key, sizeof(key));
+    tt_str_op(key, ==, "example.com");
+
+end:
+    ratelimit_destroy();
+}
+
 struct testcase_t censorscope_tests[] = {
     { "is_valid_module_name", test_is_valid_module_name },
+    { "arena_reuses_blocks", test_arena_reuses_blocks },
+    { "arena_limit", test_arena_limit },
+    { "arena_shrink_at_limit", test_arena_shrink_at_limit },
+    { "log_site_allowed", test_log_site_allowed },
+    { "targets", test_targets },
+    { "targets_filename", test_targets_filename },
+    { "index", test_index },
+    { "ratelimit", test_ratelimit },
 
     END_OF_TESTCASES
 };